@@ -28,6 +28,7 @@ cdef extern from "bigfile.h":
         unsigned int * fchecksum; 
         int dirty
         CBigAttrSet * attrset;
+        char codec[32]
 
     struct CBigBlockPtr "BigBlockPtr":
         pass
@@ -71,6 +72,7 @@ cdef extern from "bigfile.h":
 
     int big_block_flush(CBigBlock * block) nogil
     int big_block_set_dirty(CBigBlock * block, int dirty) nogil
+    int big_block_set_codec(CBigBlock * block, char * codec) nogil
     int big_block_seek(CBigBlock * bb, CBigBlockPtr * ptr, ptrdiff_t offset) nogil
     int big_block_seek_rel(CBigBlock * bb, CBigBlockPtr * ptr, ptrdiff_t rel) nogil
     int big_block_read(CBigBlock * bb, CBigBlockPtr * ptr, CBigArray * array) nogil
@@ -308,6 +310,11 @@ cdef class ColumnLowLevelAPI:
     property Nfile:
         def __get__(self):
             return self.bb.Nfile
+    property codec:
+        def __get__(self):
+            if self.bb.codec[0] == 0:
+                return 'raw'
+            return self.bb.codec.decode()
 
     def __cinit__(self):
         self.comm = None
@@ -402,6 +409,20 @@ cdef class ColumnLowLevelAPI:
 
         self._deallocated = False
 
+    def set_codec(self, codec):
+        """ Encode the data files with codec: 'raw', 'lz4' (lossless)
+            or 'quantize:TOL' (absolute error at most TOL, floating point only).
+
+            Must be called before any data is written. Each data file
+            of an encoded column must be written whole by a single write.
+        """
+        codec = codec.encode()
+        cdef char * codecptr = codec
+        with nogil:
+            rt = big_block_set_codec(&self.bb, codecptr)
+        if rt != 0:
+            raise Error()
+
     def write(self, numpy.intp_t start, numpy.ndarray buf):
         """ write at offset `start' a chunk of data inf buf.
 
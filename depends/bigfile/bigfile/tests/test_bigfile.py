@@ -590,3 +590,78 @@ def test_slicing(comm):
             assert_equal(b[3], data[3])
 
     shutil.rmtree(fname)
+
+# Codec frames hold 4MB of raw data; 600000 f8 rows span two frames.
+codec_sizes = [1, 1000, 600000]
+
+@MPITest([1])
+def test_codec_lz4(comm):
+    import os
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+    x.create('.')
+
+    numpy.random.seed(1234)
+    for size in codec_sizes:
+        cases = [
+            ('random', numpy.random.uniform(-1, 1, size=size)),
+            ('int', numpy.random.randint(0, 1000, size=size).astype('i8')),
+            ('constant', numpy.ones((size, 3), dtype='f4')),
+            # random bits do not compress, so the frames are stored
+            ('incompressible', numpy.random.randint(0, 2**63 - 1, size=size, dtype='i8').view('u8')),
+        ]
+        for name, data in cases:
+            name = '%s-%d' % (name, size)
+            with x.create(name, Nfile=2, dtype=(data.dtype, data.shape[1:]), size=size) as b:
+                b.set_codec('lz4')
+                b.write(0, data)
+
+            with x[name] as b:
+                assert b.codec == 'lz4'
+                assert_array_equal(b[:], data)
+                # across the frame boundary
+                assert_array_equal(b[size // 3:size // 3 + 30000], data[size // 3:size // 3 + 30000])
+
+            encoded = sum(os.path.getsize(os.path.join(fname, name, '%06X' % i)) for i in range(2))
+            if name.startswith('constant') and size > 1000:
+                assert encoded < data.nbytes // 100
+            if name.startswith('incompressible'):
+                # only the headers are added
+                assert encoded <= data.nbytes + 2 * (32 + 16 * 2)
+
+    shutil.rmtree(fname)
+
+@MPITest([1])
+def test_codec_quantize(comm):
+    fname = tempfile.mkdtemp()
+    x = BigFile(fname, create=True)
+    x.create('.')
+
+    numpy.random.seed(1234)
+    for dtype, tol in [('f8', 1e-3), ('f4', 1e-2)]:
+        for size in codec_sizes:
+            # sorted, like positions in Peano order, plus a velocity like column
+            data = numpy.random.uniform(-1000, 1000, size=(size, 3)).astype(dtype)
+            data[:, 0].sort()
+            name = '%s-%d' % (dtype, size)
+            with x.create(name, Nfile=2, dtype=(dtype, 3), size=size) as b:
+                b.set_codec('quantize:%g' % tol)
+                b.write(0, data)
+
+            with x[name] as b:
+                assert b.codec == 'quantize:%g' % tol
+                result = b[:]
+                part = b[size // 3:size // 3 + 30000]
+
+            # tolerance plus the rounding of the file dtype
+            bound = tol + 1000 * numpy.finfo(dtype).eps
+            assert abs(result.astype('f8') - data.astype('f8')).max() <= bound
+            assert_array_equal(part, result[size // 3:size // 3 + 30000])
+
+    with x.create('int', Nfile=1, dtype='i8', size=10) as b:
+        # only floating point values can be quantized
+        assert_raises(BigFileError, b.set_codec, 'quantize:0.1')
+        assert_raises(BigFileError, b.set_codec, 'zstd')
+        assert_raises(BigFileError, b.set_codec, 'quantize:-1')
+
+    shutil.rmtree(fname)
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "bigfile.h"
+#include "bigfile-internal.h"
+
+/*
+ * Codecs for encoded data files of a block.
+ *
+ * An encoded file is split into frames of FRAME_BYTES of raw (file dtype) data.
+ * Each frame is encoded independently, so that a reader only needs to decode
+ * the frames overlapping the rows it requests. The layout of a file is
+ *
+ *   "BFCODEC1"                    magic, 8 bytes
+ *   u8 rows, u8 nframes, u8 frame_rows   little endian
+ *   nframes x (u8 nbytes, u8 flags)
+ *   frame data
+ *
+ * Supported codecs:
+ *
+ *   lz4          byte-shuffle by the item size, then LZ4 block compression. Lossless.
+ *   quantize:TOL floating point values are rounded to multiples of 2 TOL, so the absolute
+ *                error is at most TOL (plus the rounding of the file dtype), delta encoded along the rows of each column,
+ *                zigzag mapped, then byte-shuffled and LZ4 compressed.
+ *
+ * If the compressed frame is not smaller than its input, the shuffled input is stored
+ * and FRAME_STORED is set in the flags.
+ * */
+
+#define CODEC_MAGIC "BFCODEC1"
+#define FRAME_BYTES (4 * 1024 * 1024)
+#define FRAME_STORED 1
+
+#define LZ4_HASHLOG 16
+#define LZ4_MINMATCH 4
+#define LZ4_MFLIMIT 12
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAXOFFSET 65535
+
+enum CodecType {
+    CODEC_RAW = 0,
+    CODEC_LZ4 = 1,
+    CODEC_QUANTIZE = 2,
+};
+
+/* Parse a codec string; returns -1 if it is not understood */
+static int
+_codec_parse(const char * codec, double * tolerance)
+{
+    if(codec == NULL || codec[0] == '\0' || 0 == strcmp(codec, "raw"))
+        return CODEC_RAW;
+    if(0 == strcmp(codec, "lz4"))
+        return CODEC_LZ4;
+    if(0 == strncmp(codec, "quantize:", 9)) {
+        char * end;
+        *tolerance = strtod(codec + 9, &end);
+        if(end == codec + 9 || *end != '\0' || !(*tolerance > 0))
+            return -1;
+        return CODEC_QUANTIZE;
+    }
+    return -1;
+}
+
+int
+_big_codec_isvalid(const char * codec, const char * dtype)
+{
+    double tol;
+    int type = _codec_parse(codec, &tol);
+    if(type < 0)
+        return 0;
+    /* Only floating point data can be quantized */
+    if(type == CODEC_QUANTIZE && big_file_dtype_kind(dtype) != 'f')
+        return 0;
+    return 1;
+}
+
+static void
+_put_u8(unsigned char * p, uint64_t v)
+{
+    int i;
+    for(i = 0; i < 8; i ++) {
+        p[i] = (v >> (8 * i)) & 0xff;
+    }
+}
+
+static uint64_t
+_get_u8(const unsigned char * p)
+{
+    uint64_t v = 0;
+    int i;
+    for(i = 0; i < 8; i ++) {
+        v |= ((uint64_t) p[i]) << (8 * i);
+    }
+    return v;
+}
+
+/* Transpose the bytes of n items of typesize bytes, so that equal significance bytes are adjacent. */
+static void
+_shuffle(unsigned char * dst, const unsigned char * src, size_t bytes, int typesize)
+{
+    size_t n = bytes / typesize;
+    size_t i;
+    int b;
+    for(b = 0; b < typesize; b ++) {
+        for(i = 0; i < n; i ++) {
+            dst[b * n + i] = src[i * typesize + b];
+        }
+    }
+    memcpy(dst + n * typesize, src + n * typesize, bytes - n * typesize);
+}
+
+static void
+_unshuffle(unsigned char * dst, const unsigned char * src, size_t bytes, int typesize)
+{
+    size_t n = bytes / typesize;
+    size_t i;
+    int b;
+    for(b = 0; b < typesize; b ++) {
+        for(i = 0; i < n; i ++) {
+            dst[i * typesize + b] = src[b * n + i];
+        }
+    }
+    memcpy(dst + n * typesize, src + n * typesize, bytes - n * typesize);
+}
+
+static uint32_t
+_read32(const unsigned char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t
+_lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASHLOG);
+}
+
+/* Write an LZ4 length continuation; returns the new output position or 0 if out of space. */
+static size_t
+_lz4_put_length(unsigned char * dst, size_t op, size_t dstcap, size_t len)
+{
+    while(len >= 255) {
+        if(op >= dstcap) return 0;
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if(op >= dstcap) return 0;
+    dst[op++] = len;
+    return op;
+}
+
+/* Greedy LZ4 block compressor. Returns the compressed size, or 0 if it does not fit in dstcap. */
+static size_t
+_lz4_compress(const unsigned char * src, size_t srcsize, unsigned char * dst, size_t dstcap)
+{
+    uint32_t * table = calloc(1 << LZ4_HASHLOG, sizeof(uint32_t));
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+    size_t litlen;
+
+    if(table == NULL) return 0;
+
+    if(srcsize > LZ4_MFLIMIT) {
+        const size_t limit = srcsize - LZ4_MFLIMIT;
+        const size_t matchlimit = srcsize - LZ4_LASTLITERALS;
+        while(ip < limit) {
+            uint32_t seq = _read32(src + ip);
+            uint32_t h = _lz4_hash(seq);
+            /* positions are stored + 1, so that 0 means empty */
+            size_t ref = table[h];
+            table[h] = ip + 1;
+            if(ref == 0 || ip - (ref - 1) > LZ4_MAXOFFSET || _read32(src + ref - 1) != seq) {
+                ip ++;
+                continue;
+            }
+            ref -= 1;
+            size_t mlen = LZ4_MINMATCH;
+            while(ip + mlen < matchlimit && src[ref + mlen] == src[ip + mlen]) {
+                mlen ++;
+            }
+            litlen = ip - anchor;
+            if(op + 1 + litlen + 2 > dstcap) goto ex_full;
+            size_t token = op++;
+            dst[token] = ((litlen >= 15 ? 15 : litlen) << 4) | (mlen - LZ4_MINMATCH >= 15 ? 15 : mlen - LZ4_MINMATCH);
+            if(litlen >= 15) {
+                if(0 == (op = _lz4_put_length(dst, op, dstcap, litlen - 15))) goto ex_full;
+            }
+            if(op + litlen + 2 > dstcap) goto ex_full;
+            memcpy(dst + op, src + anchor, litlen);
+            op += litlen;
+            dst[op++] = (ip - ref) & 0xff;
+            dst[op++] = (ip - ref) >> 8;
+            if(mlen - LZ4_MINMATCH >= 15) {
+                if(0 == (op = _lz4_put_length(dst, op, dstcap, mlen - LZ4_MINMATCH - 15))) goto ex_full;
+            }
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    /* last literals */
+    litlen = srcsize - anchor;
+    if(op + 1 > dstcap) goto ex_full;
+    dst[op++] = (litlen >= 15 ? 15 : litlen) << 4;
+    if(litlen >= 15) {
+        if(0 == (op = _lz4_put_length(dst, op, dstcap, litlen - 15))) goto ex_full;
+    }
+    if(op + litlen > dstcap) goto ex_full;
+    memcpy(dst + op, src + anchor, litlen);
+    op += litlen;
+
+    free(table);
+    return op;
+ex_full:
+    free(table);
+    return 0;
+}
+
+/* LZ4 block decompressor; returns 0 if exactly dstsize bytes were decoded. */
+static int
+_lz4_decompress(const unsigned char * src, size_t srcsize, unsigned char * dst, size_t dstsize)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while(ip < srcsize) {
+        unsigned int token = src[ip++];
+        size_t litlen = token >> 4;
+        if(litlen == 15) {
+            unsigned char b;
+            do {
+                if(ip >= srcsize) return -1;
+                b = src[ip++];
+                litlen += b;
+            } while(b == 255);
+        }
+        if(ip + litlen > srcsize || op + litlen > dstsize) return -1;
+        memcpy(dst + op, src + ip, litlen);
+        ip += litlen;
+        op += litlen;
+        /* The last sequence has only literals */
+        if(ip == srcsize) break;
+
+        if(ip + 2 > srcsize) return -1;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op) return -1;
+        size_t mlen = token & 15;
+        if(mlen == 15) {
+            unsigned char b;
+            do {
+                if(ip >= srcsize) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while(b == 255);
+        }
+        mlen += LZ4_MINMATCH;
+        if(op + mlen > dstsize) return -1;
+        /* the match may overlap the output; copy bytewise */
+        size_t k;
+        for(k = 0; k < mlen; k ++) {
+            dst[op + k] = dst[op - offset + k];
+        }
+        op += mlen;
+    }
+    return op == dstsize ? 0 : -1;
+}
+
+/* Quantize rows x nmemb floating point values in file dtype to zigzag delta encoded little endian i8.*/
+static int
+_quantize(uint64_t * dst, const void * src, const char * dtype, size_t rows, int nmemb, double tolerance)
+{
+    size_t n = rows * nmemb;
+    double * x = malloc(sizeof(double) * n);
+    if(x == NULL) return -1;
+    dtype_convert_simple(x, "=f8", src, dtype, n);
+    size_t i;
+    int64_t * q = (int64_t *) dst;
+    for(i = 0; i < n; i ++) {
+        double v = x[i] / (2 * tolerance);
+        if(!(fabs(v) < 4.0e18)) {
+            free(x);
+            return -1;
+        }
+        q[i] = llround(v);
+    }
+    free(x);
+    /* delta along rows, from the end so each value is differenced with the unmodified previous row */
+    for(i = n; i-- > (size_t) nmemb; ) {
+        q[i] -= q[i - nmemb];
+    }
+    for(i = 0; i < n; i ++) {
+        uint64_t z = ((uint64_t) q[i] << 1) ^ (uint64_t)(q[i] >> 63);
+        unsigned char * p = (unsigned char *) &dst[i];
+        _put_u8(p, z);
+    }
+    return 0;
+}
+
+static int
+_dequantize(void * dst, const char * dtype, const uint64_t * src, size_t rows, int nmemb, double tolerance)
+{
+    size_t n = rows * nmemb;
+    double * x = malloc(sizeof(double) * n);
+    int64_t * q = malloc(sizeof(int64_t) * n);
+    if(x == NULL || q == NULL) {
+        free(x);
+        free(q);
+        return -1;
+    }
+    size_t i;
+    for(i = 0; i < n; i ++) {
+        uint64_t z = _get_u8((const unsigned char *) &src[i]);
+        q[i] = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+    }
+    for(i = nmemb; i < n; i ++) {
+        q[i] += q[i - nmemb];
+    }
+    for(i = 0; i < n; i ++) {
+        x[i] = q[i] * (2 * tolerance);
+    }
+    dtype_convert_simple(dst, dtype, x, "=f8", n);
+    free(q);
+    free(x);
+    return 0;
+}
+
+/* Encode one frame of rows; out must have room for 2 * the transformed size. Returns bytes used. */
+static size_t
+_encode_frame(int type, double tolerance, const char * dtype, int nmemb,
+        const void * buf, size_t rows, unsigned char * out, unsigned char * scratch, uint64_t * flags)
+{
+    int itemsize = big_file_dtype_itemsize(dtype);
+    size_t bytes = rows * nmemb * itemsize;
+    const void * input = buf;
+
+    if(type == CODEC_QUANTIZE) {
+        if(0 != _quantize((uint64_t *) scratch, buf, dtype, rows, nmemb, tolerance))
+            return (size_t) -1;
+        input = scratch;
+        itemsize = 8;
+        bytes = rows * nmemb * 8;
+    }
+    unsigned char * shuffled = out + bytes;
+    _shuffle(shuffled, input, bytes, itemsize);
+    size_t nbytes = _lz4_compress(shuffled, bytes, out, bytes);
+    if(nbytes == 0 || nbytes >= bytes) {
+        memmove(out, shuffled, bytes);
+        *flags = FRAME_STORED;
+        return bytes;
+    }
+    *flags = 0;
+    return nbytes;
+}
+
+static int
+_decode_frame(int type, double tolerance, const char * dtype, int nmemb,
+        const unsigned char * in, size_t nbytes, uint64_t flags, size_t rows, void * buf, unsigned char * scratch)
+{
+    int itemsize = big_file_dtype_itemsize(dtype);
+    if(type == CODEC_QUANTIZE)
+        itemsize = 8;
+    size_t bytes = rows * nmemb * itemsize;
+    unsigned char * shuffled = scratch + bytes;
+
+    if(flags & FRAME_STORED) {
+        if(nbytes != bytes) return -1;
+        memcpy(shuffled, in, bytes);
+    } else {
+        if(0 != _lz4_decompress(in, nbytes, shuffled, bytes)) return -1;
+    }
+    if(type == CODEC_QUANTIZE) {
+        _unshuffle(scratch, shuffled, bytes, itemsize);
+        return _dequantize(buf, dtype, (uint64_t *) scratch, rows, nmemb, tolerance);
+    }
+    _unshuffle(buf, shuffled, bytes, itemsize);
+    return 0;
+}
+
+int
+_big_codec_write_file(const char * codec, const char * dtype, int nmemb, const void * buf, size_t rows, FILE * fp)
+{
+    double tolerance = 0;
+    int type = _codec_parse(codec, &tolerance);
+    RAISEIF(type < 0, ex_codec, "Unknown codec `%s'", codec);
+
+    size_t felsize = big_file_dtype_itemsize(dtype) * nmemb;
+    size_t frame_rows = FRAME_BYTES / felsize;
+    if(frame_rows == 0) frame_rows = 1;
+    size_t nframes = (rows + frame_rows - 1) / frame_rows;
+    /* quantized values are widened to 8 bytes */
+    size_t maxbytes = frame_rows * nmemb * 8 > frame_rows * felsize ? frame_rows * nmemb * 8 : frame_rows * felsize;
+
+    unsigned char * header = calloc(32 + 16 * nframes, 1);
+    unsigned char * out = malloc(2 * maxbytes);
+    unsigned char * scratch = malloc(2 * maxbytes);
+    RAISEIF(header == NULL || out == NULL || scratch == NULL, ex_malloc, "Not enough memory to encode %td rows", rows);
+
+    memcpy(header, CODEC_MAGIC, 8);
+    _put_u8(header + 8, rows);
+    _put_u8(header + 16, nframes);
+    _put_u8(header + 24, frame_rows);
+    /* reserve the frame table, fill it after the frames are written */
+    RAISEIF(32 + 16 * nframes != fwrite(header, 1, 32 + 16 * nframes, fp), ex_write, "Failed to write codec header");
+
+    size_t i;
+    for(i = 0; i < nframes; i ++) {
+        size_t nrows = rows - i * frame_rows < frame_rows ? rows - i * frame_rows : frame_rows;
+        uint64_t flags = 0;
+        size_t nbytes = _encode_frame(type, tolerance, dtype, nmemb,
+                (const char *) buf + i * frame_rows * felsize, nrows, out, scratch, &flags);
+        RAISEIF(nbytes == (size_t) -1, ex_write, "Values cannot be quantized with codec `%s'", codec);
+        RAISEIF(nbytes != fwrite(out, 1, nbytes, fp), ex_write, "Failed to write encoded frame %td", i);
+        _put_u8(header + 32 + 16 * i, nbytes);
+        _put_u8(header + 32 + 16 * i + 8, flags);
+    }
+    RAISEIF(0 > fseek(fp, 0, SEEK_SET), ex_write, "Failed to seek to codec header");
+    RAISEIF(32 + 16 * nframes != fwrite(header, 1, 32 + 16 * nframes, fp), ex_write, "Failed to write codec header");
+
+    free(scratch);
+    free(out);
+    free(header);
+    return 0;
+
+ex_write:
+ex_malloc:
+    free(scratch);
+    free(out);
+    free(header);
+ex_codec:
+    return -1;
+}
+
+int
+_big_codec_read_rows(const char * codec, const char * dtype, int nmemb, FILE * fp, size_t start, size_t rows, void * buf)
+{
+    double tolerance = 0;
+    int type = _codec_parse(codec, &tolerance);
+    RAISEIF(type < 0, ex_codec, "Unknown codec `%s'", codec);
+
+    unsigned char head[32];
+    RAISEIF(0 > fseek(fp, 0, SEEK_SET) || 32 != fread(head, 1, 32, fp), ex_codec, "Failed to read codec header");
+    RAISEIF(0 != memcmp(head, CODEC_MAGIC, 8), ex_codec, "File is not encoded with a bigfile codec");
+
+    size_t totalrows = _get_u8(head + 8);
+    size_t nframes = _get_u8(head + 16);
+    size_t frame_rows = _get_u8(head + 24);
+    size_t felsize = big_file_dtype_itemsize(dtype) * nmemb;
+    size_t maxbytes = frame_rows * nmemb * 8 > frame_rows * felsize ? frame_rows * nmemb * 8 : frame_rows * felsize;
+    RAISEIF(frame_rows == 0 || start + rows > totalrows, ex_codec, "Reading beyond the encoded file");
+
+    unsigned char * table = malloc(16 * nframes);
+    unsigned char * in = malloc(maxbytes);
+    unsigned char * scratch = malloc(2 * maxbytes);
+    unsigned char * frame = malloc(frame_rows * felsize);
+    RAISEIF(table == NULL || in == NULL || scratch == NULL || frame == NULL, ex_malloc, "Not enough memory to decode");
+    RAISEIF(16 * nframes != fread(table, 1, 16 * nframes, fp), ex_read, "Failed to read frame table");
+
+    size_t i;
+    size_t offset = 32 + 16 * nframes;
+    char * out = buf;
+    for(i = 0; i < nframes && rows > 0; i ++) {
+        size_t nbytes = _get_u8(table + 16 * i);
+        uint64_t flags = _get_u8(table + 16 * i + 8);
+        size_t first = i * frame_rows;
+        if(first + frame_rows <= start) {
+            offset += nbytes;
+            continue;
+        }
+        RAISEIF(nbytes > maxbytes, ex_read, "Corrupted frame %td", i);
+        RAISEIF(0 > fseek(fp, offset, SEEK_SET) || nbytes != fread(in, 1, nbytes, fp),
+                ex_read, "Failed to read frame %td", i);
+        offset += nbytes;
+        /* all frames but the last are full */
+        size_t nrows = totalrows - first < frame_rows ? totalrows - first : frame_rows;
+        RAISEIF(0 != _decode_frame(type, tolerance, dtype, nmemb, in, nbytes, flags, nrows, frame, scratch),
+                ex_read, "Failed to decode frame %td", i);
+        size_t skip = start > first ? start - first : 0;
+        size_t ncopy = nrows - skip < rows ? nrows - skip : rows;
+        memcpy(out, frame + skip * felsize, ncopy * felsize);
+        out += ncopy * felsize;
+        rows -= ncopy;
+        start += ncopy;
+    }
+    RAISEIF(rows > 0, ex_read, "Encoded file is shorter than expected");
+
+    free(frame);
+    free(scratch);
+    free(in);
+    free(table);
+    return 0;
+
+ex_read:
+ex_malloc:
+    free(frame);
+    free(scratch);
+    free(in);
+    free(table);
+ex_codec:
+    return -1;
+}
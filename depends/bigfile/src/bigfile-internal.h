@@ -25,6 +25,15 @@ _big_block_unpack(BigBlock * block, void * buf);
 
 int _dtype_normalize(char * dst, const char * src);
 
+int dtype_convert_simple(void * dst, const char * dstdtype, const void * src, const char * srcdtype, size_t nmemb);
+
+/* Codecs for encoded data files, see bigfile-codec.c */
+int _big_codec_isvalid(const char * codec, const char * dtype);
+/* Encode rows of data in the file dtype to fp; raises */
+int _big_codec_write_file(const char * codec, const char * dtype, int nmemb, const void * buf, size_t rows, FILE * fp);
+/* Decode rows starting from start of an encoded file to buf, in the file dtype; raises */
+int _big_codec_read_rows(const char * codec, const char * dtype, int nmemb, FILE * fp, size_t start, size_t rows, void * buf);
+
 int _big_block_open(BigBlock * bb, const char * basename); /* raises */
 int _big_block_create(BigBlock * bb, const char * basename, const char * dtype, int nmemb, int Nfile, const size_t fsize[]); /* raises*/
 
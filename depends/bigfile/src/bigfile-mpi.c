@@ -548,9 +548,154 @@ _aggregated(
     return big_file_mpi_broadcast_anyerror(e, comm);
 }
 
+/*
+ * Encoded files can only be written whole, so the rows of each file
+ * are first redistributed to a single owner rank, which encodes and writes the file.
+ * The owners are spread evenly over comm. As in _throttle_action, they are split into
+ * concurrency groups and the owners of a group write in turn, so at most concurrency ranks write at once.
+ * */
+static int
+_encoded_write(MPI_Comm comm, int concurrency, BigBlock * block, BigBlockPtr * ptr, BigArray * array)
+{
+    int ThisTask, NTask;
+    int i;
+    int e = 0;
+
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+
+    size_t elsize = big_file_dtype_itemsize(block->dtype) * block->nmemb;
+    size_t localsize = array->dims[0];
+    size_t myoffset;
+    size_t * sizes = malloc(sizeof(sizes[0]) * NTask);
+    size_t * offsets = malloc(sizeof(offsets[0]) * (NTask + 1));
+
+    size_t totalsize = MPIU_Segmenter_collect_sizes(localsize, sizes, &myoffset, comm);
+    offsets[0] = 0;
+    for(i = 0; i < NTask; i ++) {
+        offsets[i + 1] = offsets[i] + sizes[i];
+    }
+    free(sizes);
+
+    /* find the range of files covered by this write; it must be aligned to file boundaries. */
+    size_t start = block->foffset[ptr->fileid] + ptr->roffset;
+    int f0 = ptr->fileid;
+    int f1 = f0;
+    while(f1 < block->Nfile && block->foffset[f1] < start + totalsize) {
+        f1 ++;
+    }
+    if(ptr->roffset != 0 || block->foffset[f1] != start + totalsize) {
+        /* all ranks see the same ptr and totalsize, so all ranks raise here. */
+        free(offsets);
+        RAISE(ex_partial,
+            "Encoded block `%s' (%s) must be written a whole file at a time (%d:%td)",
+            block->basename, block->codec, ptr->fileid, ptr->roffset);
+    }
+    int nfiles = f1 - f0;
+
+    /* owned range of rows of each rank, relative to start */
+    size_t * ownedoffsets = malloc(sizeof(ownedoffsets[0]) * (NTask + 1));
+    int f = f0;
+    for(i = 0; i <= NTask; i ++) {
+        while(f < f1 && (ptrdiff_t) (f - f0) * NTask / nfiles < i) f ++;
+        ownedoffsets[i] = block->foffset[f] - start;
+    }
+
+    int * sendcounts = malloc(sizeof(int) * 4 * NTask);
+    int * senddispls = sendcounts + NTask;
+    int * recvcounts = sendcounts + 2 * NTask;
+    int * recvdispls = sendcounts + 3 * NTask;
+    size_t myrecv = 0;
+    for(i = 0; i < NTask; i ++) {
+        /* rows of mine in the range owned by i */
+        size_t lo = ownedoffsets[i] > myoffset ? ownedoffsets[i] : myoffset;
+        size_t hi = ownedoffsets[i + 1] < myoffset + localsize ? ownedoffsets[i + 1] : myoffset + localsize;
+        sendcounts[i] = hi > lo ? hi - lo : 0;
+        senddispls[i] = hi > lo ? lo - myoffset : 0;
+        /* rows of i in the range owned by me */
+        lo = offsets[i] > ownedoffsets[ThisTask] ? offsets[i] : ownedoffsets[ThisTask];
+        hi = offsets[i + 1] < ownedoffsets[ThisTask + 1] ? offsets[i + 1] : ownedoffsets[ThisTask + 1];
+        recvcounts[i] = hi > lo ? hi - lo : 0;
+        recvdispls[i] = myrecv;
+        myrecv += recvcounts[i];
+    }
+
+    BigArray larray[1];
+    BigArrayIter iarray[1], ilarray[1];
+    void * lbuf = malloc(elsize * localsize + 1);
+    void * gbuf = malloc(elsize * myrecv + 1);
+
+    big_array_init(larray, lbuf, block->dtype, 2, (size_t[]){localsize, block->nmemb}, NULL);
+    big_array_iter_init(iarray, array);
+    big_array_iter_init(ilarray, larray);
+    _dtype_convert(ilarray, iarray, localsize * block->nmemb);
+
+    MPI_Datatype mpidtype;
+    MPI_Type_contiguous(elsize, MPI_BYTE, &mpidtype);
+    MPI_Type_commit(&mpidtype);
+    MPI_Alltoallv(lbuf, sendcounts, senddispls, mpidtype,
+                  gbuf, recvcounts, recvdispls, mpidtype, comm);
+    MPI_Type_free(&mpidtype);
+    free(sendcounts);
+    free(lbuf);
+
+    if(concurrency <= 0) {
+        concurrency = NTask;
+    }
+    /* every owner is a segment of its own */
+    MPIU_Segmenter seggrp[1];
+    sizes = malloc(sizeof(sizes[0]) * NTask);
+    size_t ownedoffset;
+    MPIU_Segmenter_collect_sizes(myrecv, sizes, &ownedoffset, comm);
+    MPIU_Segmenter_init(seggrp, sizes, NULL, 0, concurrency, comm);
+    free(sizes);
+
+    int segment;
+    for(segment = seggrp->segment_start;
+        segment < seggrp->segment_end;
+        segment ++) {
+
+        MPI_Barrier(seggrp->Group);
+
+        if(0 != (e = big_file_mpi_broadcast_anyerror(e, seggrp->Group))) {
+            /* failed , abort. */
+            continue;
+        }
+        if(seggrp->ThisSegment != segment) continue;
+
+        /* encode and write the owned files */
+        char * p = gbuf;
+        for(f = f0; f < f1 && e == 0; f ++) {
+            size_t foff = block->foffset[f] - start;
+            if(foff < ownedoffsets[ThisTask] || foff >= ownedoffsets[ThisTask + 1]) continue;
+            BigBlockPtr ptr1[1];
+            BigArray garray[1];
+            big_array_init(garray, p, block->dtype, 2, (size_t[]){block->fsize[f], block->nmemb}, NULL);
+            big_block_seek(block, ptr1, block->foffset[f]);
+            e = big_block_write(block, ptr1, garray);
+            p += block->fsize[f] * elsize;
+        }
+    }
+    MPIU_Segmenter_destroy(seggrp);
+    free(gbuf);
+    free(ownedoffsets);
+    free(offsets);
+
+    if(0 == (e = big_file_mpi_broadcast_anyerror(e, comm))) {
+        big_block_seek_rel(block, ptr, totalsize);
+    }
+    return e;
+
+ex_partial:
+    return -1;
+}
+
 int
 big_block_mpi_write(BigBlock * block, BigBlockPtr * ptr, BigArray * array, int concurrency, MPI_Comm comm)
 {
+    if(block->codec[0]) {
+        return _encoded_write(comm, concurrency, block, ptr, array);
+    }
     int rt = _throttle_action(comm, concurrency, block, ptr, array, big_block_write);
     return rt;
 }
@@ -68,10 +68,6 @@ attrset_set_attr(BigAttrSet * attrset, const char * attrname, const void * data,
 static int
 attrset_get_attr(BigAttrSet * attrset, const char * attrname, void * data, const char * dtype, int nmemb);
 
-/* Internal dtype API */
-static int
-dtype_convert_simple(void * dst, const char * dstdtype, const void * src, const char * srcdtype, size_t nmemb);
-
 /*Check dtype is valid*/
 static int dtype_isvalid(const char * dtype);
 
@@ -343,6 +339,15 @@ _big_block_open(BigBlock * bb, const char * basename)
                ex_fscanf,
                "Failed to read header of block `%s' (%s)", bb->basename, strerror(errno));
 
+        /* The CODEC line is only present for encoded blocks. */
+        long pos = ftell(fheader);
+        if(1 != fscanf(fheader, " CODEC: %31s", bb->codec)) {
+            bb->codec[0] = '\0';
+            fseek(fheader, pos, SEEK_SET);
+        }
+        RAISEIF(bb->codec[0] && !_big_codec_isvalid(bb->codec, bb->dtype), ex_fscanf,
+                "Unsupported codec in header of block `%s' (%s)", bb->basename, bb->codec);
+
         RAISEIF(bb->Nfile < 0 || bb->Nfile >= INT_MAX-1, ex_fscanf, 
                 "Unreasonable value for Nfile in header of block `%s' (%d)",bb->basename,bb->Nfile);
         RAISEIF(bb->nmemb < 0, ex_fscanf, 
@@ -582,6 +587,22 @@ big_block_set_dirty(BigBlock * block, int value)
     block->dirty = value;
 }
 
+int
+big_block_set_codec(BigBlock * block, const char * codec)
+{
+    RAISEIF(!_big_codec_isvalid(codec, block->dtype),
+            ex_codec,
+            "Codec `%s' is not supported for dtype %s of block `%s'", codec, block->dtype, block->basename);
+    if(codec == NULL || 0 == strcmp(codec, "raw"))
+        codec = "";
+    strncpy(block->codec, codec, sizeof(block->codec) - 1);
+    block->codec[sizeof(block->codec) - 1] = '\0';
+    block->dirty = 1;
+    return 0;
+ex_codec:
+    return -1;
+}
+
 int
 big_block_flush(BigBlock * block)
 {
@@ -596,6 +617,10 @@ big_block_flush(BigBlock * block)
             (0 > fprintf(fheader, "NFILE: %d\n", block->Nfile)),
                 ex_fprintf,
                 "Writing file header");
+        if(block->codec[0]) {
+            RAISEIF(0 > fprintf(fheader, "CODEC: %s\n", block->codec),
+                ex_fprintf, "Writing file header");
+        }
         for(i = 0; i < block->Nfile; i ++) {
             unsigned int s = block->fchecksum[i];
             unsigned int r = (s & 0xffff) + ((s & 0xffffffff) >> 16);
@@ -851,14 +876,21 @@ big_block_read(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
         RAISEIF(fp == NULL,
                 ex_open,
                 NULL);
-        RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
-                ex_seek,
-                "Failed to seek in block `%s' at (%d:%td) (%s)", 
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
-        RAISEIF(chunk_size != fread(chunkbuf, felsize, chunk_size, fp),
+        if(bb->codec[0]) {
+            RAISEIF(0 != _big_codec_read_rows(bb->codec, bb->dtype, nmemb, fp, ptr->roffset, chunk_size, chunkbuf),
                 ex_read,
-                "Failed to read in block `%s' at (%d:%td) (%s)",
-                bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+                "Failed to decode block `%s' at (%d:%td)",
+                bb->basename, ptr->fileid, ptr->roffset);
+        } else {
+            RAISEIF(0 > fseek(fp, ptr->roffset * felsize, SEEK_SET),
+                    ex_seek,
+                    "Failed to seek in block `%s' at (%d:%td) (%s)", 
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+            RAISEIF(chunk_size != fread(chunkbuf, felsize, chunk_size, fp),
+                    ex_read,
+                    "Failed to read in block `%s' at (%d:%td) (%s)",
+                    bb->basename, ptr->fileid, ptr->roffset * felsize, strerror(errno));
+        }
         fclose(fp);
         fp = NULL;
 
@@ -887,12 +919,87 @@ ex_malloc:
     return -1;
 }
 
+/* Encoded files are written whole: convert each file into a buffer, then encode it. */
+static int
+_big_block_write_encoded(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
+{
+    int nmemb = bb->nmemb ? bb->nmemb : 1;
+    int felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
+    ptrdiff_t towrite = array->size / nmemb;
+    BigArrayIter array_iter;
+    FILE * fp;
+    char * filebuf = NULL;
+
+    big_array_iter_init(&array_iter, array);
+
+    RAISEIF(bb->foffset[ptr->fileid] + ptr->roffset + towrite > bb->size,
+                ex_eof,
+                "Writing beyond the block `%s` at (%d:%td)",
+                bb->basename, ptr->fileid, ptr->roffset * felsize);
+
+    while(towrite > 0 && ! big_block_eof(bb, ptr)) {
+        size_t fsize = bb->fsize[ptr->fileid];
+        RAISEIF(ptr->roffset != 0 || towrite < fsize,
+            ex_partial,
+            "Encoded block `%s' (%s) must be written a whole file at a time (%d:%td)",
+            bb->basename, bb->codec, ptr->fileid, ptr->roffset);
+
+        filebuf = malloc(fsize * felsize + 1);
+        RAISEIF(filebuf == NULL,
+            ex_malloc,
+            "not enough memory to encode file %d of %td bytes", ptr->fileid, fsize * felsize);
+
+        BigArray file_array = {0};
+        BigArrayIter file_iter;
+        size_t dims[2] = {fsize, bb->nmemb};
+        big_array_init(&file_array, filebuf, bb->dtype, 2, dims, NULL);
+        big_array_iter_init(&file_iter, &file_array);
+
+        RAISEIF(0 != _dtype_convert(&file_iter, &array_iter, fsize * bb->nmemb),
+            ex_convert, NULL);
+
+        /* checksum is always of the decoded data */
+        bb->fchecksum[ptr->fileid] = 0;
+        sysvsum(&bb->fchecksum[ptr->fileid], filebuf, fsize * felsize);
+
+        fp = _big_file_open_a_file(bb->basename, ptr->fileid, "w", 1);
+        RAISEIF(fp == NULL,
+                ex_open,
+                NULL);
+        RAISEIF(0 != _big_codec_write_file(bb->codec, bb->dtype, nmemb, filebuf, fsize, fp),
+                ex_write,
+                "Failed to encode block `%s' file %d", bb->basename, ptr->fileid);
+        fclose(fp);
+        free(filebuf);
+        filebuf = NULL;
+
+        towrite -= fsize;
+        RAISEIF(0 != big_block_seek_rel(bb, ptr, fsize),
+                ex_blockseek, NULL);
+    }
+    return 0;
+
+ex_write:
+    fclose(fp);
+ex_open:
+ex_convert:
+ex_blockseek:
+    free(filebuf);
+ex_malloc:
+ex_partial:
+ex_eof:
+    return -1;
+}
+
 int
 big_block_write(BigBlock * bb, BigBlockPtr * ptr, BigArray * array)
 {
     if(array->size == 0) return 0;
     /* the file header is modified */
     bb->dirty = 1;
+    if(bb->codec[0]) {
+        return _big_block_write_encoded(bb, ptr, array);
+    }
     char * chunkbuf = malloc(CHUNK_BYTES);
     int nmemb = bb->nmemb ? bb->nmemb : 1;
     int felsize = big_file_dtype_itemsize(bb->dtype) * nmemb;
@@ -1247,7 +1354,7 @@ big_file_dtype_parse(const char * buffer, const char * dtype, void * data, const
     return 0;
 }
 
-static int
+int
 dtype_convert_simple(void * dst, const char * dstdtype, const void * src, const char * srcdtype, size_t nmemb)
 {
     BigArray dst_array, src_array;
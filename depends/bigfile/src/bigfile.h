@@ -37,6 +37,7 @@ typedef struct BigBlock {
     int Nfile;
     BigAttrSet * attrset;
     int dirty;
+    char codec[32]; /* codec of the data files; empty for raw. See big_block_set_codec */
 } BigBlock;
 
 typedef struct BigBlockPtr BigBlockPtr;
@@ -92,6 +93,11 @@ int big_block_grow(BigBlock * bb, int Nfile_grow, const size_t fsize_grow[]); /*
 int big_block_flush(BigBlock * block); /* raises */
 
 void big_block_set_dirty(BigBlock * block, int value);
+
+/* Encode the data files of the block with a codec. Must be called before any data is written.
+ * codec is "raw", "lz4" (lossless) or "quantize:TOL" (absolute error <= TOL, floating point only).
+ * Encoded files must be written whole in a single big_block_write call. raises */
+int big_block_set_codec(BigBlock * block, const char * codec);
 void big_attrset_set_dirty(BigAttrSet * attrset, int value);
 
 /** Initialise BigBlockPtr to the place in the BigBlock offset elements from the beginning of the block.
@@ -40,10 +40,12 @@ int main(int argc, char **argv)
 {
     int NTask;
     int thread_provided;
-    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_provided);
+    /* MPI_THREAD_MULTIPLE is only needed for asynchronous snapshot writing. The parameter file cannot be read
+     * before MPI is initialised, so it is always requested: petaio_init disables asynchronous writing if it is not provided.*/
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &thread_provided);
     MPI_Comm_size(MPI_COMM_WORLD, &NTask);
-    if(thread_provided != MPI_THREAD_FUNNELED)
-        message(1, "MPI_Init_thread returned %d != MPI_THREAD_FUNNELED\n", thread_provided);
+    if(thread_provided < MPI_THREAD_FUNNELED)
+        message(1, "MPI_Init_thread returned %d < MPI_THREAD_FUNNELED\n", thread_provided);
 
     if(argc < 2)
     {
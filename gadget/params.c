@@ -16,11 +16,14 @@
 #include <libgadget/density.h>
 #include <libgadget/hydra.h>
 #include <libgadget/fof.h>
+#include <libgadget/subfind.h>
 #include <libgadget/init.h>
 #include <libgadget/timebinmgr.h>
 #include <libgadget/petaio.h>
 #include <libgadget/cooling_qso_lightup.h>
 #include <libgadget/metal_return.h>
+#include <libgadget/lightcone.h>
+#include <libgadget/checkpoint.h>
 
 static int
 BlackHoleFeedbackMethodAction (ParameterSet * ps, char * name, void * data)
@@ -63,12 +66,19 @@ create_gadget_parameter_set()
         {NULL, DENSITY_KERNEL_QUARTIC_SPLINE},
     } ;
     param_declare_enum(ps,    "DensityKernelType", DensityKernelTypeEnum, OPTIONAL, "quintic", "SPH density kernel to use. Supported values are cubic, quartic and quintic.");
+    param_declare_string(ps, "LocalCheckpointDir", OPTIONAL, "", "If set, each rank periodically writes its particles and domain to a file in this directory, which should be on fast node-local storage and unique to the run. A restart on the same number of ranks reads these instead of the last snapshot if they are newer. Remove them to restart from an older snapshot.");
+    param_declare_double(ps, "LocalCheckpointInterval", OPTIONAL, 1800, "Seconds of wall clock between node-local checkpoints.");
     param_declare_string(ps, "SnapshotFileBase", OPTIONAL, "PART", "Base name of the snapshot files, _%03d will be appended to the name.");
     param_declare_string(ps, "FOFFileBase", OPTIONAL, "PIG", "Base name of the fof files, _%03d will be appended to the name.");
     param_declare_string(ps, "EnergyFile", OPTIONAL, "energy.txt", "File to output energy statistics.");
     param_declare_int(ps,    "OutputEnergyDebug", OPTIONAL, 0, "Should we output energy statistics to energy.txt");
     param_declare_string(ps, "CpuFile", OPTIONAL, "cpu.txt", "File to output cpu usage information");
     param_declare_string(ps, "OutputList", REQUIRED, NULL, "List of output scale factors.");
+    param_declare_string(ps, "LiteOutputList", OPTIONAL, "", "List of output scale factors of the lite snapshot stream, which is appended to the single file SnapshotFileBase_LITE.");
+    param_declare_double(ps, "LiteSampleFraction", OPTIONAL, 1.0, "Fraction of the particles written to lite snapshots. They are chosen by a hash of the ID, so the same particles are in every epoch.");
+    param_declare_int(ps, "LiteParticleTypes", OPTIONAL, 2, "Bitmask of the particle types written to lite snapshots. 2 (1 << 1) is DM only.");
+    param_declare_string(ps, "LiteBlocks", OPTIONAL, "Position,ID", "Comma separated list of the blocks written to lite snapshots.");
+    param_declare_int(ps, "LiteSinglePrecision", OPTIONAL, 1, "Store double precision blocks (Position) of lite snapshots in single precision.");
 
     /*Cosmology parameters*/
     param_declare_double(ps, "Omega0", REQUIRED, 0.2814, "Total matter density at z=0");
@@ -140,6 +150,13 @@ create_gadget_parameter_set()
 
     param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "Use the Aggregated IO policy for small data set (Experimental).");
     param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 1024 * 1024 * 256, "Max number of bytes on a writer before reverting to throttled IO.");
+    param_declare_int(ps, "SnapshotAsyncWrite", OPTIONAL, 0, "Copy snapshots into a staging buffer and write them in a background thread while the simulation continues. Needs extra memory outside MaxMemSizePerNode for a copy of the snapshot, and MPI_THREAD_MULTIPLE.");
+    param_declare_int(ps, "SnapshotLosslessCompression", OPTIONAL, 0, "Compress integer snapshot blocks (IDs, Generation, ...) with the lossless byte-shuffle + LZ4 codec of bigfile.");
+    param_declare_double(ps, "SnapshotPositionTolerance", OPTIONAL, 0, "If > 0, snapshot positions are quantized and compressed with this absolute error, in internal length units. 0 writes them uncompressed.");
+    param_declare_double(ps, "SnapshotVelocityTolerance", OPTIONAL, 0, "If > 0, snapshot velocities are quantized and compressed with this absolute error, in the units of the Velocity block. 0 writes them uncompressed.");
+    param_declare_int(ps, "SnapshotConcurrentBlocks", OPTIONAL, 1, "Number of writer groups that write different small snapshot blocks at the same time, to overlap the file system latency of creating, writing and closing many small blocks. Blocks larger than BytesPerFile are still written one at a time by all ranks. 1 writes every block in turn.");
+    param_declare_int(ps, "SnapshotIndexChunkSize", OPTIONAL, 0, "Write a spatial index of each particle type, with the Peano key range and bounding box of every chunk of this many particles, so that a sub-volume can be read without reading whole blocks. 0 disables the index.");
+    param_declare_int(ps, "RestartUseSnapshotDomain", OPTIONAL, 1, "When restarting on the same number of MPI ranks, read each rank's particles from the snapshot in the saved domain layout and reuse the saved domain, instead of redoing the domain decomposition.");
 
     /*Parameters of the cooling module*/
     param_declare_int(ps, "CoolingOn", REQUIRED, 0, "Enables cooling");
@@ -166,12 +183,19 @@ create_gadget_parameter_set()
     param_declare_int(ps, "SelfShieldingOn", OPTIONAL, 1, "Enable a correction in the cooling table for self-shielding.");
     param_declare_double(ps, "PhotoIonizeFactor", OPTIONAL, 1, "Scale the TreeCool table by this factor.");
     param_declare_int(ps, "PhotoIonizationOn", OPTIONAL, 1, "Should PhotoIonization be enabled.");
+    param_declare_int(ps, "CoolingRateTable", OPTIONAL, 0, "Tabulate the heating and cooling rates in density and internal energy once per timestep and interpolate them, instead of solving the ionization network for each particle. Faster with many cooling particles; accurate to a few percent.");
     /* End cooling module parameters*/
 
     param_declare_int(ps, "HydroOn", OPTIONAL, 1, "Enables hydro force");
     param_declare_int(ps, "DensityOn", OPTIONAL, 1, "Enables SPH density computation.");
     param_declare_int(ps, "DensityIndependentSphOn", REQUIRED, 1, "Enables density-independent (pressure-entropy) SPH.");
-    param_declare_int(ps, "LightconeOn", OPTIONAL, 0, "Enables a wildly experimental lightcone algorithm that writes particles crossing a lightcone boundary to a file. May not work!");
+    param_declare_int(ps, "LightconeOn", OPTIONAL, 0, "Enables an experimental lightcone algorithm that writes particles crossing a lightcone boundary to the bigfile OutputDir/lightcone.");
+    param_declare_int(ps, "LightconeParticleTypes", OPTIONAL, 2, "Bitmask of the particle types written to the lightcone. Default is 2, DM only.");
+    param_declare_double(ps, "LightconeBufferMB", OPTIONAL, 64, "Megabytes of lightcone crossings buffered on each rank before they are written.");
+    param_declare_int(ps, "LightconeMapNside", OPTIONAL, 0, "If > 0, deposit the mass crossing the lightcone into HEALPix maps (RING ordering) with this Nside, one for each shell in comoving distance. Set LightconeParticleTypes = 0 to write only the maps. The shell being filled when a run is restarted lacks its earlier deposits, and its blocks have the attribute Complete = 0.");
+    param_declare_double(ps, "LightconeMapShellWidth", OPTIONAL, 100000, "Comoving width of the lightcone map shells, in internal length units.");
+    param_declare_int(ps, "LightconeMapParticleTypes", OPTIONAL, 63, "Bitmask of the particle types deposited in the lightcone maps. Default is all types.");
+    param_declare_int(ps, "LightconeMapVelocity", OPTIONAL, 0, "Also write a map of the mass weighted mean radial velocity of each shell.");
     param_declare_int(ps, "TreeGravOn", OPTIONAL, 1, "Enables tree gravity");
     param_declare_int(ps, "RadiationOn", OPTIONAL, 1, "Include radiation density in the background evolution.");
     param_declare_int(ps, "FastParticleType", OPTIONAL, 2, "Particles of this type will not decrease the timestep. Default neutrinos.");
@@ -181,6 +205,7 @@ create_gadget_parameter_set()
     param_declare_int(ps, "GravitySofteningGas", OPTIONAL, 1, "0 to use adaptive softening, where the gas softening is the smoothing length of the last step.");
 
     param_declare_int(ps, "ImportBufferBoost", OPTIONAL, 2, "Memory factor to allow for there being more particles imported during treewlk than exported. Increase this if code crashes during treewalk with out of memory.");
+    param_declare_int(ps, "SmallTreeWalkMaxQueries", OPTIONAL, 1000, "Treewalks over few particles, such as the winds from new stars, broadcast their queries to every task instead of exporting them if there are at most this many in total. 0 disables.");
     param_declare_double(ps, "PartAllocFactor", OPTIONAL, 1.5, "Over-allocation factor of particles. The load can be imbalanced to allow for the work to be more balanced.");
     param_declare_double(ps, "TopNodeAllocFactor", OPTIONAL, 0.5, "Initial TopNode allocation as a fraction of maximum particle number.");
     param_declare_double(ps, "SlotsIncreaseFactor", OPTIONAL, 0.01, "Percentage factor to increase slot allocation by when requested.");
@@ -192,6 +217,13 @@ create_gadget_parameter_set()
     param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog.");
     param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, 0.2, "Linking length for Friends of Friends halos.");
     param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, 32, "Minimum number of particles per FOF Halo.");
+    param_declare_int(ps, "FOFUnionFind", OPTIONAL, 0, "Find FOF groups with one union-find treewalk and a single merge of links between tasks, instead of repeating the treewalk until the groups stop changing.");
+    param_declare_int(ps, "FOFSphericalOverdensity", OPTIONAL, 0, "Compute M200c, M500c, Mvir, their radii and a radial mass profile of all particles around the potential minimum of each FOF group.");
+    param_declare_int(ps, "FOFMergerTreeTracers", OPTIONAL, 0, "Number of most bound particles per group kept to link each FOF output to the groups of the previous one. The tracers are saved in the FOF output and reloaded on restart. 0 disables merger trees.");
+    param_declare_int(ps, "SubfindOn", OPTIONAL, 0, "Find gravitationally bound subhaloes of the FOF groups and save them in the Subhalo blocks of the FOF catalog.");
+    param_declare_int(ps, "SubfindDesNumNgb", OPTIONAL, 20, "Number of neighbours used for the subhalo finder density estimate.");
+    param_declare_int(ps, "SubfindMinLength", OPTIONAL, 20, "Minimum number of bound particles per subhalo.");
+    param_declare_double(ps, "SubfindErrTolTheta", OPTIONAL, 0.5, "Tree opening angle for the subhalo binding energy.");
     param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 2, "Minimal halo mass for seeding tracer particles in internal mass units.");
     param_declare_double(ps, "MinMStarForNewSeed", OPTIONAL, 5e-4, "Minimal stellar mass in halo for seeding black holes in internal mass units.");
     param_declare_double(ps, "TimeBetweenSeedingSearch", OPTIONAL, 1.04, "Scale factor fraction increase between Seeding Attempts.");
@@ -214,7 +246,9 @@ create_gadget_parameter_set()
     param_declare_int(ps, "BlackHoleRepositionEnabled", OPTIONAL, 1, "Enables Black hole repositioning to the potential minimum.");
 
     param_declare_double(ps, "BlackHoleFeedbackRadiusMaxPhys", OPTIONAL, 0, "If set, the physical radius at which the black hole feedback energy is deposited. When both this flag and BlackHoleFeedbackRadius are both set, the smaller radius is used.");
-    param_declare_int(ps,"WriteBlackHoleDetails",OPTIONAL, 0, "If set, output BH details at every time step.");
+    param_declare_int(ps,"WriteBlackHoleDetails",OPTIONAL, 0, "If set, output BH details at every time step to the bigfile OutputDir/BlackholeDetails.");
+    param_declare_double(ps, "BlackHoleDetailsBufferMB", OPTIONAL, 16, "Megabytes of BH details buffered on each rank before they are written. They are also written with each checkpoint.");
+    param_declare_int(ps, "BlackHoleDetailsFlushSteps", OPTIONAL, 0, "If > 0, also write the buffered BH details every this many BH timesteps.");
 
     param_declare_int(ps,"BH_DynFrictionMethod",OPTIONAL, 0, "If set to non-zero, dynamical friction is applied through this method. Setting BH_DynFrictionMethod = 1, = 2, = 3 uses stars only (=1), dark matter + stars (=2), all mass (=3) to compute the DF force.");
     param_declare_int(ps,"BH_DFBoostFactor",OPTIONAL, 1, "If set, dynamical friction is boosted by this factor.");
@@ -332,6 +366,7 @@ create_gadget_parameter_set()
     param_set_action(ps, "BlackHoleFeedbackMethod", BlackHoleFeedbackMethodAction, NULL);
     param_set_action(ps, "StarformationCriterion", StarformationCriterionAction, NULL);
     param_set_action(ps, "OutputList", OutputListAction, NULL);
+    param_set_action(ps, "LiteOutputList", LiteOutputListAction, NULL);
 
     return ps;
 }
@@ -382,8 +417,11 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     set_sfr_params(ps);
     set_winds_params(ps);
     set_fof_params(ps);
+    set_subfind_params(ps);
     set_blackhole_params(ps);
     set_metal_return_params(ps);
+    set_lightcone_params(ps);
+    set_checkpoint_params(ps);
 
     parameter_set_free(ps);
 }
@@ -2,8 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <gsl/gsl_math.h>
+#include <bigfile-mpi.h>
 
 #include "allvars.h"
 #include "utils.h"
@@ -18,6 +20,7 @@
 #include "sfr_eff.h"
 #include "winds.h"
 #include "walltime.h"
+#include "petaio.h"
 /*! \file blackhole.c
  *  \brief routines for gas accretion onto black holes, and black hole mergers
  */
@@ -46,6 +49,8 @@ struct BlackholeParams
     double MaxSeedBlackHoleMass; /* Maximum black hole seed mass*/
     double SeedBlackHoleMassIndex; /* Power law index for BH seed mass*/
     /************************************************************************/
+    size_t DetailsBufferSize; /* Bytes of BlackholeDetails buffered per rank before they are written*/
+    int DetailsFlushSteps; /* If > 0, write the BlackholeDetails at least this often, in BH steps*/
 } blackhole_params;
 
 int
@@ -77,12 +82,20 @@ typedef struct {
 
     MyFloat SmoothedEntropy;
     MyFloat GasVel[3];
+
+    /* Dynamical friction environment, only filled
+     * when the dynfric walk is folded into this one.*/
+    MyFloat SurroundingVel[3];
+    MyFloat SurroundingDensity;
+    MyFloat SurroundingParticles;
+    MyFloat SurroundingRmsVel;
 } TreeWalkResultBHAccretion;
 
 typedef struct {
     TreeWalkNgbIterBase base;
     DensityKernel accretion_kernel;
     DensityKernel feedback_kernel;
+    DensityKernel dynfric_kernel;
 } TreeWalkNgbIterBHAccretion;
 
 
@@ -150,6 +163,9 @@ struct BHPriv {
     MyFloat * BH_SurroundingParticles;
     MyFloat (*BH_SurroundingVel)[3];
     MyFloat * BH_SurroundingRmsVel;
+    /* If true, the dynamic friction environment is collected in the same
+     * neighbour search as the accretion treewalk, and no separate walk is done.*/
+    int DynFricInAccretion;
 
     /*************************************************************************/
 
@@ -174,21 +190,21 @@ struct BHPriv {
 struct BHinfo{
 
     MyIDType ID;
-    MyFloat Mass;
-    MyFloat Mdot;
-    MyFloat Density;
+    double Mass;
+    double Mdot;
+    double Density;
     int minTimeBin;
     int encounter;
 
     double  MinPotPos[3];
-    MyFloat MinPot;
-    MyFloat BH_Entropy;
-    MyFloat BH_SurroundingGasVel[3];
-    MyFloat BH_accreted_momentum[3];
+    double MinPot;
+    double BH_Entropy;
+    double BH_SurroundingGasVel[3];
+    double BH_accreted_momentum[3];
 
-    MyFloat BH_accreted_Mass;
-    MyFloat BH_accreted_BHMass;
-    MyFloat BH_FeedbackWeightSum;
+    double BH_accreted_Mass;
+    double BH_accreted_BHMass;
+    double BH_FeedbackWeightSum;
 
     MyIDType SPH_SwallowID;
     MyIDType SwallowID;
@@ -198,10 +214,10 @@ struct BHinfo{
 
     /****************************************/
     double Pos[3];
-    MyFloat BH_SurroundingDensity;
-    MyFloat BH_SurroundingParticles;
-    MyFloat BH_SurroundingVel[3];
-    MyFloat BH_SurroundingRmsVel;
+    double BH_SurroundingDensity;
+    double BH_SurroundingParticles;
+    double BH_SurroundingVel[3];
+    double BH_SurroundingRmsVel;
 
     double BH_DFAccel[3];
     double BH_DragAccel[3];
@@ -210,7 +226,67 @@ struct BHinfo{
     double Mtrack;
     double Mdyn;
 
-    MyDouble a;
+    double a;
+};
+
+/* The BlackholeDetails of the active black holes are buffered on each rank,
+ * and written collectively to a bigfile when the buffer is full, every DetailsFlushSteps
+ * BH steps, and with each checkpoint. This lives outside the main allocator,
+ * as it persists between timesteps.*/
+static struct {
+    struct BHinfo * p;
+    size_t size;
+    size_t maxsize;
+    /* BH steps since the last write*/
+    int NumSteps;
+} BHDetails;
+
+/* Empty if the details are not written*/
+static char BHDetailsFile[4096];
+
+/* One column of the BlackholeDetails file: a field of struct BHinfo,
+ * and the dtype it is stored with on disc.*/
+struct BHDetailsColumn {
+    const char * name;
+    size_t offset;
+    const char * dtype;
+    int nmemb;
+    const char * outdtype;
+};
+
+#define BHDETAILS_COLUMN(field, dtype, nmemb, outdtype) {#field, offsetof(struct BHinfo, field), dtype, nmemb, outdtype}
+
+static const struct BHDetailsColumn BHDetailsColumns[] = {
+    BHDETAILS_COLUMN(ID, "u8", 1, "u8"),
+    BHDETAILS_COLUMN(Mass, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(Mdot, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(Density, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(minTimeBin, "i4", 1, "i4"),
+    BHDETAILS_COLUMN(encounter, "i4", 1, "i4"),
+    BHDETAILS_COLUMN(MinPotPos, "f8", 3, "f8"),
+    BHDETAILS_COLUMN(MinPot, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_Entropy, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_SurroundingGasVel, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(BH_accreted_momentum, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(BH_accreted_Mass, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_accreted_BHMass, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_FeedbackWeightSum, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(SPH_SwallowID, "u8", 1, "u8"),
+    BHDETAILS_COLUMN(SwallowID, "u8", 1, "u8"),
+    BHDETAILS_COLUMN(CountProgs, "i4", 1, "i4"),
+    BHDETAILS_COLUMN(Swallowed, "i4", 1, "i4"),
+    BHDETAILS_COLUMN(Pos, "f8", 3, "f8"),
+    BHDETAILS_COLUMN(BH_SurroundingDensity, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_SurroundingParticles, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_SurroundingVel, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(BH_SurroundingRmsVel, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(BH_DFAccel, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(BH_DragAccel, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(BH_GravAccel, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(Velocity, "f8", 3, "f4"),
+    BHDETAILS_COLUMN(Mtrack, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(Mdyn, "f8", 1, "f4"),
+    BHDETAILS_COLUMN(a, "f8", 1, "f8"),
 };
 
 /*Set the parameters of the BH module*/
@@ -236,6 +312,8 @@ void set_blackhole_params(ParameterSet * ps)
         blackhole_params.BH_DRAG = param_get_int(ps, "BH_DRAG");
         blackhole_params.MergeGravBound = param_get_int(ps, "MergeGravBound");
         blackhole_params.SeedBHDynMass = param_get_double(ps,"SeedBHDynMass");
+        blackhole_params.DetailsBufferSize = param_get_double(ps, "BlackHoleDetailsBufferMB") * 1024 * 1024;
+        blackhole_params.DetailsFlushSteps = param_get_int(ps, "BlackHoleDetailsFlushSteps");
 
         blackhole_params.SeedBlackHoleMass = param_get_double(ps, "SeedBlackHoleMass");
         blackhole_params.MaxSeedBlackHoleMass = param_get_double(ps,"MaxSeedBlackHoleMass");
@@ -365,8 +443,54 @@ check_grav_bound(double dx[3], double dv[3], double da[3])
 
 
 
+void
+blackhole_details_init(const char * fname)
+{
+    snprintf(BHDetailsFile, sizeof(BHDetailsFile), "%s", fname);
+}
+
+/* Write the buffered details to the BlackholeDetails file and empty the buffer.
+ * Collective; the blocks are written straight from the buffer with strided views.*/
+void
+blackhole_details_flush(void)
+{
+    if(strlen(BHDetailsFile) == 0)
+        return;
+    BHDetails.NumSteps = 0;
+    int64_t TotalBuffered = BHDetails.size;
+    MPI_Allreduce(MPI_IN_PLACE, &TotalBuffered, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(TotalBuffered == 0)
+        return;
+
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, BHDetailsFile, MPI_COMM_WORLD) &&
+       0 != big_file_mpi_create(&bf, BHDetailsFile, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open blackhole details at %s:%s\n", BHDetailsFile,
+                    big_file_get_error_message());
+    }
+    message(0, "Writing %ld black hole details to %s\n", TotalBuffered, BHDetailsFile);
+
+    struct BHinfo dummy;
+    char * p = (char *) (BHDetails.size > 0 ? BHDetails.p : &dummy);
+    const size_t N = BHDetails.size;
+    size_t i;
+    for(i = 0; i < sizeof(BHDetailsColumns) / sizeof(BHDetailsColumns[0]); i++) {
+        const struct BHDetailsColumn * col = &BHDetailsColumns[i];
+        BigArray array = {0};
+        big_array_init(&array, p + col->offset, col->dtype, 2, (size_t []){N, col->nmemb},
+                (ptrdiff_t []){sizeof(struct BHinfo), big_file_dtype_itemsize(col->dtype)});
+        petaio_append_block(&bf, col->name, &array, col->outdtype, MPI_COMM_WORLD);
+    }
+
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close blackhole details at %s:%s\n", BHDetailsFile,
+                    big_file_get_error_message());
+    }
+    BHDetails.size = 0;
+}
+
 static void
-collect_BH_info(int * ActiveParticle,int NumActiveParticle, struct BHPriv *priv, FILE * FdBlackholeDetails)
+collect_BH_info(int * ActiveParticle,int NumActiveParticle, struct BHPriv *priv)
 {
     int i;
     int c=0;
@@ -380,6 +504,12 @@ collect_BH_info(int * ActiveParticle,int NumActiveParticle, struct BHPriv *priv,
 
         int PI = P[p_i].PI;
 
+        if(BHDetails.size == BHDetails.maxsize) {
+            BHDetails.maxsize = 2 * BHDetails.maxsize + 1024;
+            BHDetails.p = realloc(BHDetails.p, BHDetails.maxsize * sizeof(struct BHinfo));
+            if(!BHDetails.p)
+                endrun(1, "Failed to allocate %ld black hole details\n", BHDetails.maxsize);
+        }
         struct BHinfo info = {0};
         info.ID = P[p_i].ID;
         info.Mass = BHP(p_i).Mass;
@@ -435,24 +565,60 @@ collect_BH_info(int * ActiveParticle,int NumActiveParticle, struct BHPriv *priv,
 
         info.a = All.Time;
 
-        int size = sizeof(info);
-
-        fwrite(&size, sizeof(size), 1, FdBlackholeDetails);
-        fwrite(&info,sizeof(info),1,FdBlackholeDetails);
-        fwrite(&size, sizeof(size), 1, FdBlackholeDetails);
+        BHDetails.p[BHDetails.size++] = info;
         c++;
     }
 
-    fflush(FdBlackholeDetails);
     int64_t totalN;
 
     sumup_large_ints(1, &c, &totalN);
-    message(0, "Written details of %ld blackholes.\n", totalN);
+    message(0, "Buffered details of %ld blackholes.\n", totalN);
+
+    BHDetails.NumSteps++;
+    if((blackhole_params.DetailsFlushSteps > 0 && BHDetails.NumSteps >= blackhole_params.DetailsFlushSteps) ||
+        MPIU_Any(BHDetails.size * sizeof(struct BHinfo) >= blackhole_params.DetailsBufferSize, MPI_COMM_WORLD))
+        blackhole_details_flush();
 }
 
 
+#ifdef DEBUG
+/* Check that the DF acceleration from the accretion treewalk is the same as from a separate DF treewalk.
+ * The separate walk overwrites DFAccel and the DF environment with the same values.*/
+static void
+blackhole_check_dynfric(TreeWalk * tw_dynfric, int * ActiveBlackHoles, int64_t NumActiveBlackHoles)
+{
+    int64_t i, nbad = 0;
+    int k;
+    MyFloat (*DFAccel)[3] = (MyFloat (*) [3]) mymalloc("DFAccelFused", 3 * NumActiveBlackHoles * sizeof(MyFloat) + 1);
+    for(i = 0; i < NumActiveBlackHoles; i++)
+        for(k = 0; k < 3; k++)
+            DFAccel[i][k] = BHP(ActiveBlackHoles[i]).DFAccel[k];
+
+    treewalk_run(tw_dynfric, ActiveBlackHoles, NumActiveBlackHoles);
+
+    for(i = 0; i < NumActiveBlackHoles; i++) {
+        const int n = ActiveBlackHoles[i];
+        double diff = 0, norm = 0;
+        for(k = 0; k < 3; k++) {
+            diff += pow(BHP(n).DFAccel[k] - DFAccel[i][k], 2);
+            norm += pow(BHP(n).DFAccel[k], 2);
+        }
+        /* The sums over the neighbours may be reduced in a different order*/
+        if(diff > 1e-10 * norm) {
+            message(1, "BH %ld DF acceleration %g %g %g in the accretion walk, %g %g %g in the DF walk\n", P[n].ID,
+                DFAccel[i][0], DFAccel[i][1], DFAccel[i][2], BHP(n).DFAccel[0], BHP(n).DFAccel[1], BHP(n).DFAccel[2]);
+            nbad++;
+        }
+    }
+    myfree(DFAccel);
+    MPI_Allreduce(MPI_IN_PLACE, &nbad, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(nbad > 0)
+        endrun(5, "%ld black holes have a different DF acceleration in the accretion treewalk\n", nbad);
+}
+#endif
+
 void
-blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FILE * FdBlackholeDetails)
+blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles)
 {
     if(!All.BlackHoleOn)
         return;
@@ -534,6 +700,12 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     tw_accretion->haswork = NULL;
     tw_dynfric->haswork = NULL;
 
+    /* The dynamic friction and accretion treewalks both search all particle types
+     * around the black hole asymmetrically, so one neighbour search can serve both.
+     * The gravitationally bound merger criterion needs the DF acceleration of this step
+     * for both black holes, including remote ones, so in that case we keep a separate walk.*/
+    priv->DynFricInAccretion = blackhole_params.BH_DynFrictionMethod > 0 && blackhole_params.MergeGravBound != 1;
+
     /*************************************************************************/
     /*  Dynamical Friction Treewalk */
 
@@ -543,7 +715,7 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     priv->BH_SurroundingParticles = mymalloc("BH_SurroundingParticles", SlotsManager->info[5].size * sizeof(priv->BH_SurroundingParticles));
     priv->BH_SurroundingDensity = mymalloc("BH_SurroundingDensity", SlotsManager->info[5].size * sizeof(priv->BH_SurroundingDensity));
     /* guard treewalk */
-    if (blackhole_params.BH_DynFrictionMethod > 0)
+    if (blackhole_params.BH_DynFrictionMethod > 0 && !priv->DynFricInAccretion)
         treewalk_run(tw_dynfric, ActiveBlackHoles, NumActiveBlackHoles);
 
     /*************************************************************************/
@@ -566,6 +738,10 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
 
     /* This allocates memory*/
     treewalk_run(tw_accretion, ActiveBlackHoles, NumActiveBlackHoles);
+#ifdef DEBUG
+    if(priv->DynFricInAccretion)
+        blackhole_check_dynfric(tw_dynfric, ActiveBlackHoles, NumActiveBlackHoles);
+#endif
 
     /*************************************************************************/
 
@@ -590,8 +766,8 @@ blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FI
     /*************************************************************************/
     walltime_measure("/BH/Feedback");
 
-    if(FdBlackholeDetails){
-        collect_BH_info(ActiveBlackHoles, NumActiveBlackHoles, priv, FdBlackholeDetails);
+    if(strlen(BHDetailsFile) > 0){
+        collect_BH_info(ActiveBlackHoles, NumActiveBlackHoles, priv);
     }
 
     myfree(priv->BH_accreted_momentum);
@@ -780,6 +956,29 @@ blackhole_dynfric_copy(int place, TreeWalkQueryBHDynfric * I, TreeWalk * tw){
 }
 
 
+/* Collect Star/+DM/+Gas density/velocity for DF computation.
+ * Shared by the dynfric treewalk and the accretion treewalk when they are fused.*/
+static void
+blackhole_dynfric_collect(const int other, const double r, const double r2, DensityKernel * kernel,
+        MyFloat * Density, MyFloat * Particles, MyFloat * Vel, MyFloat * RmsVel)
+{
+    if(P[other].Type == 4 || (P[other].Type == 1 && blackhole_params.BH_DynFrictionMethod > 1) ||
+        (P[other].Type == 0 && blackhole_params.BH_DynFrictionMethod == 3) ){
+        if(r2 < kernel->HH) {
+            double u = r * kernel->Hinv;
+            double wk = density_kernel_wk(kernel, u);
+            float mass_j = P[other].Mass;
+            int k;
+            *Particles += 1;
+            *Density += (mass_j * wk);
+            for (k = 0; k < 3; k++){
+                Vel[k] += (mass_j * wk * P[other].Vel[k]);
+                *RmsVel += (mass_j * wk * pow(P[other].Vel[k], 2));
+            }
+        }
+    }
+}
+
 static void
 blackhole_dynfric_ngbiter(TreeWalkQueryBHDynfric * I,
         TreeWalkResultBHDynfric * O,
@@ -794,26 +993,8 @@ blackhole_dynfric_ngbiter(TreeWalkQueryBHDynfric * I,
         return;
     }
 
-    int other = iter->base.other;
-    double r = iter->base.r;
-    double r2 = iter->base.r2;
-
-    /* Collect Star/+DM/+Gas density/velocity for DF computation */
-    if(P[other].Type == 4 || (P[other].Type == 1 && blackhole_params.BH_DynFrictionMethod > 1) ||
-        (P[other].Type == 0 && blackhole_params.BH_DynFrictionMethod == 3) ){
-        if(r2 < iter->dynfric_kernel.HH) {
-            double u = r * iter->dynfric_kernel.Hinv;
-            double wk = density_kernel_wk(&iter->dynfric_kernel, u);
-            float mass_j = P[other].Mass;
-            int k;
-            O->SurroundingParticles += 1;
-            O->SurroundingDensity += (mass_j * wk);
-            for (k = 0; k < 3; k++){
-                O->SurroundingVel[k] += (mass_j * wk * P[other].Vel[k]);
-                O->SurroundingRmsVel += (mass_j * wk * pow(P[other].Vel[k], 2));
-            }
-        }
-    }
+    blackhole_dynfric_collect(iter->base.other, iter->base.r, iter->base.r2, &iter->dynfric_kernel,
+            &O->SurroundingDensity, &O->SurroundingParticles, O->SurroundingVel, &O->SurroundingRmsVel);
 }
 
 /*************************************************************************************/
@@ -824,6 +1005,10 @@ blackhole_accretion_postprocess(int i, TreeWalk * tw)
 {
     int k;
     int PI = P[i].PI;
+    /* DF environment was collected in this walk: compute DFAccel first*/
+    if(BH_GET_PRIV(tw)->DynFricInAccretion)
+        blackhole_dynfric_postprocess(i, tw);
+
     if(BHP(i).Density > 0)
     {
         BH_GET_PRIV(tw)->BH_Entropy[PI] /= BHP(i).Density;
@@ -954,6 +1139,13 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
 
         density_kernel_init(&iter->accretion_kernel, I->Hsml, GetDensityKernelType());
         density_kernel_init(&iter->feedback_kernel, hsearch, GetDensityKernelType());
+        /* The DF kernel is Hsml, which may be larger than the feedback radius:
+         * search out to the larger of the two.*/
+        if(BH_GET_PRIV(lv->tw)->DynFricInAccretion) {
+            density_kernel_init(&iter->dynfric_kernel, I->Hsml, GetDensityKernelType());
+            if(iter->base.Hsml < I->Hsml)
+                iter->base.Hsml = I->Hsml;
+        }
         return;
     }
 
@@ -961,6 +1153,14 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
     double r = iter->base.r;
     double r2 = iter->base.r2;
 
+    if(BH_GET_PRIV(lv->tw)->DynFricInAccretion) {
+        blackhole_dynfric_collect(other, r, r2, &iter->dynfric_kernel,
+            &O->SurroundingDensity, &O->SurroundingParticles, O->SurroundingVel, &O->SurroundingRmsVel);
+        /* Everything else only sees neighbours inside the original search radius*/
+        if(r2 > iter->feedback_kernel.HH)
+            return;
+    }
+
     if(P[other].Mass < 0) return;
 
     if(P[other].Type != 5) {
@@ -1322,6 +1522,15 @@ blackhole_accretion_reduce(int place, TreeWalkResultBHAccretion * remote, enum T
     TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingGasVel[PI][0], remote->GasVel[0]);
     TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingGasVel[PI][1], remote->GasVel[1]);
     TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingGasVel[PI][2], remote->GasVel[2]);
+
+    if(BH_GET_PRIV(tw)->DynFricInAccretion) {
+        TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingDensity[PI], remote->SurroundingDensity);
+        TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingParticles[PI], remote->SurroundingParticles);
+        TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingVel[PI][0], remote->SurroundingVel[0]);
+        TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingVel[PI][1], remote->SurroundingVel[1]);
+        TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingVel[PI][2], remote->SurroundingVel[2]);
+        TREEWALK_REDUCE(BH_GET_PRIV(tw)->BH_SurroundingRmsVel[PI], remote->SurroundingRmsVel);
+    }
 }
 
 static void
@@ -20,7 +20,13 @@ void set_blackhole_params(ParameterSet * ps);
  * It will be compared to the current time and updated after seeding takes place.
  * tree is a valid ForceTree.
  */
-void blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles, FILE * FdBlackholeDetails);
+void blackhole(const ActiveParticles * act, ForceTree * tree, FILE * FdBlackHoles);
+
+/* Enable the BlackholeDetails output, buffered in memory and appended to the bigfile fname. */
+void blackhole_details_init(const char * fname);
+
+/* Write the buffered BlackholeDetails, eg, before a checkpoint or at the end of the run. Collective. */
+void blackhole_details_flush(void);
 
 /* Make a black hole from the particle at index. */
 void blackhole_make_one(int index);
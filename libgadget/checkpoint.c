@@ -20,38 +20,84 @@
  *  This file delegates the functions to petaio and fof.
  */
 
+/* Snapshot which is still being written in the background.
+ * It is only recorded in Snapshots.txt once it is complete,
+ * so that a restart never finds a partial snapshot.*/
+static struct {
+    int snapnum;
+    double Time;
+    const char * OutputDir;
+} PendingSnapshot = {-1, 0, NULL};
+
+static void
+record_snapshot(int snapnum, double Time, const char * OutputDir)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
+        FILE * fd = fopen(buf, "a");
+        fprintf(fd, "%03d %g\n", snapnum, Time);
+        fclose(fd);
+        myfree(buf);
+    }
+}
+
 void
-write_checkpoint(int snapnum, int WriteSnapshot, int WriteGroupID, double Time, const char * OutputDir, const char * SnapshotFileBase, const int OutputDebugFields)
+wait_checkpoint(void)
+{
+    if(!petaio_async_wait())
+        return;
+    walltime_measure("/Snapshot/Wait");
+    if(PendingSnapshot.snapnum >= 0)
+        record_snapshot(PendingSnapshot.snapnum, PendingSnapshot.Time, PendingSnapshot.OutputDir);
+    PendingSnapshot.snapnum = -1;
+}
+
+void
+write_checkpoint(int snapnum, int WriteSnapshot, int WriteGroupID, double Time, const char * OutputDir, const char * SnapshotFileBase, const int OutputDebugFields, const DomainDecomp * ddecomp)
 {
     walltime_measure("/Misc");
     if(WriteSnapshot)
     {
+        /* Finish the previous snapshot, if it is still being written*/
+        wait_checkpoint();
         /* write snapshot of particles */
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable, WriteGroupID);
         if(OutputDebugFields)
             register_debug_io_blocks(&IOTable);
-        petaio_save_snapshot(&IOTable, 1, "%s/%s_%03d", OutputDir, SnapshotFileBase, snapnum);
+        int async = petaio_save_snapshot_async(&IOTable, ddecomp, 1, "%s/%s_%03d", OutputDir, SnapshotFileBase, snapnum);
 
         destroy_io_blocks(&IOTable);
         walltime_measure("/Snapshot/Write");
 
-        int ThisTask;
-        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-        if(ThisTask == 0) {
-            char * buf = fastpm_strdup_printf("%s/Snapshots.txt", OutputDir);
-            FILE * fd = fopen(buf, "a");
-            fprintf(fd, "%03d %g\n", snapnum, Time);
-            fclose(fd);
-            myfree(buf);
+        if(async) {
+            PendingSnapshot.snapnum = snapnum;
+            PendingSnapshot.Time = Time;
+            PendingSnapshot.OutputDir = OutputDir;
         }
+        else
+            record_snapshot(snapnum, Time, OutputDir);
      }
 }
 
+void
+write_lite_snapshot(double Time, const char * OutputDir, const char * SnapshotFileBase)
+{
+    walltime_measure("/Misc");
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable, 0);
+    petaio_save_lite(&IOTable, Time, "%s/%s_LITE", OutputDir, SnapshotFileBase);
+    destroy_io_blocks(&IOTable);
+    walltime_measure("/Snapshot/Lite");
+}
+
 void
 dump_snapshot(const char * dump, const char * OutputDir)
 {
     struct IOTable IOTable = {0};
+    wait_checkpoint();
     register_io_blocks(&IOTable, 0);
     register_debug_io_blocks(&IOTable);
     petaio_save_snapshot(&IOTable, 1, "%s/%s", OutputDir, dump);
@@ -94,3 +140,221 @@ find_last_snapnum(const char * OutputDir)
     MPI_Bcast(&snapnumber, 1, MPI_INT, 0, MPI_COMM_WORLD);
     return snapnumber;
 }
+
+/* Node-local checkpoints: each rank dumps its particle and slot arenas and the domain
+ * to a file on fast local storage. They are only usable by a restart on the same
+ * number of ranks, reading the same files, so the snapshots remain the real checkpoints.*/
+static struct checkpoint_params {
+    char LocalDir[1024]; /* Directory for the node-local checkpoints. Empty to disable them. */
+    double LocalInterval; /* Seconds between node-local checkpoints */
+} CheckpointParams;
+
+/* Change this when the layout of struct particle_data changes, as the particles are stored raw*/
+#define LOCAL_CHECKPOINT_MAGIC "MPGLOCL2"
+
+struct local_checkpoint_header {
+    char magic[8];
+    int NTask;
+    int ThisTask;
+    double Time;
+    int64_t NumPart;
+    int64_t MaxPart;
+    size_t ParticleSize;
+    int64_t SlotSize[6];
+    int64_t SlotMaxSize[6];
+    size_t SlotElsize[6];
+    double CurrentParticleOffset[3];
+    int NTopNodes;
+    int NTopLeaves;
+};
+
+void
+set_checkpoint_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        param_get_string2(ps, "LocalCheckpointDir", CheckpointParams.LocalDir, sizeof(CheckpointParams.LocalDir));
+        CheckpointParams.LocalInterval = param_get_double(ps, "LocalCheckpointInterval");
+    }
+    MPI_Bcast(&CheckpointParams, sizeof(struct checkpoint_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+static char *
+local_checkpoint_name(void)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    return fastpm_strdup_printf("%s/checkpoint-%06d", CheckpointParams.LocalDir, ThisTask);
+}
+
+int
+write_local_checkpoint(double Time, const DomainDecomp * ddecomp)
+{
+    static double LastCheckpoint = -1;
+    if(strlen(CheckpointParams.LocalDir) == 0)
+        return 0;
+
+    /* Task 0 decides, so that all tasks agree*/
+    double now = MPI_Wtime();
+    MPI_Bcast(&now, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if(LastCheckpoint < 0)
+        LastCheckpoint = now;
+    if(now - LastCheckpoint < CheckpointParams.LocalInterval)
+        return 0;
+    LastCheckpoint = now;
+
+    walltime_measure("/Misc");
+    int NTask, ThisTask, ptype;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    struct local_checkpoint_header header = {0};
+    memcpy(header.magic, LOCAL_CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.NTask = NTask;
+    header.ThisTask = ThisTask;
+    header.Time = Time;
+    header.NumPart = PartManager->NumPart;
+    header.MaxPart = PartManager->MaxPart;
+    header.ParticleSize = sizeof(struct particle_data);
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!SlotsManager->info[ptype].enabled)
+            continue;
+        header.SlotSize[ptype] = SlotsManager->info[ptype].size;
+        header.SlotMaxSize[ptype] = SlotsManager->info[ptype].maxsize;
+        header.SlotElsize[ptype] = SlotsManager->info[ptype].elsize;
+    }
+    memcpy(header.CurrentParticleOffset, PartManager->CurrentParticleOffset, 3 * sizeof(double));
+    header.NTopNodes = ddecomp->NTopNodes;
+    header.NTopLeaves = ddecomp->NTopLeaves;
+
+    /* Write to a temporary and rename it, so that a checkpoint is never partially overwritten*/
+    mkdir(CheckpointParams.LocalDir, 02755);
+    char * fname = local_checkpoint_name();
+    char * tmpname = fastpm_strdup_printf("%s.tmp", fname);
+    int fail = 0;
+    FILE * fd = fopen(tmpname, "w");
+    if(!fd)
+        fail = 1;
+    else {
+        fail |= 1 != fwrite(&header, sizeof(header), 1, fd);
+        fail |= header.NumPart != (int64_t) fwrite(PartManager->Base, sizeof(struct particle_data), header.NumPart, fd);
+        for(ptype = 0; ptype < 6; ptype++)
+            fail |= header.SlotSize[ptype] != (int64_t) fwrite(SlotsManager->info[ptype].ptr, header.SlotElsize[ptype], header.SlotSize[ptype], fd);
+        fail |= header.NTopNodes != (int) fwrite(ddecomp->TopNodes, sizeof(ddecomp->TopNodes[0]), header.NTopNodes, fd);
+        fail |= header.NTopLeaves != (int) fwrite(ddecomp->TopLeaves, sizeof(ddecomp->TopLeaves[0]), header.NTopLeaves, fd);
+        fail |= NTask != (int) fwrite(ddecomp->Tasks, sizeof(ddecomp->Tasks[0]), NTask, fd);
+        fail |= 0 != fclose(fd);
+    }
+    if(!fail)
+        fail = 0 != rename(tmpname, fname);
+    /* A failed local checkpoint is not fatal: the snapshots are still there.*/
+    if(fail)
+        message(1, "Failed to write local checkpoint %s: %s\n", tmpname, strerror(errno));
+    myfree(tmpname);
+    myfree(fname);
+    if(!MPIU_Any(fail, MPI_COMM_WORLD))
+        message(0, "Wrote local checkpoint at a = %g to %s\n", Time, CheckpointParams.LocalDir);
+    walltime_measure("/Snapshot/Local");
+    return 1;
+}
+
+/* Read the header of the local checkpoint of this task and check it matches this run*/
+static int
+local_checkpoint_read_header(FILE * fd, struct local_checkpoint_header * header)
+{
+    int NTask, ThisTask, ptype;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(1 != fread(header, sizeof(header[0]), 1, fd))
+        return 0;
+    if(0 != memcmp(header->magic, LOCAL_CHECKPOINT_MAGIC, sizeof(header->magic)) ||
+        header->NTask != NTask || header->ThisTask != ThisTask ||
+        header->ParticleSize != sizeof(struct particle_data) ||
+        header->NumPart > header->MaxPart)
+        return 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(header->SlotSize[ptype] == 0)
+            continue;
+        if(!SlotsManager->info[ptype].enabled || header->SlotElsize[ptype] != SlotsManager->info[ptype].elsize)
+            return 0;
+    }
+    return 1;
+}
+
+double
+find_local_checkpoint(double SnapTime)
+{
+    if(strlen(CheckpointParams.LocalDir) == 0)
+        return -1;
+    struct local_checkpoint_header header = {0};
+    char * fname = local_checkpoint_name();
+    FILE * fd = fopen(fname, "r");
+    int good = 0;
+    if(fd) {
+        good = local_checkpoint_read_header(fd, &header);
+        fclose(fd);
+    }
+    myfree(fname);
+
+    /* Every task must have a checkpoint at the same time, newer than the snapshot*/
+    double mintime = good ? header.Time : -1, maxtime = mintime;
+    MPI_Allreduce(MPI_IN_PLACE, &mintime, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &maxtime, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    if(mintime < 0 || mintime != maxtime) {
+        if(maxtime > 0)
+            message(0, "Local checkpoints are incomplete or inconsistent: reading the snapshot.\n");
+        return -1;
+    }
+    if(mintime <= SnapTime) {
+        message(0, "Local checkpoint at a = %g is older than the snapshot at a = %g: reading the snapshot.\n", mintime, SnapTime);
+        return -1;
+    }
+    message(0, "Restarting from the local checkpoint at a = %g.\n", mintime);
+    return mintime;
+}
+
+void
+read_local_checkpoint(DomainDecomp * ddecomp)
+{
+    int NTask, ptype;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    struct local_checkpoint_header header = {0};
+    char * fname = local_checkpoint_name();
+    FILE * fd = fopen(fname, "r");
+    if(!fd || !local_checkpoint_read_header(fd, &header))
+        endrun(1, "Failed to reopen local checkpoint %s\n", fname);
+
+    /* One sequential read of everything, straight into the arenas*/
+    particle_alloc_memory(header.MaxPart);
+    PartManager->NumPart = header.NumPart;
+    memcpy(PartManager->CurrentParticleOffset, header.CurrentParticleOffset, 3 * sizeof(double));
+    int fail = header.NumPart != (int64_t) fread(PartManager->Base, sizeof(struct particle_data), header.NumPart, fd);
+
+    int64_t newSlots[6] = {0};
+    MPI_Allreduce(header.SlotMaxSize, newSlots, 6, MPI_INT64, MPI_MAX, MPI_COMM_WORLD);
+    slots_reserve(0, newSlots, SlotsManager);
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!SlotsManager->info[ptype].enabled)
+            continue;
+        SlotsManager->info[ptype].size = header.SlotSize[ptype];
+        fail |= header.SlotSize[ptype] != (int64_t) fread(SlotsManager->info[ptype].ptr, header.SlotElsize[ptype], header.SlotSize[ptype], fd);
+    }
+
+    domain_restore_alloc(ddecomp, header.NTopNodes, header.NTopLeaves);
+    fail |= header.NTopNodes != (int) fread(ddecomp->TopNodes, sizeof(ddecomp->TopNodes[0]), header.NTopNodes, fd);
+    fail |= header.NTopLeaves != (int) fread(ddecomp->TopLeaves, sizeof(ddecomp->TopLeaves[0]), header.NTopLeaves, fd);
+    fail |= NTask != (int) fread(ddecomp->Tasks, sizeof(ddecomp->Tasks[0]), NTask, fd);
+    fclose(fd);
+    if(fail)
+        endrun(1, "Failed to read local checkpoint %s\n", fname);
+    myfree(fname);
+
+    /* As for a snapshot, the timesteps are assigned anew*/
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        P[i].TimeBin = 0;
+    slots_setup_id(PartManager, SlotsManager);
+    walltime_measure("/Snapshot/ReadLocal");
+}
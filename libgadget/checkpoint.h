@@ -1,8 +1,26 @@
 #ifndef CHECKPOINT_H
 #define CHECKPOINT_H
 
-void write_checkpoint(int snapnum, int WriteSnapshot, int WriteGroupID, double Time, const char * OutputDir, const char * SnapshotFileBase, const int OutputDebugFields);
+#include "domain.h"
+
+void write_checkpoint(int snapnum, int WriteSnapshot, int WriteGroupID, double Time, const char * OutputDir, const char * SnapshotFileBase, const int OutputDebugFields, const DomainDecomp * ddecomp);
+/* Wait for an asynchronously written snapshot to complete and record it in Snapshots.txt*/
+void wait_checkpoint(void);
+/* Append to the lite snapshot stream, in OutputDir/SnapshotFileBase_LITE*/
+void write_lite_snapshot(double Time, const char * OutputDir, const char * SnapshotFileBase);
 void dump_snapshot(const char * dump, const char * OutputDir);
 int find_last_snapnum(const char * OutputDir);
 
+/* Set the parameters of the node-local checkpoints*/
+void set_checkpoint_params(ParameterSet * ps);
+/* Write a node-local checkpoint, if LocalCheckpointInterval seconds have passed since the last one.
+ * Particles must be synchronised, as for a snapshot. Collective. Returns 1 if a checkpoint was written.*/
+int write_local_checkpoint(double Time, const DomainDecomp * ddecomp);
+/* Returns the time of the node-local checkpoint if every task has one and it is newer than SnapTime,
+ * otherwise -1. Collective.*/
+double find_local_checkpoint(double SnapTime);
+/* Read the particles, slots and domain from the node-local checkpoint.
+ * Call domain_restore_finish once the particle keys are set.*/
+void read_local_checkpoint(DomainDecomp * ddecomp);
+
 #endif
@@ -58,7 +58,7 @@ void init_cooling(const char * TreeCoolFile, const char * MetalCoolFile, char *
 static double
 get_lambdanet(double rho, double u, double redshift, double Z, struct UVBG * uvbg, double * ne_guess, int isHeIIIionized)
 {
-    double LambdaNet = get_heatingcooling_rate(rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
+    double LambdaNet = get_heatingcooling_rate_tabulated(rho, u, 1 - HYDROGEN_MASSFRAC, redshift, Z, uvbg, ne_guess);
     if(!isHeIIIionized) {
         /* get_long_mean_free_path_heating returns the heating in units of erg/s/cm^3,
          * the factor of the mean density converts from erg/s/cm^3 to erg/s/g */
@@ -153,6 +153,150 @@ double DoCooling(double redshift, double u_old, double rho, double dt, struct UV
     return u;
 }
 
+/* As get_lambdanet, for the particles idx[0..nidx) of a batch. rho, u and the results are indexed by the batch position.*/
+static inline void
+get_lambdanet_batch(const int nidx, const int * idx, const double * rho, const double * u, double redshift, const double * Z, const struct UVBG * uvbg, double * ne_guess, const int * isHeIIIionized, double * LambdaNet)
+{
+    double rr[COOLING_BATCH], uu[COOLING_BATCH], zz[COOLING_BATCH], ne[COOLING_BATCH], lam[COOLING_BATCH];
+    struct UVBG uv[COOLING_BATCH];
+    int k;
+    for(k = 0; k < nidx; k++) {
+        const int i = idx[k];
+        rr[k] = rho[i];
+        uu[k] = u[i];
+        zz[k] = Z[i];
+        ne[k] = ne_guess[i];
+        uv[k] = uvbg[i];
+    }
+    get_heatingcooling_rate_batch(nidx, rr, uu, 1 - HYDROGEN_MASSFRAC, redshift, zz, uv, ne, lam);
+    const double lmfp = get_long_mean_free_path_heating(redshift) / (coolunits.rho_crit_baryon * pow(1 + redshift,3));
+    for(k = 0; k < nidx; k++) {
+        const int i = idx[k];
+        ne_guess[i] = ne[k];
+        LambdaNet[i] = lam[k];
+        if(!isHeIIIionized[i])
+            LambdaNet[i] += lmfp;
+    }
+}
+
+/* Batched version of DoCooling. Each particle follows the same bracketing and bisection steps as in DoCooling,
+ * but all the particles still iterating evaluate their cooling rates together. Particles leave the
+ * active list as they converge.*/
+void
+DoCoolingBatch(const int n, double redshift, const double * u_old_in, const double * rho_in, const double * dt_in, const struct UVBG * uvbg, double * ne_guess, const double * Z, double MinEgySpec, const int * isHeIIIionized, double * u_new)
+{
+    int i, k;
+    if(n <= 0)
+        return;
+    if(!coolunits.CoolingOn) {
+        for(i = 0; i < n; i++)
+            u_new[i] = 0;
+        return;
+    }
+    if(n > COOLING_BATCH)
+        endrun(5, "Cooling batch of %d is larger than %d\n", n, COOLING_BATCH);
+
+    double rho[COOLING_BATCH], u_old[COOLING_BATCH], dt[COOLING_BATCH];
+    double u[COOLING_BATCH], u_lower[COOLING_BATCH], u_upper[COOLING_BATCH], trial[COOLING_BATCH], LambdaNet[COOLING_BATCH];
+    int heating[COOLING_BATCH], iter[COOLING_BATCH], active[COOLING_BATCH], eval[COOLING_BATCH];
+    int nactive = 0, neval;
+
+    MinEgySpec *= coolunits.uu_in_cgs;
+    for(i = 0; i < n; i++) {
+        rho[i] = rho_in[i] * coolunits.density_in_phys_cgs / PROTONMASS;	/* convert to (physical) protons/cm^3 */
+        u_old[i] = u_old_in[i] * coolunits.uu_in_cgs;
+        if(u_old[i] < MinEgySpec)
+            u_old[i] = MinEgySpec;
+        dt[i] = dt_in[i] * coolunits.tt_in_s;
+        u[i] = u_lower[i] = u_upper[i] = u_old[i];
+        iter[i] = 0;
+        active[i] = i;
+    }
+
+    get_lambdanet_batch(n, active, rho, u, redshift, Z, uvbg, ne_guess, isHeIIIionized, LambdaNet);
+
+    for(i = 0; i < n; i++)
+        heating[i] = (u[i] - u_old[i] - LambdaNet[i] * dt[i] < 0);
+
+    /* bracketing */
+    nactive = n;
+    while(nactive > 0) {
+        neval = 0;
+        for(k = 0; k < nactive; k++) {
+            const int j = active[k];
+            if(heating[j]) {
+                u_lower[j] = u_upper[j];
+                u_upper[j] *= 1.1;
+                trial[j] = u_upper[j];
+            }
+            else {
+                u_upper[j] = u_lower[j];
+                u_lower[j] /= 1.1;
+                /* This means that we don't need an initial bracket*/
+                if(u_upper[j] <= MinEgySpec)
+                    continue;
+                trial[j] = u_lower[j];
+            }
+            eval[neval++] = j;
+        }
+        if(neval == 0)
+            break;
+        get_lambdanet_batch(neval, eval, rho, trial, redshift, Z, uvbg, ne_guess, isHeIIIionized, LambdaNet);
+        nactive = 0;
+        for(k = 0; k < neval; k++) {
+            const int j = eval[k];
+            const double f = trial[j] - u_old[j] - LambdaNet[j] * dt[j];
+            if((heating[j] && f < 0) || (!heating[j] && f > 0))
+                active[nactive++] = j;
+        }
+    }
+
+    /* bisection */
+    for(i = 0; i < n; i++)
+        active[i] = i;
+    nactive = n;
+    while(nactive > 0) {
+        neval = 0;
+        for(k = 0; k < nactive; k++) {
+            const int j = active[k];
+            u[j] = 0.5 * (u_lower[j] + u_upper[j]);
+            /* If we know that the new energy
+             * is below the minimum gas internal energy, we are done here.*/
+            if(u_upper[j] <= MinEgySpec) {
+                u[j] = MinEgySpec;
+                continue;
+            }
+            eval[neval++] = j;
+        }
+        if(neval == 0)
+            break;
+        get_lambdanet_batch(neval, eval, rho, u, redshift, Z, uvbg, ne_guess, isHeIIIionized, LambdaNet);
+        nactive = 0;
+        for(k = 0; k < neval; k++) {
+            const int j = eval[k];
+            if(u[j] - u_old[j] - LambdaNet[j] * dt[j] > 0)
+                u_upper[j] = u[j];
+            else
+                u_lower[j] = u[j];
+
+            const double du = u_upper[j] - u_lower[j];
+            iter[j]++;
+
+            if(iter[j] >= (MAXITER - 10))
+                message(1, "u= %g\n", u[j]);
+
+            if(fabs(du / u[j]) > 1.0e-6 && iter[j] < MAXITER)
+                active[nactive++] = j;
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+        if(iter[i] >= MAXITER)
+            endrun(10, "failed to converge in DoCoolingBatch()\n");
+        u_new[i] = u[i] / coolunits.uu_in_cgs;   /*convert back to internal units */
+    }
+}
+
 /* returns cooling time.
  * NOTE: If we actually have heating, a cooling time of 0 is returned.
  */
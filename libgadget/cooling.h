@@ -43,9 +43,20 @@ double GetCoolingTime(double redshift, double u_old, double rho, struct UVBG * u
 /*Get the new internal energy per unit mass. ne_guess is set to the new internal equilibrium electron density*/
 double DoCooling(double redshift, double u_old, double rho, double dt, struct UVBG * uvbg, double *ne_guess, double Z, double MinEgySpec, int isHeIIIionized);
 
+/* Maximum number of particles cooled together by DoCoolingBatch*/
+#define COOLING_BATCH 32
+
+/* As DoCooling, for n <= COOLING_BATCH particles, which are solved in lockstep.
+ * The new internal energies are stored in u_new.*/
+void DoCoolingBatch(const int n, double redshift, const double * u_old, const double * rho, const double * dt, const struct UVBG * uvbg, double * ne_guess, const double * Z, double MinEgySpec, const int * isHeIIIionized, double * u_new);
+
 /*Interpolates the ultra-violet background tables to the desired redshift and returns a cooling rate table*/
 struct UVBG get_global_UVBG(double redshift);
 
+/* Tabulate the heating and cooling rates for this redshift and UVB, used by DoCooling for particles with this UVB.
+ * Does nothing if the rate table is disabled or already built for these arguments. Collective.*/
+void build_heatingcooling_table(double redshift, const struct UVBG * uvbg);
+
 /* Change the ultra-violet background table according to a pre-computed table of UV fluctuations.
  * This zeros the UVBG if this particular particle has not reionized yet*/
 struct UVBG get_local_UVBG(double redshift, const struct UVBG * const GlobalUVBG, const double * const Pos, const double * const PosOffset);
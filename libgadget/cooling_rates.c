@@ -103,6 +103,24 @@ static double * cool_recombHp, * cool_recombHeP, * cool_recombHePP;
 /*For the Free-free cooling rate*/
 static double * cool_freefree1;
 
+/* Table of the heating and cooling rate for the current redshift and UVB.
+ * Axes are log10 density in protons/cm^3 and log10 internal energy in erg/g.
+ * Each entry stores the primordial rate and the metal cooling per unit metallicity,
+ * both divided by the density, and the equilibrium electron abundance.*/
+#define RATETAB_NRHO 261
+#define RATETAB_LOGRHOMIN -9.
+#define RATETAB_DLOGRHO 0.05
+#define RATETAB_NU 801
+#define RATETAB_LOGUMIN 10.
+#define RATETAB_DLOGU 0.01
+static struct {
+    int valid;
+    double redshift;
+    double helium;
+    struct UVBG uvbg;
+    double * tab;
+} RateTable;
+
 static void
 init_itp_type(double * xarr, struct itp_type * Gamma, int Nelem)
 {
@@ -953,6 +971,7 @@ set_cooling_params(ParameterSet * ps)
         CoolingParams.HeliumHeatThresh = param_get_double(ps, "HeliumHeatThresh");
         CoolingParams.HeliumHeatAmp = param_get_double(ps, "HeliumHeatAmp");
         CoolingParams.HeliumHeatExp = param_get_double(ps, "HeliumHeatExp");
+        CoolingParams.RateTableOn = param_get_int(ps, "CoolingRateTable");
     }
     MPI_Bcast(&CoolingParams, sizeof(struct cooling_params), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
@@ -1020,6 +1039,94 @@ init_cooling_rates(const char * TreeCoolFile, const char * MetalCoolFile, Cosmol
 
     /*Initialize the metal cooling table*/
     InitMetalCooling(MetalCoolFile);
+
+    /* Storage for the rate table, which is filled every step*/
+    RateTable.valid = 0;
+    if(CoolingParams.RateTableOn && !RateTable.tab)
+        RateTable.tab = mymalloc("CoolingRateTable", 3 * RATETAB_NRHO * RATETAB_NU * sizeof(double));
+}
+
+void
+build_heatingcooling_table(double redshift, const struct UVBG * uvbg)
+{
+    if(!CoolingParams.RateTableOn)
+        return;
+    const double helium = 1 - HYDROGEN_MASSFRAC;
+    if(RateTable.valid && RateTable.redshift == redshift && 0 == memcmp(&RateTable.uvbg, uvbg, sizeof(struct UVBG)))
+        return;
+
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    /* Each task computes some density rows, which are then gathered everywhere*/
+    int * counts = mymalloc("RateTableCounts", 2 * NTask * sizeof(int));
+    int * displs = counts + NTask;
+    int i;
+    for(i = 0; i < NTask; i++) {
+        const int start = (int64_t) i * RATETAB_NRHO / NTask;
+        const int end = (int64_t) (i + 1) * RATETAB_NRHO / NTask;
+        counts[i] = 3 * RATETAB_NU * (end - start);
+        displs[i] = 3 * RATETAB_NU * start;
+    }
+    const int start = displs[ThisTask] / (3 * RATETAB_NU);
+    const int end = start + counts[ThisTask] / (3 * RATETAB_NU);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(i = start; i < end; i++) {
+        const double density = pow(10, RATETAB_LOGRHOMIN + i * RATETAB_DLOGRHO);
+        /* Start each solve from the last: neighbouring energies have similar ionization*/
+        double ne = 1.0;
+        int j;
+        for(j = 0; j < RATETAB_NU; j++) {
+            const double ienergy = pow(10, RATETAB_LOGUMIN + j * RATETAB_DLOGU);
+            double * entry = RateTable.tab + 3 * (i * RATETAB_NU + j);
+            entry[0] = get_heatingcooling_rate(density, ienergy, helium, redshift, 0, uvbg, &ne) / density;
+            entry[1] = get_heatingcooling_rate(density, ienergy, helium, redshift, 1, uvbg, &ne) / density - entry[0];
+            entry[2] = ne;
+        }
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, RateTable.tab, counts, displs, MPI_DOUBLE, MPI_COMM_WORLD);
+    myfree(counts);
+
+    RateTable.redshift = redshift;
+    RateTable.helium = helium;
+    RateTable.uvbg = *uvbg;
+    RateTable.valid = 1;
+}
+
+/* Bilinear interpolation in the rate table. x and y are the positions on the density and energy axes,
+ * which must be inside the table.*/
+static inline void
+interp_heatingcooling_table(const double x, const double y, double * val)
+{
+    const int i = x, j = y;
+    const double dx = x - i, dy = y - j;
+    const double * e00 = RateTable.tab + 3 * (i * RATETAB_NU + j);
+    const double * e01 = e00 + 3;
+    const double * e10 = e00 + 3 * RATETAB_NU;
+    const double * e11 = e10 + 3;
+    int k;
+    for(k = 0; k < 3; k++)
+        val[k] = (1 - dx) * ((1 - dy) * e00[k] + dy * e01[k]) + dx * ((1 - dy) * e10[k] + dy * e11[k]);
+}
+
+double
+get_heatingcooling_rate_tabulated(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
+{
+    if(!RateTable.valid || redshift != RateTable.redshift || helium != RateTable.helium ||
+            0 != memcmp(&RateTable.uvbg, uvbg, sizeof(struct UVBG)))
+        return get_heatingcooling_rate(density, ienergy, helium, redshift, metallicity, uvbg, ne_equilib);
+
+    const double x = (log10(density) - RATETAB_LOGRHOMIN) / RATETAB_DLOGRHO;
+    const double y = (log10(ienergy) - RATETAB_LOGUMIN) / RATETAB_DLOGU;
+    if(!(x >= 0 && x < RATETAB_NRHO - 1 && y >= 0 && y < RATETAB_NU - 1))
+        return get_heatingcooling_rate(density, ienergy, helium, redshift, metallicity, uvbg, ne_equilib);
+
+    double val[3];
+    interp_heatingcooling_table(x, y, val);
+    *ne_equilib = val[2];
+    return density * (val[0] + metallicity * val[1]);
 }
 
 /* Split out the Compton cooling*/
@@ -1157,6 +1264,341 @@ get_heatingcooling_rate(double density, double ienergy, double helium, double re
     return LambdaNet * pow(1 - helium, 2) * density / PROTONMASS;
 }
 
+/* The batched rate network. These evaluate the same formulae as ne_internal, scipy_optimize_fixed_point
+ * and get_heatingcooling_rate, for up to COOLING_BATCH particles at once, as loops over arrays.
+ * The position of each temperature in the rate tables is found once and shared by every table.
+ * Only temperatures outside the tables call the rate functions, by name.*/
+
+/* Positions of a batch of temperatures in the recombination and cooling tables*/
+struct recomb_index
+{
+    int index[COOLING_BATCH];
+    double frac[COOLING_BATCH];
+    /* Particles outside the tables, which get index 0*/
+    int outside[COOLING_BATCH];
+    int nout;
+};
+
+/* As the index computation in get_interpolated_recomb. Takes natural log of temperature.*/
+static void
+recomb_index_batch(const int n, const double * logt, struct recomb_index * ri)
+{
+    int k;
+    for(k = 0; k < n; k++) {
+        const double dind = (logt[k] - RECOMBTMIN) / (RECOMBTMAX - RECOMBTMIN) * NRECOMBTAB;
+        ri->index[k] = (int) dind;
+        ri->frac[k] = dind - ri->index[k];
+    }
+    ri->nout = 0;
+    for(k = 0; k < n; k++) {
+        if(ri->index[k] < 0 || ri->index[k] >= NRECOMBTAB-1) {
+            ri->outside[ri->nout++] = k;
+            ri->index[k] = 0;
+        }
+    }
+}
+
+/* Interpolate one table for the whole batch. Entries outside the table are set by the caller.*/
+static void
+interp_recomb_batch(const int n, const struct recomb_index * ri, const double * rec_tab, double * out)
+{
+    int k;
+    for(k = 0; k < n; k++)
+        out[k] = rec_tab[ri->index[k] + 1] * ri->frac[k] + rec_tab[ri->index[k]] * (1 - ri->frac[k]);
+}
+
+/* Ionic abundances, as computed by nH0_internal, nHp_internal and nHe_internal*/
+struct ion_batch
+{
+    double nH0[COOLING_BATCH];
+    double nHp[COOLING_BATCH];
+    double nHe0[COOLING_BATCH];
+    double nHep[COOLING_BATCH];
+    double nHepp[COOLING_BATCH];
+};
+
+/* Ionic abundances for a batch. ne is the electron density in cgs units.*/
+static void
+ion_abundances_batch(const int n, const double * nh, const double * logt, const double * ne, const struct UVBG * uvbg, const struct recomb_index * ri, struct ion_batch * ions)
+{
+    double photofac[COOLING_BATCH];
+    double alphaHp[COOLING_BATCH], GammaeH0[COOLING_BATCH];
+    double alphaHep[COOLING_BATCH], alphaHepp[COOLING_BATCH], GammaHe0[COOLING_BATCH], GammaHep[COOLING_BATCH];
+    int k;
+
+    /* As self_shield_corr*/
+    if(!CoolingParams.SelfShieldingOn) {
+        for(k = 0; k < n; k++)
+            photofac[k] = 1;
+    }
+    else {
+        for(k = 0; k < n; k++) {
+            const double ssdens = uvbg[k].self_shield_dens;
+            const double T4 = exp(0.17 * (logt[k] - log(1e4)));
+            const double nSSh = 1.003*ssdens*T4;
+            const double corr = 0.98*pow(1+pow(nh[k]/nSSh,1.64),-2.28)+0.02*pow(1+nh[k]/nSSh, -0.84);
+            photofac[k] = nh[k] < ssdens * 0.01 ? 1 : corr;
+        }
+    }
+
+    interp_recomb_batch(n, ri, rec_alphaHp, alphaHp);
+    interp_recomb_batch(n, ri, rec_GammaH0, GammaeH0);
+    interp_recomb_batch(n, ri, rec_alphaHep, alphaHep);
+    interp_recomb_batch(n, ri, rec_alphaHepp, alphaHepp);
+    interp_recomb_batch(n, ri, rec_GammaHe0, GammaHe0);
+    interp_recomb_batch(n, ri, rec_GammaHep, GammaHep);
+    for(k = 0; k < ri->nout; k++) {
+        const int j = ri->outside[k];
+        const double temp = exp(logt[j]);
+        alphaHp[j] = recomb_alphaHp(temp);
+        GammaeH0[j] = recomb_GammaeH0(temp);
+        alphaHep[j] = recomb_alphaHepd(temp);
+        alphaHepp[j] = recomb_alphaHepp(temp);
+        GammaHe0[j] = recomb_GammaeHe0(temp);
+        GammaHep[j] = recomb_GammaeHep(temp);
+    }
+
+    for(k = 0; k < n; k++) {
+        /*Be careful when there is no ionization.*/
+        const int ionized = ne[k] > 1e-50;
+        const double photorate = (uvbg[k].gJH0 > 0. && ionized) ? uvbg[k].gJH0/ne[k] * photofac[k] : 0;
+        ions->nH0[k] = alphaHp[k]/ (alphaHp[k] + GammaeH0[k] + photorate);
+        const double nHp = 1. - ions->nH0[k];
+        ions->nHp[k] = nHp < 0 ? 0 : nHp;
+
+        const int heionized = uvbg[k].gJHe0 > 0. && ionized;
+        const double GHe0 = GammaHe0[k] + (heionized ? uvbg[k].gJHe0/ne[k] * photofac[k] : 0);
+        const double GHep = GammaHep[k] + (heionized ? uvbg[k].gJHep/ne[k] * photofac[k] : 0);
+        const double nHep = nh[k] / (1 + alphaHep[k] / GHe0 + GHep/alphaHepp[k]);
+        /*Deal with the case where there is no ionization separately to avoid NaN.*/
+        const int heok = GHe0 > 1e-50;
+        ions->nHep[k] = heok ? nHep : 0;
+        ions->nHe0[k] = heok ? nHep * alphaHep[k] / GHe0 : 1;
+        ions->nHepp[k] = heok ? nHep * GHep / alphaHepp[k] : 0;
+    }
+}
+
+/* As ne_internal, for a batch. ne and ne_out are electron densities in cgs units.*/
+static void
+ne_internal_batch(const int n, const double * nh, const double * ienergy, const double * ne, const double helium, const struct UVBG * uvbg, double * logt, double * ne_out)
+{
+    struct recomb_index ri;
+    struct ion_batch ions;
+    const double yy = helium / 4 / (1 - helium);
+    int k;
+    for(k = 0; k < n; k++)
+        logt[k] = log(get_temp_internal(ne[k]/nh[k], ienergy[k], helium));
+    recomb_index_batch(n, logt, &ri);
+    ion_abundances_batch(n, nh, logt, ne, uvbg, &ri, &ions);
+    for(k = 0; k < n; k++)
+        ne_out[k] = nh[k] * ions.nHp[k] + yy * ions.nHep[k] + 2 * yy * ions.nHepp[k];
+}
+
+/* As scipy_optimize_fixed_point, for a batch iterated in lockstep.
+ * Converged particles drop out, so the ones still iterating are packed at the front of the work arrays.
+ * ne_init is in units of nh. Sets ne to the electron density in cgs units and logt to the log temperature.*/
+static void
+scipy_optimize_fixed_point_batch(const int n, const double * ne_init, const double * nh, const double * ienergy, const double helium, const struct UVBG * uvbg, double * ne, double * logt)
+{
+    int orig[COOLING_BATCH];
+    double nhc[COOLING_BATCH], iec[COOLING_BATCH], ne0[COOLING_BATCH], ne1[COOLING_BATCH], ne2[COOLING_BATCH];
+    double necgs[COOLING_BATCH], logt1[COOLING_BATCH];
+    struct UVBG uvc[COOLING_BATCH];
+    int nactive = n;
+    int i, k;
+    for(k = 0; k < n; k++) {
+        orig[k] = k;
+        nhc[k] = nh[k];
+        iec[k] = ienergy[k];
+        ne0[k] = ne_init[k];
+        uvc[k] = uvbg[k];
+    }
+    for(i = 0; i < MAXITER && nactive > 0; i++)
+    {
+        for(k = 0; k < nactive; k++)
+            necgs[k] = ne0[k] * nhc[k];
+        ne_internal_batch(nactive, nhc, iec, necgs, helium, uvc, logt1, ne1);
+        for(k = 0; k < nactive; k++)
+            ne1[k] /= nhc[k];
+
+        int nnext = 0;
+        for(k = 0; k < nactive; k++) {
+            if(fabs(ne1[k] - ne0[k]) < ITERCONV) {
+                logt[orig[k]] = logt1[k];
+                ne[orig[k]] = ne1[k] * nhc[k];
+                continue;
+            }
+            orig[nnext] = orig[k];
+            nhc[nnext] = nhc[k];
+            iec[nnext] = iec[k];
+            ne0[nnext] = ne0[k];
+            ne1[nnext] = ne1[k];
+            uvc[nnext] = uvc[k];
+            nnext++;
+        }
+        nactive = nnext;
+
+        for(k = 0; k < nactive; k++)
+            necgs[k] = ne1[k] * nhc[k];
+        ne_internal_batch(nactive, nhc, iec, necgs, helium, uvc, logt1, ne2);
+        for(k = 0; k < nactive; k++) {
+            ne2[k] /= nhc[k];
+            const double d = ne0[k] + ne2[k] - 2.0 * ne1[k];
+            double pp = ne2[k];
+            /*This is del^2*/
+            if (d > 1e-15 || d < -1e-15)
+                pp = ne0[k] - (ne1[k] - ne0[k])*(ne1[k] - ne0[k]) / d;
+            /*Enforce positivity*/
+            ne0[k] = pp < 0 ? 0 : pp;
+        }
+    }
+    /* Anything still iterating did not converge*/
+    for(k = 0; k < nactive; k++)
+        ne[orig[k]] = NAN;
+    for(k = 0; k < n; k++) {
+        if (!isfinite(ne[k]))
+            endrun(1, "Ionization rate network failed to converge for nh = %g helium=%g ienergy=%g (init=%g)\n", nh[k], helium, ienergy[k], ne_init[k]);
+    }
+}
+
+/* As get_heatingcooling_rate after the electron density is found, for a batch.
+ * ne is the equilibrium electron density in cgs units; nebynh is set to it in units of nh.*/
+static void
+heatingcooling_rate_batch_internal(const int n, const double * density, const double * ienergy, const double helium, const double redshift, const double * metallicity, const struct UVBG * uvbg, const double * ne, const double * logt, double * nebynh, double * rate)
+{
+    struct recomb_index ri;
+    struct ion_batch ions;
+    double nh[COOLING_BATCH], temp[COOLING_BATCH];
+    double collisH0[COOLING_BATCH], collisHe0[COOLING_BATCH], collisHeP[COOLING_BATCH];
+    double recombHp[COOLING_BATCH], recombHeP[COOLING_BATCH], recombHePP[COOLING_BATCH];
+    double cff[COOLING_BATCH], cff2[COOLING_BATCH], MetalCooling[COOLING_BATCH];
+    /*The helium number fraction*/
+    const double yy = helium / 4 / (1 - helium);
+    /* Constant part of cool_InverseCompton*/
+    const double tcmb_red = CoolingParams.CMBTemperature * (1+redshift);
+    const double compton = 4 * THOMPSON * RAD_CONST / (ELECTRONMASS * LIGHTCGS ) * pow(tcmb_red, 4) * BOLTZMANN;
+    const double nhfac = pow(1 - helium, 2);
+    int k;
+
+    for(k = 0; k < n; k++) {
+        nh[k] = density[k] * (1 - helium);
+        nebynh[k] = ne[k]/nh[k];
+        temp[k] = get_temp_internal(nebynh[k], ienergy[k], helium);
+    }
+    recomb_index_batch(n, logt, &ri);
+    ion_abundances_batch(n, nh, logt, ne, uvbg, &ri, &ions);
+
+    interp_recomb_batch(n, &ri, cool_collisH0, collisH0);
+    interp_recomb_batch(n, &ri, cool_collisHe0, collisHe0);
+    interp_recomb_batch(n, &ri, cool_collisHeP, collisHeP);
+    interp_recomb_batch(n, &ri, cool_recombHp, recombHp);
+    interp_recomb_batch(n, &ri, cool_recombHeP, recombHeP);
+    interp_recomb_batch(n, &ri, cool_recombHePP, recombHePP);
+    interp_recomb_batch(n, &ri, cool_freefree1, cff);
+    for(k = 0; k < ri.nout; k++) {
+        const int j = ri.outside[k];
+        const double tt = exp(logt[j]);
+        collisH0[j] = cool_CollisionalH0(tt);
+        collisHe0[j] = cool_CollisionalHe0(tt);
+        collisHeP[j] = cool_CollisionalHeP(tt);
+        recombHp[j] = cool_RecombHp(tt);
+        recombHeP[j] = cool_RecombHeP(tt);
+        recombHePP[j] = cool_RecombHePP(tt);
+        cff[j] = cool_FreeFree1(tt);
+    }
+    /*The factor of (zz=2)^2 has been pulled out, so if we use the Spitzer gaunt factor we don't need
+     * to call the FreeFree function again.*/
+    if(CoolingParams.cooling == Enzo2Nyx) {
+        for(k = 0; k < n; k++)
+            cff2[k] = cool_FreeFree(temp[k], 2);
+    }
+    else {
+        for(k = 0; k < n; k++)
+            cff2[k] = 4 * cff[k];
+    }
+    /*Metal cooling does nothing if metal cooling is disabled, so skip the table for metal-free gas*/
+    for(k = 0; k < n; k++)
+        MetalCooling[k] = metallicity[k] != 0 ? metallicity[k] * TableMetalCoolingRate(redshift, temp[k], nh[k]) : 0;
+
+    for(k = 0; k < n; k++) {
+        /*Put the abundances in units of nH to avoid underflows*/
+        const double nHep = ions.nHep[k] * (yy/nh[k]);
+        const double nHe0 = ions.nHe0[k] * (yy/nh[k]);
+        const double nHepp = ions.nHepp[k] * (yy/nh[k]);
+        const double LambdaCollis = nebynh[k] * (collisH0[k] * ions.nH0[k] + collisHe0[k] * nHe0 + collisHeP[k] * nHep);
+        const double LambdaRecomb = nebynh[k] * (recombHp[k] * ions.nHp[k] + recombHeP[k] * nHep + recombHePP[k] * nHepp);
+        const double LambdaFF = nebynh[k] * (cff[k] * (ions.nHp[k] + nHep) + cff2[k] * nHepp);
+        const double LambdaCmptn = nebynh[k] * (compton * (temp[k] - tcmb_red)) / nh[k];
+        const double Lambda = LambdaCollis + LambdaRecomb + LambdaFF + LambdaCmptn;
+        double Heat = (ions.nH0[k] * uvbg[k].epsH0 + nHe0 * uvbg[k].epsHe0 + nHep * uvbg[k].epsHep)/nh[k];
+        Heat *= cool_he_reion_factor(density[k], helium, redshift);
+        const double LambdaNet = Heat - Lambda - MetalCooling[k];
+        rate[k] = LambdaNet * nhfac * density[k] / PROTONMASS;
+    }
+}
+
+void
+get_heatingcooling_rate_batch(const int n, const double * density, const double * ienergy, const double helium, const double redshift, const double * metallicity, const struct UVBG * uvbg, double * ne_equilib, double * rate)
+{
+    if(n > COOLING_BATCH)
+        endrun(5, "Cooling batch of %d is larger than %d\n", n, COOLING_BATCH);
+
+    /* Particles in the table are interpolated; the rest solve the network together*/
+    int solve[COOLING_BATCH];
+    int nsolve = 0;
+    int k;
+    if(RateTable.valid && redshift == RateTable.redshift && helium == RateTable.helium) {
+        double x[COOLING_BATCH], y[COOLING_BATCH];
+        int tab[COOLING_BATCH];
+        int ntab = 0;
+        for(k = 0; k < n; k++) {
+            x[k] = (log10(density[k]) - RATETAB_LOGRHOMIN) / RATETAB_DLOGRHO;
+            y[k] = (log10(ienergy[k]) - RATETAB_LOGUMIN) / RATETAB_DLOGU;
+        }
+        for(k = 0; k < n; k++) {
+            if(x[k] >= 0 && x[k] < RATETAB_NRHO - 1 && y[k] >= 0 && y[k] < RATETAB_NU - 1 &&
+                0 == memcmp(&RateTable.uvbg, &uvbg[k], sizeof(struct UVBG)))
+                tab[ntab++] = k;
+            else
+                solve[nsolve++] = k;
+        }
+        for(k = 0; k < ntab; k++) {
+            const int j = tab[k];
+            double val[3];
+            interp_heatingcooling_table(x[j], y[j], val);
+            ne_equilib[j] = val[2];
+            rate[j] = density[j] * (val[0] + metallicity[j] * val[1]);
+        }
+    }
+    else {
+        for(k = 0; k < n; k++)
+            solve[k] = k;
+        nsolve = n;
+    }
+    if(nsolve == 0)
+        return;
+
+    double dens[COOLING_BATCH], ie[COOLING_BATCH], Z[COOLING_BATCH], nh[COOLING_BATCH], ne_init[COOLING_BATCH];
+    double ne[COOLING_BATCH], logt[COOLING_BATCH], nebynh[COOLING_BATCH], lambda[COOLING_BATCH];
+    struct UVBG uv[COOLING_BATCH];
+    for(k = 0; k < nsolve; k++) {
+        const int j = solve[k];
+        dens[k] = density[j];
+        ie[k] = ienergy[j];
+        Z[k] = metallicity[j];
+        uv[k] = uvbg[j];
+        nh[k] = density[j] * (1 - helium);
+        /* As in get_equilib_ne*/
+        ne_init[k] = ne_equilib[j] > 0 ? ne_equilib[j] : 1.0;
+    }
+    scipy_optimize_fixed_point_batch(nsolve, ne_init, nh, ie, helium, uv, ne, logt);
+    heatingcooling_rate_batch_internal(nsolve, dens, ie, helium, redshift, Z, uv, ne, logt, nebynh, lambda);
+    for(k = 0; k < nsolve; k++) {
+        ne_equilib[solve[k]] = nebynh[k];
+        rate[solve[k]] = lambda[k];
+    }
+}
+
 /*Get the equilibrium temperature at given internal energy.
     density is total gas density in protons/cm^3
     Internal energy is in ergs/g.
@@ -55,6 +55,10 @@ struct cooling_params
     double HeliumHeatAmp;
     double HeliumHeatExp;
     double rho_crit_baryon;
+
+    /*Tabulate the heating and cooling rate on a density and internal energy grid once per step,
+     * instead of solving the rate network for each particle. Default: off.*/
+    int RateTableOn;
 };
 
 /*Set the parameters for the cooling module from the parameter file.*/
@@ -91,6 +95,15 @@ double get_ne_by_nh(double density, double ienergy, double helium, const struct
  */
 double get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double * ne_equilib);
 
+/* As get_heatingcooling_rate, but interpolated from the table built by build_heatingcooling_table.
+ * Falls back to get_heatingcooling_rate outside the table or for a different redshift, UVB or helium fraction.*/
+double get_heatingcooling_rate_tabulated(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double * ne_equilib);
+
+/* As get_heatingcooling_rate_tabulated, for a batch of n <= COOLING_BATCH particles with the same helium fraction.
+ * The rate network is evaluated over arrays, with the ionization equilibrium of the whole batch solved in lockstep.
+ * Each particle has its own UVB in uvbg[i]. ne_equilib is the initial guess and is set to the equilibrium.*/
+void get_heatingcooling_rate_batch(const int n, const double * density, const double * ienergy, const double helium, const double redshift, const double * metallicity, const struct UVBG * uvbg, double * ne_equilib, double * rate);
+
 enum CoolProcess {
     RECOMB,
     COLLIS,
@@ -41,6 +41,15 @@
  */
 
 static DomainParams domain_params;
+
+/* Bumped whenever particles may have changed task. See domain_get_generation.*/
+static int64_t DomainGeneration;
+
+int64_t
+domain_get_generation(void)
+{
+    return DomainGeneration;
+}
 /**
  * Policy for domain decomposition.
  *
@@ -222,6 +231,7 @@ void domain_decompose_full(DomainDecomp * ddecomp)
 
     /*Ensure collective*/
     MPIU_Barrier(ddecomp->DomainComm);
+    DomainGeneration++;
     message(0, "Domain decomposition done.\n");
 
     report_memory_usage("DOMAIN");
@@ -244,6 +254,61 @@ void domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
         domain_decompose_full(ddecomp);
         return;
     }
+    DomainGeneration++;
+}
+
+/* Allocate the top tree at its final size, laid out as at the end of domain_decompose_full. */
+void domain_restore_alloc(DomainDecomp * ddecomp, const int NTopNodes, const int NTopLeaves)
+{
+    int NTask;
+
+    domain_free(ddecomp);
+
+    ddecomp->DomainComm = MPI_COMM_WORLD;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+
+    ddecomp->NTopNodes = NTopNodes;
+    ddecomp->NTopLeaves = NTopLeaves;
+    /* Add a tail item to avoid special treatments */
+    ddecomp->Tasks = (struct task_data *) mymalloc2("Tasks", (NTask + 1) * sizeof(ddecomp->Tasks[0]));
+    ddecomp->TopNodes  = (struct topnode_data *) mymalloc2("TopNodes", sizeof(ddecomp->TopNodes[0]) * NTopNodes);
+    /* add 1 extra to mark the end of TopLeaves; see assign */
+    ddecomp->TopLeaves = (struct topleaf_data *) mymalloc2("TopLeaves", sizeof(ddecomp->TopLeaves[0]) * (NTopLeaves + 1));
+
+    ddecomp->domain_allocated_flag = 1;
+}
+
+void domain_restore_finish(DomainDecomp * ddecomp)
+{
+    walltime_measure("/Misc");
+
+    message(0, "Restoring domain with %d top leaves.\n", ddecomp->NTopLeaves);
+
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+    /* the tail items, as in domain_assign_balanced */
+    ddecomp->TopLeaves[ddecomp->NTopLeaves].Task = NTask;
+    ddecomp->TopLeaves[ddecomp->NTopLeaves].topnode = -1;
+    ddecomp->Tasks[NTask].StartLeaf = ddecomp->NTopLeaves;
+    ddecomp->Tasks[NTask].EndLeaf = ddecomp->NTopLeaves;
+
+    /* Particles are already on the right task unless the snapshot
+     * was written between exchanges, so this moves very few of them.
+     * If there is no memory, fall back to a full decomposition.*/
+    if(domain_exchange(domain_layoutfunc, ddecomp, 0, NULL, PartManager, SlotsManager, 10000, ddecomp->DomainComm)) {
+        domain_decompose_full(ddecomp);
+        return;
+    }
+
+    slots_gc_sorted(PartManager, SlotsManager);
+
+    /*Ensure collective*/
+    MPIU_Barrier(ddecomp->DomainComm);
+    DomainGeneration++;
+
+    report_memory_usage("DOMAIN");
+
+    walltime_measure("/Domain/Restore");
 }
 
 /* this function generates several domain decomposition policies for attempting
@@ -69,6 +69,17 @@ void domain_decompose_full(DomainDecomp * ddecomp);
 /* Exchange particles which have moved into the new domains, not re-doing the split unless we have to*/
 void domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift);
 
+/* Allocate the top tree of a domain that is read from a snapshot, rather than computed.
+ * The caller fills TopNodes, TopLeaves and Tasks, then calls domain_restore_finish.*/
+void domain_restore_alloc(DomainDecomp * ddecomp, const int NTopNodes, const int NTopLeaves);
+/* Exchange the particles not in their restored domain and Peano sort them,
+ * as domain_decompose_full would do.*/
+void domain_restore_finish(DomainDecomp * ddecomp);
+
+/* Counts the domain decompositions and exchanges, so that the users of the communication
+ * pattern between tasks know when to rebuild it. The same on every task.*/
+int64_t domain_get_generation(void);
+
 /** This function determines the TopLeaves entry for the given key.*/
 static inline int
 domain_get_topleaf(const peano_t key, const DomainDecomp * ddecomp) {
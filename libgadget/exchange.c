@@ -188,6 +188,41 @@ shall_we_compact_slots(int * compact, ExchangePlan * plan, const struct slots_ma
     MPI_Allreduce(lcompact, compact, 6, MPI_INT, MPI_LOR, Comm);
 }
 
+/* Build a datatype for the particles and slots exchanged with one partner:
+ * count of them, starting at offset within the particle array base and the slot arrays slots.
+ * The displacements are absolute addresses, for use with MPI_BOTTOM.
+ * Returns MPI_DATATYPE_NULL if nothing is exchanged with the partner.
+ * Whole particle records are sent. The only fields a receiver could rebuild are PI, which it resets,
+ * and Key on the domain path. A Peano key costs ~90ns to recompute against ~1ns to send,
+ * and a gap for PI would make MPI pack every message instead of sending it in place.*/
+static MPI_Datatype
+_exchange_partner_type(const ExchangePlanEntry * count, const ExchangePlanEntry * offset, char * base, char * slots[6], const struct slots_manager_type * sman)
+{
+    int blocklens[7];
+    MPI_Aint displs[7];
+    int nblocks = 0;
+    int ptype;
+    if(count->base > 0) {
+        blocklens[nblocks] = count->base * sizeof(struct particle_data);
+        MPI_Get_address(base + offset->base * sizeof(struct particle_data), &displs[nblocks]);
+        nblocks++;
+    }
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled || count->slots[ptype] == 0)
+            continue;
+        const size_t elsize = sman->info[ptype].elsize;
+        blocklens[nblocks] = count->slots[ptype] * elsize;
+        MPI_Get_address(slots[ptype] + offset->slots[ptype] * elsize, &displs[nblocks]);
+        nblocks++;
+    }
+    if(nblocks == 0)
+        return MPI_DATATYPE_NULL;
+    MPI_Datatype type;
+    MPI_Type_create_hindexed(nblocks, blocklens, displs, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
 static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
 {
     size_t n;
@@ -269,48 +304,37 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
 
     slots_reserve(1, newSlots, sman);
 
-    int * sendcounts = (int*) ta_malloc("sendcounts", int, plan->NTask);
-    int * senddispls = (int*) ta_malloc("senddispls", int, plan->NTask);
-    int * recvcounts = (int*) ta_malloc("recvcounts", int, plan->NTask);
-    int * recvdispls = (int*) ta_malloc("recvdispls", int, plan->NTask);
+    /* One datatype per partner covering its particles and all its slots,
+     * so that everything exchanged with a partner is a single message.*/
+    MPI_Datatype * sendtypes = (MPI_Datatype *) mymalloc("sendtypes", plan->NTask * sizeof(MPI_Datatype));
+    MPI_Datatype * recvtypes = (MPI_Datatype *) mymalloc("recvtypes", plan->NTask * sizeof(MPI_Datatype));
 
-    _transpose_plan_entries(plan->toGo, sendcounts, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGoOffset, senddispls, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGet, recvcounts, -1, plan->NTask);
-    _transpose_plan_entries(plan->toGetOffset, recvdispls, -1, plan->NTask);
-
-    /* Ensure the mallocs are finished on all tasks before we start sending the data*/
-    MPI_Barrier(Comm);
-#ifdef DEBUG
-    message(0, "Starting particle data exchange\n");
-#endif
     /* recv at the end */
-    MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE,
-                 pman->Base + pman->NumPart, recvcounts, recvdispls, MPI_TYPE_PARTICLE,
-                 Comm);
-
+    char * recvslots[6] = {NULL};
     for(ptype = 0; ptype < 6; ptype ++) {
-        /* skip unused slot types */
         if(!sman->info[ptype].enabled) continue;
+        recvslots[ptype] = (char *) sman->info[ptype].ptr + sman->info[ptype].size * sman->info[ptype].elsize;
+    }
 
-        size_t elsize = sman->info[ptype].elsize;
-        int N_slots = sman->info[ptype].size;
-        char * ptr = sman->info[ptype].ptr;
-        _transpose_plan_entries(plan->toGo, sendcounts, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGoOffset, senddispls, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGet, recvcounts, ptype, plan->NTask);
-        _transpose_plan_entries(plan->toGetOffset, recvdispls, ptype, plan->NTask);
+    int task;
+    for(task = 0; task < plan->NTask; task++) {
+        sendtypes[task] = _exchange_partner_type(&plan->toGo[task], &plan->toGoOffset[task], (char *) partBuf, slotBuf, sman);
+        recvtypes[task] = _exchange_partner_type(&plan->toGet[task], &plan->toGetOffset[task], (char *) (pman->Base + pman->NumPart), recvslots, sman);
+    }
 
 #ifdef DEBUG
-        message(0, "Starting exchange for slot %d\n", ptype);
+    message(0, "Starting particle data exchange\n");
 #endif
+    MPI_Alltoallw_sparse(sendtypes, recvtypes, Comm);
 
-        /* recv at the end */
-        MPI_Alltoallv_sparse(slotBuf[ptype], sendcounts, senddispls, MPI_TYPE_SLOT[ptype],
-                     ptr + N_slots * elsize,
-                     recvcounts, recvdispls, MPI_TYPE_SLOT[ptype],
-                     Comm);
+    for(task = 0; task < plan->NTask; task++) {
+        if(sendtypes[task] != MPI_DATATYPE_NULL)
+            MPI_Type_free(&sendtypes[task]);
+        if(recvtypes[task] != MPI_DATATYPE_NULL)
+            MPI_Type_free(&recvtypes[task]);
     }
+    myfree(recvtypes);
+    myfree(sendtypes);
 
 #ifdef DEBUG
         message(0, "Done with AlltoAllv\n");
@@ -353,10 +377,6 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
 
     walltime_measure("/Domain/exchange/alltoall");
 
-    myfree(recvdispls);
-    myfree(recvcounts);
-    myfree(senddispls);
-    myfree(sendcounts);
     for(ptype = 5; ptype >=0; ptype --) {
         if(!sman->info[ptype].enabled) continue;
         myfree(slotBuf[ptype]);
@@ -469,27 +489,26 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
         endrun(212, "Package is too large, no free memory: package = %lu nlimit = %lu.", package, nlimit);
 
     /* We want to avoid doing an alltoall with
-     * more than 2GB of material as this hangs.*/
+     * more than 2GB of material as this hangs.
+     * The particles and slots travel together, so this limits their sum.*/
     const size_t maxexch = 1024L*1024L*2030L;
 
     /* Fast path: if we have enough space no matter what type the particles
      * are we don't need to check them.*/
     if((plan->nexchange * (sizeof(pman->Base[0]) + maxsize + sizeof(ExchangePartCache)) < nlimit) &&
-        (plan->nexchange * sizeof(pman->Base[0]) < maxexch) && (plan->nexchange * maxsize < maxexch)) {
+        (plan->nexchange * (sizeof(pman->Base[0]) + maxsize) < maxexch)) {
         return plan->nexchange;
     }
 
-    size_t partexch = 0;
-    size_t slotexch[6] = {0};
+    size_t exch = 0;
     /*Find how many particles we have space for.*/
     for(n = 0; n < plan->nexchange; n++)
     {
         const int i = plan->ExchangeList[n];
         const int ptype = pman->Base[i].Type;
-        partexch += sizeof(pman->Base[0]);
-        slotexch[ptype] += sman->info[ptype].elsize;
+        exch += sizeof(pman->Base[0]) + sman->info[ptype].elsize;
         package += sizeof(pman->Base[0]) + sman->info[ptype].elsize + sizeof(ExchangePartCache);
-        if(package >= nlimit || slotexch[ptype] >= maxexch || partexch >= maxexch) {
+        if(package >= nlimit || exch >= maxexch) {
 //             message(1,"Not enough space for particles: nlimit=%d, package=%d\n",nlimit,package);
             break;
         }
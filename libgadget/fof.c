@@ -47,6 +47,15 @@ struct FOFParams
     double FOFHaloLinkingLength;
     double FOFHaloComovingLinkingLength; /* in code units */
     int FOFHaloMinLength;
+    /* Link with a single treewalk and union-find, then merge across tasks, instead of iterating treewalks*/
+    int FOFUnionFind;
+    /* Compute spherical overdensity masses and profiles for each group*/
+    int FOFSphericalOverdensity;
+    /* Number of most bound particles per group kept to link groups between outputs*/
+    int FOFMergerTreeTracers;
+    /* Cosmology and gravitational constant, for the critical density*/
+    Cosmology * CP;
+    double G;
 } fof_params;
 
 /*Set the parameters of the BH module*/
@@ -60,13 +69,28 @@ void set_fof_params(ParameterSet * ps)
         fof_params.FOFHaloMinLength = param_get_int(ps, "FOFHaloMinLength");
         fof_params.MinFoFMassForNewSeed = param_get_double(ps, "MinFoFMassForNewSeed");
         fof_params.MinMStarForNewSeed = param_get_double(ps, "MinMStarForNewSeed");
+        fof_params.FOFUnionFind = param_get_int(ps, "FOFUnionFind");
+        fof_params.FOFSphericalOverdensity = param_get_int(ps, "FOFSphericalOverdensity");
+        fof_params.FOFMergerTreeTracers = param_get_int(ps, "FOFMergerTreeTracers");
     }
     MPI_Bcast(&fof_params, sizeof(struct FOFParams), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
 
-void fof_init(double DMMeanSeparation)
+void fof_init(double DMMeanSeparation, Cosmology * CP, const double G)
 {
     fof_params.FOFHaloComovingLinkingLength = fof_params.FOFHaloLinkingLength * DMMeanSeparation;
+    fof_params.CP = CP;
+    fof_params.G = G;
+}
+
+int fof_so_enabled(void)
+{
+    return fof_params.FOFSphericalOverdensity;
+}
+
+int fof_merger_tree_enabled(void)
+{
+    return fof_params.FOFMergerTreeTracers > 0;
 }
 
 static double fof_periodic(double x, double BoxSize)
@@ -110,7 +134,9 @@ fof_alloc_group(const struct BaseGroup * base, const int NgroupsExt);
 
 static void fof_assign_grnr(struct BaseGroup * base, const int NgroupsExt, MPI_Comm Comm);
 
+
 void fof_label_primary(ForceTree * tree, MPI_Comm Comm);
+static void fof_label_primary_unionfind(ForceTree * tree, MPI_Comm Comm);
 extern void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Comm);
 
 typedef struct {
@@ -169,7 +195,10 @@ fof_fof(ForceTree * tree, MPI_Comm Comm)
         HaloLabel[i].Pindex = i;
     }
     /* Fill FOFP_List of primary */
-    fof_label_primary(tree, Comm);
+    if(fof_params.FOFUnionFind)
+        fof_label_primary_unionfind(tree, Comm);
+    else
+        fof_label_primary(tree, Comm);
 
     MPIU_Barrier(Comm);
     message(0, "Group finding done.\n");
@@ -210,6 +239,7 @@ fof_fof(ForceTree * tree, MPI_Comm Comm)
     MPI_Type_commit(&MPI_TYPE_GROUP);
 
     fof.Group = fof_alloc_group(base, NgroupsExt);
+    fof.NgroupsExt = NgroupsExt;
 
     myfree(base);
 
@@ -453,11 +483,11 @@ void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
     myfree(FOF_PRIMARY_GET_PRIV(tw)->Head);
 }
 
-static void
-fofp_merge(int target, int other, TreeWalk * tw)
+/* Make the root of other a child of the root of target, or the reverse, so that the lower index is the root.
+ * Returns the new root, or -1 if the particles were already in the same tree. h2 is set to the old root which was merged.*/
+static int
+fof_union(int target, int other, int * Head, int * h2out)
 {
-    /* this will lock h1 */
-    int * Head = FOF_PRIMARY_GET_PRIV(tw)->Head;
     int h1, h2;
     do {
         h1 = HEADl(-1, target, Head);
@@ -465,7 +495,7 @@ fofp_merge(int target, int other, TreeWalk * tw)
          * (because other is already in the same halo) */
         h2 = HEADl(h1, other, Head);
         if(h2 < 0)
-            return;
+            return -1;
         /* Ensure that we always merge to the lower entry.
          * This avoids circular loops in the Head entries:
          * a -> b -> a */
@@ -477,6 +507,19 @@ fofp_merge(int target, int other, TreeWalk * tw)
      /* Atomic compare exchange to make h2 a subtree of h1.
       * Set Head[h2] = h1 iff Head[h2] is still h2. Otherwise loop.*/
     } while(!__atomic_compare_exchange(&Head[h2], &h2, &h1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *h2out = h2;
+    return h1;
+}
+
+static void
+fofp_merge(int target, int other, TreeWalk * tw)
+{
+    /* this will lock h1 */
+    int * Head = FOF_PRIMARY_GET_PRIV(tw)->Head;
+    int h2;
+    int h1 = fof_union(target, other, Head, &h2);
+    if(h1 < 0)
+        return;
 
     struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
 
@@ -553,6 +596,342 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
     }
 }
 
+/* Union-find FOF. All local pairs are linked by a single treewalk with lock-free union-find.
+ * The same treewalk exports the boundary particles: the local neighbours of an imported
+ * particle are linked to each other, and one link to the imported particle is recorded.
+ * The global group labels are then found by propagating the minimum ID over the small graph
+ * of local roots joined by these links, which needs no further treewalks.*/
+
+/* A link from a local root to a particle (later its root) on another task.*/
+struct fof_uf_link {
+    int Local;
+    int Task;
+    int Remote;
+};
+
+/* A label sent to a root on another task*/
+struct fof_uf_label {
+    MyIDType MinID;
+    int MinIDTask;
+    int Root;
+};
+
+typedef struct {
+    TreeWalkQueryBase base;
+    int Index;
+    int Task;
+} TreeWalkQueryFOFUF;
+
+typedef struct {
+    TreeWalkNgbIterBase base;
+    /* First local neighbour of an imported particle*/
+    int First;
+} TreeWalkNgbIterFOFUF;
+
+struct FOFUnionFindPriv {
+    int * Head;
+    int ThisTask;
+    /* Per-thread lists of links to particles on other tasks.
+     * These grow during the treewalk so are not on the mymalloc heap.*/
+    struct fof_uf_link ** Links;
+    size_t * NLinks;
+    size_t * MaxLinks;
+};
+#define FOF_UF_GET_PRIV(tw) ((struct FOFUnionFindPriv *) (tw->priv))
+
+static void
+fof_uf_merge(int target, int other, int * Head)
+{
+    int h2;
+    int h1 = fof_union(target, other, Head, &h2);
+    if(h1 < 0)
+        return;
+    update_root(target, h1, Head);
+    update_root(other, h1, Head);
+}
+
+static void
+fof_uf_copy(int place, TreeWalkQueryFOFUF * I, TreeWalk * tw)
+{
+    I->Index = place;
+    I->Task = FOF_UF_GET_PRIV(tw)->ThisTask;
+}
+
+static int
+fof_uf_haswork(int n, TreeWalk * tw)
+{
+    if(P[n].IsGarbage || P[n].Swallowed)
+        return 0;
+    return ((1 << P[n].Type) & (FOF_PRIMARY_LINK_TYPES));
+}
+
+static void
+fof_uf_ngbiter(TreeWalkQueryFOFUF * I,
+        TreeWalkResultFOF * O,
+        TreeWalkNgbIterFOFUF * iter,
+        LocalTreeWalk * lv)
+{
+    struct FOFUnionFindPriv * priv = FOF_UF_GET_PRIV(lv->tw);
+    if(iter->base.other == -1) {
+        iter->base.Hsml = fof_params.FOFHaloComovingLinkingLength;
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        iter->base.mask = FOF_PRIMARY_LINK_TYPES;
+        iter->First = -1;
+        return;
+    }
+    int other = iter->base.other;
+
+    if(lv->mode == 0) {
+        /* Local FOF */
+        if(lv->target <= other)
+            fof_uf_merge(lv->target, other, priv->Head);
+        return;
+    }
+    /* The target is on another task. All its neighbours here are in its group,
+     * so link them together and record a single link to the target.*/
+    if(iter->First >= 0) {
+        fof_uf_merge(iter->First, other, priv->Head);
+        return;
+    }
+    iter->First = other;
+    const int tid = omp_get_thread_num();
+    if(priv->NLinks[tid] == priv->MaxLinks[tid]) {
+        priv->MaxLinks[tid] = 2 * priv->MaxLinks[tid] + 1024;
+        priv->Links[tid] = realloc(priv->Links[tid], priv->MaxLinks[tid] * sizeof(struct fof_uf_link));
+        if(!priv->Links[tid])
+            endrun(5, "Could not allocate %ld FOF links\n", priv->MaxLinks[tid]);
+    }
+    struct fof_uf_link * link = &priv->Links[tid][priv->NLinks[tid]++];
+    link->Local = other;
+    link->Task = I->Task;
+    link->Remote = I->Index;
+}
+
+static int
+fof_uf_cmp_link(const void * a, const void * b)
+{
+    const struct fof_uf_link * l1 = a;
+    const struct fof_uf_link * l2 = b;
+    if(l1->Task != l2->Task)
+        return (l1->Task > l2->Task) - (l1->Task < l2->Task);
+    if(l1->Remote != l2->Remote)
+        return (l1->Remote > l2->Remote) - (l1->Remote < l2->Remote);
+    return (l1->Local > l2->Local) - (l1->Local < l2->Local);
+}
+
+/* Sort links by task and remove duplicates. Returns the new number of links.*/
+static int64_t
+fof_uf_unique_links(struct fof_uf_link * links, int64_t nlinks)
+{
+    int64_t i, nuniq = 0;
+    qsort_openmp(links, nlinks, sizeof(struct fof_uf_link), fof_uf_cmp_link);
+    for(i = 0; i < nlinks; i++) {
+        if(nuniq > 0 && fof_uf_cmp_link(&links[nuniq-1], &links[i]) == 0)
+            continue;
+        links[nuniq++] = links[i];
+    }
+    return nuniq;
+}
+
+/* Exchange elements of size elsize, which are grouped by destination task.
+ * recvbuf must be large enough: if it is NULL it is allocated with mymalloc.
+ * Returns the receive buffer and sets nrecv and, if not NULL, recvcounts.*/
+static void *
+fof_uf_exchange(void * sendbuf, int * sendcounts, void * recvbuf, int * recvcounts, size_t elsize, int64_t * nrecv, MPI_Comm Comm)
+{
+    int NTask, i;
+    MPI_Comm_size(Comm, &NTask);
+    int * rcounts = ta_malloc("rcounts", int, 3 * NTask);
+    int * sdispls = rcounts + NTask;
+    int * rdispls = rcounts + 2 * NTask;
+    MPI_Alltoall(sendcounts, 1, MPI_INT, rcounts, 1, MPI_INT, Comm);
+    sdispls[0] = rdispls[0] = 0;
+    for(i = 1; i < NTask; i++) {
+        sdispls[i] = sdispls[i-1] + sendcounts[i-1];
+        rdispls[i] = rdispls[i-1] + rcounts[i-1];
+    }
+    *nrecv = rdispls[NTask-1] + rcounts[NTask-1];
+    if(!recvbuf)
+        recvbuf = mymalloc("FOFUFRecv", *nrecv * elsize + 1);
+    MPI_Datatype type;
+    MPI_Type_contiguous(elsize, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    MPI_Alltoallv_smart(sendbuf, sendcounts, sdispls, type, recvbuf, rcounts, rdispls, type, Comm);
+    MPI_Type_free(&type);
+    if(recvcounts)
+        memcpy(recvcounts, rcounts, NTask * sizeof(int));
+    ta_free(rcounts);
+    return recvbuf;
+}
+
+static void
+fof_label_primary_unionfind(ForceTree * tree, MPI_Comm Comm)
+{
+    int i, ThisTask, NTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_size(Comm, &NTask);
+
+    message(0, "Start linking particles with union-find (presently allocated=%g MB)\n", mymalloc_usedbytes() / (1024.0 * 1024.0));
+
+    TreeWalk tw[1] = {{0}};
+    tw->ev_label = "FOF_UNION_FIND";
+    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->ngbiter = (TreeWalkNgbIterFunction) fof_uf_ngbiter;
+    tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterFOFUF);
+    tw->haswork = fof_uf_haswork;
+    tw->fill = (TreeWalkFillQueryFunction) fof_uf_copy;
+    tw->reduce = NULL;
+    tw->type = TREEWALK_ALL;
+    tw->query_type_elsize = sizeof(TreeWalkQueryFOFUF);
+    tw->result_type_elsize = sizeof(TreeWalkResultFOF);
+    tw->tree = tree;
+    struct FOFUnionFindPriv priv[1];
+    tw->priv = priv;
+
+    const int nthread = omp_get_max_threads();
+    priv->ThisTask = ThisTask;
+    priv->Links = ta_malloc("FOFLinks", struct fof_uf_link *, nthread);
+    priv->NLinks = ta_malloc("FOFNLinks", size_t, nthread);
+    priv->MaxLinks = ta_malloc("FOFMaxLinks", size_t, nthread);
+    for(i = 0; i < nthread; i++) {
+        priv->Links[i] = NULL;
+        priv->NLinks[i] = 0;
+        priv->MaxLinks[i] = 0;
+    }
+
+    int * Head = priv->Head = (int*) mymalloc("FOF_Links", PartManager->NumPart * sizeof(int));
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        Head[i] = i;
+
+    double t0 = second();
+    /* Link local pairs and record links to the boundary particles of other tasks.*/
+    treewalk_run(tw, NULL, PartManager->NumPart);
+    double t1 = second();
+
+    /* A root is always the lowest index in its tree, so Head[i] < i for non-roots
+     * and one pass in index order points every particle at its root.
+     * Each local group takes the minimum ID of its particles.*/
+    for(i = 0; i < PartManager->NumPart; i++) {
+        const int r = Head[Head[i]];
+        Head[i] = r;
+        HaloLabel[i].MinID = P[i].ID;
+        HaloLabel[i].MinIDTask = ThisTask;
+        if(HaloLabel[r].MinID > P[i].ID)
+            HaloLabel[r].MinID = P[i].ID;
+    }
+
+    /* Gather the links to other tasks, from local roots*/
+    int64_t nlinks = 0;
+    for(i = 0; i < nthread; i++)
+        nlinks += priv->NLinks[i];
+    struct fof_uf_link * links = mymalloc("FOFUFLinks", nlinks * sizeof(struct fof_uf_link) + 1);
+    nlinks = 0;
+    for(i = 0; i < nthread; i++) {
+        size_t j;
+        for(j = 0; j < priv->NLinks[i]; j++) {
+            links[nlinks] = priv->Links[i][j];
+            links[nlinks].Local = Head[links[nlinks].Local];
+            nlinks++;
+        }
+        free(priv->Links[i]);
+    }
+    ta_free(priv->MaxLinks);
+    ta_free(priv->NLinks);
+    ta_free(priv->Links);
+    nlinks = fof_uf_unique_links(links, nlinks);
+
+    /* Send each link to the task of the remote particle, which finds the root of that particle.
+     * Both tasks keep the link between the two roots.*/
+    int * sendcounts = ta_malloc("sendcounts", int, 2 * NTask);
+    int * recvcounts = sendcounts + NTask;
+    memset(sendcounts, 0, NTask * sizeof(int));
+    int64_t k;
+    for(k = 0; k < nlinks; k++) {
+        sendcounts[links[k].Task]++;
+        links[k].Task = ThisTask;
+    }
+    int64_t nrecv;
+    struct fof_uf_link * requests = fof_uf_exchange(links, sendcounts, NULL, recvcounts, sizeof(struct fof_uf_link), &nrecv, Comm);
+    /* The replies have the same counts as the requests, so the total is known now*/
+    struct fof_uf_link * roots = mymalloc2("FOFUFRoots", (nlinks + nrecv) * sizeof(struct fof_uf_link) + 1);
+    for(k = 0; k < nrecv; k++) {
+        const int rootA = Head[requests[k].Remote];
+        /* Our link*/
+        roots[nlinks + k].Local = rootA;
+        roots[nlinks + k].Task = requests[k].Task;
+        roots[nlinks + k].Remote = requests[k].Local;
+        /* The reply: Local is still the root on the requesting task*/
+        requests[k].Remote = rootA;
+        requests[k].Task = ThisTask;
+    }
+    int64_t nreply;
+    fof_uf_exchange(requests, recvcounts, roots, NULL, sizeof(struct fof_uf_link), &nreply, Comm);
+    myfree(requests);
+    myfree(links);
+    int64_t nroots = fof_uf_unique_links(roots, nlinks + nrecv);
+
+    /* Propagate the minimum ID along the links between roots until it stops changing.
+     * After the first round only roots whose label changed send again.*/
+    char * Changed = mymalloc("FOFUFChanged", PartManager->NumPart * sizeof(char));
+    memset(Changed, 1, PartManager->NumPart * sizeof(char));
+    int64_t nchanged_tot = 0, nlinks_tot;
+    MPI_Allreduce(&nroots, &nlinks_tot, 1, MPI_INT64, MPI_SUM, Comm);
+    int round = 0;
+    do {
+        memset(sendcounts, 0, NTask * sizeof(int));
+        int64_t nsend = 0;
+        for(k = 0; k < nroots; k++)
+            if(Changed[roots[k].Local]) {
+                sendcounts[roots[k].Task]++;
+                nsend++;
+            }
+        struct fof_uf_label * labels = mymalloc("FOFUFLabels", nsend * sizeof(struct fof_uf_label) + 1);
+        nsend = 0;
+        /* roots is sorted by task, so labels are too*/
+        for(k = 0; k < nroots; k++) {
+            if(!Changed[roots[k].Local])
+                continue;
+            labels[nsend].MinID = HaloLabel[roots[k].Local].MinID;
+            labels[nsend].MinIDTask = HaloLabel[roots[k].Local].MinIDTask;
+            labels[nsend].Root = roots[k].Remote;
+            nsend++;
+        }
+        memset(Changed, 0, PartManager->NumPart * sizeof(char));
+        int64_t nlabels, nchanged = 0;
+        struct fof_uf_label * recvlabels = fof_uf_exchange(labels, sendcounts, NULL, NULL, sizeof(struct fof_uf_label), &nlabels, Comm);
+        for(k = 0; k < nlabels; k++) {
+            const int r = recvlabels[k].Root;
+            if(HaloLabel[r].MinID > recvlabels[k].MinID) {
+                HaloLabel[r].MinID = recvlabels[k].MinID;
+                HaloLabel[r].MinIDTask = recvlabels[k].MinIDTask;
+                nchanged += !Changed[r];
+                Changed[r] = 1;
+            }
+        }
+        myfree(recvlabels);
+        myfree(labels);
+        MPI_Allreduce(&nchanged, &nchanged_tot, 1, MPI_INT64, MPI_SUM, Comm);
+        round++;
+    } while(nchanged_tot > 0);
+
+    myfree(Changed);
+    myfree(roots);
+    ta_free(sendcounts);
+
+    /* Every particle takes the label of its root*/
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(Head[i] != i) {
+            HaloLabel[i].MinID = HaloLabel[Head[i]].MinID;
+            HaloLabel[i].MinIDTask = HaloLabel[Head[i]].MinIDTask;
+        }
+    }
+    myfree(Head);
+
+    message(0, "Linked local groups in %g seconds and merged them over %ld boundary links in %d rounds.\n", t1 - t0, nlinks_tot, round);
+}
+
 static void fof_reduce_base_group(void * pdst, void * psrc) {
     struct BaseGroup * gdst = pdst;
     struct BaseGroup * gsrc = psrc;
@@ -588,6 +967,12 @@ static void fof_reduce_group(void * pdst, void * psrc) {
         gdst->seed_index = gsrc->seed_index;
         gdst->seed_task = gsrc->seed_task;
     }
+    if(gsrc->MinPot < gdst->MinPot)
+    {
+        gdst->MinPot = gsrc->MinPot;
+        gdst->MinPotIndex = gsrc->MinPotIndex;
+        gdst->MinPotTask = gsrc->MinPotTask;
+    }
 
     int d1, d2;
     for(d1 = 0; d1 < 3; d1++)
@@ -611,6 +996,9 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
         memset(gdst, 0, sizeof(gdst[0]));
         gdst->base = base;
         gdst->seed_index = gdst->seed_task = -1;
+        gdst->MinPot = LARGE;
+        gdst->MinPotIndex = gdst->MinPotTask = -1;
+        gdst->MainProgenitor = -1;
     }
 
     gdst->Length ++;
@@ -648,6 +1036,13 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
             gdst->seed_task = ThisTask;
         }
 
+    if(P[index].Potential < gdst->MinPot)
+    {
+        gdst->MinPot = P[index].Potential;
+        gdst->MinPotIndex = index;
+        gdst->MinPotTask = ThisTask;
+    }
+
     int d1, d2;
     double xyz[3];
     double rel[3];
@@ -1256,6 +1651,478 @@ static void fof_label_secondary(ForceTree * tree)
     myfree(FOF_SECONDARY_GET_PRIV(tw)->distance);
 }
 
+/* Spherical overdensity masses.
+ * A treewalk from the potential minimum of each group bins the mass of all particles
+ * within a search radius into logarithmic radial shells. The SO radius is where the mean
+ * enclosed density falls below the threshold, interpolated between the shell edges.*/
+
+typedef struct {
+    TreeWalkQueryBase base;
+    MyFloat Rmax;
+} TreeWalkQueryFOFSO;
+
+typedef struct {
+    TreeWalkResultBase base;
+    double Mass[FOF_SO_NBINS];
+} TreeWalkResultFOFSO;
+
+typedef struct {
+    TreeWalkNgbIterBase base;
+} TreeWalkNgbIterFOFSO;
+
+struct FOFSOPriv {
+    /* Group centred on each particle, or -1*/
+    int * CentreGroup;
+    /* Search radius of each group*/
+    double * Rmax;
+    /* Mass in each radial shell of each group*/
+    double (*Mass)[FOF_SO_NBINS];
+};
+#define FOF_SO_GET_PRIV(tw) ((struct FOFSOPriv *) (tw->priv))
+
+/* Outer edge of radial bin i for a profile out to rmax*/
+static double
+fof_so_edge(const int i, const double rmax)
+{
+    return rmax * pow(10, -FOF_SO_DECADES * (1 - (i + 1.) / FOF_SO_NBINS));
+}
+
+static void
+fof_so_copy(int place, TreeWalkQueryFOFSO * I, TreeWalk * tw)
+{
+    I->Rmax = FOF_SO_GET_PRIV(tw)->Rmax[FOF_SO_GET_PRIV(tw)->CentreGroup[place]];
+}
+
+static void
+fof_so_reduce(int place, TreeWalkResultFOFSO * O, enum TreeWalkReduceMode mode, TreeWalk * tw)
+{
+    double * Mass = FOF_SO_GET_PRIV(tw)->Mass[FOF_SO_GET_PRIV(tw)->CentreGroup[place]];
+    int i;
+    for(i = 0; i < FOF_SO_NBINS; i++)
+        TREEWALK_REDUCE(Mass[i], O->Mass[i]);
+}
+
+static void
+fof_so_ngbiter(TreeWalkQueryFOFSO * I,
+        TreeWalkResultFOFSO * O,
+        TreeWalkNgbIterFOFSO * iter,
+        LocalTreeWalk * lv)
+{
+    if(iter->base.other == -1) {
+        iter->base.Hsml = I->Rmax;
+        iter->base.mask = 1 + 2 + 4 + 8 + 16 + 32;
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        return;
+    }
+    const int other = iter->base.other;
+    const double r = iter->base.r;
+    int bin = 0;
+    if(r > fof_so_edge(0, I->Rmax))
+        bin = ceil(FOF_SO_NBINS * (1 + log10(r / I->Rmax) / FOF_SO_DECADES)) - 1;
+    if(bin >= FOF_SO_NBINS)
+        bin = FOF_SO_NBINS - 1;
+    O->Mass[bin] += P[other].Mass;
+}
+
+/* Find the radius where the mean density enclosed by the profile menc drops below rhothresh,
+ * and the mass within it. Both are zero if the threshold is not crossed within the profile.*/
+static void
+fof_so_radius(const double * menc, const double rmax, const double rhothresh, float * mso, float * rso)
+{
+    int i;
+    *mso = *rso = 0;
+    for(i = 0; i < FOF_SO_NBINS; i++) {
+        const double r = fof_so_edge(i, rmax);
+        const double rho = menc[i] / (4 * M_PI / 3 * r * r * r);
+        if(rho >= rhothresh)
+            continue;
+        /* The centre is not resolved*/
+        if(i == 0)
+            return;
+        const double r0 = fof_so_edge(i - 1, rmax);
+        const double rho0 = menc[i - 1] / (4 * M_PI / 3 * r0 * r0 * r0);
+        /* The mean density is a power law between the edges*/
+        const double lr = log(r0) + (log(rhothresh) - log(rho0)) * (log(r) - log(r0)) / (log(rho) - log(rho0));
+        *rso = exp(lr);
+        *mso = rhothresh * 4 * M_PI / 3 * pow(*rso, 3);
+        return;
+    }
+}
+
+/* The SO properties are only set on the task with the centre, so sum them into the other copies*/
+static void
+fof_reduce_so(void * pdst, void * psrc)
+{
+    struct Group * gdst = pdst;
+    struct Group * gsrc = psrc;
+    int i;
+    gdst->M200c += gsrc->M200c;
+    gdst->R200c += gsrc->R200c;
+    gdst->M500c += gsrc->M500c;
+    gdst->R500c += gsrc->R500c;
+    gdst->Mvir += gsrc->Mvir;
+    gdst->Rvir += gsrc->Rvir;
+    gdst->SORadius += gsrc->SORadius;
+    for(i = 0; i < FOF_SO_NBINS; i++)
+        gdst->SOMassProfile[i] += gsrc->SOMassProfile[i];
+}
+
+void
+fof_spherical_overdensity(FOFGroups * fof, ForceTree * tree, const double atime, MPI_Comm Comm)
+{
+    int i, ThisTask;
+    const int NgroupsExt = fof->NgroupsExt;
+    MPI_Comm_rank(Comm, &ThisTask);
+
+    const double a = atime;
+    const double hubble = hubble_function(fof_params.CP, a);
+    /* Comoving critical density*/
+    const double rhocrit = 3 * hubble * hubble / (8 * M_PI * fof_params.G) * a * a * a;
+    /* Virial overdensity relative to critical from Bryan & Norman 1998*/
+    const double x = fof_params.CP->Omega0 / (a * a * a) * pow(fof_params.CP->Hubble / hubble, 2) - 1;
+    const double deltavir = 18 * M_PI * M_PI + 82 * x - 39 * x * x;
+    const double deltamin = fmin(deltavir, 200);
+
+    TreeWalk tw[1] = {{0}};
+    tw->ev_label = "FOF_SO";
+    tw->visit = treewalk_visit_nolist_ngbiter;
+    tw->ngbiter = (TreeWalkNgbIterFunction) fof_so_ngbiter;
+    tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterFOFSO);
+    tw->haswork = NULL;
+    tw->fill = (TreeWalkFillQueryFunction) fof_so_copy;
+    tw->reduce = (TreeWalkReduceResultFunction) fof_so_reduce;
+    tw->postprocess = NULL;
+    tw->type = TREEWALK_ALL;
+    tw->query_type_elsize = sizeof(TreeWalkQueryFOFSO);
+    tw->result_type_elsize = sizeof(TreeWalkResultFOFSO);
+    tw->tree = tree;
+    struct FOFSOPriv priv[1];
+    tw->priv = priv;
+
+    priv->CentreGroup = mymalloc("SOCentreGroup", sizeof(int) * PartManager->NumPart);
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        priv->CentreGroup[i] = -1;
+    priv->Rmax = mymalloc("SORmax", sizeof(double) * (NgroupsExt + 1));
+    priv->Mass = mymalloc("SOMass", sizeof(priv->Mass[0]) * (NgroupsExt + 1));
+    int * queue = mymalloc("SOQueue", sizeof(int) * (NgroupsExt + 1));
+    int nqueue = 0;
+
+    for(i = 0; i < NgroupsExt; i++) {
+        struct Group * g = &fof->Group[i];
+        /* Twice the radius enclosing the FOF mass at the lowest overdensity*/
+        priv->Rmax[i] = 2 * cbrt(3 * g->Mass / (4 * M_PI * deltamin * rhocrit));
+        memset(priv->Mass[i], 0, sizeof(priv->Mass[0]));
+        g->M200c = g->R200c = g->M500c = g->R500c = g->Mvir = g->Rvir = 0;
+        g->SORadius = 0;
+        memset(g->SOMassProfile, 0, sizeof(g->SOMassProfile));
+        if(g->MinPotTask == ThisTask) {
+            priv->CentreGroup[g->MinPotIndex] = i;
+            queue[nqueue++] = g->MinPotIndex;
+        }
+    }
+
+    treewalk_run(tw, queue, nqueue);
+
+    int64_t nunresolved = 0;
+    #pragma omp parallel for reduction(+: nunresolved)
+    for(i = 0; i < nqueue; i++) {
+        const int gi = priv->CentreGroup[queue[i]];
+        struct Group * g = &fof->Group[gi];
+        double menc[FOF_SO_NBINS];
+        int j;
+        menc[0] = priv->Mass[gi][0];
+        for(j = 1; j < FOF_SO_NBINS; j++)
+            menc[j] = menc[j-1] + priv->Mass[gi][j];
+        for(j = 0; j < FOF_SO_NBINS; j++)
+            g->SOMassProfile[j] = menc[j];
+        g->SORadius = priv->Rmax[gi];
+        fof_so_radius(menc, priv->Rmax[gi], 200 * rhocrit, &g->M200c, &g->R200c);
+        fof_so_radius(menc, priv->Rmax[gi], 500 * rhocrit, &g->M500c, &g->R500c);
+        fof_so_radius(menc, priv->Rmax[gi], deltavir * rhocrit, &g->Mvir, &g->Rvir);
+        if(g->Mvir == 0)
+            nunresolved++;
+    }
+
+    myfree(queue);
+    myfree(priv->Mass);
+    myfree(priv->Rmax);
+    myfree(priv->CentreGroup);
+
+    fof_reduce_groups(fof->Group, NgroupsExt, sizeof(fof->Group[0]), fof_reduce_so, Comm);
+
+    int64_t totunresolved;
+    MPI_Allreduce(&nunresolved, &totunresolved, 1, MPI_INT64, MPI_SUM, Comm);
+    message(0, "Spherical overdensities done: %ld groups have no virial radius within the search radius.\n", totunresolved);
+    walltime_measure("/FOF/SO");
+}
+
+/* Merger trees.
+ * At each FOF output the most bound particles of each group are kept as tracers.
+ * At the next output the tracers are joined by ID to the new group membership,
+ * linking the old and new groups by the fraction of the tracers they share.*/
+
+struct fof_mt_member {
+    MyIDType ID;
+    int64_t GrNr;
+    double Potential;
+};
+
+struct fof_mt_main {
+    int64_t Descendant;
+    int64_t Progenitor;
+    float Merit;
+    /* Task which has the descendant group*/
+    int Task;
+};
+
+/* Tracers of the previous output. These persist between outputs, so are not on the mymalloc heap.*/
+static struct fof_mt_tracer * MTTracers;
+static int64_t MTNTracers;
+
+struct fof_mt_tracer *
+fof_merger_tree_tracers(int64_t * ntracers)
+{
+    *ntracers = MTNTracers;
+    return MTTracers;
+}
+
+void
+fof_merger_tree_set_tracers(struct fof_mt_tracer * tracers, int64_t ntracers)
+{
+    free(MTTracers);
+    MTTracers = tracers;
+    MTNTracers = ntracers;
+}
+
+static int fof_mt_dest_member_id(const void * a, int NTask) { return ((const struct fof_mt_member *) a)->ID % NTask; }
+static int fof_mt_dest_member_grnr(const void * a, int NTask) { return ((const struct fof_mt_member *) a)->GrNr % NTask; }
+static int fof_mt_dest_tracer_id(const void * a, int NTask) { return ((const struct fof_mt_tracer *) a)->ID % NTask; }
+static int fof_mt_dest_progenitor(const void * a, int NTask) { return ((const struct fof_mt_link *) a)->Progenitor % NTask; }
+static int fof_mt_dest_descendant(const void * a, int NTask) { return ((const struct fof_mt_link *) a)->Descendant % NTask; }
+static int fof_mt_dest_main(const void * a, int NTask) { return ((const struct fof_mt_main *) a)->Task; }
+
+static uint64_t fof_mt_key_member_id(const void * a, void * arg) { return ((const struct fof_mt_member *) a)->ID; }
+static uint64_t fof_mt_key_tracer_id(const void * a, void * arg) { return ((const struct fof_mt_tracer *) a)->ID; }
+
+/* By group, then most bound first*/
+static int
+fof_mt_cmp_member_grnr(const void * a, const void * b)
+{
+    const struct fof_mt_member * m1 = a, * m2 = b;
+    if(m1->GrNr != m2->GrNr)
+        return (m1->GrNr > m2->GrNr) - (m1->GrNr < m2->GrNr);
+    if(m1->Potential != m2->Potential)
+        return (m1->Potential > m2->Potential) - (m1->Potential < m2->Potential);
+    return (m1->ID > m2->ID) - (m1->ID < m2->ID);
+}
+
+static int
+fof_mt_cmp_link_progenitor(const void * a, const void * b)
+{
+    const struct fof_mt_link * l1 = a, * l2 = b;
+    if(l1->Progenitor != l2->Progenitor)
+        return (l1->Progenitor > l2->Progenitor) - (l1->Progenitor < l2->Progenitor);
+    return (l1->Descendant > l2->Descendant) - (l1->Descendant < l2->Descendant);
+}
+
+/* By descendant, then the most shared tracers first*/
+static int
+fof_mt_cmp_link_descendant(const void * a, const void * b)
+{
+    const struct fof_mt_link * l1 = a, * l2 = b;
+    if(l1->Descendant != l2->Descendant)
+        return (l1->Descendant > l2->Descendant) - (l1->Descendant < l2->Descendant);
+    if(l1->Shared != l2->Shared)
+        return (l1->Shared < l2->Shared) - (l1->Shared > l2->Shared);
+    return (l1->Progenitor > l2->Progenitor) - (l1->Progenitor < l2->Progenitor);
+}
+
+/* Send each item to the task dest(item), returning the received items allocated with mymalloc.*/
+static void *
+fof_mt_route(const void * items, const int64_t n, const size_t elsize, int (*dest)(const void * item, int NTask), int64_t * nrecv, MPI_Comm Comm)
+{
+    int NTask, t;
+    int64_t i;
+    MPI_Comm_size(Comm, &NTask);
+    int * sendcounts = ta_malloc("MTSendCounts", int, 2 * NTask);
+    int * offset = sendcounts + NTask;
+    memset(sendcounts, 0, sizeof(int) * NTask);
+    for(i = 0; i < n; i++)
+        sendcounts[dest((const char *) items + i * elsize, NTask)]++;
+    offset[0] = 0;
+    for(t = 1; t < NTask; t++)
+        offset[t] = offset[t-1] + sendcounts[t-1];
+    char * sendbuf = mymalloc2("MTSend", n * elsize + 1);
+    for(i = 0; i < n; i++) {
+        const char * item = (const char *) items + i * elsize;
+        t = dest(item, NTask);
+        memcpy(sendbuf + elsize * offset[t]++, item, elsize);
+    }
+    void * recv = fof_uf_exchange(sendbuf, sendcounts, NULL, NULL, elsize, nrecv, Comm);
+    myfree(sendbuf);
+    ta_free(sendcounts);
+    return recv;
+}
+
+/* The particles in groups, allocated with mymalloc2*/
+static struct fof_mt_member *
+fof_mt_members(int64_t * nmembers)
+{
+    struct fof_mt_member * members = mymalloc2("MTMembers", PartManager->NumPart * sizeof(struct fof_mt_member) + 1);
+    int64_t i, n = 0;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].GrNr < 0 || P[i].IsGarbage)
+            continue;
+        members[n].ID = P[i].ID;
+        members[n].GrNr = P[i].GrNr;
+        members[n].Potential = P[i].Potential;
+        n++;
+    }
+    *nmembers = n;
+    return members;
+}
+
+struct fof_mt_link *
+fof_merger_tree(FOFGroups * fof, int64_t * nlinks, MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    int64_t i, j;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+
+    /* Join the tracers of the previous output to the current membership by ID*/
+    int64_t nmembers, nrmembers, nrtracers;
+    struct fof_mt_member * members = fof_mt_members(&nmembers);
+    struct fof_mt_member * rmembers = fof_mt_route(members, nmembers, sizeof(struct fof_mt_member), fof_mt_dest_member_id, &nrmembers, Comm);
+    myfree(members);
+    struct fof_mt_tracer * rtracers = fof_mt_route(MTTracers, MTNTracers, sizeof(struct fof_mt_tracer), fof_mt_dest_tracer_id, &nrtracers, Comm);
+    radix_sort_openmp(rmembers, nrmembers, sizeof(struct fof_mt_member), fof_mt_key_member_id, sizeof(MyIDType), NULL);
+    radix_sort_openmp(rtracers, nrtracers, sizeof(struct fof_mt_tracer), fof_mt_key_tracer_id, sizeof(MyIDType), NULL);
+
+    struct fof_mt_link * rawlinks = mymalloc2("MTRawLinks", nrtracers * sizeof(struct fof_mt_link) + 1);
+    int64_t nraw = 0;
+    for(i = 0, j = 0; i < nrtracers; i++) {
+        while(j < nrmembers && rmembers[j].ID < rtracers[i].ID)
+            j++;
+        if(j == nrmembers)
+            break;
+        if(rmembers[j].ID != rtracers[i].ID)
+            continue;
+        rawlinks[nraw].Progenitor = rtracers[i].GrNr;
+        rawlinks[nraw].Descendant = rmembers[j].GrNr;
+        rawlinks[nraw].Shared = 1;
+        rawlinks[nraw].NProgTracer = rtracers[i].NTracer;
+        rawlinks[nraw].Merit = 0;
+        nraw++;
+    }
+    myfree(rtracers);
+    myfree(rmembers);
+
+    /* Count the tracers shared by each pair of groups on the task of the progenitor*/
+    struct fof_mt_link * links = fof_mt_route(rawlinks, nraw, sizeof(struct fof_mt_link), fof_mt_dest_progenitor, nlinks, Comm);
+    myfree(rawlinks);
+    qsort_openmp(links, *nlinks, sizeof(struct fof_mt_link), fof_mt_cmp_link_progenitor);
+    int64_t nunique = 0;
+    for(i = 0; i < *nlinks; i++) {
+        if(nunique > 0 && links[nunique-1].Progenitor == links[i].Progenitor && links[nunique-1].Descendant == links[i].Descendant) {
+            links[nunique-1].Shared++;
+            continue;
+        }
+        links[nunique++] = links[i];
+    }
+    *nlinks = nunique;
+    for(i = 0; i < *nlinks; i++)
+        links[i].Merit = (double) links[i].Shared / links[i].NProgTracer;
+
+    /* The main progenitor of each group shares the most tracers with it*/
+    int64_t ndesc, nrmain;
+    struct fof_mt_link * desc = fof_mt_route(links, *nlinks, sizeof(struct fof_mt_link), fof_mt_dest_descendant, &ndesc, Comm);
+    qsort_openmp(desc, ndesc, sizeof(struct fof_mt_link), fof_mt_cmp_link_descendant);
+
+    /* The groups are sorted by GrNr, which starts at 1, so each task has a contiguous range*/
+    int64_t * groupoffset = ta_malloc("MTGroupOffset", int64_t, NTask + 1);
+    int64_t ngroups = fof->Ngroups;
+    MPI_Allgather(&ngroups, 1, MPI_INT64, groupoffset + 1, 1, MPI_INT64, Comm);
+    groupoffset[0] = 1;
+    for(i = 0; i < NTask; i++)
+        groupoffset[i + 1] += groupoffset[i];
+
+    struct fof_mt_main * mains = mymalloc2("MTMain", ndesc * sizeof(struct fof_mt_main) + 1);
+    int64_t nmain = 0;
+    for(i = 0; i < ndesc; i++) {
+        if(i > 0 && desc[i].Descendant == desc[i-1].Descendant)
+            continue;
+        mains[nmain].Descendant = desc[i].Descendant;
+        mains[nmain].Progenitor = desc[i].Progenitor;
+        mains[nmain].Merit = desc[i].Merit;
+        /* Last task starting at or before the descendant: skips tasks without groups*/
+        int lo = 0, hi = NTask;
+        while(hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if(groupoffset[mid] <= desc[i].Descendant)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        mains[nmain].Task = lo;
+        nmain++;
+    }
+    struct fof_mt_main * rmain = fof_mt_route(mains, nmain, sizeof(struct fof_mt_main), fof_mt_dest_main, &nrmain, Comm);
+    myfree(mains);
+
+    for(i = 0; i < fof->Ngroups; i++) {
+        fof->Group[i].MainProgenitor = -1;
+        fof->Group[i].ProgenitorMerit = 0;
+    }
+    for(i = 0; i < nrmain; i++) {
+        const int64_t gi = rmain[i].Descendant - groupoffset[ThisTask];
+        if(gi < 0 || gi >= fof->Ngroups || fof->Group[gi].base.GrNr != rmain[i].Descendant)
+            endrun(5, "Descendant %ld not found: groups are not sorted by GrNr\n", rmain[i].Descendant);
+        fof->Group[gi].MainProgenitor = rmain[i].Progenitor;
+        fof->Group[gi].ProgenitorMerit = rmain[i].Merit;
+    }
+    myfree(rmain);
+    ta_free(groupoffset);
+    myfree(desc);
+
+    /* Keep the most bound particles of each group as the tracers for the next output*/
+    members = fof_mt_members(&nmembers);
+    rmembers = fof_mt_route(members, nmembers, sizeof(struct fof_mt_member), fof_mt_dest_member_grnr, &nrmembers, Comm);
+    myfree(members);
+    qsort_openmp(rmembers, nrmembers, sizeof(struct fof_mt_member), fof_mt_cmp_member_grnr);
+
+    int64_t ntracers = 0, start;
+    for(start = 0; start < nrmembers; start = j) {
+        for(j = start; j < nrmembers && rmembers[j].GrNr == rmembers[start].GrNr; j++)
+            continue;
+        ntracers += (j - start < fof_params.FOFMergerTreeTracers) ? j - start : fof_params.FOFMergerTreeTracers;
+    }
+    free(MTTracers);
+    MTTracers = malloc((ntracers + 1) * sizeof(struct fof_mt_tracer));
+    if(!MTTracers)
+        endrun(5, "Could not allocate %ld merger tree tracers\n", ntracers);
+    MTNTracers = 0;
+    for(start = 0; start < nrmembers; start = j) {
+        for(j = start; j < nrmembers && rmembers[j].GrNr == rmembers[start].GrNr; j++)
+            continue;
+        const int n = (j - start < fof_params.FOFMergerTreeTracers) ? j - start : fof_params.FOFMergerTreeTracers;
+        for(i = start; i < start + n; i++) {
+            MTTracers[MTNTracers].ID = rmembers[i].ID;
+            MTTracers[MTNTracers].GrNr = rmembers[i].GrNr;
+            MTTracers[MTNTracers].NTracer = n;
+            MTNTracers++;
+        }
+    }
+    myfree(rmembers);
+
+    int64_t totlinks;
+    MPI_Allreduce(nlinks, &totlinks, 1, MPI_INT64, MPI_SUM, Comm);
+    message(0, "Merger tree: %ld links to the groups of the previous output.\n", totlinks);
+    walltime_measure("/FOF/MergerTree");
+    return links;
+}
+
 /*
  * Deal with seeding of particles At each FOF stage,
  * if seed_index is >= 0,  then that particle on seed_task
@@ -5,10 +5,20 @@
 #include "utils/paramset.h"
 #include "timestep.h"
 #include "slotsmanager.h"
+#include "cosmology.h"
 
 void set_fof_params(ParameterSet * ps);
 
-void fof_init(double DMMeanSeparation);
+/* Set the linking length, and the cosmology and gravitational constant for the spherical overdensities*/
+void fof_init(double DMMeanSeparation, Cosmology * CP, const double G);
+
+/* Returns 1 if spherical overdensity masses are computed for the groups*/
+int fof_so_enabled(void);
+
+/* Number of radial bins in the spherical overdensity mass profile.
+ * Bin i has outer edge SORadius * 10^(-FOF_SO_DECADES * (1 - (i+1)/FOF_SO_NBINS)).*/
+#define FOF_SO_NBINS 32
+#define FOF_SO_DECADES 2.5
 
 struct BaseGroup {
     int OriginalTask;
@@ -53,6 +63,30 @@ struct Group
 
     int seed_index;
     int seed_task;
+
+    /* The particle at the minimum of the potential, which is the centre of the spherical overdensities*/
+    double MinPot;
+    int MinPotIndex;
+    int MinPotTask;
+
+    /* Spherical overdensity masses and comoving radii around the potential minimum,
+     * relative to the critical density. These include all particles, not only those in the group.
+     * They are zero if the threshold is not crossed within SORadius.*/
+    float M200c;
+    float R200c;
+    float M500c;
+    float R500c;
+    float Mvir;
+    float Rvir;
+    /* Comoving radius of the mass profile*/
+    float SORadius;
+    /* Mass enclosed within the outer edge of each radial bin*/
+    float SOMassProfile[FOF_SO_NBINS];
+
+    /* The group of the previous FOF output sharing the most tracer particles with this one, or -1*/
+    int64_t MainProgenitor;
+    /* Fraction of the tracers of the main progenitor which are in this group*/
+    float ProgenitorMerit;
 };
 
 /* Structure to hold all allocated FOF groups*/
@@ -62,12 +96,20 @@ typedef struct FOFGroups
     /* Ngroups is maximally NumPart,
      * so can be 32-bit*/
     int Ngroups;
+    /* Number of entries in Group: the Ngroups hosted here come first,
+     * followed by copies of the groups hosted elsewhere which have particles on this task.*/
+    int NgroupsExt;
     int64_t TotNgroups;
 } FOFGroups;
 
 /*Computes the Group structure, saved as a global array below*/
 FOFGroups fof_fof(ForceTree * tree, MPI_Comm Comm);
 
+/* Computes the spherical overdensity masses, radii and mass profiles of the groups found by fof_fof,
+ * which must not have been saved yet. tree is the tree passed to fof_fof and atime the current scale factor.
+ * This is a treewalk, so only call it for catalogues which are written. Collective.*/
+void fof_spherical_overdensity(FOFGroups * fof, ForceTree * tree, const double atime, MPI_Comm Comm);
+
 /*Frees the Group structure*/
 void fof_finish(FOFGroups * fof);
 
@@ -75,8 +117,47 @@ void fof_finish(FOFGroups * fof);
  * The tree and active particle structs are used only because we may need to reallocate them. */
 void fof_seed(FOFGroups * fof, ForceTree * tree, ActiveParticles * act, MPI_Comm Comm);
 
+/* Returns 1 if the groups are linked to those of the previous FOF output*/
+int fof_merger_tree_enabled(void);
+
+/* A link between a group of the previous FOF output and a group of this output*/
+struct fof_mt_link {
+    int64_t Progenitor;
+    int64_t Descendant;
+    /* Number of tracers of the progenitor which are in the descendant*/
+    int Shared;
+    /* Number of tracers of the progenitor*/
+    int NProgTracer;
+    /* Shared / NProgTracer*/
+    float Merit;
+};
+
+/* A most bound particle of a group, kept to link the group to those of the next FOF output*/
+struct fof_mt_tracer {
+    MyIDType ID;
+    int64_t GrNr;
+    /* Number of tracers of this group*/
+    int NTracer;
+};
+
+/* The tracers kept at the last FOF output on this task, and their number*/
+struct fof_mt_tracer * fof_merger_tree_tracers(int64_t * ntracers);
+
+/* Replace the tracers, taking ownership of the malloc'ed array. Used when restarting.*/
+void fof_merger_tree_set_tracers(struct fof_mt_tracer * tracers, int64_t ntracers);
+
+/* Join the tracer particles kept at the previous FOF output to the current group membership,
+ * setting MainProgenitor and ProgenitorMerit for each group.
+ * fof->Group must be sorted by GrNr across tasks. Then keep the most bound particles of each group
+ * as the tracers for the next output. Returns the links, allocated with mymalloc, and sets nlinks. Collective.*/
+struct fof_mt_link * fof_merger_tree(FOFGroups * fof, int64_t * nlinks, MPI_Comm Comm);
+
 /*Saves the Group structure to disc.*/
 void fof_save_groups(FOFGroups * fof, int num, MPI_Comm Comm);
 
+/* Reload the merger tree tracers from the last FOF output, number num or nearby, written no later than Time.
+ * If there is none the next output has no progenitors. Collective.*/
+void fof_load_merger_tree(int num, double Time, MPI_Comm Comm);
+
 
 #endif
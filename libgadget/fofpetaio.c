@@ -16,11 +16,13 @@
 #include "petaio.h"
 #include "exchange.h"
 #include "fof.h"
+#include "subfind.h"
 #include "walltime.h"
 
 static void fof_register_io_blocks(struct IOTable * IOTable);
 static void fof_write_header(BigFile * bf, int64_t TotNgroups, MPI_Comm Comm);
 static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * ent);
+static void fof_save_merger_tree(BigFile * bf, struct fof_mt_link * links, int64_t nlinks);
 
 static int fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, MPI_Comm Comm);
 
@@ -52,6 +54,14 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
     MPIU_Barrier(Comm);
     fof_write_header(&bf, fof->TotNgroups, Comm);
 
+    /* Needs the groups sorted by GrNr, and sets their progenitors before they are written*/
+    if(fof_merger_tree_enabled()) {
+        int64_t nlinks;
+        struct fof_mt_link * links = fof_merger_tree(fof, &nlinks, Comm);
+        fof_save_merger_tree(&bf, links, nlinks);
+        myfree(links);
+    }
+
     for(i = 0; i < FOFIOTable.used; i ++) {
         /* only process the particle blocks */
         char blockname[128];
@@ -69,7 +79,7 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
     destroy_io_blocks(&FOFIOTable);
     walltime_measure("/FOF/IO/WriteFOF");
 
-    if(SaveParticles) {
+    if(SaveParticles || subfind_enabled()) {
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable, 1);
         struct part_manager_type halo_pman = {0};
@@ -81,39 +91,152 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
             return;
         }
 
-        int * selection = mymalloc("Selection", sizeof(int) * halo_pman.NumPart);
+        if(SaveParticles) {
+            int * selection = mymalloc("Selection", sizeof(int) * halo_pman.NumPart);
 
-        int ptype_offset[6]={0};
-        int ptype_count[6]={0};
-        petaio_build_selection(selection, ptype_offset, ptype_count, halo_pman.Base, halo_pman.NumPart, NULL);
+            int ptype_offset[6]={0};
+            int ptype_count[6]={0};
+            petaio_build_selection(selection, ptype_offset, ptype_count, halo_pman.Base, halo_pman.NumPart, NULL);
 
-        walltime_measure("/FOF/IO/argind");
+            walltime_measure("/FOF/IO/argind");
 
-        for(i = 0; i < IOTable.used; i ++) {
-            /* only process the particle blocks */
-            char blockname[128];
-            int ptype = IOTable.ent[i].ptype;
-            BigArray array = {0};
-            if(ptype < 6 && ptype >= 0) {
-                sprintf(blockname, "%d/%s", ptype, IOTable.ent[i].name);
-                petaio_build_buffer(&array, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], halo_pman.Base, &halo_sman);
+            for(i = 0; i < IOTable.used; i ++) {
+                /* only process the particle blocks */
+                char blockname[128];
+                int ptype = IOTable.ent[i].ptype;
+                BigArray array = {0};
+                if(ptype < 6 && ptype >= 0) {
+                    sprintf(blockname, "%d/%s", ptype, IOTable.ent[i].name);
+                    petaio_build_buffer(&array, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], halo_pman.Base, &halo_sman);
 
-                message(0, "Writing Block %s\n", blockname);
+                    message(0, "Writing Block %s\n", blockname);
 
-                petaio_save_block(&bf, blockname, &array, 1);
-                petaio_destroy_buffer(&array);
+                    petaio_save_block(&bf, blockname, &array, 1);
+                    petaio_destroy_buffer(&array);
+                }
             }
+            myfree(selection);
+            walltime_measure("/FOF/IO/WriteParticles");
         }
-        myfree(selection);
+        /* Finds subhaloes and redistributes the particles, so must be after the particles are written*/
+        if(subfind_enabled())
+            subfind_save_subhalos(&bf, &halo_pman, &halo_sman, Comm);
         myfree(halo_sman.Base);
         myfree(halo_pman.Base);
-        walltime_measure("/FOF/IO/WriteParticles");
         destroy_io_blocks(&IOTable);
     }
 
     big_file_mpi_close(&bf, Comm);
 }
 
+/* Write the links between the groups of the previous output and this one,
+ * and the tracers of this output, so a restart can link the next output to it.*/
+static void
+fof_save_merger_tree(BigFile * bf, struct fof_mt_link * links, int64_t nlinks)
+{
+#define FOF_SAVE_FIELD(name, items, n, field, dtype) do { \
+        BigArray array = {0}; \
+        big_array_init(&array, &items[0].field, dtype, 2, (size_t []){n, 1}, \
+                (ptrdiff_t []){sizeof(items[0]), big_file_dtype_itemsize(dtype)}); \
+        petaio_save_block(bf, "MergerTree/" name, &array, 1); \
+    } while(0)
+
+    FOF_SAVE_FIELD("ProgenitorGroupID", links, nlinks, Progenitor, "i8");
+    FOF_SAVE_FIELD("DescendantGroupID", links, nlinks, Descendant, "i8");
+    FOF_SAVE_FIELD("SharedTracers", links, nlinks, Shared, "i4");
+    FOF_SAVE_FIELD("ProgenitorTracers", links, nlinks, NProgTracer, "i4");
+    FOF_SAVE_FIELD("Merit", links, nlinks, Merit, "f4");
+
+    int64_t ntracers;
+    struct fof_mt_tracer * tracers = fof_merger_tree_tracers(&ntracers);
+    FOF_SAVE_FIELD("TracerID", tracers, ntracers, ID, "u8");
+    FOF_SAVE_FIELD("TracerGroupID", tracers, ntracers, GrNr, "i8");
+    FOF_SAVE_FIELD("TracerNumber", tracers, ntracers, NTracer, "i4");
+#undef FOF_SAVE_FIELD
+}
+
+/* Time of the FOF output num, or -1 if it does not exist or has no merger tree tracers*/
+static double
+fof_merger_tree_output_time(int num, MPI_Comm Comm)
+{
+    double Time = -1;
+    BigFile bf = {0};
+    BigBlock bh;
+    char * fname = fastpm_strdup_printf("%s/%s_%03d", All.OutputDir, All.FOFFileBase, num);
+    if(0 == big_file_mpi_open(&bf, fname, Comm)) {
+        if(0 == big_file_mpi_open_block(&bf, &bh, "MergerTree/TracerID", Comm)) {
+            big_block_mpi_close(&bh, Comm);
+            if(0 == big_file_mpi_open_block(&bf, &bh, "Header", Comm)) {
+                if(0 != big_block_get_attr(&bh, "Time", &Time, "f8", 1))
+                    Time = -1;
+                big_block_mpi_close(&bh, Comm);
+            }
+        }
+        big_file_mpi_close(&bf, Comm);
+    }
+    myfree(fname);
+    return Time;
+}
+
+void
+fof_load_merger_tree(int num, double Time, MPI_Comm Comm)
+{
+    /* The last output at or before the snapshot. A node-local checkpoint may be newer than
+     * the snapshot, so look for later outputs written before it too.*/
+    int best = -1, n;
+    for(n = num; n >= 0 && best < 0; n--) {
+        const double t = fof_merger_tree_output_time(n, Comm);
+        if(t >= 0 && t <= Time)
+            best = n;
+    }
+    for(n = (best < 0 ? num : best) + 1; ; n++) {
+        const double t = fof_merger_tree_output_time(n, Comm);
+        if(t < 0 || t > Time)
+            break;
+        best = n;
+    }
+    if(best < 0) {
+        message(0, "No FOF output with merger tree tracers before a = %g: the next output will have no progenitors.\n", Time);
+        fof_merger_tree_set_tracers(NULL, 0);
+        return;
+    }
+
+    char * fname = fastpm_strdup_printf("%s/%s_%03d", All.OutputDir, All.FOFFileBase, best);
+    BigFile bf = {0};
+    BigBlock bb;
+    if(0 != big_file_mpi_open(&bf, fname, Comm))
+        endrun(0, "Failed to open file at %s\n", fname);
+    if(0 != big_file_mpi_open_block(&bf, &bb, "MergerTree/TracerID", Comm))
+        endrun(0, "Failed to open block at %s:MergerTree/TracerID\n", fname);
+    const int64_t size = bb.size;
+    big_block_mpi_close(&bb, Comm);
+
+    /* The tracers are routed by ID when they are used, so any split will do*/
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+    const int64_t ntracers = size * (ThisTask + 1) / NTask - size * ThisTask / NTask;
+    struct fof_mt_tracer * tracers = malloc((ntracers + 1) * sizeof(struct fof_mt_tracer));
+    if(!tracers)
+        endrun(5, "Could not allocate %ld merger tree tracers\n", ntracers);
+
+#define FOF_READ_FIELD(name, field, dtype) do { \
+        BigArray array = {0}; \
+        big_array_init(&array, &tracers[0].field, dtype, 2, (size_t []){ntracers, 1}, \
+                (ptrdiff_t []){sizeof(tracers[0]), big_file_dtype_itemsize(dtype)}); \
+        petaio_read_block(&bf, "MergerTree/" name, &array, 1); \
+    } while(0)
+
+    FOF_READ_FIELD("TracerID", ID, "u8");
+    FOF_READ_FIELD("TracerGroupID", GrNr, "i8");
+    FOF_READ_FIELD("TracerNumber", NTracer, "i4");
+#undef FOF_READ_FIELD
+    big_file_mpi_close(&bf, Comm);
+    fof_merger_tree_set_tracers(tracers, ntracers);
+    message(0, "Read %ld merger tree tracers from %s\n", size, fname);
+    myfree(fname);
+}
+
 struct PartIndex {
     uint64_t origin;
     union {
@@ -154,22 +277,12 @@ static int fof_cmp_origin(const void * c1, const void * c2) {
 }
 #endif
 
-static int
-order_by_type_and_grnr(const void *a, const void *b)
+/* Sort key ordering by type, then by group number. GrNr >= 0 for halo particles.*/
+static uint64_t
+key_by_type_and_grnr(const void * a, void * arg)
 {
     const struct particle_data * pa  = (const struct particle_data *) a;
-    const struct particle_data * pb  = (const struct particle_data *) b;
-
-    if(pa->Type < pb->Type)
-        return -1;
-    if(pa->Type > pb->Type)
-        return +1;
-    if(pa->GrNr < pb->GrNr)
-        return -1;
-    if(pa->GrNr > pb->GrNr)
-        return +1;
-
-    return 0;
+    return ((uint64_t) pa->Type << 60) | (uint64_t) pa->GrNr;
 }
 
 static int
@@ -312,7 +425,7 @@ fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_mana
     }
 
     /* Sort locally by group number*/
-    qsort_openmp(halopart, halo_pman->NumPart, sizeof(struct particle_data), order_by_type_and_grnr);
+    radix_sort_openmp(halopart, halo_pman->NumPart, sizeof(struct particle_data), key_by_type_and_grnr, 8, NULL);
     GrNrMax = -1;
     #pragma omp parallel for reduction(max: GrNrMax)
     for(i = 0; i < halo_pman->NumPart; i ++) {
@@ -452,6 +565,16 @@ SIMPLE_PROPERTY_FOF(GasMetalElemMass, GasMetalElemMass[0], float, NMETALS)
 SIMPLE_PROPERTY_FOF(StellarMetalElemMass, StellarMetalElemMass[0], float, NMETALS)
 SIMPLE_PROPERTY_FOF(BlackholeMass, BH_Mass, float, 1)
 SIMPLE_PROPERTY_FOF(BlackholeAccretionRate, BH_Mdot, float, 1)
+SIMPLE_PROPERTY_FOF(M200c, M200c, float, 1)
+SIMPLE_PROPERTY_FOF(R200c, R200c, float, 1)
+SIMPLE_PROPERTY_FOF(M500c, M500c, float, 1)
+SIMPLE_PROPERTY_FOF(R500c, R500c, float, 1)
+SIMPLE_PROPERTY_FOF(Mvir, Mvir, float, 1)
+SIMPLE_PROPERTY_FOF(Rvir, Rvir, float, 1)
+SIMPLE_PROPERTY_FOF(SORadius, SORadius, float, 1)
+SIMPLE_PROPERTY_FOF(SOMassProfile, SOMassProfile[0], float, FOF_SO_NBINS)
+SIMPLE_PROPERTY_FOF(MainProgenitor, MainProgenitor, int64_t, 1)
+SIMPLE_PROPERTY_FOF(ProgenitorMerit, ProgenitorMerit, float, 1)
 
 static void fof_register_io_blocks(struct IOTable * IOTable) {
     IOTable->used = 0;
@@ -483,4 +606,18 @@ static void fof_register_io_blocks(struct IOTable * IOTable) {
         IO_REG(BlackholeMass, "f4", 1, PTYPE_FOF_GROUP, IOTable);
         IO_REG(BlackholeAccretionRate, "f4", 1, PTYPE_FOF_GROUP, IOTable);
     }
+    if(fof_so_enabled()) {
+        IO_REG(M200c, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(R200c, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(M500c, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(R500c, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(Mvir, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(Rvir, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(SORadius, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(SOMassProfile, "f4", FOF_SO_NBINS, PTYPE_FOF_GROUP, IOTable);
+    }
+    if(fof_merger_tree_enabled()) {
+        IO_REG(MainProgenitor, "i8", 1, PTYPE_FOF_GROUP, IOTable);
+        IO_REG(ProgenitorMerit, "f4", 1, PTYPE_FOF_GROUP, IOTable);
+    }
 }
@@ -23,6 +23,7 @@
 #include "timestep.h"
 #include "timebinmgr.h"
 #include "cosmology.h"
+#include "checkpoint.h"
 
 /*! \file init.c
  *  \brief code for initialisation of a simulation from initial conditions
@@ -147,6 +148,15 @@ inttime_t init(int RestartSnapNum, DomainDecomp * ddecomp)
 {
     int i;
 
+    /* A node-local checkpoint newer than the snapshot is read instead of it.
+     * The neutrino state is only in the snapshot.*/
+    double LocalTime = -1;
+    if(RestartSnapNum >= 0 && !All.MassiveNuLinRespOn) {
+        LocalTime = find_local_checkpoint(All.TimeInit);
+        if(LocalTime > 0)
+            All.TimeInit = LocalTime;
+    }
+
     /*Add TimeInit and TimeMax to the output list*/
     if (RestartSnapNum < 0) {
         /* allow a first snapshot at IC time; */
@@ -170,7 +180,11 @@ inttime_t init(int RestartSnapNum, DomainDecomp * ddecomp)
     set_global_time(Ti_Current);
 
     /*Read the snapshot*/
-    petaio_read_snapshot(RestartSnapNum, MPI_COMM_WORLD);
+    int restored = 0;
+    if(LocalTime > 0)
+        read_local_checkpoint(ddecomp);
+    else
+        restored = petaio_read_snapshot(RestartSnapNum, MPI_COMM_WORLD);
 
     domain_test_id_uniqueness(PartManager);
 
@@ -185,7 +199,10 @@ inttime_t init(int RestartSnapNum, DomainDecomp * ddecomp)
      * on Task 0, there will be a lot of imbalance*/
     MPIU_Barrier(MPI_COMM_WORLD);
 
-    fof_init(All.MeanSeparation[1]);
+    fof_init(All.MeanSeparation[1], &All.CP, All.G);
+    /* Link the next FOF output to the last one written before the restart*/
+    if(RestartSnapNum >= 0 && fof_merger_tree_enabled())
+        fof_load_merger_tree(RestartSnapNum, All.TimeInit, MPI_COMM_WORLD);
 
     #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++)	/* initialize sph_properties */
@@ -255,7 +272,13 @@ inttime_t init(int RestartSnapNum, DomainDecomp * ddecomp)
 
     walltime_measure("/Init");
 
-    domain_decompose_full(ddecomp);	/* do initial domain decomposition (gives equal numbers of particles) */
+    /* If the particles were read in the layout of the saved domain, reuse it. */
+    if(LocalTime > 0)
+        domain_restore_finish(ddecomp);
+    else if(restored)
+        petaio_read_domain(RestartSnapNum, ddecomp);
+    else
+        domain_decompose_full(ddecomp);	/* do initial domain decomposition (gives equal numbers of particles) */
 
     if(All.DensityOn)
         setup_smoothinglengths(RestartSnapNum, ddecomp, Ti_Current);
@@ -3,18 +3,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_integration.h>
-/*For mkdir*/
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <bigfile-mpi.h>
 
 #include "utils.h"
+#include "utils/openmpsort.h"
 
 #include "allvars.h"
 #include "timefac.h"
+#include "timebinmgr.h"
 #include "partmanager.h"
 #include "cosmology.h"
+#include "petaio.h"
+#include "lightcone.h"
 
 #define NENTRY 4096
 static double tab_loga[NENTRY];
@@ -29,11 +32,11 @@ static double tab_Dc[NENTRY];
 
 /*
  * replicas to consider, function of redshift;
- *
+ * Stored as separate arrays so that the crossing test vectorizes over replicas.
  * */
 static int Nreplica;
 static int BoxBoost = 20;
-static double Reps[8192][3];
+static double RepX[8192], RepY[8192], RepZ[8192];
 static double HorizonDistance2;
 static double HorizonDistance;
 static double HorizonDistancePrev;
@@ -43,11 +46,86 @@ static double zmin = 0.1;
 static double zmax = 80.0;
 static double ReferenceRedshift = 2.0; /* write all particles below this redshift; write a fraction above this. */
 static double SampleFraction; /* current fraction of particle gets written */
-static FILE * fd_lightcone;
+
+/* A particle crossing the lightcone*/
+struct lightcone_particle {
+    double Pos[3];
+    float Vel[3];
+    float Redshift; /* Redshift at which the particle crossed */
+    float SampleFraction; /* Fraction of particles written at this redshift */
+    int Type;
+    MyIDType ID;
+};
+
+/* A growable list of crossings. Each thread fills its own during lightcone_compute;
+ * they are then appended to the list of the rank, which is written when it is larger than BufferSize.
+ * These live outside of the main allocator, as they persist between timesteps.*/
+struct lightcone_list {
+    struct lightcone_particle * p;
+    int64_t size;
+    int64_t maxsize;
+};
+
+/* Mass deposited by the crossings into a HEALPix pixel of a shell.
+ * The pixels are kept as a sparse list, with duplicates merged after each timestep.*/
+struct lightcone_pixel {
+    int64_t Pix; /* RING ordering */
+    int Shell;
+    double Mass;
+    double MassVr; /* Mass weighted radial velocity */
+};
+
+struct lightcone_pixel_list {
+    struct lightcone_pixel * p;
+    int64_t size;
+    int64_t maxsize;
+};
+
+static struct lightcone_params {
+    int Types; /* Bitmask of the particle types in the lightcone*/
+    size_t BufferSize; /* Bytes of crossings per rank to buffer before writing*/
+    int64_t MapNside; /* HEALPix resolution of the shell maps. 0 disables the maps. */
+    double MapShellWidth; /* Comoving width of a map shell, internal units*/
+    int MapTypes; /* Bitmask of the particle types deposited in the maps*/
+    int MapVelocity; /* Also make a map of the mass weighted radial velocity*/
+} LightconeParams;
+
+static struct lightcone_list Buffered;
+static struct lightcone_pixel_list Pixels;
+/* Index of the outermost shell not yet written. Shells are written from the outside in,
+ * as the horizon moves inwards.*/
+static int NextShell = -1;
+/* Shell being filled when a restarted run stopped. Its deposits from before the restart are lost,
+ * so it is marked as incomplete. -1 if none.*/
+static int IncompleteShell = -1;
+static char LightconeFile[4096];
 
 static double lightcone_get_horizon(double a);
-static void lightcone_cross(int p, double ddrift);
-static void lightcone_set_time(double a);
+static void lightcone_cross(int p, double ddrift, double loga, double loga_next, double * dold2, double * dnew2, struct lightcone_list * list, struct lightcone_pixel_list * pixels);
+static void lightcone_truncate(double a);
+static void lightcone_merge_pixels(struct lightcone_pixel_list * lists, int nlists);
+static void lightcone_write_shells(double horizon);
+static int lightcone_set_time(double a, double a_next);
+
+void
+set_lightcone_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        LightconeParams.Types = param_get_int(ps, "LightconeParticleTypes");
+        LightconeParams.BufferSize = param_get_double(ps, "LightconeBufferMB") * 1024 * 1024;
+        LightconeParams.MapNside = param_get_int(ps, "LightconeMapNside");
+        LightconeParams.MapShellWidth = param_get_double(ps, "LightconeMapShellWidth");
+        LightconeParams.MapTypes = param_get_int(ps, "LightconeMapParticleTypes");
+        LightconeParams.MapVelocity = param_get_int(ps, "LightconeMapVelocity");
+        if(LightconeParams.MapNside > 0 && LightconeParams.MapShellWidth <= 0)
+            endrun(0, "LightconeMapShellWidth = %g must be positive when LightconeMapNside = %ld\n",
+                    LightconeParams.MapShellWidth, LightconeParams.MapNside);
+    }
+    MPI_Bcast(&LightconeParams, sizeof(struct lightcone_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
 /*
 M, L = self.M, self.L
   logx = numpy.linspace(log10amin, 0, Np)
@@ -91,27 +169,28 @@ static void lightcone_init_entry(Cosmology * CP, int i) {
 void lightcone_init(Cosmology * CP, double timeBegin)
 {
     int i;
+    /* The starting time is only known once the snapshot or checkpoint has been read*/
+    if(timeBegin <= 0 || timeBegin > 1)
+        endrun(1, "Lightcone starting at a = %g: call lightcone_init after the starting time is set\n", timeBegin);
     dloga = (0.0 - log(timeBegin)) / (NENTRY - 1);
     for(i = 0; i < NENTRY; i ++) {
         lightcone_init_entry(CP, i);
     };
-    char buf[1024];
-    int chunk = 100;
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    /* The crossings are appended to a single bigfile, which is created if it does not exist.
+     * A restart computes the crossings after the restart time again, so drop them from the file.*/
+    snprintf(LightconeFile, sizeof(LightconeFile), "%s/lightcone", All.OutputDir);
+    lightcone_truncate(timeBegin);
 
-    sprintf(buf, "%s/lightcone/", All.OutputDir);
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/", All.OutputDir, (int)(ThisTask / chunk));
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/lightcone-%05d.raw", All.OutputDir, (int)(ThisTask / chunk), ThisTask);
-
-    fd_lightcone = fopen(buf, "a+");
-    if(fd_lightcone == NULL) {
-        endrun(1, "failed to open %s\n", buf);
-    }
+    HorizonDistance = lightcone_get_horizon(timeBegin);
+    HorizonDistance2 = HorizonDistance * HorizonDistance;
     HorizonDistanceRef = lightcone_get_horizon(1 / (1 + ReferenceRedshift));
-    printf("lightcone reference redshift = %g distance = %g\n",
+    /* The shell containing the starting horizon is only partially covered.
+     * On a restart the rest of it was in memory when the previous run stopped.*/
+    if(LightconeParams.MapNside > 0) {
+        NextShell = HorizonDistance / LightconeParams.MapShellWidth;
+        IncompleteShell = timeBegin > All.TimeIC ? NextShell : -1;
+    }
+    message(0, "lightcone reference redshift = %g distance = %g\n",
             ReferenceRedshift, HorizonDistanceRef);
 }
 
@@ -132,8 +211,9 @@ static double lightcone_get_horizon(double a) {
     return tab_Dc[bin] * u2 + tab_Dc[bin + 1] * u1;
 }
 
-/* fill in the table of box offsets for current time */
-static void update_replicas(double a) {
+/* fill in the table of box offsets for current time:
+ * the replicas which the shell between the two horizons passes through.*/
+static void update_replicas(void) {
     int Nmax = BoxBoost * BoxBoost * BoxBoost;
     int i;
     int rx, ry, rz;
@@ -150,10 +230,10 @@ static void update_replicas(double a) {
         dy += All.BoxSize;
         dz += All.BoxSize;
         d2 = dx * dx + dy * dy + dz * dz;
-        if(d1 <= HorizonDistance2 && d2 >= HorizonDistance2) {
-            Reps[Nreplica][0] = rx * All.BoxSize;
-            Reps[Nreplica][1] = ry * All.BoxSize;
-            Reps[Nreplica][2] = rz * All.BoxSize;
+        if(d1 <= HorizonDistance2Prev && d2 >= HorizonDistance2) {
+            RepX[Nreplica] = rx * All.BoxSize;
+            RepY[Nreplica] = ry * All.BoxSize;
+            RepZ[Nreplica] = rz * All.BoxSize;
             Nreplica ++;
             if(Nreplica > 1000) {
                 endrun(951234, "too many replica");
@@ -171,30 +251,421 @@ static void update_replicas(double a) {
     }
 }
 
+/* Make room for at least newsize elements in a list, doubling it if needed*/
+static void *
+lightcone_reserve(void * p, int64_t * maxsize, const int64_t newsize, const size_t elsize)
+{
+    if(newsize <= *maxsize)
+        return p;
+    *maxsize = *maxsize ? 2 * *maxsize : 1024;
+    if(*maxsize < newsize)
+        *maxsize = newsize;
+    p = realloc(p, *maxsize * elsize);
+    if(!p)
+        endrun(1, "Failed to allocate %ld lightcone entries of size %lu\n", *maxsize, elsize);
+    return p;
+}
+
+/* Append a crossing to a list, growing it if needed*/
+static struct lightcone_particle *
+lightcone_list_append(struct lightcone_list * list)
+{
+    list->p = lightcone_reserve(list->p, &list->maxsize, list->size + 1, sizeof(struct lightcone_particle));
+    return &list->p[list->size++];
+}
+
+/* Convert a direction to a HEALPix pixel in the RING scheme. Follows vec2pix_ring of the HEALPix library.*/
+int64_t
+lightcone_vec2pix_ring(const int64_t nside, const double vec[3])
+{
+    const double r = sqrt(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2]);
+    const double z = r > 0 ? vec[2] / r : 1;
+    const double za = fabs(z);
+    /* in [0,4) */
+    double tt = atan2(vec[1], vec[0]) / M_PI_2;
+    if(tt < 0)
+        tt += 4;
+    if(tt >= 4)
+        tt -= 4;
+
+    if(za <= 2./3) {
+        /* Equatorial region */
+        const double temp1 = nside * (0.5 + tt);
+        const double temp2 = nside * z * 0.75;
+        const int64_t jp = temp1 - temp2; /* index of ascending edge line */
+        const int64_t jm = temp1 + temp2; /* index of descending edge line */
+        const int64_t ir = nside + 1 + jp - jm; /* ring number counted from z=2/3, in 1..2n+1 */
+        const int64_t kshift = 1 - (ir & 1);
+        int64_t ip = (jp + jm - nside + kshift + 1) / 2;
+        ip = ((ip % (4 * nside)) + 4 * nside) % (4 * nside);
+        return 2 * nside * (nside - 1) + (ir - 1) * 4 * nside + ip;
+    }
+    /* Polar caps */
+    const double tp = tt - (int64_t) tt;
+    const double tmp = nside * sqrt(3 * (1 - za));
+    const int64_t jp = tp * tmp; /* increasing edge line index */
+    const int64_t jm = (1.0 - tp) * tmp; /* decreasing edge line index */
+    const int64_t ir = jp + jm + 1; /* ring number counted from the closest pole */
+    int64_t ip = tt * ir;
+    ip = ((ip % (4 * ir)) + 4 * ir) % (4 * ir);
+    if(z > 0)
+        return 2 * ir * (ir - 1) + ip;
+    return 12 * nside * nside - 2 * ir * (ir + 1) + ip;
+}
+
+/* Sort by shell, outermost first, then by pixel*/
+static int
+lightcone_pixel_cmp(const void * a, const void * b)
+{
+    const struct lightcone_pixel * pa = a, * pb = b;
+    if(pa->Shell != pb->Shell)
+        return (pa->Shell < pb->Shell) - (pa->Shell > pb->Shell);
+    return (pa->Pix > pb->Pix) - (pa->Pix < pb->Pix);
+}
+
+/* Add the thread pixel lists to the pixels of this rank and merge the duplicate pixels,
+ * so that the list stays no larger than the number of pixels touched by this rank.*/
+static void
+lightcone_merge_pixels(struct lightcone_pixel_list * lists, int nlists)
+{
+    int t;
+    for(t = 0; t < nlists; t++) {
+        Pixels.p = lightcone_reserve(Pixels.p, &Pixels.maxsize, Pixels.size + lists[t].size, sizeof(struct lightcone_pixel));
+        if(lists[t].size > 0)
+            memcpy(Pixels.p + Pixels.size, lists[t].p, lists[t].size * sizeof(struct lightcone_pixel));
+        Pixels.size += lists[t].size;
+        free(lists[t].p);
+    }
+    if(Pixels.size == 0)
+        return;
+    qsort_openmp(Pixels.p, Pixels.size, sizeof(struct lightcone_pixel), lightcone_pixel_cmp);
+    int64_t i, n = 0;
+    for(i = 1; i < Pixels.size; i++) {
+        if(Pixels.p[i].Shell == Pixels.p[n].Shell && Pixels.p[i].Pix == Pixels.p[n].Pix) {
+            Pixels.p[n].Mass += Pixels.p[i].Mass;
+            Pixels.p[n].MassVr += Pixels.p[i].MassVr;
+        }
+        else
+            Pixels.p[++n] = Pixels.p[i];
+    }
+    Pixels.size = n + 1;
+}
+
+static void
+lightcone_open(BigFile * bf)
+{
+    if(0 != big_file_mpi_open(bf, LightconeFile, MPI_COMM_WORLD) &&
+       0 != big_file_mpi_create(bf, LightconeFile, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open lightcone at %s:%s\n", LightconeFile,
+                    big_file_get_error_message());
+    }
+}
+
+static void
+lightcone_close(BigFile * bf)
+{
+    if(0 != big_file_mpi_close(bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close lightcone at %s:%s\n", LightconeFile,
+                    big_file_get_error_message());
+    }
+}
+
+/* Remove the crossings later than a, which a restart from a will compute again, from the lightcone file.
+ * The crossings of a flush are in rank order, not time order, so each block is read, filtered
+ * and rewritten, spread evenly over the ranks. Collective.*/
+static void
+lightcone_truncate(double a)
+{
+    BigFile bf = {0};
+    BigBlock bb;
+    if(0 != big_file_mpi_open(&bf, LightconeFile, MPI_COMM_WORLD))
+        return;
+    if(0 != big_file_mpi_open_block(&bf, &bb, "Redshift", MPI_COMM_WORLD)) {
+        lightcone_close(&bf);
+        return;
+    }
+    const int64_t size = bb.size;
+    big_block_mpi_close(&bb, MPI_COMM_WORLD);
+
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int64_t start = size * ThisTask / NTask;
+    const int64_t nlocal = size * (ThisTask + 1) / NTask - start;
+
+    /* Crossings at the restart time itself were found by the step ending there*/
+    const float zrestart = 1 / a - 1;
+    char * keep = mymalloc("LightconeKeep", sizemax(nlocal, 1));
+    float * redshift = mymalloc("LightconeRedshift", sizemax(nlocal, 1) * sizeof(float));
+    BigArray array = {0};
+    big_array_init(&array, redshift, "f4", 2, (size_t []){nlocal, 1}, NULL);
+    petaio_read_block(&bf, "Redshift", &array, 1);
+    int64_t i, nkeep = 0;
+    for(i = 0; i < nlocal; i++) {
+        keep[i] = redshift[i] >= zrestart;
+        nkeep += keep[i];
+    }
+    myfree(redshift);
+
+    int64_t TotalKeep = nkeep;
+    MPI_Allreduce(MPI_IN_PLACE, &TotalKeep, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(TotalKeep < size) {
+        message(0, "Removing %ld lightcone crossings after a = %g from %s\n", size - TotalKeep, a, LightconeFile);
+        const char * blocks[] = {"Position", "Velocity", "ID", "Type", "Redshift", "SampleFraction"};
+        int b;
+        for(b = 0; b < (int) (sizeof(blocks) / sizeof(blocks[0])); b++) {
+            if(0 != big_file_mpi_open_block(&bf, &bb, blocks[b], MPI_COMM_WORLD))
+                continue;
+            char dtype[8];
+            strncpy(dtype, bb.dtype, sizeof(dtype));
+            const int nmemb = bb.nmemb;
+            big_block_mpi_close(&bb, MPI_COMM_WORLD);
+            const size_t rowsize = big_file_dtype_itemsize(dtype) * nmemb;
+            char * data = mymalloc("LightconeBlock", sizemax(nlocal, 1) * rowsize);
+            big_array_init(&array, data, dtype, 2, (size_t []){nlocal, nmemb}, NULL);
+            petaio_read_block(&bf, (char *) blocks[b], &array, 1);
+            int64_t n = 0;
+            for(i = 0; i < nlocal; i++)
+                if(keep[i])
+                    memmove(data + rowsize * n++, data + rowsize * i, rowsize);
+            big_array_init(&array, data, dtype, 2, (size_t []){n, nmemb}, NULL);
+            petaio_save_block(&bf, (char *) blocks[b], &array, 0);
+            myfree(data);
+        }
+    }
+    myfree(keep);
+    lightcone_close(&bf);
+}
+
+/* Write a dense map of a shell. Each rank owns a contiguous range of pixels:
+ * the sparse pixels are sent to their owner, which adds them up and writes its range.*/
+static void
+lightcone_write_shell(BigFile * bf, const int shell, const int64_t npix)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    const int64_t PixPerTask = (npix + NTask - 1) / NTask;
+    const int64_t start = ThisTask * PixPerTask < npix ? ThisTask * PixPerTask : npix;
+    const int64_t end = start + PixPerTask < npix ? start + PixPerTask : npix;
+    const int64_t nlocal = end > start ? end - start : 0;
+
+    /* The pixels of the outermost shell are at the head of the list, sorted by pixel and so by owner*/
+    int64_t nsend = 0;
+    while(nsend < Pixels.size && Pixels.p[nsend].Shell == shell)
+        nsend++;
+
+    int * Send_count = ta_malloc("Send_count", int, 4 * NTask);
+    int * Send_offset = Send_count + NTask;
+    int * Recv_count = Send_count + 2 * NTask;
+    int * Recv_offset = Send_count + 3 * NTask;
+    memset(Send_count, 0, sizeof(int) * NTask);
+    int64_t i;
+    for(i = 0; i < nsend; i++)
+        Send_count[Pixels.p[i].Pix / PixPerTask]++;
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    int64_t nrecv = 0;
+    Send_offset[0] = Recv_offset[0] = 0;
+    for(i = 0; i < NTask; i++) {
+        if(i > 0) {
+            Send_offset[i] = Send_offset[i-1] + Send_count[i-1];
+            Recv_offset[i] = Recv_offset[i-1] + Recv_count[i-1];
+        }
+        nrecv += Recv_count[i];
+    }
+
+    MPI_Datatype MPI_TYPE_PIXEL;
+    MPI_Type_contiguous(sizeof(struct lightcone_pixel), MPI_BYTE, &MPI_TYPE_PIXEL);
+    MPI_Type_commit(&MPI_TYPE_PIXEL);
+    struct lightcone_pixel * recv = mymalloc("LightconeRecvPix", sizemax(nrecv, 1) * sizeof(struct lightcone_pixel));
+    MPI_Alltoallv_smart(Pixels.p, Send_count, Send_offset, MPI_TYPE_PIXEL,
+                        recv, Recv_count, Recv_offset, MPI_TYPE_PIXEL, MPI_COMM_WORLD);
+    MPI_Type_free(&MPI_TYPE_PIXEL);
+
+    const int nmaps = LightconeParams.MapVelocity ? 2 : 1;
+    double * map = mymalloc("LightconeMap", sizemax(nlocal, 1) * nmaps * sizeof(double));
+    memset(map, 0, sizemax(nlocal, 1) * nmaps * sizeof(double));
+    for(i = 0; i < nrecv; i++) {
+        const int64_t j = recv[i].Pix - start;
+        map[nmaps * j] += recv[i].Mass;
+        if(nmaps > 1)
+            map[nmaps * j + 1] += recv[i].MassVr;
+    }
+    /* Mass weighted to mean radial velocity*/
+    if(nmaps > 1)
+        for(i = 0; i < nlocal; i++)
+            if(map[nmaps * i] > 0)
+                map[nmaps * i + 1] /= map[nmaps * i];
+
+    const double inner = shell * LightconeParams.MapShellWidth;
+    const double outer = inner + LightconeParams.MapShellWidth;
+    const char * names[2] = {"Mass", "RadialVelocity"};
+    /* The shell is written whole, replacing the map of a run that was restarted before this time*/
+    const int complete = shell != IncompleteShell;
+    if(!complete)
+        message(0, "Lightcone map of shell %d lacks the deposits from before the restart: marking it with Complete = 0\n", shell);
+    float * fmap = mymalloc("LightconeMapF4", sizemax(nlocal, 1) * sizeof(float));
+    int k;
+    for(k = 0; k < nmaps; k++) {
+        char blockname[128];
+        snprintf(blockname, sizeof(blockname), "Shell%04d/%s", shell, names[k]);
+        for(i = 0; i < nlocal; i++)
+            fmap[i] = map[nmaps * i + k];
+        BigArray array = {0};
+        big_array_init(&array, fmap, "f4", 2, (size_t []){nlocal, 1}, NULL);
+        petaio_save_block(bf, blockname, &array, 0);
+        BigBlock bb;
+        if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD) ||
+           0 != big_block_set_attr(&bb, "Nside", &LightconeParams.MapNside, "i8", 1) ||
+           0 != big_block_set_attr(&bb, "ShellInner", &inner, "f8", 1) ||
+           0 != big_block_set_attr(&bb, "ShellOuter", &outer, "f8", 1) ||
+           0 != big_block_set_attr(&bb, "Complete", &complete, "i4", 1) ||
+           0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to write attributes of %s:%s\n", blockname, big_file_get_error_message());
+        }
+    }
+    myfree(fmap);
+    myfree(map);
+    myfree(recv);
+    ta_free(Send_count);
+
+    /* Drop the written pixels*/
+    memmove(Pixels.p, Pixels.p + nsend, (Pixels.size - nsend) * sizeof(struct lightcone_pixel));
+    Pixels.size -= nsend;
+}
+
+/* Write the maps of all shells which the horizon has passed through. Collective.*/
+static void
+lightcone_write_shells(double horizon)
+{
+    if(NextShell < 0 || NextShell * LightconeParams.MapShellWidth < horizon)
+        return;
+    const int64_t npix = 12 * LightconeParams.MapNside * LightconeParams.MapNside;
+    BigFile bf = {0};
+    lightcone_open(&bf);
+    for(; NextShell >= 0 && NextShell * LightconeParams.MapShellWidth >= horizon; NextShell--) {
+        message(0, "Writing lightcone map of shell %d, comoving distance %g - %g\n", NextShell,
+                NextShell * LightconeParams.MapShellWidth, (NextShell + 1) * LightconeParams.MapShellWidth);
+        lightcone_write_shell(&bf, NextShell, npix);
+    }
+    lightcone_close(&bf);
+}
+
 /* Compute a list of particles which crossed
  * the lightcone boundaries on this timestep and
- * write them to the lightcone file*/
+ * add them to the lightcone buffer, which is written when full.*/
 void lightcone_compute(double a, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next)
 {
     int i;
-    lightcone_set_time(a);
+    const double loga_next = loga_from_ti(ti_next);
+    if(!lightcone_set_time(a, exp(loga_next)))
+        return;
+    /* Below zmin only the maps are made*/
+    if(SampleFraction <= 0.0 && LightconeParams.MapNside <= 0)
+        return;
     const double ddrift = get_exact_drift_factor(CP, ti_curr, ti_next);
-    #pragma omp parallel for
-    for(i = 0; i < PartManager->NumPart; i++)
+
+    const int NT = omp_get_max_threads();
+    struct lightcone_list * lists = ta_malloc("LightconeLists", struct lightcone_list, NT);
+    struct lightcone_pixel_list * pixels = ta_malloc("LightconePixels", struct lightcone_pixel_list, NT);
+    memset(lists, 0, NT * sizeof(struct lightcone_list));
+    memset(pixels, 0, NT * sizeof(struct lightcone_pixel_list));
+    /* Distances of a particle in each replica, for each thread*/
+    const int64_t nrep = sizemax(Nreplica, 1);
+    double * dist2 = ta_malloc("LightconeDist2", double, 2 * nrep * NT);
+
+    #pragma omp parallel
     {
-        lightcone_cross(i, ddrift);
+        const int tid = omp_get_thread_num();
+        struct lightcone_list * list = &lists[tid];
+        struct lightcone_pixel_list * pixlist = &pixels[tid];
+        double * dold2 = dist2 + 2 * nrep * tid;
+        double * dnew2 = dold2 + nrep;
+        #pragma omp for
+        for(i = 0; i < PartManager->NumPart; i++)
+        {
+            lightcone_cross(i, ddrift, log(a), loga_next, dold2, dnew2, list, pixlist);
+        }
     }
+    ta_free(dist2);
+
+    /* Merge the thread lists into the buffer of this rank*/
+    int t;
+    for(t = 0; t < NT; t++) {
+        if(Buffered.size + lists[t].size > Buffered.maxsize) {
+            Buffered.maxsize = Buffered.size + lists[t].size;
+            Buffered.p = realloc(Buffered.p, Buffered.maxsize * sizeof(struct lightcone_particle));
+            if(!Buffered.p)
+                endrun(1, "Failed to allocate %ld lightcone particles\n", Buffered.maxsize);
+        }
+        if(lists[t].size > 0)
+            memcpy(Buffered.p + Buffered.size, lists[t].p, lists[t].size * sizeof(struct lightcone_particle));
+        Buffered.size += lists[t].size;
+        free(lists[t].p);
+    }
+    lightcone_merge_pixels(pixels, NT);
+    ta_free(pixels);
+    ta_free(lists);
+
+    if(LightconeParams.MapNside > 0)
+        lightcone_write_shells(HorizonDistance);
+
+    if(MPIU_Any(Buffered.size * sizeof(struct lightcone_particle) >= LightconeParams.BufferSize, MPI_COMM_WORLD))
+        lightcone_flush();
+}
+
+/* Write the buffered crossings to the lightcone file and empty the buffer.
+ * Collective; the blocks are written straight from the buffer with strided views.*/
+void lightcone_flush(void)
+{
+    int64_t TotalBuffered = Buffered.size;
+    MPI_Allreduce(MPI_IN_PLACE, &TotalBuffered, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(TotalBuffered == 0)
+        return;
+
+    BigFile bf = {0};
+    lightcone_open(&bf);
+    message(0, "Writing %ld lightcone particles to %s\n", TotalBuffered, LightconeFile);
+
+    struct lightcone_particle dummy;
+    struct lightcone_particle * p = Buffered.size > 0 ? Buffered.p : &dummy;
+    const size_t N = Buffered.size;
+    const ptrdiff_t stride = sizeof(struct lightcone_particle);
+    BigArray array = {0};
+
+    big_array_init(&array, &p->Pos[0], "f8", 2, (size_t []){N, 3}, (ptrdiff_t []){stride, sizeof(double)});
+    petaio_append_block(&bf, "Position", &array, "f8", MPI_COMM_WORLD);
+    big_array_init(&array, &p->Vel[0], "f4", 2, (size_t []){N, 3}, (ptrdiff_t []){stride, sizeof(float)});
+    petaio_append_block(&bf, "Velocity", &array, "f4", MPI_COMM_WORLD);
+    big_array_init(&array, &p->ID, "u8", 2, (size_t []){N, 1}, (ptrdiff_t []){stride, sizeof(MyIDType)});
+    petaio_append_block(&bf, "ID", &array, "u8", MPI_COMM_WORLD);
+    big_array_init(&array, &p->Type, "i4", 2, (size_t []){N, 1}, (ptrdiff_t []){stride, sizeof(int)});
+    petaio_append_block(&bf, "Type", &array, "i4", MPI_COMM_WORLD);
+    big_array_init(&array, &p->Redshift, "f4", 2, (size_t []){N, 1}, (ptrdiff_t []){stride, sizeof(float)});
+    petaio_append_block(&bf, "Redshift", &array, "f4", MPI_COMM_WORLD);
+    big_array_init(&array, &p->SampleFraction, "f4", 2, (size_t []){N, 1}, (ptrdiff_t []){stride, sizeof(float)});
+    petaio_append_block(&bf, "SampleFraction", &array, "f4", MPI_COMM_WORLD);
+
+    lightcone_close(&bf);
+    Buffered.size = 0;
 }
 
-void lightcone_set_time(double a) {
+/* Set the horizons at the start and end of the timestep, and the replicas between them.
+ * Returns 0 before zmax, when the lightcone is not followed. The particles are only written above zmin,
+ * the maps are made down to z = 0.*/
+static int lightcone_set_time(double a, double a_next) {
     double z = 1 / a - 1;
-    if(z > zmin && z < zmax) {
-        HorizonDistancePrev = HorizonDistance;
-        HorizonDistance2Prev = HorizonDistance2;
-        HorizonDistance = lightcone_get_horizon(a);
-        HorizonDistance2 = HorizonDistance * HorizonDistance;
-        update_replicas(a);
-        fflush(fd_lightcone);
+    if(z >= zmax) {
+        SampleFraction = 0;
+        return 0;
+    }
+    HorizonDistancePrev = lightcone_get_horizon(a);
+    HorizonDistance2Prev = HorizonDistancePrev * HorizonDistancePrev;
+    HorizonDistance = lightcone_get_horizon(a_next);
+    HorizonDistance2 = HorizonDistance * HorizonDistance;
+    update_replicas();
+    if(z > zmin) {
         if (z < ReferenceRedshift) {
             SampleFraction = 1.0;
         } else {
@@ -216,54 +687,89 @@ void lightcone_set_time(double a) {
     } else {
         SampleFraction = 0;
     }
+    return 1;
 }
 
-/* check crossing of the horizon, write the particle */
-static void lightcone_cross(int p, double ddrift) {
-    if(SampleFraction <= 0.0) return;
+/* check crossing of the horizon in every replica, add the particle to list and deposit it in the shell map.
+ * dold2 and dnew2 are scratch space for Nreplica distances. */
+static void lightcone_cross(int p, double ddrift, double loga, double loga_next, double * dold2, double * dnew2, struct lightcone_list * list, struct lightcone_pixel_list * pixels) {
     int i;
     int k;
-    /* DM only */
-    if(P[p].Type != 1) return;
+    const int write = SampleFraction > 0 && ((1 << P[p].Type) & LightconeParams.Types);
+    const int deposit = LightconeParams.MapNside > 0 && NextShell >= 0 && ((1 << P[p].Type) & LightconeParams.MapTypes);
+    /* No replica straddles the shell between the horizons, eg, beyond BoxBoost boxes*/
+    if(Nreplica == 0 || (!write && !deposit)) return;
 
+    double pnew[3];
+    double pold[3];
+    for(k = 0; k < 3; k ++) {
+        pold[k] = P[p].Pos[k] - PartManager->CurrentParticleOffset[k];
+        pnew[k] = pold[k] + P[p].Vel[k] * ddrift;
+    }
+
+    /* Distances in each replica, vectorized over replicas. Most particles cross in none.*/
+    #pragma omp simd
     for(i = 0; i < Nreplica; i++) {
-        double r = get_random_number(P[p].ID + i);
-        if(r > SampleFraction) continue;
+        const double ox = pold[0] + RepX[i], oy = pold[1] + RepY[i], oz = pold[2] + RepZ[i];
+        const double nx = pnew[0] + RepX[i], ny = pnew[1] + RepY[i], nz = pnew[2] + RepZ[i];
+        dold2[i] = ox * ox + oy * oy + oz * oz;
+        dnew2[i] = nx * nx + ny * ny + nz * nz;
+    }
 
-        double pnew[3];
-        double pold[3];
-        double p3[4];
-        double dnew = 0, dold = 0;
-        for(k = 0; k < 3; k ++) {
-            pold[k] = P[p].Pos[k] + Reps[i][k] - PartManager->CurrentParticleOffset[k];
-            pnew[k] = P[p].Pos[k] + P[i].Vel[k] * ddrift - PartManager->CurrentParticleOffset[k];
-            dnew += pnew[k] * pnew[k];
-            dold += pold[k] * pold[k];
+    for(i = 0; i < Nreplica; i++) {
+        if(!(dold2[i] <= HorizonDistance2Prev && dnew2[i] >= HorizonDistance2))
+            continue;
+        /* The maps include every particle; the particle output only a sample*/
+        const int sampled = write && get_random_number(P[p].ID + i) <= SampleFraction;
+        if(!sampled && !deposit) continue;
+
+        double u1, u2;
+        if(dold2[i] != dnew2[i]) {
+            double cnew, cold;
+            cnew = sqrt(dnew2[i]) - HorizonDistance;
+            cold = sqrt(dold2[i]) - HorizonDistancePrev;
+            u1 = -cold / (cnew - cold);
+            u2 = cnew / (cnew - cold);
+        } else {
+            /* really should write all particles along the line:
+             * this partilce is moving along the horizon! */
+            u1 = u2 = 0.5;
         }
-        if(
-            (dold <= HorizonDistance2Prev && dnew >= HorizonDistance2)
-         ) {
-            double u1, u2;
-            if(dold != dnew) {
-                double cnew, cold;
-                dnew = sqrt(dnew);
-                dold = sqrt(dold);
-                cnew = dnew - HorizonDistance;
-                cold = dold - HorizonDistancePrev;
-                u1 = -cold / (cnew - cold);
-                u2 = cnew / (cnew - cold);
-            } else {
-                /* really should write all particles along the line:
-                 * this partilce is moving along the horizon! */
-                u1 = u2 = 0.5;
-            }
 
-            /* write particle position */
-            for(k = 0; k < 3; k ++) {
-                p3[k] = pold[k] * u2 + pnew[k] * u1;
-            }
-            p3[3] = SampleFraction;
-            fwrite(p3, sizeof(double), 4, fd_lightcone);
+        const double rep[3] = {RepX[i], RepY[i], RepZ[i]};
+        const double a_cross = exp(loga * u2 + loga_next * u1);
+        /* Velocities follow the snapshot convention*/
+        const double velfac = GetUsePeculiarVelocity() ? 1 / a_cross : 1;
+        double pos[3];
+        for(k = 0; k < 3; k ++)
+            pos[k] = (pold[k] * u2 + pnew[k] * u1) + rep[k];
+
+        if(deposit) {
+            const double rc = sqrt(pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2]);
+            int shell = rc / LightconeParams.MapShellWidth;
+            /* Shells beyond NextShell are already written*/
+            if(shell > NextShell)
+                shell = NextShell;
+            pixels->p = lightcone_reserve(pixels->p, &pixels->maxsize, pixels->size + 1, sizeof(struct lightcone_pixel));
+            struct lightcone_pixel * pix = &pixels->p[pixels->size++];
+            pix->Pix = lightcone_vec2pix_ring(LightconeParams.MapNside, pos);
+            pix->Shell = shell;
+            pix->Mass = P[p].Mass;
+            pix->MassVr = 0;
+            if(rc > 0)
+                pix->MassVr = P[p].Mass * velfac * (P[p].Vel[0] * pos[0] + P[p].Vel[1] * pos[1] + P[p].Vel[2] * pos[2]) / rc;
+        }
+        if(!sampled)
+            continue;
+
+        struct lightcone_particle * lp = lightcone_list_append(list);
+        for(k = 0; k < 3; k ++) {
+            lp->Pos[k] = pos[k];
+            lp->Vel[k] = P[p].Vel[k] * velfac;
         }
+        lp->Redshift = 1 / a_cross - 1;
+        lp->SampleFraction = SampleFraction;
+        lp->Type = P[p].Type;
+        lp->ID = P[p].ID;
     }
 }
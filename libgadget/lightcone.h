@@ -1,7 +1,19 @@
 #ifndef LIGHTCONE_H
 #define LIGHTCONE_H
 
-/* Initialise the lightcone code module. */
+#include "utils/paramset.h"
+#include "cosmology.h"
+#include "timebinmgr.h"
+
+/* Initialise the lightcone code module for a run starting at timeBegin. Crossings after timeBegin are removed from the file. */
 void lightcone_init(Cosmology * CP, double timeBegin);
+/* Find the particles crossing the lightcone during this timestep and buffer them.
+ * Collective: the buffer is written when any rank holds more than LightconeBufferMB.*/
 void lightcone_compute(double a, Cosmology * CP, inttime_t ti_curr, inttime_t ti_next);
+/* Write the buffered crossings to the lightcone file. Collective. */
+void lightcone_flush(void);
+/* Set the parameters of the lightcone module*/
+void set_lightcone_params(ParameterSet * ps);
+/* HEALPix pixel in RING ordering of the direction vec, as used by the shell maps*/
+int64_t lightcone_vec2pix_ring(const int64_t nside, const double vec[3]);
 #endif
@@ -5,6 +5,7 @@
 #include <math.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_integration.h>
+#include <gsl/gsl_interp.h>
 #include <gsl/gsl_interp2d.h>
 #include <gsl/gsl_roots.h>
 #include <gsl/gsl_errno.h>
@@ -157,9 +158,61 @@ double atime_integ(double atime, void * params)
     return 1/(hubble_function(CP, atime) * atime);
 }
 
+/* Number of points in the scale factor to cosmic time spline*/
+#define TIME_NA 1024
+/* Smallest scale factor in the spline*/
+#define TIME_AMIN 1e-3
+
+/* Number of stellar ages in the cumulative yield tables*/
+#define YIELD_NAGE 256
+/* Youngest stellar age in the yield tables, in Myr. No star dies this young.*/
+#define YIELD_AGEMIN 1.
+#define YIELD_NMETNODE 8
+/* Union of the metallicity points of the lifetime, AGB and SNII tables*/
+static const double yield_metallicity_nodes[YIELD_NMETNODE] = {0, 0.0001, 0.0004, 0.001, 0.004, 0.008, 0.02, 0.05};
+/* Metallicity points in the yield tables between each pair of nodes. The dying mass, and so the cumulative yields,
+ * are not linear in metallicity between the nodes.*/
+#define YIELD_METSPLIT 4
+#define YIELD_NMET ((YIELD_NMETNODE - 1) * YIELD_METSPLIT + 1)
+
+/* Quantities stored in the cumulative yield tables*/
+enum YieldQuantity {
+    YIELD_MASS = 0, /* Total mass returned*/
+    YIELD_METALS = 1, /* Total metal returned*/
+    YIELD_DYINGMASS = 2, /* Mass of the stars dying at this age*/
+    YIELD_SPECIES = 3, /* Metal species yields*/
+    YIELD_NQ = 3 + NMETALS,
+};
+
+/* Tables built once per run by init_metal_return.
+ * The cumulative yields are the IMF weighted yields of all stars which have died
+ * by a given age, so that the yield over a timestep is a difference of two table lookups.*/
+static struct yield_tables
+{
+    int valid;
+    /* Cosmic time in Myr as a function of log scale factor*/
+    double loga[TIME_NA];
+    double tmyr[TIME_NA];
+    gsl_interp * a_to_t;
+    /* Hubble time in Myr: the log-spaced ages go to twice this.*/
+    double hubbletime;
+    double dlogage;
+    double cumulative[YIELD_NMET][YIELD_NAGE][YIELD_NQ];
+    double imf_norm;
+    /* Maximum possible mass return*/
+    double maxmassfrac;
+    struct interps interp;
+} YieldTables;
+
 /* Compute the difference in internal time units between two scale factors.*/
 static double atime_to_myr(Cosmology *CP, double atime1, double atime2, gsl_integration_workspace * gsl_work)
 {
+    /* Use the spline if we can*/
+    if(YieldTables.valid && atime1 >= TIME_AMIN && atime2 >= TIME_AMIN &&
+        log(atime1) <= YieldTables.loga[TIME_NA-1] && log(atime2) <= YieldTables.loga[TIME_NA-1]) {
+        return gsl_interp_eval(YieldTables.a_to_t, YieldTables.loga, YieldTables.tmyr, log(atime2), NULL)
+             - gsl_interp_eval(YieldTables.a_to_t, YieldTables.loga, YieldTables.tmyr, log(atime1), NULL);
+    }
     /* t = dt/da da = 1/(Ha) da*/
     /* Approximate hubble function as constant here: we only care
      * about metal return over a single timestep*/
@@ -190,8 +243,9 @@ massendlife (double mass, void *params)
   return tlifemyr - p->dtfind;
 }
 
-/* Solve the lifetime function to find the lowest and highest mass bin that dies this timestep*/
-double do_rootfinding(struct massbin_find_params *p, double mass_low, double mass_high)
+/* Solve the lifetime function to find the lowest and highest mass bin that dies this timestep,
+ * to a relative accuracy epsrel*/
+double do_rootfinding(struct massbin_find_params *p, double mass_low, double mass_high, const double epsrel)
 {
     int iter = 0;
     gsl_function F;
@@ -211,7 +265,7 @@ double do_rootfinding(struct massbin_find_params *p, double mass_low, double mas
       mass_low = gsl_root_fsolver_x_lower (s);
       mass_high = gsl_root_fsolver_x_upper (s);
       int status = gsl_root_test_interval (mass_low, mass_high,
-                                       0, 0.005);
+                                       0, epsrel);
       //message(4, "lo %g hi %g root %g val %g\n", mass_low, mass_high, gsl_root_fsolver_root(s), massendlife(gsl_root_fsolver_root(s), p));
       if (status == GSL_SUCCESS)
         break;
@@ -254,7 +308,7 @@ void find_mass_bin_limits(double * masslow, double * masshigh, const double dtst
     if(massendlife (agb_masses[0], &p) <= 0)
         *masslow = lifetime_masses[0];
     else
-        *masslow = do_rootfinding(&p, agb_masses[0], MAXMASS);
+        *masslow = do_rootfinding(&p, agb_masses[0], MAXMASS, 0.005);
 
     /* Now find stars that died before the start of this timebin*/
     p.dtfind = dtstart;
@@ -267,11 +321,43 @@ void find_mass_bin_limits(double * masslow, double * masshigh, const double dtst
     else if(massendlife (*masslow, &p) <= 0)
         *masshigh = *masslow;
     else
-        *masshigh = do_rootfinding(&p, *masslow, MAXMASS);
+        *masshigh = do_rootfinding(&p, *masslow, MAXMASS, 0.005);
     gsl_interp_accel_free(p.metalacc);
     gsl_interp_accel_free(p.massacc);
 }
 
+/* Find the mass of the stars which die at age dtmyr, down to the lightest star in the lifetime table
+ * so that it is continuous in age. It is interpolated in the yield tables, so is found more accurately
+ * than in find_mass_bin_limits.*/
+static double
+find_dying_mass(const double dtmyr, double stellarmetal, gsl_interp2d * lifetime_tables)
+{
+    /* Clamp metallicities to the table values.*/
+    if(stellarmetal < lifetime_metallicity[0])
+        stellarmetal = lifetime_metallicity[0];
+    if(stellarmetal > lifetime_metallicity[LIFE_NMET-1])
+        stellarmetal = lifetime_metallicity[LIFE_NMET-1];
+
+    struct massbin_find_params p = {0};
+    p.metalacc = gsl_interp_accel_alloc();
+    p.massacc = gsl_interp_accel_alloc();
+    p.lifetime_tables = lifetime_tables;
+    p.stellarmetal = stellarmetal;
+    p.dtfind = dtmyr;
+    double mass;
+    /* If no stars have died yet*/
+    if(massendlife (MAXMASS, &p) >= 0)
+        mass = MAXMASS;
+    /* All stars die before this age*/
+    else if(massendlife (lifetime_masses[0], &p) <= 0)
+        mass = lifetime_masses[0];
+    else
+        mass = do_rootfinding(&p, lifetime_masses[0], MAXMASS, 1e-6);
+    gsl_interp_accel_free(p.metalacc);
+    gsl_interp_accel_free(p.massacc);
+    return mass;
+}
+
 /* Parameters of the interpolator
  * to hand to the imf integral.
  * Use different interpolation structures
@@ -392,7 +478,7 @@ double compute_snii_yield(gsl_interp2d * snii_interp, const double * snii_weight
 }
 
 /* Compute the total mass yield for this star in this timestep*/
-static double mass_yield(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, struct interps * interp, double imf_norm, gsl_integration_workspace * gsl_work, double masslow, double masshigh)
+double mass_yield(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, struct interps * interp, double imf_norm, gsl_integration_workspace * gsl_work, double masslow, double masshigh)
 {
     /* Number of AGB stars/SnII by integrating the IMF*/
     double agbyield = compute_agb_yield(interp->agb_mass_interp, agb_total_mass, stellarmetal, masslow, masshigh, gsl_work);
@@ -407,35 +493,150 @@ static double mass_yield(double dtmyrstart, double dtmyrend, double stellarmetal
     return massyield;
 }
 
-/* Compute the total metal yield for this star in this timestep*/
-static double metal_yield(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, struct interps * interp, MyFloat * MetalYields, double imf_norm, gsl_integration_workspace * gsl_work, double masslow, double masshigh)
+/* Stellar age of the i-th point in the cumulative yield tables, in Myr*/
+static double
+yield_table_age(int i)
 {
-    double MetalGenerated = 0;
-    /* Number of AGB stars/SnII by integrating the IMF*/
-    MetalGenerated += compute_agb_yield(interp->agb_metallicity_interp, agb_total_metals, stellarmetal, masslow, masshigh, gsl_work);
-    MetalGenerated += compute_snii_yield(interp->snii_metallicity_interp, snii_total_metals, stellarmetal, masslow, masshigh, gsl_work);
-    MetalGenerated /= imf_norm;
+    return YIELD_AGEMIN * exp(i * YieldTables.dlogage);
+}
+
+/* Metallicity of the i-th point in the cumulative yield tables*/
+static double
+yield_table_metallicity(int i)
+{
+    const int node = i / YIELD_METSPLIT;
+    if(node >= YIELD_NMETNODE - 1)
+        return yield_metallicity_nodes[YIELD_NMETNODE - 1];
+    const double frac = (double) (i % YIELD_METSPLIT) / YIELD_METSPLIT;
+    return yield_metallicity_nodes[node] + frac * (yield_metallicity_nodes[node + 1] - yield_metallicity_nodes[node]);
+}
 
+/* Build the scale factor to time spline and the cumulative yield tables.
+ * Every task builds its own copy: this is done once per run.*/
+void
+init_metal_return(Cosmology * CP, const double TimeMax)
+{
     int i;
-    for(i = 0; i < NMETALS; i++)
-    {
-        MetalYields[i] = 0;
-        MetalYields[i] += compute_agb_yield(interp->agb_metals_interp[i], agb_yield[i], stellarmetal, masslow, masshigh, gsl_work);
-        MetalYields[i] += compute_snii_yield(interp->snii_metals_interp[i], snii_yield[i], stellarmetal, masslow, masshigh, gsl_work);
-        MetalYields[i] /= imf_norm;
+    int nthread = omp_get_max_threads();
+    gsl_integration_workspace ** gsl_work = ta_malloc("gsl_work", gsl_integration_workspace *, nthread);
+    for(i=0; i < nthread; i++)
+        gsl_work[i] = gsl_integration_workspace_alloc(GSL_WORKSPACE);
+
+    setup_metal_table_interp(&YieldTables.interp);
+    YieldTables.imf_norm = compute_imf_norm(gsl_work[0]);
+    YieldTables.hubbletime = 1/(CP->HubbleParam*HUBBLE * SEC_PER_MEGAYEAR);
+    /* Maximum possible mass return*/
+    YieldTables.maxmassfrac = mass_yield(0, YieldTables.hubbletime, snii_metallicities[SNII_NMET-1], CP->HubbleParam, &YieldTables.interp, YieldTables.imf_norm, gsl_work[0], agb_masses[0], MAXMASS);
+
+    /* Cosmic time from the smallest scale factor, going a little past the end of the simulation*/
+    const double logamax = log(fmax(TimeMax, 1.) * 1.1);
+    YieldTables.loga[0] = log(TIME_AMIN);
+    YieldTables.tmyr[0] = 0;
+    for(i = 1; i < TIME_NA; i++) {
+        YieldTables.loga[i] = log(TIME_AMIN) + i * (logamax - log(TIME_AMIN)) / (TIME_NA - 1);
+        YieldTables.tmyr[i] = YieldTables.tmyr[i-1] + atime_to_myr(CP, exp(YieldTables.loga[i-1]), exp(YieldTables.loga[i]), gsl_work[0]);
+    }
+    YieldTables.a_to_t = gsl_interp_alloc(gsl_interp_cspline, TIME_NA);
+    gsl_interp_init(YieldTables.a_to_t, YieldTables.loga, YieldTables.tmyr, TIME_NA);
+
+    /* Ages go from before the first star dies to twice the Hubble time*/
+    YieldTables.dlogage = log(2 * YieldTables.hubbletime / YIELD_AGEMIN) / (YIELD_NAGE - 1);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < YIELD_NMET * YIELD_NAGE; i++) {
+        const int tid = omp_get_thread_num();
+        const double stellarmetal = yield_table_metallicity(i / YIELD_NAGE);
+        const double age = yield_table_age(i % YIELD_NAGE);
+        double * cum = YieldTables.cumulative[i / YIELD_NAGE][i % YIELD_NAGE];
+        struct interps * interp = &YieldTables.interp;
+        /* Every star heavier than this has died*/
+        const double dyingmass = find_dying_mass(age, stellarmetal, interp->lifetime_interp);
+        cum[YIELD_DYINGMASS] = dyingmass;
+        cum[YIELD_MASS] = (compute_agb_yield(interp->agb_mass_interp, agb_total_mass, stellarmetal, dyingmass, MAXMASS, gsl_work[tid])
+                        + compute_snii_yield(interp->snii_mass_interp, snii_total_mass, stellarmetal, dyingmass, MAXMASS, gsl_work[tid])) / YieldTables.imf_norm;
+        cum[YIELD_METALS] = (compute_agb_yield(interp->agb_metallicity_interp, agb_total_metals, stellarmetal, dyingmass, MAXMASS, gsl_work[tid])
+                        + compute_snii_yield(interp->snii_metallicity_interp, snii_total_metals, stellarmetal, dyingmass, MAXMASS, gsl_work[tid])) / YieldTables.imf_norm;
+        int j;
+        for(j = 0; j < NMETALS; j++)
+            cum[YIELD_SPECIES + j] = (compute_agb_yield(interp->agb_metals_interp[j], agb_yield[j], stellarmetal, dyingmass, MAXMASS, gsl_work[tid])
+                        + compute_snii_yield(interp->snii_metals_interp[j], snii_yield[j], stellarmetal, dyingmass, MAXMASS, gsl_work[tid])) / YieldTables.imf_norm;
     }
-    double Nsn1a = sn1a_number(dtmyrstart, dtmyrend, hub);
-    for(i = 0; i < NMETALS; i++)
-        MetalYields[i] += Nsn1a * sn1a_yields[i];
-    MetalGenerated += Nsn1a * sn1a_total_metals;
 
-    return MetalGenerated;
+    for(i=0; i < nthread; i++)
+        gsl_integration_workspace_free(gsl_work[i]);
+    ta_free(gsl_work);
+    YieldTables.valid = 1;
+    message(0, "Tabulated stellar yields for %d ages between %g and %g Myr\n", YIELD_NAGE, YIELD_AGEMIN, yield_table_age(YIELD_NAGE-1));
+}
+
+/* Interpolate the cumulative yields of a stellar population of this age and metallicity.*/
+static void
+cumulative_yields(double age, double stellarmetal, double * cum)
+{
+    /* Clamp to the table: nothing dies younger than the first age point.*/
+    double y = log(fmax(age, YIELD_AGEMIN) / YIELD_AGEMIN) / YieldTables.dlogage;
+    if(y > YIELD_NAGE - 1)
+        y = YIELD_NAGE - 1;
+    int ia = y;
+    if(ia > YIELD_NAGE - 2)
+        ia = YIELD_NAGE - 2;
+    const double da = y - ia;
+
+    if(stellarmetal < yield_metallicity_nodes[0])
+        stellarmetal = yield_metallicity_nodes[0];
+    if(stellarmetal > yield_metallicity_nodes[YIELD_NMETNODE-1])
+        stellarmetal = yield_metallicity_nodes[YIELD_NMETNODE-1];
+    int node = 0;
+    while(node < YIELD_NMETNODE - 2 && stellarmetal > yield_metallicity_nodes[node+1])
+        node++;
+    /* Position in the evenly spaced points between the nodes*/
+    const double z = (stellarmetal - yield_metallicity_nodes[node]) / (yield_metallicity_nodes[node+1] - yield_metallicity_nodes[node]) * YIELD_METSPLIT;
+    int iz = z;
+    if(iz > YIELD_METSPLIT - 1)
+        iz = YIELD_METSPLIT - 1;
+    const double dz = z - iz;
+    iz += node * YIELD_METSPLIT;
+
+    const double * c00 = YieldTables.cumulative[iz][ia];
+    const double * c01 = YieldTables.cumulative[iz][ia+1];
+    const double * c10 = YieldTables.cumulative[iz+1][ia];
+    const double * c11 = YieldTables.cumulative[iz+1][ia+1];
+    int k;
+    for(k = 0; k < YIELD_NQ; k++)
+        cum[k] = (1 - dz) * ((1 - da) * c00[k] + da * c01[k]) + dz * ((1 - da) * c10[k] + da * c11[k]);
+}
+
+/* Compute the mass, metal and species yields of a star between two ages from the tables,
+ * including Sn1a. Yields are per unit initial mass. masslow and masshigh are set to the
+ * mass range of the stars which died. MetalYields may be NULL.*/
+void
+tabulated_yields(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, double * MassYield, double * MetalYield, MyFloat * MetalYields, MyFloat * masslow, MyFloat * masshigh)
+{
+    double cumstart[YIELD_NQ], cumend[YIELD_NQ];
+    cumulative_yields(dtmyrstart, stellarmetal, cumstart);
+    cumulative_yields(dtmyrend, stellarmetal, cumend);
+    const double Nsn1a = sn1a_number(dtmyrstart, dtmyrend, hub);
+    if(MassYield)
+        *MassYield = cumend[YIELD_MASS] - cumstart[YIELD_MASS] + Nsn1a * sn1a_total_metals;
+    if(MetalYield)
+        *MetalYield = cumend[YIELD_METALS] - cumstart[YIELD_METALS] + Nsn1a * sn1a_total_metals;
+    if(MetalYields) {
+        int i;
+        for(i = 0; i < NMETALS; i++)
+            MetalYields[i] = cumend[YIELD_SPECIES + i] - cumstart[YIELD_SPECIES + i] + Nsn1a * sn1a_yields[i];
+    }
+    if(masslow)
+        *masslow = cumend[YIELD_DYINGMASS];
+    if(masshigh)
+        *masshigh = cumstart[YIELD_DYINGMASS];
 }
 
 /* Initialise the private structure, finding stellar mass return and ages*/
 int64_t
 metal_return_init(const ActiveParticles * act, Cosmology * CP, struct MetalReturnPriv * priv, const double atime)
 {
+    if(!YieldTables.valid)
+        endrun(5, "Metal return called before init_metal_return\n");
     int nthread = omp_get_max_threads();
     priv->gsl_work = ta_malloc("gsl_work", gsl_integration_workspace *, nthread);
     int i;
@@ -444,17 +645,15 @@ metal_return_init(const ActiveParticles * act, Cosmology * CP, struct MetalRetur
         priv->gsl_work[i] = gsl_integration_workspace_alloc(GSL_WORKSPACE);
     priv->hub = CP->HubbleParam;
 
-    /* Initialize*/
-    setup_metal_table_interp(&priv->interp);
     priv->StellarAges = mymalloc("StellarAges", SlotsManager->info[4].size * sizeof(MyFloat));
     priv->MassReturn = mymalloc("MassReturn", SlotsManager->info[4].size * sizeof(MyFloat));
     priv->LowDyingMass = mymalloc("LowDyingMass", SlotsManager->info[4].size * sizeof(MyFloat));
     priv->HighDyingMass = mymalloc("HighDyingMass", SlotsManager->info[4].size * sizeof(MyFloat));
     priv->StarVolumeSPH = mymalloc("StarVolumeSPH", SlotsManager->info[4].size * sizeof(MyFloat));
 
-    priv->imf_norm = compute_imf_norm(priv->gsl_work[0]);
+    priv->imf_norm = YieldTables.imf_norm;
     /* Maximum possible mass return for below*/
-    double maxmassfrac = mass_yield(0, 1/(CP->HubbleParam*HUBBLE * SEC_PER_MEGAYEAR), snii_metallicities[SNII_NMET-1], CP->HubbleParam, &priv->interp, priv->imf_norm, priv->gsl_work[0],agb_masses[0], MAXMASS);
+    const double maxmassfrac = YieldTables.maxmassfrac;
 
     int64_t haswork = 0;
     /* First find the mass return as a fraction of the total mass and the age of the star.
@@ -470,9 +669,9 @@ metal_return_init(const ActiveParticles * act, Cosmology * CP, struct MetalRetur
         priv->StellarAges[slot] = atime_to_myr(CP, STARP(p_i).FormationTime, atime, priv->gsl_work[tid]);
         /* Note this takes care of units*/
         double initialmass = P[p_i].Mass + STARP(p_i).TotalMassReturned;
-        find_mass_bin_limits(&priv->LowDyingMass[slot], &priv->HighDyingMass[slot], STARP(p_i).LastEnrichmentMyr, priv->StellarAges[P[p_i].PI], STARP(p_i).Metallicity, priv->interp.lifetime_interp);
-
-        priv->MassReturn[slot] = initialmass * mass_yield(STARP(p_i).LastEnrichmentMyr, priv->StellarAges[P[p_i].PI], STARP(p_i).Metallicity, CP->HubbleParam, &priv->interp, priv->imf_norm, priv->gsl_work[tid],priv->LowDyingMass[slot], priv->HighDyingMass[slot]);
+        double massyield;
+        tabulated_yields(STARP(p_i).LastEnrichmentMyr, priv->StellarAges[slot], STARP(p_i).Metallicity, CP->HubbleParam, &massyield, NULL, NULL, &priv->LowDyingMass[slot], &priv->HighDyingMass[slot]);
+        priv->MassReturn[slot] = initialmass * massyield;
         //message(3, "Particle %d PI %d massgen %g mass %g initmass %g\n", p_i, P[p_i].PI, priv->MassReturn[P[p_i].PI], P[p_i].Mass, initialmass);
         /* Guard against making a zero mass particle and warn since this should not happen.*/
         if(STARP(p_i).TotalMassReturned + priv->MassReturn[slot] > initialmass * maxmassfrac) {
@@ -582,12 +781,12 @@ metal_return_copy(int place, TreeWalkQueryMetals * input, TreeWalk * tw)
     double InitialMass = P[place].Mass + STARP(place).TotalMassReturned;
     double dtmyrend = METALS_GET_PRIV(tw)->StellarAges[pi];
     double dtmyrstart = STARP(place).LastEnrichmentMyr;
-    int tid = omp_get_thread_num();
     /* This is the total mass returned from this stellar population this timestep. Note this is already in the desired units.*/
     input->MassGenerated = METALS_GET_PRIV(tw)->MassReturn[pi];
     /* This returns the total amount of metal produced this timestep, and also fills out MetalSpeciesGenerated, which is an
      * element by element table of the metal produced by dying stars this timestep.*/
-    double total_z_yield = metal_yield(dtmyrstart, dtmyrend, input->Metallicity, METALS_GET_PRIV(tw)->hub, &METALS_GET_PRIV(tw)->interp, input->MetalSpeciesGenerated, METALS_GET_PRIV(tw)->imf_norm, METALS_GET_PRIV(tw)->gsl_work[tid], METALS_GET_PRIV(tw)->LowDyingMass[pi], METALS_GET_PRIV(tw)->HighDyingMass[pi]);
+    double total_z_yield;
+    tabulated_yields(dtmyrstart, dtmyrend, input->Metallicity, METALS_GET_PRIV(tw)->hub, NULL, &total_z_yield, input->MetalSpeciesGenerated, NULL, NULL);
     /* The total metal returned is the metal created this timestep, plus the metal which was already in the mass returned by the dying stars.*/
     input->MetalGenerated = InitialMass * total_z_yield + STARP(place).Metallicity * input->MassGenerated;
     //message(3, "Particle %d PI %d z %g massgen %g metallicity %g\n", pi, P[pi].PI, total_z_yield, METALS_GET_PRIV(tw)->MassReturn[pi], STARP(place).Metallicity);
@@ -35,7 +35,6 @@ struct MetalReturnPriv {
     double MaxGasMass;
     Cosmology *CP;
     MyFloat * StarVolumeSPH;
-    struct interps interp;
     struct SpinLocks * spin;
 };
 
@@ -44,6 +43,16 @@ void metal_return(const ActiveParticles * act, const ForceTree * const tree, Cos
 
 void set_metal_return_params(ParameterSet * ps);
 
+/* Build the scale factor to time spline and the cumulative yield tables. Call once at startup.*/
+void init_metal_return(Cosmology * CP, const double TimeMax);
+
+/* Compute the total mass yield of a star between two ages by integrating the IMF over the stars dying between masslow and masshigh.*/
+double mass_yield(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, struct interps * interp, double imf_norm, gsl_integration_workspace * gsl_work, double masslow, double masshigh);
+
+/* Compute the mass, metal and species yields of a star between two ages from the tables built by init_metal_return,
+ * including Sn1a. masslow and masshigh are set to the mass range of the stars which died. Any output may be NULL.*/
+void tabulated_yields(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, double * MassYield, double * MetalYield, MyFloat * MetalYields, MyFloat * masslow, MyFloat * masshigh);
+
 /* Initialise the metal private structure, finding mass return.*/
 int64_t metal_return_init(const ActiveParticles * act, Cosmology * CP, struct MetalReturnPriv * priv, const double atime);
 /* Free memory allocated in metal_return_init*/
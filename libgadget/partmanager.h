@@ -6,9 +6,20 @@
 
 /*! This structure holds all the information that is
  * stored for each particle of the simulation.
+ * The fields are grouped by how often they are touched, so that the
+ * loops which read only a few of them do not stream the whole record:
+ * - hot: read for every neighbour in the tree walks and by the tree build.
+ *   These are the first 56 bytes, so reading them touches at most two cache lines.
+ * - warm: read by the kicks and the drift.
+ * - cold: everything else.
+ * Keep new fields in the cold section unless a hot loop needs them.
+ * Only the order changes: there is no separate array of hot fields. The exchange and
+ * slots_gc move whole records and petaio reads and writes the fields by name,
+ * so they are unaffected by the order.
  */
 struct particle_data
 {
+    /* Hot */
     double Pos[3];   /*!< particle position at its current time */
     float Mass;     /*!< particle mass */
 
@@ -35,13 +46,27 @@ struct particle_data
                         points to the corresponding structure in (SPH|BH|STAR)P array.*/
     inttime_t Ti_drift;       /*!< current time of the particle position. The same for all particles. */
 
-    MyIDType ID;
+    MyFloat Hsml;
 
+    /* Union these two because they are transients: they are hard to move
+     * to private arrays because they need to travel with the particle during exchange*/
+    union {
+        /* The peano key is a hash of the position used in the domain decomposition.
+         * It is slow to generate so we store it here.*/
+        peano_t Key; /* only by domain.c and force_tree_rebuild */
+        /* FOF Group number: only has meaning during FOF.*/
+        int64_t GrNr;
+    };
+
+    /* Warm */
     MyFloat Vel[3];   /* particle velocity at its current time */
     MyFloat GravAccel[3];  /* particle acceleration due to short-range gravity */
 
     MyFloat GravPM[3];		/* particle acceleration due to long-range PM gravity force */
 
+    /* Cold */
+    MyIDType ID;
+
     MyFloat Potential;		/* gravitational potential. This is the total potential after gravtree+gravpm is called. */
 
     /* DtHsml is 1/3 DivVel * Hsml evaluated at the last active timestep for this particle.
@@ -56,18 +81,6 @@ struct particle_data
          * so it is safe to union with DtHsml.*/
         int TargetTask;
     };
-    MyFloat Hsml;
-
-    /* Union these two because they are transients: they are hard to move
-     * to private arrays because they need to travel with the particle during exchange*/
-    union {
-        /* The peano key is a hash of the position used in the domain decomposition.
-         * It is slow to generate so we store it here.*/
-        peano_t Key; /* only by domain.c and force_tree_rebuild */
-        /* FOF Group number: only has meaning during FOF.*/
-        int64_t GrNr;
-    };
-
 };
 
 extern struct part_manager_type {
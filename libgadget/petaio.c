@@ -5,6 +5,7 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include <bigfile-mpi.h>
 
@@ -41,6 +42,18 @@ static struct petaio_params {
      * and v / sqrt(a) = sqrt(a) dx/dt in the ICs. Note that snapshots never match Gadget-2, which
      * saves physical peculiar velocity / sqrt(a) in both ICs and snapshots. */
     int UsePeculiarVelocity;
+    int AsyncWrite;        /* Pack snapshots into a staging arena and write them from a background thread. */
+    int LosslessCompression; /* Compress integer blocks with the lossless lz4 codec. */
+    double PositionTolerance; /* If > 0, quantize Position to this absolute error. */
+    double VelocityTolerance; /* If > 0, quantize Velocity to this absolute error. */
+    int RestartUseSnapshotDomain; /* On restart, read particles in the saved domain layout if the number of tasks matches. */
+    int ConcurrentBlocks; /* Max number of writer groups writing different small blocks at the same time. */
+    int IndexChunkSize; /* Number of particles per chunk of the spatial index of a snapshot. 0 disables the index. */
+    /* The lite snapshot stream*/
+    double LiteSampleFraction; /* Fraction of particles in the lite snapshots, chosen by ID.*/
+    int LiteTypes; /* Bitmask of the particle types in the lite snapshots.*/
+    char LiteBlocks[256]; /* Comma separated list of blocks in the lite snapshots.*/
+    int LiteSinglePrecision; /* Store double precision blocks in single precision.*/
 } IO;
 
 /*Set the IO parameters*/
@@ -57,7 +70,17 @@ set_petaio_params(ParameterSet * ps)
         IO.WritersPerFile = param_get_int(ps, "WritersPerFile");
         IO.AggregatedIOThreshold = param_get_int(ps, "AggregatedIOThreshold");
         IO.EnableAggregatedIO = param_get_int(ps, "EnableAggregatedIO");
-
+        IO.AsyncWrite = param_get_int(ps, "SnapshotAsyncWrite");
+        IO.LosslessCompression = param_get_int(ps, "SnapshotLosslessCompression");
+        IO.PositionTolerance = param_get_double(ps, "SnapshotPositionTolerance");
+        IO.VelocityTolerance = param_get_double(ps, "SnapshotVelocityTolerance");
+        IO.RestartUseSnapshotDomain = param_get_int(ps, "RestartUseSnapshotDomain");
+        IO.ConcurrentBlocks = param_get_int(ps, "SnapshotConcurrentBlocks");
+        IO.IndexChunkSize = param_get_int(ps, "SnapshotIndexChunkSize");
+        IO.LiteSampleFraction = param_get_double(ps, "LiteSampleFraction");
+        IO.LiteTypes = param_get_int(ps, "LiteParticleTypes");
+        param_get_string2(ps, "LiteBlocks", IO.LiteBlocks, sizeof(IO.LiteBlocks));
+        IO.LiteSinglePrecision = param_get_int(ps, "LiteSinglePrecision");
     }
     MPI_Bcast(&IO, sizeof(struct petaio_params), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
@@ -82,10 +105,26 @@ void petaio_init(void) {
     }
     if(IO.NumWriters == 0)
         MPI_Comm_size(MPI_COMM_WORLD, &IO.NumWriters);
+    /* The background writer makes MPI calls concurrently with the main thread.*/
+    if(IO.AsyncWrite) {
+        int provided;
+        MPI_Query_thread(&provided);
+        if(provided < MPI_THREAD_MULTIPLE) {
+            message(0, "MPI does not provide MPI_THREAD_MULTIPLE (%d): asynchronous snapshot writing is disabled.\n", provided);
+            IO.AsyncWrite = 0;
+        }
+        else
+            message(0, "Asynchronous snapshot writing is enabled.\n");
+    }
 }
 
 /* save a snapshot file */
-static void petaio_save_internal(char * fname, struct IOTable * IOTable, int verbose);
+static void petaio_save_internal(char * fname, struct IOTable * IOTable, const DomainDecomp * ddecomp, int verbose);
+static void petaio_save_block_comm(BigFile * bf, char * blockname, BigArray * array, const char * codec, int verbose, MPI_Comm Comm);
+static int petaio_save_async(char * fname, struct IOTable * IOTable, const DomainDecomp * ddecomp, int verbose);
+static void petaio_save_domain(BigFile * bf, const DomainDecomp * ddecomp, const int * ptype_count);
+static void petaio_save_particle_block(BigFile * bf, IOTableEntry * ent, const int * selection, const int * ptype_offset, const int * ptype_count, int verbose);
+static int petaio_build_view(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager);
 
 void
 petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...)
@@ -97,7 +136,297 @@ petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...
     va_end(va);
     message(0, "saving snapshot into %s\n", fname);
 
-    petaio_save_internal(fname, IOTable, verbose);
+    petaio_save_internal(fname, IOTable, NULL, verbose);
+    myfree(fname);
+}
+
+int
+petaio_save_snapshot_async(struct IOTable * IOTable, const DomainDecomp * ddecomp, int verbose, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+
+    char * fname = fastpm_strdup_vprintf(fmt, va);
+    va_end(va);
+
+    /* Only one snapshot may be in flight at a time*/
+    petaio_async_wait();
+
+    int async = IO.AsyncWrite && petaio_save_async(fname, IOTable, ddecomp, verbose);
+    if(!async) {
+        message(0, "saving snapshot into %s\n", fname);
+        petaio_save_internal(fname, IOTable, ddecomp, verbose);
+    }
+    myfree(fname);
+    return async;
+}
+
+/* Lite snapshots: a high cadence stream of a subsample of the particles, with a few blocks,
+ * appended to one bigfile for all epochs. Each block grows by new files at every epoch,
+ * so an output adds no directories. Epoch/Time and Epoch/NumPart have one row per epoch,
+ * and the rows of epoch n in %d/Block start after the particles of type %d in the epochs before it.
+ * A restart from an earlier snapshot writes the epochs after it again, so they are first removed by petaio_truncate_lite.*/
+
+/* Select the particles of the lite stream. The subsample is by a hash of the ID,
+ * so that the same particles are in every epoch.*/
+static int
+petaio_lite_select(int i, const struct particle_data * Parts)
+{
+    if(!((1 << Parts[i].Type) & IO.LiteTypes))
+        return 0;
+    if(IO.LiteSampleFraction >= 1)
+        return 1;
+    /* splitmix64 finalizer*/
+    uint64_t h = Parts[i].ID + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h < IO.LiteSampleFraction * 18446744073709551616.0;
+}
+
+/* Is the block name in the comma separated list LiteBlocks?*/
+static int
+petaio_lite_has_block(const char * name)
+{
+    const char * p = IO.LiteBlocks;
+    const size_t len = strlen(name);
+    while(*p) {
+        while(*p == ',' || *p == ' ')
+            p++;
+        const size_t n = strcspn(p, ", ");
+        if(n == len && 0 == strncmp(p, name, len))
+            return 1;
+        p += n;
+    }
+    return 0;
+}
+
+/* Append array to the end of a block, creating it with dtype if it does not exist.
+ * Returns the number of rows in the block before this call.*/
+int64_t
+petaio_append_block(BigFile * bf, const char * blockname, BigArray * array, const char * dtype, MPI_Comm Comm)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+
+    int64_t localsize = array->dims[0];
+    int64_t size = 0, oldsize = 0;
+    MPI_Allreduce(&localsize, &size, 1, MPI_INT64, MPI_SUM, Comm);
+    const int64_t rowsize = big_file_dtype_itemsize(dtype) * array->dims[1];
+    /* An epoch with no particles adds no files*/
+    const int NumFiles = (size * rowsize + IO.BytesPerFile - 1) / IO.BytesPerFile;
+
+    if(0 == big_file_mpi_open_block(bf, &bb, blockname, Comm)) {
+        oldsize = bb.size;
+        if(NumFiles > 0 && 0 != big_block_mpi_grow_simple(&bb, NumFiles, size, Comm)) {
+            endrun(0, "Failed to grow block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+        }
+    }
+    else if(0 != big_file_mpi_create_block(bf, &bb, blockname, dtype, array->dims[1], NumFiles, size, Comm)) {
+        endrun(0, "Failed to create block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+    if(0 != big_block_seek(&bb, &ptr, oldsize)) {
+        endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_write(&bb, &ptr, array, IO.NumWriters, Comm)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bb, Comm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+    return oldsize;
+}
+
+/* Keep the first nrows rows of a block, rewriting them spread evenly over the tasks. Collective.*/
+static void
+petaio_truncate_block(BigFile * bf, const char * blockname, const int64_t nrows)
+{
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open block at %s:%s\n", blockname,
+                big_file_get_error_message());
+    }
+    char dtype[8];
+    strncpy(dtype, bb.dtype, sizeof(dtype));
+    const int nmemb = bb.nmemb;
+    const int64_t size = bb.size;
+    big_block_mpi_close(&bb, MPI_COMM_WORLD);
+    if(size <= nrows)
+        return;
+
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int64_t nlocal = nrows * (ThisTask + 1) / NTask - nrows * ThisTask / NTask;
+    char * data = mymalloc("TruncateBlock", nlocal * big_file_dtype_itemsize(dtype) * nmemb + 1);
+    BigArray array = {0};
+    big_array_init(&array, data, dtype, 2, (size_t []){nlocal, nmemb}, NULL);
+    petaio_read_block(bf, (char *) blockname, &array, 1);
+    petaio_save_block(bf, (char *) blockname, &array, 0);
+    myfree(data);
+}
+
+static int
+petaio_cmp_blockname(const void * a, const void * b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+void
+petaio_truncate_lite(const double Time, const char * fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    char * fname = fastpm_strdup_vprintf(fmt, va);
+    va_end(va);
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    BigFile bf = {0};
+    BigBlock bb;
+    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD)) {
+        myfree(fname);
+        return;
+    }
+    if(0 != big_file_mpi_open_block(&bf, &bb, "Epoch/Time", MPI_COMM_WORLD)) {
+        big_file_mpi_close(&bf, MPI_COMM_WORLD);
+        myfree(fname);
+        return;
+    }
+    const int64_t NEpoch = bb.size;
+    double BoxSize = 0, SampleFraction = 0;
+    int UsePeculiarVelocity = 0;
+    if(0 != big_block_get_attr(&bb, "BoxSize", &BoxSize, "f8", 1) ||
+       0 != big_block_get_attr(&bb, "SampleFraction", &SampleFraction, "f8", 1) ||
+       0 != big_block_get_attr(&bb, "UsePeculiarVelocity", &UsePeculiarVelocity, "i4", 1)) {
+        endrun(0, "Failed to read lite snapshot attributes: %s\n", big_file_get_error_message());
+    }
+    big_block_mpi_close(&bb, MPI_COMM_WORLD);
+
+    /* The epoch table is small, so task 0 reads it and finds the rows of each type to keep.
+     * The epochs are in time order.*/
+    const int64_t nread = ThisTask == 0 ? NEpoch : 0;
+    double * Times = mymalloc("LiteTimes", nread * (sizeof(double) + 6 * sizeof(int64_t)) + 1);
+    int64_t * NumPart = (int64_t *) (Times + nread);
+    BigArray array = {0};
+    big_array_init(&array, Times, "f8", 2, (size_t []){nread, 1}, NULL);
+    petaio_read_block(&bf, "Epoch/Time", &array, 1);
+    big_array_init(&array, NumPart, "i8", 2, (size_t []){nread, 6}, NULL);
+    petaio_read_block(&bf, "Epoch/NumPart", &array, 1);
+    int64_t NKeep[7] = {0};
+    int64_t i;
+    int ptype;
+    for(i = 0; i < nread && Times[i] <= Time; i++) {
+        for(ptype = 0; ptype < 6; ptype++)
+            NKeep[ptype] += NumPart[6 * i + ptype];
+        NKeep[6]++;
+    }
+    myfree(Times);
+    MPI_Bcast(NKeep, 7, MPI_INT64, 0, MPI_COMM_WORLD);
+
+    if(NKeep[6] < NEpoch) {
+        message(0, "Removing %ld lite snapshot epochs after a = %g from %s\n", NEpoch - NKeep[6], Time, fname);
+        /* Sorted, so every task truncates the blocks in the same order*/
+        char ** blocknames;
+        int nblocks, b;
+        big_file_list(&bf, &blocknames, &nblocks);
+        qsort(blocknames, nblocks, sizeof(char *), petaio_cmp_blockname);
+        for(b = 0; b < nblocks; b++) {
+            if(1 == sscanf(blocknames[b], "%d/", &ptype) && ptype >= 0 && ptype < 6)
+                petaio_truncate_block(&bf, blocknames[b], NKeep[ptype]);
+            free(blocknames[b]);
+        }
+        free(blocknames);
+        petaio_truncate_block(&bf, "Epoch/NumPart", NKeep[6]);
+        petaio_truncate_block(&bf, "Epoch/Time", NKeep[6]);
+        /* Rewriting the block dropped its attributes*/
+        if(0 != big_file_mpi_open_block(&bf, &bb, "Epoch/Time", MPI_COMM_WORLD) ||
+           0 != big_block_set_attr(&bb, "BoxSize", &BoxSize, "f8", 1) ||
+           0 != big_block_set_attr(&bb, "SampleFraction", &SampleFraction, "f8", 1) ||
+           0 != big_block_set_attr(&bb, "UsePeculiarVelocity", &UsePeculiarVelocity, "i4", 1) ||
+           0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to write lite snapshot attributes: %s\n", big_file_get_error_message());
+        }
+    }
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close lite snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    myfree(fname);
+}
+
+void
+petaio_save_lite(struct IOTable * IOTable, const double Time, const char * fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    char * fname = fastpm_strdup_vprintf(fmt, va);
+    va_end(va);
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD) &&
+       0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open lite snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    int ptype_offset[6]={0};
+    int ptype_count[6]={0};
+    int64_t NTotal[6]={0};
+
+    int * selection = mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, petaio_lite_select);
+    sumup_large_ints(6, ptype_count, NTotal);
+
+    message(0, "Appending %td particles at a = %g to lite snapshot %s\n", NTotal[0] + NTotal[1] + NTotal[2] + NTotal[3] + NTotal[4] + NTotal[5], Time, fname);
+
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        const int ptype = ent->ptype;
+        if(!(ptype < 6 && ptype >= 0) || !((1 << ptype) & IO.LiteTypes) || !petaio_lite_has_block(ent->name))
+            continue;
+        char blockname[128];
+        BigArray array = {0};
+        snprintf(blockname, sizeof(blockname), "%d/%s", ptype, ent->name);
+        petaio_build_buffer(&array, ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+        /* bigfile converts the buffer to the dtype of the block*/
+        const char * dtype = ent->dtype;
+        if(IO.LiteSinglePrecision && 0 == strcmp(dtype, "f8"))
+            dtype = "f4";
+        petaio_append_block(&bf, blockname, &array, dtype, MPI_COMM_WORLD);
+        petaio_destroy_buffer(&array);
+    }
+    myfree(selection);
+
+    /* The epoch table has a row for each epoch, written by task 0*/
+    double Times[1] = {Time};
+    BigArray array = {0};
+    big_array_init(&array, Times, "f8", 2, (size_t []){ThisTask == 0, 1}, NULL);
+    if(0 == petaio_append_block(&bf, "Epoch/Time", &array, "f8", MPI_COMM_WORLD)) {
+        BigBlock bb;
+        if(0 != big_file_mpi_open_block(&bf, &bb, "Epoch/Time", MPI_COMM_WORLD) ||
+           0 != big_block_set_attr(&bb, "BoxSize", &All.BoxSize, "f8", 1) ||
+           0 != big_block_set_attr(&bb, "SampleFraction", &IO.LiteSampleFraction, "f8", 1) ||
+           0 != big_block_set_attr(&bb, "UsePeculiarVelocity", &IO.UsePeculiarVelocity, "i4", 1) ||
+           0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to write lite snapshot attributes: %s\n", big_file_get_error_message());
+        }
+    }
+    big_array_init(&array, NTotal, "i8", 2, (size_t []){ThisTask == 0, 6}, NULL);
+    petaio_append_block(&bf, "Epoch/NumPart", &array, "i8", MPI_COMM_WORLD);
+
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close lite snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
     myfree(fname);
 }
 
@@ -150,7 +479,7 @@ petaio_build_selection(int * selection,
     }
 }
 
-static void petaio_save_internal(char * fname, struct IOTable * IOTable, int verbose) {
+static void petaio_save_internal(char * fname, struct IOTable * IOTable, const DomainDecomp * ddecomp, int verbose) {
     BigFile bf = {0};
     if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
         endrun(0, "Failed to create snapshot at %s:%s\n", fname,
@@ -169,22 +498,32 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
 
     petaio_write_header(&bf, NTotal);
 
-    int i;
+    if(ddecomp)
+        petaio_save_domain(&bf, ddecomp, ptype_count);
+
+    petaio_save_index(&bf, selection, ptype_offset, ptype_count, IO.IndexChunkSize);
+
+    /* only process the particle blocks */
+    int * blocks = ta_malloc("Blocks", int, IOTable->used);
+    int i, nblocks = 0;
     for(i = 0; i < IOTable->used; i ++) {
-        /* only process the particle blocks */
-        char blockname[128];
         int ptype = IOTable->ent[i].ptype;
-        BigArray array = {0};
         /*This exclude FOF blocks*/
-        if(!(ptype < 6 && ptype >= 0)) {
-            continue;
-        }
-        sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
-        petaio_build_buffer(&array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
-        petaio_save_block(&bf, blockname, &array, verbose);
-        petaio_destroy_buffer(&array);
+        if(ptype < 6 && ptype >= 0)
+            blocks[nblocks++] = i;
     }
 
+    i = 0;
+    while(i < nblocks) {
+        int nbatch = petaio_plan_batch(IOTable, blocks + i, nblocks - i, ptype_count);
+        if(nbatch > 1)
+            petaio_save_batch(&bf, IOTable, blocks + i, nbatch, selection, ptype_offset, ptype_count, verbose);
+        else
+            petaio_save_particle_block(&bf, &IOTable->ent[blocks[i]], selection, ptype_offset, ptype_count, verbose);
+        i += nbatch;
+    }
+    ta_free(blocks);
+
     if(All.MassiveNuLinRespOn) {
         int ThisTask;
         MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
@@ -198,7 +537,418 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
     myfree(selection);
 }
 
-void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Comm Comm) {
+/* Write one particle block with all ranks.*/
+static void
+petaio_save_particle_block(BigFile * bf, IOTableEntry * ent, const int * selection, const int * ptype_offset, const int * ptype_count, int verbose)
+{
+    char blockname[128];
+    const int ptype = ent->ptype;
+    BigArray array = {0};
+    sprintf(blockname, "%d/%s", ptype, ent->name);
+    /* Plain fields of consecutive particles are written in place*/
+    const int isview = petaio_build_view(&array, ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+    if(!isview)
+        petaio_build_buffer(&array, ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+    petaio_save_block_comm(bf, blockname, &array, ent->codec, verbose, MPI_COMM_WORLD);
+    if(!isview)
+        petaio_destroy_buffer(&array);
+}
+
+/* Decide how many of the next blocks are written together by petaio_save_batch.
+ * A batch holds the packed buffers of all its blocks, plus the copies received by the
+ * writer groups, and must fit in half of the free memory on every rank.
+ * Blocks larger than a file are bandwidth rather than latency bound, and are written
+ * alone by all ranks as before. Returns the batch size, which is 1 if the blocks are written one at a time.*/
+int
+petaio_plan_batch(struct IOTable * IOTable, const int * blocks, const int nblocks, const int * ptype_count)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int NGroup = IO.ConcurrentBlocks < NTask ? IO.ConcurrentBlocks : NTask;
+    if(NGroup <= 1 || nblocks <= 1)
+        return 1;
+
+    int64_t * maxlocal = ta_malloc("maxlocal", int64_t, 2 * nblocks);
+    int64_t * total = maxlocal + nblocks;
+    int b;
+    for(b = 0; b < nblocks; b++) {
+        IOTableEntry * ent = &IOTable->ent[blocks[b]];
+        maxlocal[b] = (int64_t) ptype_count[ent->ptype] * dtype_itemsize(ent->dtype) * ent->items;
+        total[b] = maxlocal[b];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, maxlocal, nblocks, MPI_INT64, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, total, nblocks, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+
+    int64_t budget = mymalloc_freebytes() / 2;
+    MPI_Allreduce(MPI_IN_PLACE, &budget, 1, MPI_INT64, MPI_MIN, MPI_COMM_WORLD);
+
+    int64_t used = 0;
+    for(b = 0; b < nblocks; b++) {
+        if(total[b] > (int64_t) IO.BytesPerFile)
+            break;
+        /* The sent buffer, and the share of the block received by a group, with slack for imbalance*/
+        used += 2 * maxlocal[b] + total[b] * NGroup / NTask + 8192;
+        if(used > budget)
+            break;
+    }
+    ta_free(maxlocal);
+    return b > 1 ? b : 1;
+}
+
+/* The MPI type of the first nrows rows of array, at their address in memory*/
+static MPI_Datatype
+petaio_rows_type(const BigArray * array, const int64_t nrows)
+{
+    MPI_Datatype type;
+    MPI_Type_create_hvector(nrows, array->dims[1] * array->strides[1], array->strides[0], MPI_BYTE, &type);
+    return type;
+}
+
+/* Combine the row types of several blocks at absolute addresses into one type, for use with MPI_BOTTOM.
+ * The component types are freed.*/
+static MPI_Datatype
+petaio_struct_type(const int n, MPI_Aint * addr, MPI_Datatype * types)
+{
+    MPI_Datatype type;
+    int * ones = ta_malloc("ones", int, n);
+    int k;
+    for(k = 0; k < n; k++)
+        ones[k] = 1;
+    MPI_Type_create_struct(n, ones, addr, types, &type);
+    MPI_Type_commit(&type);
+    for(k = 0; k < n; k++)
+        MPI_Type_free(&types[k]);
+    ta_free(ones);
+    return type;
+}
+
+/* First rank of writer group g, for NGroup groups of contiguous ranks*/
+static inline int
+petaio_group_start(const int g, const int NGroup, const int NTask)
+{
+    return (int64_t) g * NTask / NGroup;
+}
+
+/* Write several small particle blocks at once. The ranks are split into contiguous
+ * writer groups and each block is sent to, then created, written and closed by, one group.
+ * The file system latency of blocks in different groups then overlaps, instead of
+ * every block waiting for the one before it. Blocks go largest first to the least loaded group,
+ * so that the groups finish together. Each group member receives the rows of a contiguous
+ * range of ranks, so the rows of a block keep their order in the file.*/
+void
+petaio_save_batch(BigFile * bf, struct IOTable * IOTable, const int * blocks, const int nblocks,
+        const int * selection, const int * ptype_offset, const int * ptype_count, int verbose)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    int NGroup = IO.ConcurrentBlocks < NTask ? IO.ConcurrentBlocks : NTask;
+    if(NGroup > nblocks)
+        NGroup = nblocks;
+
+    if(verbose)
+        message(0, "Writing %d blocks concurrently with %d writer groups.\n", nblocks, NGroup);
+
+    /* Rows of each block on each rank: rows[task * nblocks + b]*/
+    int64_t * rows = mymalloc2("BatchRows", sizeof(int64_t) * NTask * nblocks);
+    int64_t * bytes = ta_malloc("BlockBytes", int64_t, nblocks + NGroup);
+    int64_t * load = bytes + nblocks;
+    int * group = ta_malloc("BlockGroup", int, 2 * nblocks);
+    int * order = group + nblocks;
+    int b, g, k, s;
+    for(b = 0; b < nblocks; b++)
+        rows[(size_t) ThisTask * nblocks + b] = ptype_count[IOTable->ent[blocks[b]].ptype];
+    MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, rows, nblocks, MPI_INT64, MPI_COMM_WORLD);
+
+    for(b = 0; b < nblocks; b++) {
+        IOTableEntry * ent = &IOTable->ent[blocks[b]];
+        /* Every block also costs a fixed latency, whatever its size*/
+        bytes[b] = 65536;
+        for(s = 0; s < NTask; s++)
+            bytes[b] += rows[(size_t) s * nblocks + b] * dtype_itemsize(ent->dtype) * ent->items;
+        order[b] = b;
+    }
+    /* Largest first; insertion sort is stable and the batches are short.*/
+    for(b = 1; b < nblocks; b++) {
+        const int o = order[b];
+        for(k = b; k > 0 && bytes[order[k-1]] < bytes[o]; k--)
+            order[k] = order[k-1];
+        order[k] = o;
+    }
+    for(g = 0; g < NGroup; g++)
+        load[g] = 0;
+    for(k = 0; k < nblocks; k++) {
+        int best = 0;
+        for(g = 1; g < NGroup; g++)
+            if(load[g] < load[best])
+                best = g;
+        group[order[k]] = best;
+        load[best] += bytes[order[k]];
+    }
+
+    int MyGroup = 0;
+    while(MyGroup + 1 < NGroup && petaio_group_start(MyGroup + 1, NGroup, NTask) <= ThisTask)
+        MyGroup++;
+    const int MyStart = petaio_group_start(MyGroup, NGroup, NTask);
+    const int MySize = petaio_group_start(MyGroup + 1, NGroup, NTask) - MyStart;
+
+    /* Pack the local rows of every block*/
+    BigArray * send = ta_malloc("SendArrays", BigArray, 2 * nblocks);
+    BigArray * recv = send + nblocks;
+    int * isview = ta_malloc("IsView", int, nblocks);
+    for(b = 0; b < nblocks; b++) {
+        IOTableEntry * ent = &IOTable->ent[blocks[b]];
+        const int ptype = ent->ptype;
+        memset(&send[b], 0, sizeof(BigArray));
+        isview[b] = petaio_build_view(&send[b], ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+        if(!isview[b])
+            petaio_build_buffer(&send[b], ent, selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+    }
+    /* Space for the rows this rank receives of the blocks of its group*/
+    for(b = 0; b < nblocks; b++) {
+        memset(&recv[b], 0, sizeof(BigArray));
+        if(group[b] != MyGroup)
+            continue;
+        int64_t nrecv = 0;
+        for(s = 0; s < NTask; s++)
+            if((int64_t) s * MySize / NTask == ThisTask - MyStart)
+                nrecv += rows[(size_t) s * nblocks + b];
+        petaio_alloc_buffer(&recv[b], &IOTable->ent[blocks[b]], nrecv);
+    }
+
+    /* One exchange for the whole batch: each rank sends its rows of the blocks of group g
+     * to one member of g, described by a struct type of all the blocks at once.*/
+    MPI_Datatype * sendtypes = ta_malloc("SendTypes", MPI_Datatype, 2 * NTask);
+    MPI_Datatype * recvtypes = sendtypes + NTask;
+    int * sendcounts = ta_malloc("SendCounts", int, 3 * NTask);
+    int * recvcounts = sendcounts + NTask;
+    int * displs = sendcounts + 2 * NTask;
+    MPI_Aint * addr = ta_malloc("Addr", MPI_Aint, nblocks);
+    MPI_Datatype * types = ta_malloc("Types", MPI_Datatype, nblocks);
+    int64_t * recvd = ta_malloc("Received", int64_t, nblocks);
+    for(s = 0; s < NTask; s++) {
+        sendtypes[s] = recvtypes[s] = MPI_BYTE;
+        sendcounts[s] = recvcounts[s] = displs[s] = 0;
+    }
+    for(g = 0; g < NGroup; g++) {
+        const int start = petaio_group_start(g, NGroup, NTask);
+        const int dest = start + (int64_t) ThisTask * (petaio_group_start(g + 1, NGroup, NTask) - start) / NTask;
+        int n = 0;
+        for(b = 0; b < nblocks; b++) {
+            const int64_t nrows = rows[(size_t) ThisTask * nblocks + b];
+            if(group[b] != g || nrows == 0)
+                continue;
+            types[n] = petaio_rows_type(&send[b], nrows);
+            MPI_Get_address(send[b].data, &addr[n]);
+            n++;
+        }
+        if(n > 0) {
+            sendtypes[dest] = petaio_struct_type(n, addr, types);
+            sendcounts[dest] = 1;
+        }
+    }
+    for(b = 0; b < nblocks; b++)
+        recvd[b] = 0;
+    for(s = 0; s < NTask; s++) {
+        if((int64_t) s * MySize / NTask != ThisTask - MyStart)
+            continue;
+        int n = 0;
+        for(b = 0; b < nblocks; b++) {
+            const int64_t nrows = rows[(size_t) s * nblocks + b];
+            if(group[b] != MyGroup || nrows == 0)
+                continue;
+            types[n] = petaio_rows_type(&recv[b], nrows);
+            MPI_Get_address((char *) recv[b].data + recvd[b] * recv[b].strides[0], &addr[n]);
+            recvd[b] += nrows;
+            n++;
+        }
+        if(n > 0) {
+            recvtypes[s] = petaio_struct_type(n, addr, types);
+            recvcounts[s] = 1;
+        }
+    }
+    MPI_Alltoallw(MPI_BOTTOM, sendcounts, displs, sendtypes, MPI_BOTTOM, recvcounts, displs, recvtypes, MPI_COMM_WORLD);
+    for(s = 0; s < NTask; s++) {
+        if(sendcounts[s])
+            MPI_Type_free(&sendtypes[s]);
+        if(recvcounts[s])
+            MPI_Type_free(&recvtypes[s]);
+    }
+    ta_free(recvd);
+    ta_free(types);
+    ta_free(addr);
+    ta_free(sendcounts);
+    ta_free(sendtypes);
+
+    /* Each group writes its own blocks, largest first.*/
+    MPI_Comm GroupComm;
+    MPI_Comm_split(MPI_COMM_WORLD, MyGroup, ThisTask, &GroupComm);
+    for(k = 0; k < nblocks; k++) {
+        b = order[k];
+        if(group[b] != MyGroup)
+            continue;
+        IOTableEntry * ent = &IOTable->ent[blocks[b]];
+        char blockname[128];
+        sprintf(blockname, "%d/%s", ent->ptype, ent->name);
+        petaio_save_block_comm(bf, blockname, &recv[b], ent->codec, verbose, GroupComm);
+    }
+    MPI_Comm_free(&GroupComm);
+
+    for(b = nblocks - 1; b >= 0; b--)
+        if(group[b] == MyGroup)
+            petaio_destroy_buffer(&recv[b]);
+    for(b = nblocks - 1; b >= 0; b--)
+        if(!isview[b])
+            petaio_destroy_buffer(&send[b]);
+    ta_free(isview);
+    ta_free(send);
+    ta_free(group);
+    ta_free(bytes);
+    myfree(rows);
+}
+
+/* An asynchronous snapshot. The particle blocks are packed into a private staging arena
+ * outside of the main allocator, so that the simulation can continue (and
+ * use its memory stack as normal) while a background thread writes them
+ * using a duplicate of the world communicator.*/
+struct AsyncBlock {
+    char blockname[128];
+    char codec[32];
+    BigArray array;
+};
+
+static struct {
+    int pending;
+    pthread_t thread;
+    MPI_Comm Comm;
+    Allocator Arena[1];
+    BigFile bf;
+    char fname[4096];
+    int verbose;
+    int NBlocks;
+    struct AsyncBlock * Blocks;
+} AsyncIO;
+
+static void petaio_alloc_buffer_internal(BigArray * array, IOTableEntry * ent, int64_t localsize, Allocator * alloc);
+static void petaio_fill_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager);
+
+static void *
+petaio_async_writer(void * unused)
+{
+    int i;
+    for(i = 0; i < AsyncIO.NBlocks; i++) {
+        struct AsyncBlock * blk = &AsyncIO.Blocks[i];
+        petaio_save_block_comm(&AsyncIO.bf, blk->blockname, &blk->array, blk->codec, AsyncIO.verbose, AsyncIO.Comm);
+    }
+    if(0 != big_file_mpi_close(&AsyncIO.bf, AsyncIO.Comm)){
+        endrun(0, "Failed to close snapshot at %s:%s\n", AsyncIO.fname,
+                    big_file_get_error_message());
+    }
+    return NULL;
+}
+
+/* Pack the snapshot into the staging arena and start the background writer.
+ * Returns 0 without writing anything if the arena cannot be allocated on some rank.*/
+static int
+petaio_save_async(char * fname, struct IOTable * IOTable, const DomainDecomp * ddecomp, int verbose)
+{
+    int ptype_offset[6]={0};
+    int ptype_count[6]={0};
+    int64_t NTotal[6]={0};
+
+    int * selection = mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
+
+    /* Size the arena: every allocation is padded by up to two pages of alignment and header.*/
+    int i;
+    int NBlocks = 0;
+    size_t bytes = 0;
+    for(i = 0; i < IOTable->used; i ++) {
+        int ptype = IOTable->ent[i].ptype;
+        if(!(ptype < 6 && ptype >= 0))
+            continue;
+        bytes += (size_t) dtype_itemsize(IOTable->ent[i].dtype) * IOTable->ent[i].items * ptype_count[ptype] + 8192;
+        NBlocks ++;
+    }
+    bytes += NBlocks * sizeof(struct AsyncBlock) + 8192;
+
+    int fail = allocator_init(AsyncIO.Arena, "ASYNCIO", bytes, 0, NULL);
+    if(MPIU_Any(fail != 0, MPI_COMM_WORLD)) {
+        message(0, "Could not allocate %td bytes for asynchronous snapshot; writing synchronously.\n", bytes);
+        if(!fail)
+            allocator_destroy(AsyncIO.Arena);
+        myfree(selection);
+        return 0;
+    }
+
+    message(0, "saving snapshot asynchronously into %s\n", fname);
+
+    if(0 != big_file_mpi_create(&AsyncIO.bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    sumup_large_ints(6, ptype_count, NTotal);
+
+    /* The header, domain and neutrinos are small and depend on global state, so write them now.*/
+    petaio_write_header(&AsyncIO.bf, NTotal);
+
+    if(ddecomp)
+        petaio_save_domain(&AsyncIO.bf, ddecomp, ptype_count);
+
+    petaio_save_index(&AsyncIO.bf, selection, ptype_offset, ptype_count, IO.IndexChunkSize);
+
+    if(All.MassiveNuLinRespOn) {
+        int ThisTask;
+        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        petaio_save_neutrinos(&AsyncIO.bf, ThisTask);
+    }
+
+    AsyncIO.Blocks = allocator_alloc_bot(AsyncIO.Arena, "AsyncBlocks", NBlocks * sizeof(struct AsyncBlock));
+    AsyncIO.NBlocks = 0;
+    for(i = 0; i < IOTable->used; i ++) {
+        int ptype = IOTable->ent[i].ptype;
+        if(!(ptype < 6 && ptype >= 0))
+            continue;
+        struct AsyncBlock * blk = &AsyncIO.Blocks[AsyncIO.NBlocks++];
+        snprintf(blk->blockname, sizeof(blk->blockname), "%d/%s", ptype, IOTable->ent[i].name);
+        strncpy(blk->codec, IOTable->ent[i].codec, sizeof(blk->codec));
+        petaio_alloc_buffer_internal(&blk->array, &IOTable->ent[i], ptype_count[ptype], AsyncIO.Arena);
+        petaio_fill_buffer(&blk->array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+    }
+    myfree(selection);
+
+    strncpy(AsyncIO.fname, fname, sizeof(AsyncIO.fname)-1);
+    AsyncIO.fname[sizeof(AsyncIO.fname)-1] = '\0';
+    AsyncIO.verbose = verbose;
+    MPI_Comm_dup(MPI_COMM_WORLD, &AsyncIO.Comm);
+    if(0 != pthread_create(&AsyncIO.thread, NULL, petaio_async_writer, NULL))
+        endrun(1, "Failed to start asynchronous snapshot writer thread\n");
+    AsyncIO.pending = 1;
+    return 1;
+}
+
+int
+petaio_async_wait(void)
+{
+    if(!AsyncIO.pending)
+        return 0;
+    pthread_join(AsyncIO.thread, NULL);
+    MPI_Comm_free(&AsyncIO.Comm);
+    allocator_reset(AsyncIO.Arena, 0);
+    allocator_destroy(AsyncIO.Arena);
+    AsyncIO.pending = 0;
+    message(0, "Finished asynchronous write of snapshot %s\n", AsyncIO.fname);
+    return 1;
+}
+
+static int petaio_read_domain_layout(BigFile * bf, int64_t * NLocal, MPI_Comm Comm);
+
+/* Returns 1 if the particles were read in the domain layout saved in the snapshot. */
+static int
+petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Comm Comm) {
     int ptype;
     int i;
     BigFile bf = {0};
@@ -258,10 +1008,17 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
     particle_alloc_memory(MaxPart);
 
     int64_t NLocal[6];
+    /* On a restart with the same number of tasks, read each task's particles from the
+     * previous run, so that the saved domain can be reused. */
+    int restored = !ic && IO.RestartUseSnapshotDomain && petaio_read_domain_layout(&bf, NLocal, Comm);
+    if(!restored) {
+        for(ptype = 0; ptype < 6; ptype ++) {
+            int64_t start = ThisTask * NTotal[ptype] / NTask;
+            int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
+            NLocal[ptype] = end - start;
+        }
+    }
     for(ptype = 0; ptype < 6; ptype ++) {
-        int64_t start = ThisTask * NTotal[ptype] / NTask;
-        int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
-        NLocal[ptype] = end - start;
         PartManager->NumPart += NLocal[ptype];
     }
 
@@ -334,6 +1091,7 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
     }
     /* now we have IDs, set up the ID consistency between slots. */
     slots_setup_id(PartManager, SlotsManager);
+    return restored;
 }
 
 void
@@ -363,11 +1121,12 @@ petaio_read_header(int num)
     myfree(fname);
 }
 
-void
+int
 petaio_read_snapshot(int num, MPI_Comm Comm)
 {
     char * fname;
     struct IOTable IOTable = {0};
+    int restored = 0;
 
     register_io_blocks(&IOTable, 0);
 
@@ -404,9 +1163,10 @@ petaio_read_snapshot(int num, MPI_Comm Comm)
         /*
          * we always save the Entropy, init.c will not mess with the entropy
          * */
-        petaio_read_internal(fname, 0, &IOTable, Comm);
+        restored = petaio_read_internal(fname, 0, &IOTable, Comm);
     }
     myfree(fname);
+    return restored;
 }
 
 
@@ -570,7 +1330,9 @@ petaio_read_header_internal(BigFile * bf) {
     }
 }
 
-void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t localsize) {
+static void
+petaio_alloc_buffer_internal(BigArray * array, IOTableEntry * ent, int64_t localsize, Allocator * alloc)
+{
     size_t dims[2];
     ptrdiff_t strides[2];
     int elsize = dtype_itemsize(ent->dtype);
@@ -579,11 +1341,15 @@ void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t localsize
     dims[1] = ent->items;
     strides[1] = elsize;
     strides[0] = elsize * ent->items;
-    char * buffer = mymalloc("IOBUFFER", dims[0] * dims[1] * elsize);
+    char * buffer = allocator_alloc_bot(alloc, "IOBUFFER", dims[0] * dims[1] * elsize);
 
     big_array_init(array, buffer, ent->dtype, 2, dims, strides);
 }
 
+void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t localsize) {
+    petaio_alloc_buffer_internal(array, ent, localsize, A_MAIN);
+}
+
 /* readout array into P struct with setters */
 void petaio_readout_buffer(BigArray * array, IOTableEntry * ent) {
     int i;
@@ -609,11 +1375,43 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
     /* don't forget to free buffer after its done*/
     petaio_alloc_buffer(array, ent, NumSelection);
 
+    petaio_fill_buffer(array, ent, selection, NumSelection, Parts, SlotsManager);
+}
+
+/* Address of the field of ent for particle j. Only valid if ent->field_base != IO_FIELD_NONE. */
+static inline char *
+petaio_field_ptr(const IOTableEntry * ent, const int j, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    if(ent->field_base == IO_FIELD_SLOT)
+        return SlotsManager->info[ent->ptype].ptr + (size_t) Parts[j].PI * ent->field_stride + ent->field_offset;
+    return (char *) Parts + (size_t) j * ent->field_stride + ent->field_offset;
+}
+
+/* Fill an allocated IO buffer with the getter of ent, for the selected particles*/
+static void
+petaio_fill_buffer(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
     /* Fast code path if there are no such particles */
     if(NumSelection == 0) {
         return;
     }
 
+    /* Plain fields are a strided gather, no getter call per particle.*/
+    if(ent->field_base != IO_FIELD_NONE) {
+        const size_t rowsize = array->strides[0];
+        char * data = array->data;
+        int i;
+        #pragma omp parallel for
+        for(i = 0; i < NumSelection; i ++) {
+            const int j = selection[i];
+            if(Parts[j].Type != ent->ptype) {
+                endrun(2, "Selection %d has type = %d != %d\n", j, Parts[j].Type, ent->ptype);
+            }
+            memcpy(data + rowsize * i, petaio_field_ptr(ent, j, Parts, SlotsManager), rowsize);
+        }
+        return;
+    }
+
 #pragma omp parallel
     {
         int i;
@@ -635,6 +1433,37 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
     }
 }
 
+/* Make array a strided view straight into particle (or slot) memory, with no copy.
+ * This is possible if ent is a plain field and the selected particles are consecutive,
+ * which is the usual case after the particles are sorted by type.
+ * Returns 0 if a buffer must be built instead.*/
+static int
+petaio_build_view(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    if(ent->field_base == IO_FIELD_NONE || NumSelection == 0)
+        return 0;
+
+    int i;
+    int contiguous = 1;
+    const int first = selection[0];
+    const int firstPI = Parts[first].PI;
+    #pragma omp parallel for reduction(&: contiguous)
+    for(i = 0; i < NumSelection; i ++) {
+        const int j = selection[i];
+        if(j != first + i || Parts[j].Type != ent->ptype)
+            contiguous = 0;
+        else if(ent->field_base == IO_FIELD_SLOT && Parts[j].PI != firstPI + i)
+            contiguous = 0;
+    }
+    if(!contiguous)
+        return 0;
+
+    size_t dims[2] = {NumSelection, ent->items};
+    ptrdiff_t strides[2] = {ent->field_stride, dtype_itemsize(ent->dtype)};
+    big_array_init(array, petaio_field_ptr(ent, first, Parts, SlotsManager), ent->dtype, 2, dims, strides);
+    return 1;
+}
+
 /* destroy a buffer, freeing its memory */
 void petaio_destroy_buffer(BigArray * array) {
     myfree(array->data);
@@ -665,8 +1494,134 @@ int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int requ
     return 0;
 }
 
+/* Read a whole block of the index into a malloc'ed buffer. Returns the number of rows or -1.*/
+static int64_t
+petaio_read_index_block(BigFile * bf, const char * blockname, const char * dtype, const int nmemb, void ** buf)
+{
+    BigBlock bb;
+    BigBlockPtr ptr;
+    BigArray array = {0};
+    if(0 != big_file_open_block(bf, &bb, blockname))
+        return -1;
+    if(bb.nmemb != nmemb) {
+        big_block_close(&bb);
+        return -1;
+    }
+    const int64_t size = bb.size;
+    *buf = malloc(dtype_itemsize(dtype) * nmemb * size + 1);
+    big_array_init(&array, *buf, dtype, 2, (size_t []){size, nmemb}, NULL);
+    if(0 != big_block_seek(&bb, &ptr, 0) ||
+       0 != big_block_read(&bb, &ptr, &array)) {
+        big_block_close(&bb);
+        free(*buf);
+        return -1;
+    }
+    big_block_close(&bb);
+    return size;
+}
+
+/* Find the chunks of the index of type ptype that overlap the box or the key range, and return their rows.*/
+static int64_t
+petaio_index_find(BigFile * bf, int ptype, const double * BoxMin, const double * BoxMax, const peano_t KeyMin, const peano_t KeyMax, int64_t ** ranges)
+{
+    char blockname[128];
+    int64_t * Rows;
+    snprintf(blockname, sizeof(blockname), "%d/Index/Rows", ptype);
+    const int64_t NChunk = petaio_read_index_block(bf, blockname, "i8", 2, (void **) &Rows);
+    if(NChunk < 0)
+        return -1;
+
+    void * Bounds;
+    /* Keys or box of each chunk*/
+    snprintf(blockname, sizeof(blockname), BoxMin ? "%d/Index/Box" : "%d/Index/Keys", ptype);
+    if(NChunk != petaio_read_index_block(bf, blockname, BoxMin ? "f8" : "u8", BoxMin ? 6 : 2, &Bounds)) {
+        free(Rows);
+        return -1;
+    }
+
+    /* Rows are in order, so neighbouring chunks can be merged into one range.*/
+    int64_t * out = malloc(2 * sizeof(int64_t) * (NChunk + 1));
+    int64_t c, n = 0;
+    for(c = 0; c < NChunk; c++) {
+        int match = 1;
+        if(BoxMin) {
+            const double * box = (double *) Bounds + 6 * c;
+            int d;
+            for(d = 0; d < 3; d++)
+                if(box[d] > BoxMax[d] || box[3 + d] < BoxMin[d])
+                    match = 0;
+        } else {
+            const peano_t * keys = (peano_t *) Bounds + 2 * c;
+            if(keys[0] > KeyMax || keys[1] < KeyMin)
+                match = 0;
+        }
+        if(!match || Rows[2 * c + 1] == 0)
+            continue;
+        if(n > 0 && out[2 * (n-1)] + out[2 * (n-1) + 1] == Rows[2 * c]) {
+            out[2 * (n-1) + 1] += Rows[2 * c + 1];
+        } else {
+            out[2 * n] = Rows[2 * c];
+            out[2 * n + 1] = Rows[2 * c + 1];
+            n++;
+        }
+    }
+    free(Bounds);
+    free(Rows);
+    *ranges = out;
+    return n;
+}
+
+int64_t
+petaio_index_find_box(BigFile * bf, int ptype, const double BoxMin[3], const double BoxMax[3], int64_t ** ranges)
+{
+    return petaio_index_find(bf, ptype, BoxMin, BoxMax, 0, 0, ranges);
+}
+
+int64_t
+petaio_index_find_keys(BigFile * bf, int ptype, const peano_t KeyMin, const peano_t KeyMax, int64_t ** ranges)
+{
+    return petaio_index_find(bf, ptype, NULL, NULL, KeyMin, KeyMax, ranges);
+}
+
+int64_t
+petaio_read_ranges(BigFile * bf, const char * blockname, const int64_t * ranges, const int64_t nranges, BigArray * array)
+{
+    BigBlock bb;
+    if(0 != big_file_open_block(bf, &bb, blockname))
+        return -1;
+
+    int64_t i, NumRows = 0;
+    for(i = 0; i < nranges; i++)
+        NumRows += ranges[2 * i + 1];
+
+    const size_t rowsize = dtype_itemsize(bb.dtype) * bb.nmemb;
+    char * buf = malloc(rowsize * NumRows + 1);
+    big_array_init(array, buf, bb.dtype, 2, (size_t []){NumRows, bb.nmemb}, NULL);
+
+    for(i = 0; i < nranges; i++) {
+        BigBlockPtr ptr;
+        BigArray part = {0};
+        big_array_init(&part, buf, bb.dtype, 2, (size_t []){ranges[2 * i + 1], bb.nmemb}, NULL);
+        if(0 != big_block_seek(&bb, &ptr, ranges[2 * i]) ||
+           0 != big_block_read(&bb, &ptr, &part)) {
+            big_block_close(&bb);
+            free(array->data);
+            return -1;
+        }
+        buf += rowsize * ranges[2 * i + 1];
+    }
+    big_block_close(&bb);
+    return NumRows;
+}
+
 /* save a block to disk */
 void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int verbose)
+{
+    petaio_save_block_comm(bf, blockname, array, NULL, verbose, MPI_COMM_WORLD);
+}
+
+static void
+petaio_save_block_comm(BigFile * bf, char * blockname, BigArray * array, const char * codec, int verbose, MPI_Comm Comm)
 {
 
     BigBlock bb;
@@ -674,9 +1629,17 @@ void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int ver
 
     int elsize = big_file_dtype_itemsize(array->dtype);
 
-    int NumWriters = IO.NumWriters;
-
-    size_t size = count_sum(array->dims[0]);
+    /* Writer groups that write blocks concurrently (see petaio_save_batch) share the writers*/
+    int NTask, CommSize;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_size(Comm, &CommSize);
+    int NumWriters = (int64_t) IO.NumWriters * CommSize / NTask;
+    if(NumWriters < 1)
+        NumWriters = 1;
+
+    int64_t localsize = array->dims[0];
+    int64_t size = 0;
+    MPI_Allreduce(&localsize, &size, 1, MPI_INT64, MPI_SUM, Comm);
     int NumFiles;
 
     if(IO.EnableAggregatedIO) {
@@ -703,26 +1666,313 @@ void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int ver
     }
     /* create the block */
     /* dims[1] is the number of members per item */
-    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, Comm)) {
         endrun(0, "Failed to create block at %s:%s\n", blockname,
                     big_file_get_error_message());
     }
+    /* Encoded blocks are compressed a whole file at a time: the rows are first sent to the rank owning
+     * each file, then the owners take turns so that at most NumWriters of them write at once. */
+    if(codec && codec[0] && 0 != big_block_set_codec(&bb, codec)) {
+        endrun(0, "Failed to set codec of block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
     if(0 != big_block_seek(&bb, &ptr, 0)) {
         endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
     }
-    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, Comm)) {
         endrun(0, "Failed to write :%s\n", big_file_get_error_message());
     }
 
     if(verbose && size > 0)
         message(0, "Done writing %td particles to %d Files\n", size, NumFiles);
 
-    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bb, Comm)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
                 big_file_get_error_message());
     }
 }
 
+/* Save the domain decomposition, so that a restart on the same number of tasks
+ * can read each task's particles straight into place and reuse the top tree.
+ * Domain/NumPartPerTask has one row per task, the number of particles of each type it saved.
+ * The other blocks are the top tree, written by task 0.*/
+static void
+petaio_save_domain(BigFile * bf, const DomainDecomp * ddecomp, const int * ptype_count)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    int64_t NumPart[6];
+    int i;
+    for(i = 0; i < 6; i++)
+        NumPart[i] = ptype_count[i];
+
+    BigArray array = {0};
+    big_array_init(&array, NumPart, "i8", 2, (size_t []){1, 6}, NULL);
+    petaio_save_block(bf, "Domain/NumPartPerTask", &array, 0);
+
+    /* The particle offset is subtracted from the saved positions, but the domain was built with it.*/
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, "Domain/NumPartPerTask", MPI_COMM_WORLD) ||
+       0 != big_block_set_attr(&bb, "ParticleOffset", PartManager->CurrentParticleOffset, "f8", 3) ||
+       0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to write domain attributes: %s\n", big_file_get_error_message());
+    }
+
+    /* Only task 0 writes the top tree, which is the same on all tasks.*/
+    const int NTopNodes = ThisTask == 0 ? ddecomp->NTopNodes : 0;
+    const int NTopLeaves = ThisTask == 0 ? ddecomp->NTopLeaves : 0;
+    const int NTasks = ThisTask == 0 ? NTask : 0;
+
+    int64_t * TopNodes = mymalloc("DomainTopNodes", 4 * sizeof(int64_t) * NTopNodes);
+    for(i = 0; i < NTopNodes; i++) {
+        TopNodes[4 * i] = ddecomp->TopNodes[i].StartKey;
+        TopNodes[4 * i + 1] = ddecomp->TopNodes[i].Daughter;
+        TopNodes[4 * i + 2] = ddecomp->TopNodes[i].Shift;
+        TopNodes[4 * i + 3] = ddecomp->TopNodes[i].Leaf;
+    }
+    big_array_init(&array, TopNodes, "i8", 2, (size_t []){NTopNodes, 4}, NULL);
+    petaio_save_block(bf, "Domain/TopNodes", &array, 0);
+    myfree(TopNodes);
+
+    int * TopLeafTask = mymalloc("DomainTopLeaves", sizeof(int) * NTopLeaves);
+    for(i = 0; i < NTopLeaves; i++)
+        TopLeafTask[i] = ddecomp->TopLeaves[i].Task;
+    big_array_init(&array, TopLeafTask, "i4", 1, (size_t []){NTopLeaves}, NULL);
+    petaio_save_block(bf, "Domain/TopLeafTask", &array, 0);
+    myfree(TopLeafTask);
+
+    big_array_init(&array, ddecomp->Tasks, "i4", 2, (size_t []){NTasks, 2}, NULL);
+    petaio_save_block(bf, "Domain/Tasks", &array, 0);
+}
+
+/* Write a coarse spatial index of the particles of each type. The rows of each task are cut
+ * into chunks of ChunkSize particles; since the particles are in Peano order on each task,
+ * every chunk covers a small region. For each chunk %d/Index/Rows has the first row and number of rows,
+ * %d/Index/Keys the smallest and largest Peano key and %d/Index/Box the bounding box
+ * (minimum then maximum) of the saved positions. The keys use BITS_PER_DIMENSION bits,
+ * of the saved positions, which do not include the random particle offset.*/
+void
+petaio_save_index(BigFile * bf, const int * selection, const int * ptype_offset, const int * ptype_count, const int64_t ChunkSize)
+{
+    if(ChunkSize <= 0)
+        return;
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        int64_t first = 0, count = ptype_count[ptype], NTotal;
+        MPI_Exscan(&count, &first, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(&count, &NTotal, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        /* MPI_Exscan leaves the result undefined on the first task.*/
+        if(ThisTask == 0)
+            first = 0;
+        if(NTotal == 0)
+            continue;
+
+        const int64_t NChunk = (count + ChunkSize - 1) / ChunkSize;
+        int64_t * Rows = mymalloc("IndexRows", NChunk * 2 * sizeof(int64_t));
+        peano_t * Keys = mymalloc("IndexKeys", NChunk * 2 * sizeof(peano_t));
+        double * Box = mymalloc("IndexBox", NChunk * 6 * sizeof(double));
+        const int * sel = selection + ptype_offset[ptype];
+
+        int64_t c;
+        #pragma omp parallel for
+        for(c = 0; c < NChunk; c++) {
+            const int64_t start = c * ChunkSize;
+            const int64_t end = start + ChunkSize < count ? start + ChunkSize : count;
+            Rows[2 * c] = first + start;
+            Rows[2 * c + 1] = end - start;
+            Keys[2 * c] = PEANOCELLS;
+            Keys[2 * c + 1] = 0;
+            int d;
+            for(d = 0; d < 3; d++) {
+                Box[6 * c + d] = All.BoxSize;
+                Box[6 * c + 3 + d] = 0;
+            }
+            int64_t i;
+            for(i = start; i < end; i++) {
+                double pos[3];
+                for(d = 0; d < 3; d++) {
+                    /* The same as the saved Position, see GTPosition*/
+                    pos[d] = P[sel[i]].Pos[d] - PartManager->CurrentParticleOffset[d];
+                    while(pos[d] > All.BoxSize) pos[d] -= All.BoxSize;
+                    while(pos[d] <= 0) pos[d] += All.BoxSize;
+                    if(pos[d] < Box[6 * c + d])
+                        Box[6 * c + d] = pos[d];
+                    if(pos[d] > Box[6 * c + 3 + d])
+                        Box[6 * c + 3 + d] = pos[d];
+                }
+                peano_t key = PEANO(pos, All.BoxSize);
+                if(key < Keys[2 * c])
+                    Keys[2 * c] = key;
+                if(key > Keys[2 * c + 1])
+                    Keys[2 * c + 1] = key;
+            }
+        }
+
+        char blockname[128];
+        BigArray array = {0};
+        snprintf(blockname, sizeof(blockname), "%d/Index/Rows", ptype);
+        big_array_init(&array, Rows, "i8", 2, (size_t []){NChunk, 2}, NULL);
+        petaio_save_block(bf, blockname, &array, 0);
+
+        BigBlock bb;
+        const int Bits = BITS_PER_DIMENSION;
+        if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD) ||
+           0 != big_block_set_attr(&bb, "ChunkSize", &ChunkSize, "i8", 1) ||
+           0 != big_block_set_attr(&bb, "BitsPerDimension", &Bits, "i4", 1) ||
+           0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to write index attributes: %s\n", big_file_get_error_message());
+        }
+
+        snprintf(blockname, sizeof(blockname), "%d/Index/Keys", ptype);
+        big_array_init(&array, Keys, "u8", 2, (size_t []){NChunk, 2}, NULL);
+        petaio_save_block(bf, blockname, &array, 0);
+
+        snprintf(blockname, sizeof(blockname), "%d/Index/Box", ptype);
+        big_array_init(&array, Box, "f8", 2, (size_t []){NChunk, 6}, NULL);
+        petaio_save_block(bf, blockname, &array, 0);
+
+        myfree(Box);
+        myfree(Keys);
+        myfree(Rows);
+    }
+}
+
+/* Read the number of particles of each type this task saved, if the snapshot has a domain saved
+ * with the same number of tasks and the particles will fit. Returns 1 if NLocal was set.*/
+static int
+petaio_read_domain_layout(BigFile * bf, int64_t * NLocal, MPI_Comm Comm)
+{
+    int NTask;
+    MPI_Comm_size(Comm, &NTask);
+
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, "Domain/NumPartPerTask", Comm)) {
+        message(0, "Snapshot has no saved domain, distributing particles evenly.\n");
+        return 0;
+    }
+    if(bb.size != (size_t) NTask || bb.nmemb != 6) {
+        message(0, "Snapshot domain was saved on %td tasks, not %d: distributing particles evenly.\n", bb.size, NTask);
+        big_block_mpi_close(&bb, Comm);
+        return 0;
+    }
+    BigArray array = {0};
+    BigBlockPtr ptr;
+    double ParticleOffset[3];
+    big_array_init(&array, NLocal, "i8", 2, (size_t []){1, 6}, NULL);
+    if(0 != big_block_seek(&bb, &ptr, 0) ||
+       0 != big_block_mpi_read(&bb, &ptr, &array, IO.NumWriters, Comm) ||
+       0 != big_block_get_attr(&bb, "ParticleOffset", ParticleOffset, "f8", 3) ||
+       0 != big_block_mpi_close(&bb, Comm)) {
+        endrun(0, "Failed to read saved domain: %s\n", big_file_get_error_message());
+    }
+
+    int64_t NumPart = 0;
+    int i;
+    for(i = 0; i < 6; i++)
+        NumPart += NLocal[i];
+    if(MPIU_Any(NumPart >= PartManager->MaxPart, Comm)) {
+        message(0, "Saved domain does not fit in PartAllocFactor: distributing particles evenly.\n");
+        return 0;
+    }
+    /* Positions are saved without the offset; the setters put it back.*/
+    memcpy(PartManager->CurrentParticleOffset, ParticleOffset, 3 * sizeof(double));
+    message(0, "Reading particles in the saved domain layout.\n");
+    return 1;
+}
+
+void
+petaio_read_domain(int num, DomainDecomp * ddecomp)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    char * fname = fastpm_strdup_printf("%s/%s_%03d", All.OutputDir, All.SnapshotFileBase, num);
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    BigBlock bn, bl, bt;
+    if(0 != big_file_mpi_open_block(&bf, &bn, "Domain/TopNodes", MPI_COMM_WORLD) ||
+       0 != big_file_mpi_open_block(&bf, &bl, "Domain/TopLeafTask", MPI_COMM_WORLD) ||
+       0 != big_file_mpi_open_block(&bf, &bt, "Domain/Tasks", MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open saved domain: %s\n", big_file_get_error_message());
+    }
+    if(bt.size != (size_t) NTask)
+        endrun(1, "Saved domain has %td tasks, not %d\n", bt.size, NTask);
+
+    domain_restore_alloc(ddecomp, bn.size, bl.size);
+
+    /* The top tree is small: read it on task 0 and broadcast it.*/
+    int64_t * TopNodes = mymalloc("DomainTopNodes", 4 * sizeof(int64_t) * ddecomp->NTopNodes);
+    int * TopLeafTask = mymalloc("DomainTopLeaves", sizeof(int) * ddecomp->NTopLeaves);
+    if(ThisTask == 0) {
+        BigArray array = {0};
+        BigBlockPtr ptr;
+        big_array_init(&array, TopNodes, "i8", 2, (size_t []){ddecomp->NTopNodes, 4}, NULL);
+        if(0 != big_block_seek(&bn, &ptr, 0) || 0 != big_block_read(&bn, &ptr, &array))
+            endrun(1, "Failed to read Domain/TopNodes: %s\n", big_file_get_error_message());
+        big_array_init(&array, TopLeafTask, "i4", 1, (size_t []){ddecomp->NTopLeaves}, NULL);
+        if(0 != big_block_seek(&bl, &ptr, 0) || 0 != big_block_read(&bl, &ptr, &array))
+            endrun(1, "Failed to read Domain/TopLeafTask: %s\n", big_file_get_error_message());
+        big_array_init(&array, ddecomp->Tasks, "i4", 2, (size_t []){NTask, 2}, NULL);
+        if(0 != big_block_seek(&bt, &ptr, 0) || 0 != big_block_read(&bt, &ptr, &array))
+            endrun(1, "Failed to read Domain/Tasks: %s\n", big_file_get_error_message());
+    }
+    MPI_Bcast(TopNodes, 4 * ddecomp->NTopNodes, MPI_INT64, 0, MPI_COMM_WORLD);
+    MPI_Bcast(TopLeafTask, ddecomp->NTopLeaves, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(ddecomp->Tasks, 2 * NTask, MPI_INT, 0, MPI_COMM_WORLD);
+
+    int i;
+    for(i = 0; i < ddecomp->NTopNodes; i++) {
+        ddecomp->TopNodes[i].StartKey = TopNodes[4 * i];
+        ddecomp->TopNodes[i].Daughter = TopNodes[4 * i + 1];
+        ddecomp->TopNodes[i].Shift = TopNodes[4 * i + 2];
+        ddecomp->TopNodes[i].Leaf = TopNodes[4 * i + 3];
+    }
+    for(i = 0; i < ddecomp->NTopLeaves; i++) {
+        ddecomp->TopLeaves[i].Task = TopLeafTask[i];
+        ddecomp->TopLeaves[i].topnode = 0;
+    }
+    myfree(TopLeafTask);
+    myfree(TopNodes);
+
+    if(0 != big_block_mpi_close(&bt, MPI_COMM_WORLD) ||
+       0 != big_block_mpi_close(&bl, MPI_COMM_WORLD) ||
+       0 != big_block_mpi_close(&bn, MPI_COMM_WORLD) ||
+       0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    myfree(fname);
+
+    domain_restore_finish(ddecomp);
+}
+
+/* Choose the codec used to write a block from the compression parameters.
+ * Positions and velocities may be quantized; the other floating point blocks
+ * compress poorly without loss, so only integer blocks use the lossless codec.*/
+static void
+petaio_set_codec(IOTableEntry * ent)
+{
+    char kind = big_file_dtype_kind(ent->dtype);
+    ent->codec[0] = '\0';
+    if(IO.PositionTolerance > 0 && 0 == strcmp(ent->name, "Position"))
+        snprintf(ent->codec, sizeof(ent->codec), "quantize:%g", IO.PositionTolerance);
+    else if(IO.VelocityTolerance > 0 && 0 == strcmp(ent->name, "Velocity"))
+        snprintf(ent->codec, sizeof(ent->codec), "quantize:%g", IO.VelocityTolerance);
+    else if(IO.LosslessCompression && (kind == 'i' || kind == 'u'))
+        strcpy(ent->codec, "lz4");
+}
+
 /*
  * register an IO block of name for particle type ptype.
  *
@@ -761,9 +2011,28 @@ void io_register_io_block(char * name,
     ent->setter = setter;
     ent->items = items;
     ent->required = required;
+    ent->field_base = IO_FIELD_NONE;
+    ent->field_offset = 0;
+    ent->field_stride = 0;
+    petaio_set_codec(ent);
     IOTable->used ++;
 }
 
+/* Mark the last registered block as a plain field. See IO_FIELD. */
+void
+io_register_field(struct IOTable * IOTable, int base, size_t offset, size_t stride, size_t size)
+{
+    if(IOTable->used == 0)
+        endrun(1, "No io block to attach the field to.\n");
+    IOTableEntry * ent = &IOTable->ent[IOTable->used - 1];
+    /* Fields stored at a different precision (eg, MyFloat as double) need the getter to convert.*/
+    if(size != (size_t) dtype_itemsize(ent->dtype))
+        return;
+    ent->field_base = base;
+    ent->field_offset = offset;
+    ent->field_stride = stride;
+}
+
 static void GTPosition(int i, double * out, void * baseptr, void * smanptr) {
     /* Remove the particle offset before saving*/
     struct particle_data * part = (struct particle_data *) baseptr;
@@ -780,6 +2049,12 @@ static void STPosition(int i, double * out, void * baseptr, void * smanptr) {
     struct particle_data * part = (struct particle_data *) baseptr;
     for(d = 0; d < 3; d ++) {
         part[i].Pos[d] = out[d];
+        /* Re-apply the offset if it was restored with the domain*/
+        if(PartManager->CurrentParticleOffset[d] != 0) {
+            part[i].Pos[d] += PartManager->CurrentParticleOffset[d];
+            while(part[i].Pos[d] > All.BoxSize) part[i].Pos[d] -= All.BoxSize;
+            while(part[i].Pos[d] <= 0) part[i].Pos[d] += All.BoxSize;
+        }
     }
 }
 
@@ -883,7 +2158,22 @@ SIMPLE_PROPERTY_PI(BlackholeJumpToMinPot, JumpToMinPot, int, 1, struct bh_partic
 SIMPLE_PROPERTY_PI(BlackholeMtrack, Mtrack, float, 1, struct bh_particle_data)
 SIMPLE_PROPERTY_PI(BlackholeMseed, Mseed, float, 1, struct bh_particle_data)
 
-SIMPLE_SETTER_PI(STBlackholeMinPotPos , MinPotPos[0], double, 3, struct bh_particle_data)
+static void STBlackholeMinPotPos(int i, double * out, void * baseptr, void * smanptr) {
+    struct particle_data * part = (struct particle_data *) baseptr;
+    int PI = part[i].PI;
+    struct slot_info * info = &(((struct slots_manager_type *) smanptr)->info[5]);
+    struct bh_particle_data * sl = (struct bh_particle_data *) info->ptr;
+    int d;
+    for(d = 0; d < 3; d ++) {
+        sl[PI].MinPotPos[d] = out[d];
+        /* Re-apply the offset if it was restored with the domain*/
+        if(PartManager->CurrentParticleOffset[d] != 0) {
+            sl[PI].MinPotPos[d] += PartManager->CurrentParticleOffset[d];
+            while(sl[PI].MinPotPos[d] > All.BoxSize) sl[PI].MinPotPos[d] -= All.BoxSize;
+            while(sl[PI].MinPotPos[d] <= 0) sl[PI].MinPotPos[d] += All.BoxSize;
+        }
+    }
+}
 static void GTBlackholeMinPotPos(int i, double * out, void * baseptr, void * smanptr) {
     /* Remove the particle offset before saving*/
     struct particle_data * part = (struct particle_data *) baseptr;
@@ -995,11 +2285,15 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID) {
         /* We put Mass first because sometimes there is
          * corruption in the first array and we can recover from Mass corruption*/
         IO_REG(Mass,     "f4", 1, i, IOTable);
+        IO_FIELD(Mass, IOTable);
         IO_REG(Position, "f8", 3, i, IOTable);
         IO_REG(Velocity, "f4", 3, i, IOTable);
         IO_REG(ID,       "u8", 1, i, IOTable);
-        if(All.OutputPotential)
+        IO_FIELD(ID, IOTable);
+        if(All.OutputPotential) {
             IO_REG_WRONLY(Potential, "f4", 1, i, IOTable);
+            IO_FIELD(Potential, IOTable);
+        }
         if(WriteGroupID)
             IO_REG_WRONLY(GroupID, "u4", 1, i, IOTable);
         if(All.OutputTimebins)
@@ -1007,14 +2301,21 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID) {
     }
 
     IO_REG(Generation,       "u1", 1, 0, IOTable);
+    IO_FIELD(Generation, IOTable);
     IO_REG(Generation,       "u1", 1, 4, IOTable);
+    IO_FIELD(Generation, IOTable);
     IO_REG(Generation,       "u1", 1, 5, IOTable);
+    IO_FIELD(Generation, IOTable);
     /* Bare Bone SPH*/
     IO_REG(SmoothingLength,  "f4", 1, 0, IOTable);
+    IO_FIELD(Hsml, IOTable);
     IO_REG(Density,          "f4", 1, 0, IOTable);
+    IO_FIELD_PI(Density, struct sph_particle_data, IOTable);
 
-    if(DensityIndependentSphOn())
+    if(DensityIndependentSphOn()) {
         IO_REG(EgyWtDensity,          "f4", 1, 0, IOTable);
+        IO_FIELD_PI(EgyWtDensity, struct sph_particle_data, IOTable);
+    }
 
     /* On reload this sets the Entropy variable, need the densities.
      * Register this after Density and EgyWtDensity will ensure density is read
@@ -1023,6 +2324,7 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID) {
 
     /* Cooling */
     IO_REG(ElectronAbundance,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(Ne, struct sph_particle_data, IOTable);
     if(All.CoolingOn) {
         IO_REG_WRONLY(NeutralHydrogenFraction, "f4", 1, 0, IOTable);
     }
@@ -1039,37 +2341,57 @@ void register_io_blocks(struct IOTable * IOTable, int WriteGroupID) {
         IO_REG_WRONLY(StarFormationRate, "f4", 1, 0, IOTable);
         /* Another new addition: save the DelayTime for wind particles*/
         IO_REG_NONFATAL(DelayTime,  "f4", 1, 0, IOTable);
+        IO_FIELD_PI(DelayTime, struct sph_particle_data, IOTable);
     }
     IO_REG_NONFATAL(BirthDensity, "f4", 1, 4, IOTable);
+    IO_FIELD_PI(BirthDensity, struct star_particle_data, IOTable);
     IO_REG_TYPE(StarFormationTime, "f4", 1, 4, IOTable);
+    IO_FIELD_PI(FormationTime, struct star_particle_data, IOTable);
     IO_REG_TYPE(Metallicity,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(Metallicity, struct sph_particle_data, IOTable);
     IO_REG_TYPE(Metallicity,       "f4", 1, 4, IOTable);
+    IO_FIELD_PI(Metallicity, struct star_particle_data, IOTable);
     if(All.MetalReturnOn) {
         IO_REG_TYPE(Metals,       "f4", NMETALS, 0, IOTable);
+        IO_FIELD_PI(Metals[0], struct sph_particle_data, IOTable);
         IO_REG_TYPE(Metals,       "f4", NMETALS, 4, IOTable);
+        IO_FIELD_PI(Metals[0], struct star_particle_data, IOTable);
         IO_REG_TYPE(LastEnrichmentMyr, "f4", 1, 4, IOTable);
+        IO_FIELD_PI(LastEnrichmentMyr, struct star_particle_data, IOTable);
         IO_REG_TYPE(TotalMassReturned, "f4", 1, 4, IOTable);
+        IO_FIELD_PI(TotalMassReturned, struct star_particle_data, IOTable);
         IO_REG_NONFATAL(SmoothingLength,  "f4", 1, 4, IOTable);
+        IO_FIELD(Hsml, IOTable);
     }
     /* end SF */
 
     /* Black hole */
     IO_REG_TYPE(StarFormationTime, "f4", 1, 5, IOTable);
+    IO_FIELD_PI(FormationTime, struct bh_particle_data, IOTable);
     IO_REG(BlackholeMass,          "f4", 1, 5, IOTable);
+    IO_FIELD_PI(Mass, struct bh_particle_data, IOTable);
     IO_REG(BlackholeDensity,          "f4", 1, 5, IOTable);
+    IO_FIELD_PI(Density, struct bh_particle_data, IOTable);
     IO_REG(BlackholeAccretionRate, "f4", 1, 5, IOTable);
+    IO_FIELD_PI(Mdot, struct bh_particle_data, IOTable);
+    /* CountProgs is converted to float by the getter, so no field*/
     IO_REG(BlackholeProgenitors,   "i4", 1, 5, IOTable);
     IO_REG(BlackholeMinPotPos, "f8", 3, 5, IOTable);
     IO_REG(BlackholeJumpToMinPot,   "i4", 1, 5, IOTable);
+    IO_FIELD_PI(JumpToMinPot, struct bh_particle_data, IOTable);
     IO_REG(BlackholeMtrack,         "f4", 1, 5, IOTable);
+    IO_FIELD_PI(Mtrack, struct bh_particle_data, IOTable);
     IO_REG_NONFATAL(BlackholeMseed,         "f4", 1, 5, IOTable);
+    IO_FIELD_PI(Mseed, struct bh_particle_data, IOTable);
 
     /* Smoothing lengths for black hole: this is a new addition*/
     IO_REG_NONFATAL(SmoothingLength,  "f4", 1, 5, IOTable);
+    IO_FIELD(Hsml, IOTable);
     /* Marks whether a BH particle has been swallowed*/
     IO_REG_NONFATAL(Swallowed, "u1", 1, 5, IOTable);
     /* ID of the swallowing black hole particle. If == -1, then particle is live*/
     IO_REG_NONFATAL(BlackholeSwallowID, "u8", 1, 5, IOTable);
+    IO_FIELD_PI(SwallowID, struct bh_particle_data, IOTable);
     /* Time the BH was swallowed*/
     IO_REG_NONFATAL(BlackholeSwallowTime, "f4", 1, 5, IOTable);
 
@@ -1095,17 +2417,26 @@ void register_debug_io_blocks(struct IOTable * IOTable)
     int ptype;
     for(ptype = 0; ptype < 6; ptype++) {
         IO_REG_WRONLY(GravAccel,       "f4", 3, ptype, IOTable);
+        IO_FIELD(GravAccel[0], IOTable);
         IO_REG_WRONLY(GravPM,       "f4", 3, ptype, IOTable);
+        IO_FIELD(GravPM[0], IOTable);
         if(!All.OutputTimebins) /* Otherwise it is output in the regular blocks*/
             IO_REG_WRONLY(TimeBin,       "u4", 1, ptype, IOTable);
     }
     IO_REG_WRONLY(HydroAccel,       "f4", 3, 0, IOTable);
+    IO_FIELD_PI(HydroAccel[0], struct sph_particle_data, IOTable);
     IO_REG_WRONLY(MaxSignalVel,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(MaxSignalVel, struct sph_particle_data, IOTable);
     IO_REG_WRONLY(Entropy,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(Entropy, struct sph_particle_data, IOTable);
     IO_REG_WRONLY(DtEntropy,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(DtEntropy, struct sph_particle_data, IOTable);
     IO_REG_WRONLY(DhsmlEgyDensityFactor,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(DhsmlEgyDensityFactor, struct sph_particle_data, IOTable);
     IO_REG_WRONLY(DivVel,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(DivVel, struct sph_particle_data, IOTable);
     IO_REG_WRONLY(CurlVel,       "f4", 1, 0, IOTable);
+    IO_FIELD_PI(CurlVel, struct sph_particle_data, IOTable);
     /*Sort IO blocks so similar types are together; then ordered by the sequence they are declared. */
     qsort_openmp(IOTable->ent, IOTable->used, sizeof(struct IOTableEntry), order_by_type);
 }
@@ -2,10 +2,12 @@
 #define PETAIO_H
 
 #include <mpi.h>
+#include <stddef.h>
 #include "bigfile.h"
 #include "utils/paramset.h"
 #include "partmanager.h"
 #include "slotsmanager.h"
+#include "domain.h"
 
 typedef void (*property_getter) (int i, void * result, void * baseptr, void * slotptr);
 typedef void (*property_setter) (int i, void * target, void * baseptr, void * slotptr);
@@ -18,10 +20,22 @@ typedef struct IOTableEntry {
     char dtype[8];
     int items;
     int required;
+    /* bigfile codec used when writing the block; empty for raw. See big_block_set_codec. */
+    char codec[32];
+    /* If the block is a plain field of the particle or slot struct, where it is. See IO_FIELD.*/
+    int field_base;
+    size_t field_offset;
+    size_t field_stride;
     property_getter getter;
     property_setter setter;
 } IOTableEntry;
 
+enum IOFieldBase {
+    IO_FIELD_NONE = 0, /* Use the getter */
+    IO_FIELD_PART = 1, /* A field of struct particle_data */
+    IO_FIELD_SLOT = 2, /* A field of the slot of the particle type, found via PI */
+};
+
 struct IOTable {
     IOTableEntry * ent;
     int used;
@@ -48,8 +62,49 @@ void petaio_destroy_buffer(BigArray * array);
 void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int verbose);
 int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int required);
 
+/* Sub-volume reads using the spatial index of a snapshot (see SnapshotIndexChunkSize).
+ * Find the rows of particles of type ptype that may lie in the box [BoxMin, BoxMax] in the saved frame,
+ * or whose Peano keys (of the saved positions, BITS_PER_DIMENSION bits) may lie in [KeyMin, KeyMax].
+ * The box is not periodic: split a box that wraps around into several boxes. The rows are a superset,
+ * so filter the Position of the particles read for an exact selection.
+ * *ranges is set to a sorted list of (first row, number of rows), to be freed with free().
+ * Returns the number of ranges, or -1 if the snapshot has no index.*/
+int64_t petaio_index_find_box(BigFile * bf, int ptype, const double BoxMin[3], const double BoxMax[3], int64_t ** ranges);
+int64_t petaio_index_find_keys(BigFile * bf, int ptype, const peano_t KeyMin, const peano_t KeyMax, int64_t ** ranges);
+/* Write the spatial index of the particles in selection, ptype_count[ptype] of each type starting
+ * at ptype_offset[ptype], in chunks of ChunkSize rows. Collective. Exposed for the tests.*/
+void petaio_save_index(BigFile * bf, const int * selection, const int * ptype_offset, const int * ptype_count, const int64_t ChunkSize);
+/* Number of the next nblocks particle blocks (indices into IOTable) to write together with petaio_save_batch,
+ * or 1 if they are written one at a time. Collective. Exposed for the tests.*/
+int petaio_plan_batch(struct IOTable * IOTable, const int * blocks, const int nblocks, const int * ptype_count);
+/* Write nblocks particle blocks at once, each by one of SnapshotConcurrentBlocks writer groups of ranks.
+ * Collective. Exposed for the tests.*/
+void petaio_save_batch(BigFile * bf, struct IOTable * IOTable, const int * blocks, const int nblocks,
+        const int * selection, const int * ptype_offset, const int * ptype_count, int verbose);
+/* Read only the rows in ranges of a block, eg "1/Position", into array. The buffer is allocated
+ * with malloc; free array->data when done. Returns the number of rows, or -1 on error.*/
+int64_t petaio_read_ranges(BigFile * bf, const char * blockname, const int64_t * ranges, const int64_t nranges, BigArray * array);
+/* Append array to the end of a block, creating it with dtype if it does not exist.
+ * Collective on Comm. Returns the number of rows in the block before this call.*/
+int64_t petaio_append_block(BigFile * bf, const char * blockname, BigArray * array, const char * dtype, MPI_Comm Comm);
+
 void petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...);
-void petaio_read_snapshot(int num, MPI_Comm Comm);
+/* Save a snapshot, writing it from a background thread if SnapshotAsyncWrite is set.
+ * The particle data is copied before returning, so the caller may continue to evolve it.
+ * If ddecomp is not NULL, the domain is saved so that a restart on the same number of tasks can reuse it.
+ * Returns 1 if the write is still in progress, 0 if it completed synchronously.*/
+int petaio_save_snapshot_async(struct IOTable * IOTable, const DomainDecomp * ddecomp, int verbose, const char *fmt, ...);
+/* Append the particles and blocks selected by the Lite* parameters to the multi-epoch lite snapshot.*/
+void petaio_save_lite(struct IOTable * IOTable, const double Time, const char * fmt, ...);
+/* Remove the epochs after Time from the lite snapshot, if it exists. A restart writes them again. Collective.*/
+void petaio_truncate_lite(const double Time, const char * fmt, ...);
+/* Wait for an asynchronous snapshot write to finish. Returns 1 if a write was outstanding.*/
+int petaio_async_wait(void);
+/* Read a snapshot. Returns 1 if the particles were read in the domain layout saved in the snapshot,
+ * in which case petaio_read_domain should be used instead of a full domain decomposition.*/
+int petaio_read_snapshot(int num, MPI_Comm Comm);
+/* Read the domain saved in a snapshot into ddecomp.*/
+void petaio_read_domain(int num, DomainDecomp * ddecomp);
 void petaio_read_header(int num);
 
 void
@@ -90,6 +145,23 @@ void io_register_io_block(char * name,
         struct IOTable * IOTable
         );
 
+/*
+ * Declares that the last registered io block is a plain copy of a field, the same
+ * field as its SIMPLE_GETTER. The block is then packed with a strided copy,
+ * or written straight from particle memory, instead of calling the getter.
+ *
+ * field: the first item, for example Metals[0].
+ * IO_FIELD_PI is for a field of the slot struct slottype.
+ *
+ * The field must have the C type of the block dtype. Fields whose size does not match
+ * the dtype keep using the getter.
+ * */
+#define IO_FIELD(field, IOTable) \
+    io_register_field(IOTable, IO_FIELD_PART, offsetof(struct particle_data, field), sizeof(struct particle_data), sizeof(((struct particle_data *) 0)->field))
+#define IO_FIELD_PI(field, slottype, IOTable) \
+    io_register_field(IOTable, IO_FIELD_SLOT, offsetof(slottype, field), sizeof(slottype), sizeof(((slottype *) 0)->field))
+void io_register_field(struct IOTable * IOTable, int base, size_t offset, size_t stride, size_t size);
+
 
 /*
  * define a simple getter function
@@ -22,6 +22,7 @@
 #include "timestep.h"
 #include "drift.h"
 #include "forcetree.h"
+#include "treewalk.h"
 #include "blackhole.h"
 #include "hydra.h"
 #include "sfr_eff.h"
@@ -40,7 +41,6 @@ static FILE * FdEnergy;
 static FILE  *FdCPU;    /*!< file handle for cpu.txt log-file. */
 static FILE *FdSfr;     /*!< file handle for sfr.txt log-file. */
 static FILE *FdBlackHoles;  /*!< file handle for blackholes.txt log-file. */
-static FILE *FdBlackholeDetails;  /*!< file handle for BlackholeDetails binary file. */
 
 static struct ClockTable Clocks;
 
@@ -107,11 +107,22 @@ int begrun(int RestartFlag, int RestartSnapNum)
 
     set_random_numbers(All.RandomSeed);
 
-    if(All.LightconeOn)
-        lightcone_init(&All.CP, All.Time);
+    if(All.MetalReturnOn)
+        init_metal_return(&All.CP, All.TimeMax);
     return RestartSnapNum;
 }
 
+/* Set up the outputs which are appended to over the run: the lite snapshots and the lightcone.
+ * What they hold after TimeInit is computed again, so it is removed. Call once init has set the starting time,
+ * which may be that of a local checkpoint.*/
+void
+begin_output_streams(double TimeInit)
+{
+    petaio_truncate_lite(TimeInit, "%s/%s_LITE", All.OutputDir, All.SnapshotFileBase);
+    if(All.LightconeOn)
+        lightcone_init(&All.CP, TimeInit);
+}
+
 /* Small function to decide - collectively - whether to use pairwise gravity this step*/
 static int
 use_pairwise_gravity(ActiveParticles * Act, struct part_manager_type * PartManager)
@@ -147,6 +158,8 @@ run(int RestartSnapNum)
     /* ... read initial model and initialise the times*/
     DriftKickTimes times = init_driftkicktime(init(RestartSnapNum, ddecomp));
 
+    begin_output_streams(All.TimeInit);
+
     /* Stored scale factor of the next black hole seeding check*/
     double TimeNextSeedingCheck = All.Time;
 
@@ -208,8 +221,8 @@ run(int RestartSnapNum)
 
         int extradomain = is_timebin_active(times.mintimebin + All.MaxDomainTimeBinDepth, times.Ti_Current);
         /* drift and ddecomp decomposition */
-        /* at first step this is a noop */
-        if(extradomain || is_PM) {
+        /* at first step the drift is a noop and init has just built the domain, so only exchange. */
+        if(NumCurrentTiStep > 0 && (extradomain || is_PM)) {
             /* Sync positions of all particles */
             drift_all_particles(Ti_Last, times.Ti_Current, All.BoxSize, &All.CP, rel_random_shift);
             /* full decomposition rebuilds the domain, needs keys.*/
@@ -384,7 +397,7 @@ run(int RestartSnapNum)
             }
 
             /* Black hole accretion and feedback */
-            blackhole(&Act, &Tree, FdBlackHoles, FdBlackholeDetails);
+            blackhole(&Act, &Tree, FdBlackHoles);
 
             /**** radiative cooling and star formation *****/
             if(All.CoolingOn)
@@ -441,13 +454,33 @@ run(int RestartSnapNum)
                 force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav, 0, All.OutputDir);
             }
             fof = fof_fof(&Tree, MPI_COMM_WORLD);
+            /* Only the saved catalogues need the spherical overdensities*/
+            if(fof_so_enabled())
+                fof_spherical_overdensity(&fof, &Tree, All.Time, MPI_COMM_WORLD);
         }
 
         /* We don't need this timestep's tree anymore.*/
         force_tree_free(&Tree);
 
         /* WriteFOF just reminds the checkpoint code to save GroupID*/
-        write_checkpoint(SnapshotFileCount, WriteSnapshot, WriteFOF, All.Time, All.OutputDir, All.SnapshotFileBase, All.OutputDebugFields);
+        write_checkpoint(SnapshotFileCount, WriteSnapshot, WriteFOF, All.Time, All.OutputDir, All.SnapshotFileBase, All.OutputDebugFields, ddecomp);
+
+        /* Node-local checkpoints between the snapshots, on PM steps where the particles are synchronised*/
+        int WroteLocal = 0;
+        if(is_PM && !WriteSnapshot)
+            WroteLocal = write_local_checkpoint(All.Time, ddecomp);
+
+        if(planned_sync && planned_sync->write_lite)
+            write_lite_snapshot(All.Time, All.OutputDir, All.SnapshotFileBase);
+
+        /* Write the buffered lightcone crossings with each checkpoint and at the end of the run,
+         * so a restart, which removes the crossings after its start from the file, does not lose them*/
+        if(All.LightconeOn && (WriteSnapshot || WroteLocal || !next_sync || stop))
+            lightcone_flush();
+
+        /* Write the buffered black hole details with each checkpoint, so a restart does not lose them*/
+        if(All.BlackHoleOn && (WriteSnapshot || WroteLocal || !next_sync || stop))
+            blackhole_details_flush();
 
         /* Save FOF tables after checkpoint so that if there is a FOF save bug we have particle tables available to debug it*/
         if(WriteFOF) {
@@ -484,6 +517,10 @@ run(int RestartSnapNum)
         free_activelist(&Act);
     }
 
+    /* Make sure the last snapshot is on disc before we exit*/
+    wait_checkpoint();
+
+    treewalk_free_neighbours();
     close_outputfiles();
 }
 
@@ -550,7 +587,6 @@ open_outputfiles(int RestartSnapNum)
     FdEnergy = NULL;
     FdBlackHoles = NULL;
     FdSfr = NULL;
-    FdBlackholeDetails = NULL;
 
     if(RestartSnapNum != -1) {
         postfix = fastpm_strdup_printf("-R%03d", RestartSnapNum);
@@ -558,12 +594,10 @@ open_outputfiles(int RestartSnapNum)
         postfix = fastpm_strdup_printf("%s", "");
     }
 
-    /* all the processors write to separate files*/
+    /* all the processors write to a single bigfile, from a buffer*/
     if(All.BlackHoleOn && All.WriteBlackHoleDetails){
-        buf = fastpm_strdup_printf("%s/%s%s/%06X", All.OutputDir,"BlackholeDetails",postfix,ThisTask);
-        fastpm_path_ensure_dirname(buf);
-        if(!(FdBlackholeDetails = fopen(buf,"a")))
-            endrun(1, "Failed to open blackhole detail %s\n", buf);
+        buf = fastpm_strdup_printf("%s/%s%s", All.OutputDir,"BlackholeDetails",postfix);
+        blackhole_details_init(buf);
         myfree(buf);
     }
 
@@ -617,8 +651,6 @@ close_outputfiles(void)
         fclose(FdSfr);
     if(FdBlackHoles)
         fclose(FdBlackHoles);
-    if(FdBlackholeDetails)
-        fclose(FdBlackholeDetails);
 }
 
 /*! Computes conversion factors between internal code units and the
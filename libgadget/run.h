@@ -4,6 +4,8 @@
 int begrun(int RestartFlag, int RestartSnapNum);
 
 void run(int RestartSnapNum);
+/* Set up the lite snapshot and lightcone outputs for a run starting at TimeInit. Called by run after init.*/
+void begin_output_streams(double TimeInit);
 void runtests(int RestartSnapNum);
 void runfof(int RestartSnapNum);
 
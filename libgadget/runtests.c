@@ -197,6 +197,8 @@ runfof(int RestartSnapNum)
     int HybridNuGrav = All.HybridNeutrinosOn && All.Time <= All.HybridNuPartTime;
     force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav, 0, All.OutputDir);
     FOFGroups fof = fof_fof(&Tree, MPI_COMM_WORLD);
+    if(fof_so_enabled())
+        fof_spherical_overdensity(&fof, &Tree, All.Time, MPI_COMM_WORLD);
     force_tree_free(&Tree);
     fof_save_groups(&fof, RestartSnapNum, MPI_COMM_WORLD);
     fof_finish(&fof);
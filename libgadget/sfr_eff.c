@@ -94,7 +94,7 @@ struct sfr_eeqos_data
 static struct sfr_eeqos_data get_sfr_eeqos(struct particle_data * part, struct sph_particle_data * sph, double dtime, const double a3inv, const struct UVBG * const GlobalUVBG);
 
 /*Cooling only: no star formation*/
-static void cooling_direct(int i, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG);
+static void cooling_direct_batch(const int * parts, const int n, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG);
 
 static void cooling_relaxed(int i, double dtime, const double a3inv, struct sfr_eeqos_data sfr_data, const struct UVBG * const GlobalUVBG);
 
@@ -172,15 +172,20 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * Gra
 
     /* Get the global UVBG for this redshift. */
     struct UVBG GlobalUVBG = get_global_UVBG(1./All.Time - 1);
+    /* Tabulate the cooling rates for this step, if enabled*/
+    build_heatingcooling_table(1./All.Time - 1, &GlobalUVBG);
     double sum_sm = 0, sum_mass_stars = 0, localsfr = 0;
 
     /* First decide which stars are cooling and which starforming. If star forming we add them to a list.
      * Note the dynamic scheduling: individual particles may have very different loop iteration lengths.
-     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.*/
+     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.
+     * Cooling particles are gathered into small per-thread batches which are cooled together.*/
     #pragma omp parallel reduction(+:localsfr) reduction(+: sum_sm) reduction(+:sum_mass_stars)
     {
         int i;
         const int tid = omp_get_thread_num();
+        int coolbatch[COOLING_BATCH];
+        int ncool = 0;
         #pragma omp for schedule(static)
         for(i=0; i < nactive; i++)
         {
@@ -217,9 +222,16 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree, MyFloat * Gra
                     nqthrsfr[tid]++;
                 }
             }
-            else
-                cooling_direct(p_i, a3inv, hubble, &GlobalUVBG);
+            else {
+                coolbatch[ncool++] = p_i;
+                if(ncool == COOLING_BATCH) {
+                    cooling_direct_batch(coolbatch, ncool, a3inv, hubble, &GlobalUVBG);
+                    ncool = 0;
+                }
+            }
         }
+        if(ncool > 0)
+            cooling_direct_batch(coolbatch, ncool, a3inv, hubble, &GlobalUVBG);
     }
 
     report_memory_usage("SFR");
@@ -384,29 +396,47 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
         return NewStars;
 }
 
+/* Cool a batch of n <= COOLING_BATCH gas particles, given by their indices in parts.*/
 static void
-cooling_direct(int i, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG)
+cooling_direct_batch(const int * parts, const int n, const double a3inv, const double hubble, const struct UVBG * const GlobalUVBG)
 {
-    /*  the actual time-step */
-    double dloga = get_dloga_for_bin(P[i].TimeBin, P[i].Ti_drift);
-    double dtime = dloga / hubble;
+    double uold[COOLING_BATCH], rho[COOLING_BATCH], dtime[COOLING_BATCH], ne[COOLING_BATCH], Z[COOLING_BATCH];
+    double enttou[COOLING_BATCH], unew[COOLING_BATCH];
+    struct UVBG uvbg[COOLING_BATCH];
+    int HeIIIionized[COOLING_BATCH];
+    const double redshift = 1./All.Time - 1;
+    int k;
+    if(n <= 0)
+        return;
 
-    double ne = SPHP(i).Ne;	/* electron abundance (gives ionization state and mean molecular weight) */
+    for(k = 0; k < n; k++) {
+        const int i = parts[k];
+        /*  the actual time-step */
+        double dloga = get_dloga_for_bin(P[i].TimeBin, P[i].Ti_drift);
+        dtime[k] = dloga / hubble;
 
-    const double enttou = pow(SPH_EOMDensity(&SPHP(i)) * a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
+        ne[k] = SPHP(i).Ne;	/* electron abundance (gives ionization state and mean molecular weight) */
 
-    /* Current internal energy including adiabatic change*/
-    double uold = SPHP(i).Entropy * enttou;
+        enttou[k] = pow(SPH_EOMDensity(&SPHP(i)) * a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
 
-    double redshift = 1./All.Time - 1;
-    struct UVBG uvbg = get_local_UVBG(redshift, GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset);
-    double unew = DoCooling(redshift, uold, SPHP(i).Density * a3inv, dtime, &uvbg, &ne, SPHP(i).Metallicity, All.MinEgySpec, P[i].HeIIIionized);
-
-    SPHP(i).Ne = ne;
-    /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
-    SPHP(i).Entropy = unew / enttou;
-    /* Cooling gas is not forming stars*/
-    SPHP(i).Sfr = 0;
+        /* Current internal energy including adiabatic change*/
+        uold[k] = SPHP(i).Entropy * enttou[k];
+        rho[k] = SPHP(i).Density * a3inv;
+        Z[k] = SPHP(i).Metallicity;
+        HeIIIionized[k] = P[i].HeIIIionized;
+        uvbg[k] = get_local_UVBG(redshift, GlobalUVBG, P[i].Pos, PartManager->CurrentParticleOffset);
+    }
+
+    DoCoolingBatch(n, redshift, uold, rho, dtime, uvbg, ne, Z, All.MinEgySpec, HeIIIionized, unew);
+
+    for(k = 0; k < n; k++) {
+        const int i = parts[k];
+        SPHP(i).Ne = ne[k];
+        /* Update the entropy. This is done after synchronizing kicks and drifts, as per run.c.*/
+        SPHP(i).Entropy = unew[k] / enttou[k];
+        /* Cooling gas is not forming stars*/
+        SPHP(i).Sfr = 0;
+    }
 }
 
 /* returns 1 if the particle is on the effective equation of state,
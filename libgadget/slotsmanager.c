@@ -157,6 +157,14 @@ slots_gc(int * compact_slots, struct part_manager_type * pman, struct slots_mana
 
     MPI_Allreduce(MPI_IN_PLACE, &tree_invalid, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
 
+    /* Tell anything holding particle indices that they have moved*/
+    if(tree_invalid) {
+        EISlotsAfterGC event = {
+            .pman = pman,
+        };
+        event_emit(&EventSlotsAfterGC, (EIBase *) &event);
+    }
+
     return tree_invalid;
 }
 
@@ -469,6 +477,10 @@ slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sma
 #ifdef DEBUG
     slots_check_id_consistency(pman, sman);
 #endif
+    EISlotsAfterGC event = {
+        .pman = pman,
+    };
+    event_emit(&EventSlotsAfterGC, (EIBase *) &event);
 }
 
 size_t
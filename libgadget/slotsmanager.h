@@ -150,4 +150,10 @@ typedef struct {
     int child;
 } EISlotsFork;
 
+/* Emitted when a gc has reordered the particles of pman.*/
+typedef struct {
+    EIBase base;
+    struct part_manager_type * pman;
+} EISlotsAfterGC;
+
 #endif
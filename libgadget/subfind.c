@@ -0,0 +1,1390 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <bigfile-mpi.h>
+
+#include "utils.h"
+#include "utils/mpsort.h"
+
+#include "allvars.h"
+#include "partmanager.h"
+#include "slotsmanager.h"
+#include "exchange.h"
+#include "petaio.h"
+#include "gravity.h"
+#include "walltime.h"
+#include "domain.h"
+#include "forcetree.h"
+#include "treewalk.h"
+#include "density.h"
+#include "densitykernel.h"
+#include "subfind.h"
+
+/*! \file subfind.c
+ *  \brief Find gravitationally bound subhaloes inside FOF groups.
+ *
+ *  This follows SUBFIND (Springel et al 2001, astro-ph/0012055).
+ *  Each FOF group is placed on a single task and searched there.
+ *  The density of each particle is estimated with the SPH kernel over DesNumNgb neighbours.
+ *  Particles are then added in order of decreasing density to the subgroups of their two
+ *  densest denser neighbours. When these neighbours are in different subgroups the particle is a
+ *  saddle point: both subgroups become subhalo candidates and are joined.
+ *  Candidates are unbound using a tree potential, smallest first, and each particle belongs to
+ *  the smallest subhalo in which it is bound. The bound remainder of the group is the main subhalo.
+ */
+
+static struct subfind_params SubfindParams;
+
+/*Set the parameters of the subfind module*/
+void
+set_subfind_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        SubfindParams.SubfindOn = param_get_int(ps, "SubfindOn");
+        SubfindParams.DesNumNgb = param_get_int(ps, "SubfindDesNumNgb");
+        SubfindParams.MinLength = param_get_int(ps, "SubfindMinLength");
+        SubfindParams.ErrTolTheta = param_get_double(ps, "SubfindErrTolTheta");
+    }
+    MPI_Bcast(&SubfindParams, sizeof(struct subfind_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+/*This is a helper for the tests*/
+void
+set_subfindpar(struct subfind_params sp)
+{
+    SubfindParams = sp;
+}
+
+int
+subfind_enabled(void)
+{
+    return SubfindParams.SubfindOn;
+}
+
+/* Maximum number of particles in a leaf of the potential tree*/
+#define SUBFIND_LEAFSIZE 8
+/* Maximum depth of the potential tree*/
+#define SUBFIND_MAXDEPTH 40
+/* Candidates smaller than this use direct summation for the potential*/
+#define SUBFIND_DIRECT 1000
+/* Allowed deviation from DesNumNgb of the kernel weighted number of neighbours*/
+#define SUBFIND_NGB_DEVIATION 2
+/* Number of densities to evaluate simultaneously*/
+#define NHSML 10
+
+/* Particle data for the group being searched.
+ * Positions are relative to the first particle of the group, so the group is not periodic.*/
+struct sub_particle {
+    double Pos[3];
+    double Vel[3];
+    double Mass;
+    double Density;
+    double Potential;
+    double Energy;
+    MyIDType ID;
+    int Type;
+    /* The two densest neighbours which are denser than this particle, or -1*/
+    int Ngb[2];
+    /* Subhalo this particle belongs to, or -1*/
+    int SubNr;
+};
+
+/* A subhalo catalogue entry. The types are those written to the file.*/
+struct Subhalo {
+    double Pos[3];
+    double CM[3];
+    MyIDType MostBoundID;
+    uint32_t GrNr;
+    /* Rank by length within the group: the main subhalo is 0*/
+    uint32_t Rank;
+    uint32_t Length;
+    uint32_t LenType[6];
+    float Mass;
+    float MassType[6];
+    float Vel[3];
+    float VelDisp;
+    float Vmax;
+    float RVmax;
+    float HalfMassRadius;
+};
+
+/* A subhalo candidate: the Len particles following Head along the subgroup chains.
+ * Head = -1 is the whole group.*/
+struct sub_candidate {
+    int Head;
+    int Len;
+};
+
+/* Sort helper*/
+struct sub_sort {
+    double Key;
+    int Index;
+};
+
+struct sub_node {
+    double Center[3];
+    double Len;
+    double CM[3];
+    double Mass;
+    int Child[8];
+    /* Particles in the leaf are Index[Start .. Start + Count)*/
+    int Start;
+    int Count;
+    int Leaf;
+};
+
+struct sub_tree {
+    struct sub_node * Nodes;
+    int NNodes;
+    int MaxNodes;
+    int * Tmp;
+};
+
+/* Working memory for the group search, sized for the largest group*/
+struct sub_work {
+    struct sub_particle * sp;
+    struct sub_sort * order;
+    struct sub_candidate * cand;
+    int * Head;
+    int * Next;
+    int * Tail;
+    int * Len;
+    int * list;
+    struct sub_tree tree;
+};
+
+static int
+subfind_cmp_key(const void * a, const void * b)
+{
+    const struct sub_sort * s1 = a;
+    const struct sub_sort * s2 = b;
+    if(s1->Key != s2->Key)
+        return (s1->Key > s2->Key) - (s1->Key < s2->Key);
+    return (s1->Index > s2->Index) - (s1->Index < s2->Index);
+}
+
+static int
+subfind_cmp_candidate(const void * a, const void * b)
+{
+    const struct sub_candidate * c1 = a;
+    const struct sub_candidate * c2 = b;
+    return (c1->Len > c2->Len) - (c1->Len < c2->Len);
+}
+
+static int
+subfind_cmp_length(const void * a, const void * b)
+{
+    const struct Subhalo * s1 = a;
+    const struct Subhalo * s2 = b;
+    return (s1->Length < s2->Length) - (s1->Length > s2->Length);
+}
+
+static void
+subfind_radix_rank(const void * a, void * radix, void * arg)
+{
+    uint64_t * u = (uint64_t *) radix;
+    const struct Subhalo * sub = a;
+    u[0] = (((uint64_t) sub->GrNr) << 32) + sub->Rank;
+}
+
+/* Number of particles of one group on a task, and the task it is searched on*/
+struct sub_group {
+    int64_t GrNr;
+    int64_t Len;
+    /* Task the group is searched on, or -1 if it is not searched*/
+    int64_t Target;
+};
+
+/* The groups placed on a task, and the room it has for them*/
+struct sub_task_load {
+    int64_t Load;
+    /* Length of the largest group placed*/
+    int64_t MaxLen;
+    int64_t MaxPart;
+    int64_t FreeBytes;
+};
+
+static int
+subfind_cmp_grnr(const void * a, const void * b)
+{
+    const struct sub_group * g1 = a;
+    const struct sub_group * g2 = b;
+    return (g1->GrNr > g2->GrNr) - (g1->GrNr < g2->GrNr);
+}
+
+/* Longest first, so the largest groups are placed while there is the most room*/
+static int
+subfind_cmp_len(const void * a, const void * b)
+{
+    const struct sub_group * g1 = a;
+    const struct sub_group * g2 = b;
+    if(g1->Len != g2->Len)
+        return (g1->Len < g2->Len) - (g1->Len > g2->Len);
+    return subfind_cmp_grnr(a, b);
+}
+
+static int
+subfind_cmp_int64(const void * a, const void * b)
+{
+    const int64_t * i1 = a;
+    const int64_t * i2 = b;
+    return (*i1 > *i2) - (*i1 < *i2);
+}
+
+/* Memory needed on the searching task for each particle, besides the particle itself:
+ * the slot it may carry, the density tree and tree walk, and the group sort.*/
+static size_t
+subfind_part_bytes(const struct slots_manager_type * halo_sman)
+{
+    size_t slotbytes = 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        if(halo_sman->info[ptype].enabled && halo_sman->info[ptype].elsize > slotbytes)
+            slotbytes = halo_sman->info[ptype].elsize;
+    return slotbytes + sizeof(struct NODE) + sizeof(int64_t) + (3 + 2 * NHSML) * sizeof(MyFloat)
+        + (4 + 2 * omp_get_max_threads()) * sizeof(int) + sizeof(struct sub_sort) + sizeof(struct Subhalo);
+}
+
+/* Memory needed to search a group, per particle of the group*/
+static size_t
+subfind_group_bytes(void)
+{
+    return sizeof(struct sub_particle) + sizeof(struct sub_sort) + 2 * sizeof(struct sub_candidate)
+        + 6 * sizeof(int) + sizeof(struct sub_node);
+}
+
+static int
+subfind_fits(const struct sub_task_load * t, const int64_t len, const size_t partbytes, const size_t groupbytes)
+{
+    const int64_t load = t->Load + len;
+    const int64_t maxlen = len > t->MaxLen ? len : t->MaxLen;
+    return load <= t->MaxPart && load * partbytes + maxlen * groupbytes <= 0.9 * t->FreeBytes;
+}
+
+static void
+subfind_place(struct sub_task_load * t, const int64_t len)
+{
+    t->Load += len;
+    if(len > t->MaxLen)
+        t->MaxLen = len;
+}
+
+/* Choose the task to search each group on, setting TargetTask of the halo particles.
+ * A group goes to task GrNr % NTask if it fits in the particle table and the free memory there.
+ * Otherwise it goes to the task with the most room left, and if it fits nowhere it is not searched:
+ * its particles are marked as garbage so the exchange drops them.
+ * Returns the total number of groups not searched. Collective.*/
+static int64_t
+subfind_assign_tasks(struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    int64_t i;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+    const int64_t NumPart = halo_pman->NumPart;
+    const size_t partbytes = subfind_part_bytes(halo_sman);
+    const size_t groupbytes = subfind_group_bytes();
+    struct sub_task_load mine = {0, 0, halo_pman->MaxPart, mymalloc_freebytes()};
+
+    /* Lengths of the groups on this task, sent to the task owning each group*/
+    int64_t * grnr = mymalloc("SubfindGrNr", (NumPart + 1) * sizeof(int64_t));
+    for(i = 0; i < NumPart; i++)
+        grnr[i] = halo_pman->Base[i].GrNr;
+    qsort_openmp(grnr, NumPart, sizeof(int64_t), subfind_cmp_int64);
+
+    int * Send_count = ta_malloc("Send_count", int, 4 * NTask);
+    int * Recv_count = Send_count + NTask;
+    int * Send_offset = Send_count + 2 * NTask;
+    int * Recv_offset = Send_count + 3 * NTask;
+    memset(Send_count, 0, NTask * sizeof(int));
+    int64_t nsend = 0;
+    for(i = 0; i < NumPart; i++)
+        if(i == 0 || grnr[i] != grnr[i-1]) {
+            Send_count[grnr[i] % NTask]++;
+            nsend++;
+        }
+    Send_offset[0] = 0;
+    for(i = 1; i < NTask; i++)
+        Send_offset[i] = Send_offset[i-1] + Send_count[i-1];
+
+    struct sub_group * send = mymalloc("SubfindSendGroups", (nsend + 1) * sizeof(struct sub_group));
+    /* Recv_count counts the entries filled so far*/
+    memset(Recv_count, 0, NTask * sizeof(int));
+    struct sub_group * g = NULL;
+    for(i = 0; i < NumPart; i++) {
+        if(i == 0 || grnr[i] != grnr[i-1]) {
+            const int task = grnr[i] % NTask;
+            g = &send[Send_offset[task] + Recv_count[task]++];
+            g->GrNr = grnr[i];
+            g->Len = 0;
+            g->Target = -1;
+        }
+        g->Len++;
+    }
+
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    int64_t nrecv = 0;
+    Recv_offset[0] = 0;
+    for(i = 0; i < NTask; i++) {
+        nrecv += Recv_count[i];
+        if(i > 0)
+            Recv_offset[i] = Recv_offset[i-1] + Recv_count[i-1];
+    }
+    MPI_Datatype type;
+    MPI_Type_contiguous(sizeof(struct sub_group), MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    struct sub_group * recv = mymalloc("SubfindRecvGroups", (nrecv + 1) * sizeof(struct sub_group));
+    MPI_Alltoallv_smart(send, Send_count, Send_offset, type, recv, Recv_count, Recv_offset, type, Comm);
+
+    /* Total lengths of the groups owned by this task*/
+    struct sub_group * own = mymalloc("SubfindOwnGroups", (nrecv + 1) * sizeof(struct sub_group));
+    memcpy(own, recv, nrecv * sizeof(struct sub_group));
+    qsort_openmp(own, nrecv, sizeof(struct sub_group), subfind_cmp_grnr);
+    int64_t nown = 0;
+    for(i = 0; i < nrecv; i++) {
+        if(nown > 0 && own[nown-1].GrNr == own[i].GrNr)
+            own[nown-1].Len += own[i].Len;
+        else
+            own[nown++] = own[i];
+    }
+
+    /* Keep the groups which fit on their owner. GrNr is in order of decreasing length, so the largest go first.*/
+    int nreject = 0;
+    for(i = 0; i < nown; i++) {
+        own[i].Target = -1;
+        if(own[i].Len < SubfindParams.MinLength)
+            continue;
+        if(subfind_fits(&mine, own[i].Len, partbytes, groupbytes)) {
+            subfind_place(&mine, own[i].Len);
+            own[i].Target = ThisTask;
+        }
+        else
+            nreject++;
+    }
+
+    /* Place the other groups on the task with the most room. Every task computes the same placement.*/
+    struct sub_task_load * loads = ta_malloc("SubfindLoads", struct sub_task_load, NTask);
+    MPI_Allgather(&mine, sizeof(mine), MPI_BYTE, loads, sizeof(mine), MPI_BYTE, Comm);
+    int * Reject_count = ta_malloc("Reject_count", int, 2 * NTask);
+    int * Reject_offset = Reject_count + NTask;
+    MPI_Allgather(&nreject, 1, MPI_INT, Reject_count, 1, MPI_INT, Comm);
+    int64_t totreject = 0;
+    Reject_offset[0] = 0;
+    for(i = 0; i < NTask; i++) {
+        totreject += Reject_count[i];
+        if(i > 0)
+            Reject_offset[i] = Reject_offset[i-1] + Reject_count[i-1];
+    }
+    struct sub_group * reject = mymalloc("SubfindRejectGroups", (totreject + 1) * sizeof(struct sub_group));
+    int64_t nr = Reject_offset[ThisTask];
+    for(i = 0; i < nown; i++)
+        if(own[i].Target < 0 && own[i].Len >= SubfindParams.MinLength)
+            reject[nr++] = own[i];
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, reject, Reject_count, Reject_offset, type, Comm);
+
+    int64_t notsearched = 0;
+    qsort_openmp(reject, totreject, sizeof(struct sub_group), subfind_cmp_len);
+    for(i = 0; i < totreject; i++) {
+        int t, best = -1;
+        for(t = 0; t < NTask; t++) {
+            if(!subfind_fits(&loads[t], reject[i].Len, partbytes, groupbytes))
+                continue;
+            if(best < 0 || loads[t].MaxPart - loads[t].Load > loads[best].MaxPart - loads[best].Load)
+                best = t;
+        }
+        reject[i].Target = best;
+        if(best >= 0)
+            subfind_place(&loads[best], reject[i].Len);
+        else
+            notsearched++;
+    }
+    qsort_openmp(reject, totreject, sizeof(struct sub_group), subfind_cmp_grnr);
+    for(i = 0; i < nown; i++) {
+        if(own[i].Target >= 0 || own[i].Len < SubfindParams.MinLength)
+            continue;
+        const struct sub_group * r = bsearch(&own[i], reject, totreject, sizeof(struct sub_group), subfind_cmp_grnr);
+        own[i].Target = r->Target;
+    }
+    if(totreject > 0)
+        message(0, "%ld groups did not fit on their task, %ld are too large to search anywhere.\n", totreject, notsearched);
+
+    /* Send the targets back to the tasks holding the particles*/
+    for(i = 0; i < nrecv; i++) {
+        const struct sub_group * o = bsearch(&recv[i], own, nown, sizeof(struct sub_group), subfind_cmp_grnr);
+        recv[i].Target = o->Target;
+    }
+    MPI_Alltoallv_smart(recv, Recv_count, Recv_offset, type, send, Send_count, Send_offset, type, Comm);
+    MPI_Type_free(&type);
+
+    qsort_openmp(send, nsend, sizeof(struct sub_group), subfind_cmp_grnr);
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        struct particle_data * pp = &halo_pman->Base[i];
+        const struct sub_group key = {pp->GrNr, 0, 0};
+        const struct sub_group * o = bsearch(&key, send, nsend, sizeof(struct sub_group), subfind_cmp_grnr);
+        if(o->Target < 0) {
+            pp->IsGarbage = 1;
+            pp->TargetTask = ThisTask;
+        }
+        else
+            pp->TargetTask = o->Target;
+    }
+
+    myfree(reject);
+    ta_free(Reject_count);
+    ta_free(loads);
+    myfree(own);
+    myfree(recv);
+    myfree(send);
+    ta_free(Send_count);
+    myfree(grnr);
+    return notsearched;
+}
+
+static int
+subfind_layout(int i, const void * userdata)
+{
+    const struct part_manager_type * halo_pman = userdata;
+    return halo_pman->Base[i].TargetTask;
+}
+
+/* Estimate the density of each particle with the SPH kernel, using the smoothing length loop of the
+ * density code on a tree of the halo particles of this task. The domain is local: each group is on one task,
+ * so nothing is exported and the neighbour indices below are valid on this task.*/
+
+typedef struct {
+    TreeWalkNgbIterBase base;
+    DensityKernel kernel[NHSML];
+    double kernel_volume[NHSML];
+} TreeWalkNgbIterSubfindDensity;
+
+typedef struct
+{
+    TreeWalkQueryBase base;
+    MyFloat Hsml[NHSML];
+} TreeWalkQuerySubfindDensity;
+
+typedef struct {
+    TreeWalkResultBase base;
+    MyFloat Rho[NHSML];
+    MyFloat Ngb[NHSML];
+    int maxcmpte;
+    int _alignment;
+} TreeWalkResultSubfindDensity;
+
+struct SubfindDensityPriv {
+    /* Current number of neighbours*/
+    MyFloat (*NumNgb)[NHSML];
+    /* Lower and upper bounds on smoothing length*/
+    MyFloat *Left, *Right;
+    MyFloat (*Rho)[NHSML];
+    /* Maximum index where NumNgb is valid. */
+    int * maxcmpte;
+    /* Output: the density of each particle*/
+    MyFloat * Density;
+    /* Output: the two densest denser neighbours in the same group*/
+    int (*Ngb)[2];
+    /* Group of each particle*/
+    const int64_t * GrNr;
+};
+
+#define SUBFIND_GET_PRIV(tw) ((struct SubfindDensityPriv*) ((tw)->priv))
+
+static int
+subfind_density_haswork(int i, TreeWalk * tw)
+{
+    return 1;
+}
+
+/* Get Hsml for one of the evaluations*/
+static inline double
+subfind_effhsml(int place, int i, TreeWalk * tw)
+{
+    double left = SUBFIND_GET_PRIV(tw)->Left[place];
+    double right = SUBFIND_GET_PRIV(tw)->Right[place];
+    /* Start from the size of the tree node containing the particle*/
+    if(left == 0 && right > 0.99*tw->tree->BoxSize && P[place].Hsml == 0) {
+        int fat = force_get_father(place, tw->tree);
+        P[place].Hsml = tw->tree->Nodes[fat].len;
+        if(P[place].Hsml == 0)
+            P[place].Hsml = tw->tree->BoxSize / pow(PartManager->NumPart, 1./3)/4.;
+    }
+    if(right > 0.99*tw->tree->BoxSize)
+        right = P[place].Hsml * ((1.+NHSML)/NHSML);
+    if(left == 0)
+        left = 0.1 * P[place].Hsml;
+    /* Evenly spaced in volume, since NumNgb ~ h^3.*/
+    double rvol = pow(right, 3);
+    double lvol = pow(left, 3);
+    return pow((1.*i+1)/(1.*NHSML+1) * (rvol - lvol) + lvol, 1./3);
+}
+
+static void
+subfind_density_copy(int place, TreeWalkQuerySubfindDensity * I, TreeWalk * tw)
+{
+    int i;
+    for(i = 0; i < NHSML; i++)
+        I->Hsml[i] = subfind_effhsml(place, i, tw);
+}
+
+static void
+subfind_density_reduce(int place, TreeWalkResultSubfindDensity * remote, enum TreeWalkReduceMode mode, TreeWalk * tw)
+{
+    struct SubfindDensityPriv * priv = SUBFIND_GET_PRIV(tw);
+    int i;
+    if(mode == 0 || priv->maxcmpte[place] > remote->maxcmpte)
+        priv->maxcmpte[place] = remote->maxcmpte;
+    for(i = 0; i < remote->maxcmpte; i++) {
+        TREEWALK_REDUCE(priv->NumNgb[place][i], remote->Ngb[i]);
+        TREEWALK_REDUCE(priv->Rho[place][i], remote->Rho[i]);
+    }
+}
+
+static void
+subfind_density_check_neighbours(int i, TreeWalk * tw)
+{
+    struct SubfindDensityPriv * priv = SUBFIND_GET_PRIV(tw);
+    MyFloat * Left = priv->Left;
+    MyFloat * Right = priv->Right;
+    const int tid = omp_get_thread_num();
+    const double desnumngb = SubfindParams.DesNumNgb;
+
+    const int maxcmpt = priv->maxcmpte[i];
+    int j;
+    double evalhsml[NHSML];
+    for(j = 0; j < maxcmpt; j++)
+        evalhsml[j] = subfind_effhsml(i, j, tw);
+
+    int close = 0;
+    P[i].Hsml = ngb_narrow_down(&Right[i], &Left[i], evalhsml, priv->NumNgb[i], maxcmpt, desnumngb, &close, tw->tree->BoxSize);
+    const double numngb = priv->NumNgb[i][close];
+    priv->Density[i] = priv->Rho[i][close];
+
+    if(numngb < desnumngb - SUBFIND_NGB_DEVIATION || numngb > desnumngb + SUBFIND_NGB_DEVIATION) {
+        /* Particles at the same position: accept the current estimate*/
+        if((Right[i] - Left[i]) < 1.0e-4 * Left[i]) {
+            message(1, "Very tight Hsml bounds for i=%d ID=%lu Hsml=%g Left=%g Right=%g Ngbs=%g\n",
+                i, P[i].ID, P[i].Hsml, Left[i], Right[i], numngb);
+            return;
+        }
+        tw->NPRedo[tid][tw->NPLeft[tid]] = i;
+        tw->NPLeft[tid] ++;
+    }
+    if(tw->maxnumngb[tid] < numngb)
+        tw->maxnumngb[tid] = numngb;
+    if(tw->minnumngb[tid] > numngb)
+        tw->minnumngb[tid] = numngb;
+}
+
+static void
+subfind_density_ngbiter(
+        TreeWalkQuerySubfindDensity * I,
+        TreeWalkResultSubfindDensity * O,
+        TreeWalkNgbIterSubfindDensity * iter,
+        LocalTreeWalk * lv)
+{
+    int i;
+    if(iter->base.other == -1) {
+        for(i = 0; i < NHSML; i++) {
+            density_kernel_init(&iter->kernel[i], I->Hsml[i], GetDensityKernelType());
+            iter->kernel_volume[i] = density_kernel_volume(&iter->kernel[i]);
+        }
+        iter->base.Hsml = I->Hsml[NHSML-1];
+        iter->base.mask = 0xff; /* all particles */
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        O->maxcmpte = NHSML;
+        return;
+    }
+    const int other = iter->base.other;
+    for(i = 0; i < O->maxcmpte; i++) {
+        if(iter->base.r2 < iter->kernel[i].HH) {
+            const double wk = density_kernel_wk(&iter->kernel[i], iter->base.r * iter->kernel[i].Hinv);
+            O->Ngb[i] += wk * iter->kernel_volume[i];
+            O->Rho[i] += P[other].Mass * wk;
+        }
+    }
+    /* Entries past the first with enough neighbours are not needed*/
+    for(i = 0; i < NHSML; i++) {
+        if(O->Ngb[i] > SubfindParams.DesNumNgb) {
+            O->maxcmpte = i+1;
+            iter->base.Hsml = I->Hsml[i];
+            break;
+        }
+    }
+}
+
+typedef struct {
+    TreeWalkQueryBase base;
+    MyFloat Density;
+    int64_t GrNr;
+    int Index;
+    int _alignment;
+} TreeWalkQuerySubfindNgb;
+
+typedef struct {
+    TreeWalkResultBase base;
+    int Ngb[2];
+} TreeWalkResultSubfindNgb;
+
+/* Ties are broken by the particle index, matching the order of the particles within a group*/
+#define DENSER(rho_a, a, rho_b, b) ((rho_a) > (rho_b) || ((rho_a) == (rho_b) && (a) < (b)))
+
+/* Add o to the two densest neighbours in ngb*/
+static void
+subfind_add_ngb(int * ngb, const int o, const MyFloat * Density)
+{
+    if(ngb[0] == o || ngb[1] == o)
+        return;
+    if(ngb[0] < 0 || DENSER(Density[o], o, Density[ngb[0]], ngb[0])) {
+        ngb[1] = ngb[0];
+        ngb[0] = o;
+    }
+    else if(ngb[1] < 0 || DENSER(Density[o], o, Density[ngb[1]], ngb[1]))
+        ngb[1] = o;
+}
+
+static void
+subfind_ngb_copy(int place, TreeWalkQuerySubfindNgb * I, TreeWalk * tw)
+{
+    I->Density = SUBFIND_GET_PRIV(tw)->Density[place];
+    I->GrNr = SUBFIND_GET_PRIV(tw)->GrNr[place];
+    I->Index = place;
+}
+
+static void
+subfind_ngb_reduce(int place, TreeWalkResultSubfindNgb * remote, enum TreeWalkReduceMode mode, TreeWalk * tw)
+{
+    struct SubfindDensityPriv * priv = SUBFIND_GET_PRIV(tw);
+    int k;
+    if(mode == 0)
+        priv->Ngb[place][0] = priv->Ngb[place][1] = -1;
+    for(k = 0; k < 2; k++)
+        if(remote->Ngb[k] >= 0)
+            subfind_add_ngb(priv->Ngb[place], remote->Ngb[k], priv->Density);
+}
+
+static void
+subfind_ngb_ngbiter(
+        TreeWalkQuerySubfindNgb * I,
+        TreeWalkResultSubfindNgb * O,
+        TreeWalkNgbIterBase * iter,
+        LocalTreeWalk * lv)
+{
+    struct SubfindDensityPriv * priv = SUBFIND_GET_PRIV(lv->tw);
+    if(iter->other == -1) {
+        iter->Hsml = P[I->Index].Hsml;
+        iter->mask = 0xff; /* all particles */
+        iter->symmetric = NGB_TREEFIND_ASYMMETRIC;
+        O->Ngb[0] = O->Ngb[1] = -1;
+        return;
+    }
+    const int other = iter->other;
+    if(other == I->Index || priv->GrNr[other] != I->GrNr)
+        return;
+    if(DENSER(priv->Density[other], other, I->Density, I->Index))
+        subfind_add_ngb(O->Ngb, other, priv->Density);
+}
+
+/* Estimate the density of each halo particle and find its two densest denser neighbours in the same group.
+ * The particles must be in PartManager, with the tree built over them.*/
+static void
+subfind_density(const ForceTree * tree, const int64_t * GrNr, MyFloat * Density, int (*Ngb)[2])
+{
+    TreeWalk tw[1] = {{0}};
+    struct SubfindDensityPriv priv[1];
+    const int64_t NumPart = PartManager->NumPart;
+    int64_t i;
+
+    tw->ev_label = "SUBFIND_DENSITY";
+    tw->visit = treewalk_visit_nolist_ngbiter;
+    tw->NoNgblist = 1;
+    tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterSubfindDensity);
+    tw->ngbiter = (TreeWalkNgbIterFunction) subfind_density_ngbiter;
+    tw->haswork = subfind_density_haswork;
+    tw->fill = (TreeWalkFillQueryFunction) subfind_density_copy;
+    tw->reduce = (TreeWalkReduceResultFunction) subfind_density_reduce;
+    tw->postprocess = (TreeWalkProcessFunction) subfind_density_check_neighbours;
+    tw->query_type_elsize = sizeof(TreeWalkQuerySubfindDensity);
+    tw->result_type_elsize = sizeof(TreeWalkResultSubfindDensity);
+    tw->priv = priv;
+    tw->tree = tree;
+
+    priv->Density = Density;
+    priv->Ngb = Ngb;
+    priv->GrNr = GrNr;
+    priv->Left = (MyFloat *) mymalloc("SUBFIND_PRIV->Left", NumPart * sizeof(MyFloat));
+    priv->Right = (MyFloat *) mymalloc("SUBFIND_PRIV->Right", NumPart * sizeof(MyFloat));
+    priv->NumNgb = (MyFloat (*) [NHSML]) mymalloc("SUBFIND_PRIV->NumNgb", NumPart * sizeof(priv->NumNgb[0]));
+    priv->Rho = (MyFloat (*) [NHSML]) mymalloc("SUBFIND_PRIV->Rho", NumPart * sizeof(priv->Rho[0]));
+    priv->maxcmpte = (int *) mymalloc("SUBFIND_PRIV->maxcmpte", NumPart * sizeof(int));
+
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        priv->Left[i] = 0;
+        priv->Right[i] = tree->BoxSize;
+        P[i].Hsml = 0;
+    }
+
+    treewalk_do_hsml_loop(tw, NULL, NumPart, 1);
+
+    myfree(priv->maxcmpte);
+    myfree(priv->Rho);
+    myfree(priv->NumNgb);
+    myfree(priv->Right);
+    myfree(priv->Left);
+
+    /* Second walk over the converged smoothing lengths for the denser neighbours*/
+    TreeWalk tw2[1] = {{0}};
+    tw2->ev_label = "SUBFIND_NGB";
+    tw2->visit = treewalk_visit_nolist_ngbiter;
+    tw2->NoNgblist = 1;
+    tw2->ngbiter_type_elsize = sizeof(TreeWalkNgbIterBase);
+    tw2->ngbiter = (TreeWalkNgbIterFunction) subfind_ngb_ngbiter;
+    tw2->haswork = subfind_density_haswork;
+    tw2->fill = (TreeWalkFillQueryFunction) subfind_ngb_copy;
+    tw2->reduce = (TreeWalkReduceResultFunction) subfind_ngb_reduce;
+    tw2->query_type_elsize = sizeof(TreeWalkQuerySubfindNgb);
+    tw2->result_type_elsize = sizeof(TreeWalkResultSubfindNgb);
+    tw2->priv = priv;
+    tw2->tree = tree;
+    treewalk_run(tw2, NULL, NumPart);
+}
+
+/* Build a tree over the halo particles, which after the exchange need no other task,
+ * and find the density and denser neighbours of each.*/
+static void
+subfind_halo_density(struct part_manager_type * halo_pman, MyFloat * Density, int (*Ngb)[2], MPI_Comm Comm)
+{
+    int NTask, ThisTask;
+    int64_t i;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+
+    /* GrNr shares storage with the Peano key used by the tree*/
+    int64_t * GrNr = mymalloc("SubfindGrNr", (halo_pman->NumPart + 1) * sizeof(int64_t));
+    for(i = 0; i < halo_pman->NumPart; i++)
+        GrNr[i] = halo_pman->Base[i].GrNr;
+
+    /* A domain with a single top-level node on every task*/
+    DomainDecomp dd = {0};
+    dd.domain_allocated_flag = 1;
+    dd.DomainComm = Comm;
+    dd.NTopNodes = 1;
+    dd.NTopLeaves = 1;
+    dd.TopNodes = mymalloc("SubfindTopNode", sizeof(struct topnode_data));
+    dd.TopNodes[0].Daughter = -1;
+    dd.TopNodes[0].Leaf = 0;
+    dd.TopNodes[0].StartKey = 0;
+    dd.TopNodes[0].Shift = BITS_PER_DIMENSION * 3;
+    dd.TopLeaves = mymalloc("SubfindTopLeaf", sizeof(struct topleaf_data));
+    dd.TopLeaves[0].Task = ThisTask;
+    dd.TopLeaves[0].topnode = 0;
+    dd.Tasks = mymalloc("SubfindTasks", NTask * sizeof(struct task_data));
+    memset(dd.Tasks, 0, NTask * sizeof(struct task_data));
+    dd.Tasks[ThisTask].EndLeaf = 1;
+
+    /* The tree and the tree walk use the global particle table*/
+    struct part_manager_type saved = PartManager[0];
+    PartManager[0] = *halo_pman;
+    for(i = 0; i < PartManager->NumPart; i++)
+        P[i].Key = PEANO(P[i].Pos, All.BoxSize);
+
+    ForceTree tree = {0};
+    force_tree_rebuild(&tree, &dd, All.BoxSize, 0, 0, NULL);
+    subfind_density(&tree, GrNr, Density, Ngb);
+    force_tree_free(&tree);
+
+    *halo_pman = PartManager[0];
+    PartManager[0] = saved;
+
+    myfree(dd.Tasks);
+    myfree(dd.TopLeaves);
+    myfree(dd.TopNodes);
+    for(i = 0; i < halo_pman->NumPart; i++)
+        halo_pman->Base[i].GrNr = GrNr[i];
+    myfree(GrNr);
+}
+
+/* Find the subhalo candidates from the saddle points of the density field. Returns the number of candidates.*/
+static int
+subfind_candidates(struct sub_work * w, const int n)
+{
+    struct sub_particle * sp = w->sp;
+    int * Head = w->Head, * Next = w->Next, * Tail = w->Tail, * Len = w->Len;
+    int i, k, ncand = 0;
+
+    /* Decreasing density*/
+    for(i = 0; i < n; i++) {
+        w->order[i].Key = -sp[i].Density;
+        w->order[i].Index = i;
+    }
+    qsort_openmp(w->order, n, sizeof(struct sub_sort), subfind_cmp_key);
+
+    for(k = 0; k < n; k++) {
+        i = w->order[k].Index;
+        const int a = sp[i].Ngb[0], b = sp[i].Ngb[1];
+        int ha = a >= 0 ? Head[a] : -1;
+        int hb = b >= 0 ? Head[b] : -1;
+        Next[i] = -1;
+        /* A local density maximum starts a new subgroup*/
+        if(ha < 0) {
+            Head[i] = Tail[i] = i;
+            Len[i] = 1;
+            continue;
+        }
+        if(hb >= 0 && hb != ha) {
+            /* Saddle point: both subgroups are candidates*/
+            if(Len[ha] >= SubfindParams.MinLength) {
+                w->cand[ncand].Head = ha;
+                w->cand[ncand++].Len = Len[ha];
+            }
+            if(Len[hb] >= SubfindParams.MinLength) {
+                w->cand[ncand].Head = hb;
+                w->cand[ncand++].Len = Len[hb];
+            }
+            /* Join the smaller subgroup to the end of the larger,
+             * so that each candidate remains contiguous along the chain.*/
+            if(Len[ha] < Len[hb]) {
+                int tmp = ha;
+                ha = hb;
+                hb = tmp;
+            }
+            Next[Tail[ha]] = hb;
+            Tail[ha] = Tail[hb];
+            Len[ha] += Len[hb];
+            int p;
+            for(p = hb; p >= 0; p = Next[p])
+                Head[p] = ha;
+        }
+        Next[Tail[ha]] = i;
+        Tail[ha] = i;
+        Len[ha]++;
+        Head[i] = ha;
+    }
+    /* The whole group is the last candidate*/
+    w->cand[ncand].Head = -1;
+    w->cand[ncand++].Len = n;
+    qsort(w->cand, ncand, sizeof(struct sub_candidate), subfind_cmp_candidate);
+    return ncand;
+}
+
+/* Build a node of the potential tree from the particles idx[start .. start+count), returning its index.*/
+static int
+subfind_tree_node(struct sub_tree * tree, const struct sub_particle * sp, int * idx, const int start, const int count, const double * center, const double len, const int depth)
+{
+    if(tree->NNodes == tree->MaxNodes) {
+        tree->MaxNodes = 2 * tree->MaxNodes + 64;
+        tree->Nodes = realloc(tree->Nodes, tree->MaxNodes * sizeof(struct sub_node));
+        if(!tree->Nodes)
+            endrun(5, "Could not allocate %d subfind tree nodes\n", tree->MaxNodes);
+    }
+    const int no = tree->NNodes++;
+    struct sub_node * node = &tree->Nodes[no];
+    int i, d;
+    node->Len = len;
+    node->Mass = 0;
+    for(d = 0; d < 3; d++) {
+        node->Center[d] = center[d];
+        node->CM[d] = 0;
+    }
+    for(i = 0; i < 8; i++)
+        node->Child[i] = -1;
+    for(i = start; i < start + count; i++) {
+        node->Mass += sp[idx[i]].Mass;
+        for(d = 0; d < 3; d++)
+            node->CM[d] += sp[idx[i]].Mass * sp[idx[i]].Pos[d];
+    }
+    for(d = 0; d < 3; d++)
+        node->CM[d] = node->Mass > 0 ? node->CM[d] / node->Mass : center[d];
+    node->Start = start;
+    node->Count = count;
+    node->Leaf = (count <= SUBFIND_LEAFSIZE || depth >= SUBFIND_MAXDEPTH);
+    if(node->Leaf)
+        return no;
+
+    /* Sort the particles into octants*/
+    int octcount[8] = {0}, octstart[8];
+    for(i = start; i < start + count; i++) {
+        int oct = 0;
+        for(d = 0; d < 3; d++)
+            oct |= (sp[idx[i]].Pos[d] > center[d]) << d;
+        octcount[oct]++;
+    }
+    octstart[0] = 0;
+    for(i = 1; i < 8; i++)
+        octstart[i] = octstart[i-1] + octcount[i-1];
+    int octfill[8];
+    memcpy(octfill, octstart, sizeof(octfill));
+    for(i = start; i < start + count; i++) {
+        int oct = 0;
+        for(d = 0; d < 3; d++)
+            oct |= (sp[idx[i]].Pos[d] > center[d]) << d;
+        tree->Tmp[octfill[oct]++] = idx[i];
+    }
+    memcpy(idx + start, tree->Tmp, count * sizeof(int));
+
+    for(i = 0; i < 8; i++) {
+        if(octcount[i] == 0)
+            continue;
+        double subcenter[3];
+        for(d = 0; d < 3; d++)
+            subcenter[d] = center[d] + ((i >> d) & 1 ? 0.25 : -0.25) * len;
+        int child = subfind_tree_node(tree, sp, idx, start + octstart[i], octcount[i], subcenter, len / 2, depth + 1);
+        /* The node array may have moved*/
+        tree->Nodes[no].Child[i] = child;
+    }
+    return no;
+}
+
+/* Potential of particle i from the tree, in units of -G/a*/
+static double
+subfind_tree_potential(const struct sub_tree * tree, const struct sub_particle * sp, const int * idx, const int i, const double eps2)
+{
+    int stack[8 * (SUBFIND_MAXDEPTH + 2)];
+    int nstack = 0;
+    double pot = 0;
+    const double theta2 = SubfindParams.ErrTolTheta * SubfindParams.ErrTolTheta;
+    stack[nstack++] = 0;
+    while(nstack > 0) {
+        const struct sub_node * node = &tree->Nodes[stack[--nstack]];
+        int d, j;
+        if(node->Leaf) {
+            for(j = node->Start; j < node->Start + node->Count; j++) {
+                const int o = idx[j];
+                if(o == i)
+                    continue;
+                double r2 = 0;
+                for(d = 0; d < 3; d++)
+                    r2 += (sp[o].Pos[d] - sp[i].Pos[d]) * (sp[o].Pos[d] - sp[i].Pos[d]);
+                pot += sp[o].Mass / sqrt(r2 + eps2);
+            }
+            continue;
+        }
+        double r2 = 0;
+        int inside = 1;
+        for(d = 0; d < 3; d++) {
+            r2 += (node->CM[d] - sp[i].Pos[d]) * (node->CM[d] - sp[i].Pos[d]);
+            if(fabs(sp[i].Pos[d] - node->Center[d]) > 0.5 * node->Len)
+                inside = 0;
+        }
+        /* Use the monopole of distant nodes which do not contain the particle*/
+        if(!inside && node->Len * node->Len < theta2 * r2) {
+            pot += node->Mass / sqrt(r2 + eps2);
+            continue;
+        }
+        for(j = 0; j < 8; j++)
+            if(node->Child[j] >= 0)
+                stack[nstack++] = node->Child[j];
+    }
+    return pot;
+}
+
+/* Compute the potential of the particles in list, from each other only.*/
+static void
+subfind_potential(struct sub_particle * sp, int * list, const int m, struct sub_tree * tree)
+{
+    const double fac = All.G / All.cf.a;
+    /* Plummer equivalent softening of the dark matter*/
+    const double eps = FORCE_SOFTENING(0, 1) / 2.8;
+    const double eps2 = eps * eps;
+    int k;
+    if(m < SUBFIND_DIRECT) {
+        #pragma omp parallel for if(m > 200)
+        for(k = 0; k < m; k++) {
+            const int i = list[k];
+            double pot = 0;
+            int j, d;
+            for(j = 0; j < m; j++) {
+                const int o = list[j];
+                if(o == i)
+                    continue;
+                double r2 = 0;
+                for(d = 0; d < 3; d++)
+                    r2 += (sp[o].Pos[d] - sp[i].Pos[d]) * (sp[o].Pos[d] - sp[i].Pos[d]);
+                pot += sp[o].Mass / sqrt(r2 + eps2);
+            }
+            sp[i].Potential = -fac * pot;
+        }
+        return;
+    }
+    /* Bounding cube of the candidate. Building the tree reorders list.*/
+    double min[3], max[3], center[3], len = 0;
+    int d;
+    for(d = 0; d < 3; d++)
+        min[d] = max[d] = sp[list[0]].Pos[d];
+    for(k = 1; k < m; k++)
+        for(d = 0; d < 3; d++) {
+            min[d] = fmin(min[d], sp[list[k]].Pos[d]);
+            max[d] = fmax(max[d], sp[list[k]].Pos[d]);
+        }
+    for(d = 0; d < 3; d++) {
+        center[d] = 0.5 * (min[d] + max[d]);
+        len = fmax(len, max[d] - min[d]);
+    }
+    tree->NNodes = 0;
+    subfind_tree_node(tree, sp, list, 0, m, center, len * (1 + 1e-6) + 1e-10, 0);
+
+    #pragma omp parallel for
+    for(k = 0; k < m; k++)
+        sp[list[k]].Potential = -fac * subfind_tree_potential(tree, sp, list, list[k], eps2);
+}
+
+/* Remove the unbound particles from list, returning the number of bound particles.
+ * Energies are physical, relative to the most bound particle and the mean velocity.*/
+static int
+subfind_unbind(struct sub_work * w, int * list, int m)
+{
+    struct sub_particle * sp = w->sp;
+    const double a = All.cf.a;
+    const double hubble_a = All.cf.hubble * a;
+    while(m >= SubfindParams.MinLength) {
+        subfind_potential(sp, list, m, &w->tree);
+        int k, d, minp = list[0];
+        double vcm[3] = {0}, mass = 0;
+        for(k = 0; k < m; k++) {
+            const int i = list[k];
+            if(sp[i].Potential < sp[minp].Potential)
+                minp = i;
+            mass += sp[i].Mass;
+            for(d = 0; d < 3; d++)
+                vcm[d] += sp[i].Mass * sp[i].Vel[d];
+        }
+        for(d = 0; d < 3; d++)
+            vcm[d] /= mass;
+        int nunbound = 0;
+        for(k = 0; k < m; k++) {
+            const int i = list[k];
+            double v2 = 0;
+            for(d = 0; d < 3; d++) {
+                /* Peculiar velocity plus the Hubble flow*/
+                double v = (sp[i].Vel[d] - vcm[d]) / a + hubble_a * (sp[i].Pos[d] - sp[minp].Pos[d]);
+                v2 += v * v;
+            }
+            sp[i].Energy = sp[i].Potential + 0.5 * v2;
+            if(sp[i].Energy > 0)
+                nunbound++;
+        }
+        if(nunbound == 0)
+            break;
+        /* Remove at most a quarter of the particles at once, so the centre is not lost.*/
+        if(nunbound > m / 4) {
+            for(k = 0; k < m; k++) {
+                w->order[k].Key = sp[list[k]].Energy;
+                w->order[k].Index = list[k];
+            }
+            qsort_openmp(w->order, m, sizeof(struct sub_sort), subfind_cmp_key);
+            m -= m / 4;
+            for(k = 0; k < m; k++)
+                list[k] = w->order[k].Index;
+        }
+        else {
+            int nbound = 0;
+            for(k = 0; k < m; k++)
+                if(sp[list[k]].Energy <= 0)
+                    list[nbound++] = list[k];
+            m = nbound;
+        }
+    }
+    return m;
+}
+
+/* Wrap a position relative to the first particle of the group back into the box*/
+static double
+subfind_box_position(const double x, const double first, const double offset)
+{
+    double out = x + first - offset;
+    while(out >= All.BoxSize)
+        out -= All.BoxSize;
+    while(out < 0)
+        out += All.BoxSize;
+    return out;
+}
+
+static void
+subfind_properties(struct sub_work * w, const int * list, const int m, const double * FirstPos, const double * offset, struct Subhalo * sub)
+{
+    struct sub_particle * sp = w->sp;
+    const double velfac = GetUsePeculiarVelocity() ? 1. / All.cf.a : 1.;
+    double mass = 0, massType[6] = {0}, cm[3] = {0}, vel[3] = {0};
+    int k, d, mostbound = list[0];
+    memset(sub, 0, sizeof(struct Subhalo));
+    for(k = 0; k < m; k++) {
+        const int i = list[k];
+        if(sp[i].Energy < sp[mostbound].Energy)
+            mostbound = i;
+        mass += sp[i].Mass;
+        massType[sp[i].Type] += sp[i].Mass;
+        sub->LenType[sp[i].Type]++;
+        for(d = 0; d < 3; d++) {
+            cm[d] += sp[i].Mass * sp[i].Pos[d];
+            vel[d] += sp[i].Mass * sp[i].Vel[d];
+        }
+    }
+    double disp = 0;
+    for(d = 0; d < 3; d++) {
+        cm[d] /= mass;
+        vel[d] /= mass;
+    }
+    for(k = 0; k < m; k++)
+        for(d = 0; d < 3; d++)
+            disp += sp[list[k]].Mass * pow(velfac * (sp[list[k]].Vel[d] - vel[d]), 2);
+
+    sub->Length = m;
+    sub->Mass = mass;
+    for(k = 0; k < 6; k++)
+        sub->MassType[k] = massType[k];
+    sub->MostBoundID = sp[mostbound].ID;
+    sub->VelDisp = sqrt(disp / (3 * mass));
+    for(d = 0; d < 3; d++) {
+        sub->Pos[d] = subfind_box_position(sp[mostbound].Pos[d], FirstPos[d], offset[d]);
+        sub->CM[d] = subfind_box_position(cm[d], FirstPos[d], offset[d]);
+        sub->Vel[d] = velfac * vel[d];
+    }
+
+    /* Radial profile around the most bound particle*/
+    for(k = 0; k < m; k++) {
+        double r2 = 0;
+        for(d = 0; d < 3; d++)
+            r2 += pow(sp[list[k]].Pos[d] - sp[mostbound].Pos[d], 2);
+        w->order[k].Key = sqrt(r2);
+        w->order[k].Index = list[k];
+    }
+    qsort_openmp(w->order, m, sizeof(struct sub_sort), subfind_cmp_key);
+    double menc = 0;
+    for(k = 0; k < m; k++) {
+        menc += sp[w->order[k].Index].Mass;
+        const double r = w->order[k].Key;
+        if(sub->HalfMassRadius == 0 && menc >= 0.5 * mass)
+            sub->HalfMassRadius = r;
+        if(r > 0) {
+            /* Physical circular velocity*/
+            double vc = sqrt(All.G * menc / (All.cf.a * r));
+            if(vc > sub->Vmax) {
+                sub->Vmax = vc;
+                sub->RVmax = r;
+            }
+        }
+    }
+}
+
+/* Find the subhaloes of one group in w->sp, which has the densities and denser neighbours set.
+ * Returns the number found, stored in subs.*/
+static int
+subfind_group(struct sub_work * w, const int n, const double * FirstPos, const double * offset, const int64_t GrNr, struct Subhalo * subs)
+{
+    struct sub_particle * sp = w->sp;
+    int c, k, nsubs = 0;
+
+    const int ncand = subfind_candidates(w, n);
+
+    /* Smallest candidates first: each particle belongs to the smallest subhalo in which it is bound.*/
+    for(c = 0; c < ncand; c++) {
+        int m = 0;
+        if(w->cand[c].Head < 0) {
+            for(k = 0; k < n; k++)
+                if(sp[k].SubNr < 0)
+                    w->list[m++] = k;
+        }
+        else {
+            int p = w->cand[c].Head;
+            for(k = 0; k < w->cand[c].Len; k++, p = w->Next[p])
+                if(sp[p].SubNr < 0)
+                    w->list[m++] = p;
+        }
+        if(m < SubfindParams.MinLength)
+            continue;
+        m = subfind_unbind(w, w->list, m);
+        if(m < SubfindParams.MinLength)
+            continue;
+        for(k = 0; k < m; k++)
+            sp[w->list[k]].SubNr = nsubs;
+        subfind_properties(w, w->list, m, FirstPos, offset, &subs[nsubs]);
+        subs[nsubs].GrNr = GrNr;
+        nsubs++;
+    }
+    qsort(subs, nsubs, sizeof(struct Subhalo), subfind_cmp_length);
+    for(k = 0; k < nsubs; k++)
+        subs[k].Rank = k;
+    return nsubs;
+}
+
+/* Unbind a set of particles, for the tests*/
+int
+subfind_unbind_particles(const double (*pos)[3], const double (*vel)[3], const double * mass, const int n, int * bound)
+{
+    struct sub_work w[1] = {0};
+    int k, d;
+    w->sp = mymalloc("SubfindPart", (n + 1) * sizeof(struct sub_particle));
+    w->order = mymalloc("SubfindOrder", (n + 1) * sizeof(struct sub_sort));
+    w->list = mymalloc("SubfindList", (n + 1) * sizeof(int));
+    w->tree.Tmp = mymalloc("SubfindTreeTmp", (n + 1) * sizeof(int));
+    for(k = 0; k < n; k++) {
+        for(d = 0; d < 3; d++) {
+            w->sp[k].Pos[d] = pos[k][d];
+            w->sp[k].Vel[d] = vel[k][d];
+        }
+        w->sp[k].Mass = mass[k];
+        w->list[k] = k;
+        bound[k] = 0;
+    }
+    const int m = subfind_unbind(w, w->list, n);
+    if(m >= SubfindParams.MinLength)
+        for(k = 0; k < m; k++)
+            bound[w->list[k]] = 1;
+    free(w->tree.Nodes);
+    myfree(w->tree.Tmp);
+    myfree(w->list);
+    myfree(w->order);
+    myfree(w->sp);
+    return m >= SubfindParams.MinLength ? m : 0;
+}
+
+void
+subfind_save_subhalos(BigFile * bf, struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, MPI_Comm Comm)
+{
+    int64_t i;
+
+    /* Place each group on a single task with room for it*/
+    const int64_t NotSearched = subfind_assign_tasks(halo_pman, halo_sman, Comm);
+    if(domain_exchange(subfind_layout, halo_pman, 1, NULL, halo_pman, halo_sman, 10000, Comm))
+        endrun(1930, "Failed to exchange particles for the subhalo finder.\n");
+    walltime_measure("/FOF/Subhalo/Distribute");
+
+    const int64_t NumPart = halo_pman->NumPart;
+    struct particle_data * hp = halo_pman->Base;
+
+    /* Room for the most subhaloes possible*/
+    int64_t maxsubs = NumPart / (SubfindParams.MinLength > 1 ? SubfindParams.MinLength : 1) + 1;
+    struct Subhalo * subs = mymalloc("Subhalos", maxsubs * sizeof(struct Subhalo));
+
+    MyFloat * Density = mymalloc("SubfindDensity", (NumPart + 1) * sizeof(MyFloat));
+    int (*Ngb)[2] = mymalloc("SubfindNgb", (NumPart + 1) * sizeof(Ngb[0]));
+    subfind_halo_density(halo_pman, Density, Ngb, Comm);
+    walltime_measure("/FOF/Subhalo/Density");
+
+    /* Sort the particles by group*/
+    struct sub_sort * bygroup = mymalloc("SubfindByGroup", (NumPart + 1) * sizeof(struct sub_sort));
+    for(i = 0; i < NumPart; i++) {
+        bygroup[i].Key = hp[i].GrNr;
+        bygroup[i].Index = i;
+    }
+    qsort_openmp(bygroup, NumPart, sizeof(struct sub_sort), subfind_cmp_key);
+    int64_t maxlen = 0, start = 0;
+    for(i = 1; i <= NumPart; i++) {
+        if(i == NumPart || bygroup[i].Key != bygroup[start].Key) {
+            if(i - start > maxlen)
+                maxlen = i - start;
+            start = i;
+        }
+    }
+    /* Position of each particle within its group*/
+    int * pos = mymalloc("SubfindPos", (NumPart + 1) * sizeof(int));
+
+    struct sub_work w[1];
+    w->sp = mymalloc("SubfindPart", (maxlen + 1) * sizeof(struct sub_particle));
+    w->order = mymalloc("SubfindOrder", (maxlen + 1) * sizeof(struct sub_sort));
+    w->cand = mymalloc("SubfindCand", (2 * maxlen + 1) * sizeof(struct sub_candidate));
+    w->Head = mymalloc("SubfindHead", 5 * (maxlen + 1) * sizeof(int));
+    w->Next = w->Head + (maxlen + 1);
+    w->Tail = w->Next + (maxlen + 1);
+    w->Len = w->Tail + (maxlen + 1);
+    w->list = w->Len + (maxlen + 1);
+    w->tree.Tmp = mymalloc("SubfindTreeTmp", (maxlen + 1) * sizeof(int));
+    w->tree.Nodes = NULL;
+    w->tree.MaxNodes = 0;
+
+    int64_t nsubs = 0;
+    start = 0;
+    for(i = 1; i <= NumPart; i++) {
+        if(i < NumPart && bygroup[i].Key == bygroup[start].Key)
+            continue;
+        const int n = i - start;
+        const int first = bygroup[start].Index;
+        const int64_t GrNr = hp[first].GrNr;
+        const int64_t gstart = start;
+        start = i;
+        int k, d;
+        for(k = 0; k < n; k++)
+            pos[bygroup[gstart + k].Index] = k;
+        /* Positions relative to the first particle, so the group does not cross the box*/
+        for(k = 0; k < n; k++) {
+            const int index = bygroup[gstart + k].Index;
+            const struct particle_data * pp = &hp[index];
+            struct sub_particle * s = &w->sp[k];
+            for(d = 0; d < 3; d++) {
+                s->Pos[d] = pp->Pos[d] - hp[first].Pos[d];
+                if(s->Pos[d] >= 0.5 * All.BoxSize)
+                    s->Pos[d] -= All.BoxSize;
+                if(s->Pos[d] < -0.5 * All.BoxSize)
+                    s->Pos[d] += All.BoxSize;
+                s->Vel[d] = pp->Vel[d];
+            }
+            s->Mass = pp->Mass;
+            s->ID = pp->ID;
+            s->Type = pp->Type;
+            s->SubNr = -1;
+            s->Density = Density[index];
+            for(d = 0; d < 2; d++)
+                s->Ngb[d] = Ngb[index][d] >= 0 ? pos[Ngb[index][d]] : -1;
+        }
+        nsubs += subfind_group(w, n, hp[first].Pos, halo_pman->CurrentParticleOffset, GrNr, subs + nsubs);
+    }
+
+    free(w->tree.Nodes);
+    myfree(w->tree.Tmp);
+    myfree(w->Head);
+    myfree(w->cand);
+    myfree(w->order);
+    myfree(w->sp);
+    myfree(pos);
+    myfree(bygroup);
+    myfree(Ngb);
+    myfree(Density);
+
+    int64_t totsubs;
+    MPI_Allreduce(&nsubs, &totsubs, 1, MPI_INT64, MPI_SUM, Comm);
+    message(0, "Found %ld subhalos.\n", totsubs);
+    walltime_measure("/FOF/Subhalo/Find");
+
+    /* Order by group and by rank within the group*/
+    mpsort_mpi(subs, nsubs, sizeof(struct Subhalo), subfind_radix_rank, 8, NULL, Comm);
+
+#define SUBFIND_SAVE(name, field, dtype, items) do { \
+        BigArray array = {0}; \
+        big_array_init(&array, &subs[0].field, dtype, 2, (size_t []){nsubs, items}, \
+                (ptrdiff_t []){sizeof(struct Subhalo), big_file_dtype_itemsize(dtype)}); \
+        petaio_save_block(bf, "Subhalo/" name, &array, 1); \
+    } while(0)
+
+    SUBFIND_SAVE("GroupID", GrNr, "u4", 1);
+    SUBFIND_SAVE("RankInGroup", Rank, "u4", 1);
+    SUBFIND_SAVE("Length", Length, "u4", 1);
+    SUBFIND_SAVE("LengthByType", LenType[0], "u4", 6);
+    SUBFIND_SAVE("Mass", Mass, "f4", 1);
+    SUBFIND_SAVE("MassByType", MassType[0], "f4", 6);
+    SUBFIND_SAVE("Position", Pos[0], "f8", 3);
+    SUBFIND_SAVE("MassCenterPosition", CM[0], "f8", 3);
+    SUBFIND_SAVE("MassCenterVelocity", Vel[0], "f4", 3);
+    SUBFIND_SAVE("VelocityDispersion", VelDisp, "f4", 1);
+    SUBFIND_SAVE("Vmax", Vmax, "f4", 1);
+    SUBFIND_SAVE("RVmax", RVmax, "f4", 1);
+    SUBFIND_SAVE("HalfMassRadius", HalfMassRadius, "f4", 1);
+    SUBFIND_SAVE("MostBoundID", MostBoundID, "u8", 1);
+#undef SUBFIND_SAVE
+
+    /* Record the groups too large to search, which have no subhaloes in the catalogue*/
+    BigBlock bh;
+    if(0 != big_file_mpi_open_block(bf, &bh, "Subhalo/GroupID", Comm))
+        endrun(0, "Failed to open block Subhalo/GroupID: %s\n", big_file_get_error_message());
+    big_block_set_attr(&bh, "NumGroupsNotSearched", &NotSearched, "i8", 1);
+    if(0 != big_block_mpi_close(&bh, Comm))
+        endrun(0, "Failed to close block Subhalo/GroupID: %s\n", big_file_get_error_message());
+
+    myfree(subs);
+    walltime_measure("/FOF/Subhalo/IO");
+}
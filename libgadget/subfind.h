@@ -0,0 +1,41 @@
+#ifndef SUBFIND_H
+#define SUBFIND_H
+
+#include <bigfile-mpi.h>
+#include "utils/paramset.h"
+#include "partmanager.h"
+#include "slotsmanager.h"
+
+struct subfind_params
+{
+    int SubfindOn;
+    /* Number of neighbours for the density estimate*/
+    int DesNumNgb;
+    /* Minimum number of particles in a subhalo*/
+    int MinLength;
+    /* Opening angle of the potential tree*/
+    double ErrTolTheta;
+};
+
+/* Set the parameters of the subhalo finder*/
+void set_subfind_params(ParameterSet * ps);
+
+/* Returns 1 if subhaloes are found when the FOF catalogue is saved*/
+int subfind_enabled(void);
+
+/* Find the gravitationally bound subhaloes of the FOF group particles in halo_pman
+ * and write them as the Subhalo blocks of the open FOF file.
+ * The particles are redistributed so that each group is on a single task. Collective.*/
+void subfind_save_subhalos(BigFile * bf, struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, MPI_Comm Comm);
+
+/*Internal API, exposed for tests*/
+
+/* Set the subhalo finder parameters directly*/
+void set_subfindpar(struct subfind_params sp);
+
+/* Unbind the n particles with the given (non-periodic) positions, velocities and masses.
+ * bound[i] is set to 1 if particle i is in the bound remainder and 0 otherwise.
+ * Returns the number of bound particles, or 0 if fewer than MinLength remain.*/
+int subfind_unbind_particles(const double (*pos)[3], const double (*vel)[3], const double * mass, const int n, int * bound);
+
+#endif
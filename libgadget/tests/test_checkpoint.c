@@ -0,0 +1,226 @@
+/*Tests for the node-local checkpoints*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgadget/partmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/paramset.h>
+#include <libgadget/utils/peano.h>
+#include <libgadget/domain.h>
+#include <libgadget/checkpoint.h>
+
+#include "stub.h"
+
+#define NGAS 1000
+#define NDM 1000
+#define NSTAR 200
+#define NUMPART (NGAS + NDM + NSTAR)
+
+static char * LocalDir = "test-local-checkpoint";
+static double BoxSize = 8;
+static struct ClockTable CT;
+
+static void
+setup_slots(void)
+{
+    slots_init(0, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    slots_set_enabled(4, sizeof(struct star_particle_data), SlotsManager);
+}
+
+/* Random gas, dark matter and star particles, decomposed over the tasks*/
+static void
+make_particles(DomainDecomp * dd)
+{
+    int ThisTask, i, d;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    srand48(2718 + ThisTask);
+    int64_t NType[6] = {NGAS, NDM, 0, 0, NSTAR, 0};
+    particle_alloc_memory(2 * NUMPART);
+    slots_reserve(1, NType, SlotsManager);
+    PartManager->NumPart = NUMPART;
+    memset(P, 0, NUMPART * sizeof(struct particle_data));
+    slots_setup_topology(PartManager, NType, SlotsManager);
+    for(i = 0; i < NUMPART; i++) {
+        for(d = 0; d < 3; d++) {
+            P[i].Pos[d] = BoxSize * drand48();
+            P[i].Vel[d] = drand48() - 0.5;
+        }
+        P[i].ID = (MyIDType) ThisTask * NUMPART + i + 1;
+        P[i].Mass = 1 + drand48();
+        P[i].TimeBin = 0;
+        P[i].Key = PEANO(P[i].Pos, BoxSize);
+    }
+    slots_setup_id(PartManager, SlotsManager);
+    for(i = 0; i < SlotsManager->info[0].size; i++)
+        SphP[i].Density = drand48();
+    for(i = 0; i < SlotsManager->info[4].size; i++)
+        StarP[i].BirthDensity = drand48();
+    domain_decompose_full(dd);
+}
+
+/* Domain, slots and particles are freed in the reverse order of allocation*/
+static void
+free_particles(DomainDecomp * dd)
+{
+    domain_free(dd);
+    slots_free(SlotsManager);
+    myfree(P);
+}
+
+/* Overwrite size bytes at offset in the local checkpoint of this task*/
+static void
+patch_checkpoint(long offset, const void * data, size_t size)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    char fname[1024];
+    snprintf(fname, sizeof(fname), "%s/checkpoint-%06d", LocalDir, ThisTask);
+    FILE * fd = fopen(fname, "r+");
+    assert_non_null(fd);
+    assert_int_equal(fseek(fd, offset, SEEK_SET), 0);
+    assert_int_equal(fwrite(data, size, 1, fd), 1);
+    fclose(fd);
+}
+
+/* Writing and reading a checkpoint gives back the same particles, slots and domain*/
+static void
+test_local_checkpoint_roundtrip(void ** state)
+{
+    int NTask, ptype;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    DomainDecomp dd = {0};
+    make_particles(&dd);
+    assert_int_equal(write_local_checkpoint(0.5, &dd), 1);
+
+    /* Keep copies outside the arenas, to compare against*/
+    const int64_t NumPart = PartManager->NumPart;
+    struct particle_data * Pcopy = malloc(NumPart * sizeof(struct particle_data));
+    memcpy(Pcopy, P, NumPart * sizeof(struct particle_data));
+    int64_t SlotSize[6];
+    char * SlotCopy[6] = {0};
+    for(ptype = 0; ptype < 6; ptype++) {
+        SlotSize[ptype] = SlotsManager->info[ptype].size;
+        if(!SlotsManager->info[ptype].enabled)
+            continue;
+        SlotCopy[ptype] = malloc(SlotSize[ptype] * SlotsManager->info[ptype].elsize + 1);
+        memcpy(SlotCopy[ptype], SlotsManager->info[ptype].ptr, SlotSize[ptype] * SlotsManager->info[ptype].elsize);
+    }
+    const int NTopNodes = dd.NTopNodes, NTopLeaves = dd.NTopLeaves;
+    struct topnode_data * TopNodes = malloc(NTopNodes * sizeof(struct topnode_data));
+    memcpy(TopNodes, dd.TopNodes, NTopNodes * sizeof(struct topnode_data));
+    struct topleaf_data * TopLeaves = malloc(NTopLeaves * sizeof(struct topleaf_data));
+    memcpy(TopLeaves, dd.TopLeaves, NTopLeaves * sizeof(struct topleaf_data));
+    struct task_data * Tasks = malloc(NTask * sizeof(struct task_data));
+    memcpy(Tasks, dd.Tasks, NTask * sizeof(struct task_data));
+
+    free_particles(&dd);
+    setup_slots();
+
+    /* Only used if newer than the snapshot*/
+    assert_true(find_local_checkpoint(0.4) == 0.5);
+    assert_true(find_local_checkpoint(0.5) == -1);
+
+    read_local_checkpoint(&dd);
+    assert_int_equal(PartManager->NumPart, NumPart);
+    assert_int_equal(PartManager->MaxPart, 2 * NUMPART);
+    assert_memory_equal(P, Pcopy, NumPart * sizeof(struct particle_data));
+    for(ptype = 0; ptype < 6; ptype++) {
+        assert_int_equal(SlotsManager->info[ptype].size, SlotSize[ptype]);
+        if(!SlotCopy[ptype])
+            continue;
+        assert_memory_equal(SlotsManager->info[ptype].ptr, SlotCopy[ptype], SlotSize[ptype] * SlotsManager->info[ptype].elsize);
+        free(SlotCopy[ptype]);
+    }
+    slots_check_id_consistency(PartManager, SlotsManager);
+    assert_int_equal(dd.NTopNodes, NTopNodes);
+    assert_int_equal(dd.NTopLeaves, NTopLeaves);
+    assert_memory_equal(dd.TopNodes, TopNodes, NTopNodes * sizeof(struct topnode_data));
+    assert_memory_equal(dd.TopLeaves, TopLeaves, NTopLeaves * sizeof(struct topleaf_data));
+    assert_memory_equal(dd.Tasks, Tasks, NTask * sizeof(struct task_data));
+    domain_restore_finish(&dd);
+
+    free(Tasks);
+    free(TopLeaves);
+    free(TopNodes);
+    free(Pcopy);
+    free_particles(&dd);
+    setup_slots();
+}
+
+/* A checkpoint from a different layout or number of tasks is not used*/
+static void
+test_local_checkpoint_reject(void ** state)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    DomainDecomp dd = {0};
+    make_particles(&dd);
+
+    assert_int_equal(write_local_checkpoint(0.5, &dd), 1);
+    assert_true(find_local_checkpoint(0.4) == 0.5);
+    /* The magic is at the start of the header*/
+    patch_checkpoint(0, "MPGLOCL0", 8);
+    assert_true(find_local_checkpoint(0.4) == -1);
+
+    /* The number of tasks follows the magic*/
+    assert_int_equal(write_local_checkpoint(0.5, &dd), 1);
+    const int BadNTask = NTask + 1;
+    patch_checkpoint(8, &BadNTask, sizeof(int));
+    assert_true(find_local_checkpoint(0.4) == -1);
+
+    /* One task missing its checkpoint invalidates all of them*/
+    assert_int_equal(write_local_checkpoint(0.5, &dd), 1);
+    if(ThisTask == NTask - 1) {
+        char fname[1024];
+        snprintf(fname, sizeof(fname), "%s/checkpoint-%06d", LocalDir, ThisTask);
+        assert_int_equal(remove(fname), 0);
+    }
+    assert_true(find_local_checkpoint(0.4) == -1);
+
+    free_particles(&dd);
+    setup_slots();
+}
+
+static int
+setup_checkpoint(void ** state)
+{
+    walltime_init(&CT);
+    setup_slots();
+
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+
+    /* A checkpoint on every call*/
+    ParameterSet * ps = parameter_set_new();
+    param_declare_string(ps, "LocalCheckpointDir", OPTIONAL, LocalDir, "");
+    param_declare_double(ps, "LocalCheckpointInterval", OPTIONAL, 0, "");
+    char * error;
+    assert_int_equal(param_parse(ps, "", &error), 0);
+    set_checkpoint_params(ps);
+    parameter_set_free(ps);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_local_checkpoint_roundtrip),
+        cmocka_unit_test(test_local_checkpoint_reject),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_checkpoint, NULL);
+}
@@ -233,6 +233,26 @@ static void test_DoCooling(void ** state)
            //printf("%g , ", tcool);
 
         }
+        /* The batched cooling should give the same answer as DoCooling for a row of particles*/
+        double ub[NSTEP], rhob[NSTEP], dtb[NSTEP], neb[NSTEP], Zb[NSTEP], unewb[NSTEP];
+        struct UVBG uvbgb[NSTEP];
+        int heb[NSTEP];
+        for (j = 0; j<NSTEP; j++) {
+            ub[j] = exp(log(umin) +  j * (log(umax) - log(umin)) / 1. /NSTEP);
+            rhob[j] = dens;
+            dtb[j] = dt;
+            neb[j] = 1.0;
+            Zb[j] = 0;
+            uvbgb[j] = uvbg;
+            heb[j] = 1;
+        }
+        DoCoolingBatch(NSTEP, 0, ub, rhob, dtb, uvbgb, neb, Zb, MinEgySpec, heb, unewb);
+        for (j = 0; j<NSTEP; j++) {
+            double ne=1.0;
+            double unew = DoCooling(0, ub[j], dens, dt, &uvbg, &ne, 0, MinEgySpec, 1);
+            assert_true(fabs(unewb[j]/unew - 1) < 1e-6);
+            assert_true(fabs(neb[j]/ne - 1) < 1e-6);
+        }
     }
 //    printf("\n");
 }
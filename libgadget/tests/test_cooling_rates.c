@@ -169,6 +169,108 @@ static void test_rate_network(void ** state)
     assert_true( get_neutral_fraction_phys_cgs(0.1, 100.*1e10,0.24, &uvbg, &ne) <0.05);
 }
 
+/* Check the tabulated heating and cooling rate against the rate network.
+ * The interpolation error is compared to the size of the rate nearby, as the net rate passes through zero.*/
+static void test_heatingcooling_rate_table(void ** state)
+{
+    struct cooling_params coolpar = get_test_coolpar();
+    coolpar.RateTableOn = 1;
+    const char * TreeCool = GADGET_TESTDATA_ROOT "/examples/TREECOOL_ep_2018p";
+    const char * MetalCool = "";
+
+    set_coolpar(coolpar);
+    Cosmology CP = {0};
+    CP.OmegaCDM = 0.3;
+    CP.OmegaBaryon = coolpar.fBar * CP.OmegaCDM;
+    CP.HubbleParam = 0.7;
+
+    init_cooling_rates(TreeCool, MetalCool, &CP);
+
+    const double redshift = 2;
+    struct UVBG uvbg = get_global_UVBG(redshift);
+    build_heatingcooling_table(redshift, &uvbg);
+
+    const double helium = 1 - HYDROGEN_MASSFRAC;
+    int i, j;
+    for(i = 0; i < 23; i++) {
+        const double dens = pow(10, -7 + 0.3 * i + 0.013);
+        for(j = 0; j < 37; j++) {
+            const double ienergy = pow(10, 10.5 + 0.15 * j + 0.007);
+            double ne = 1, netab = 1;
+            const double exact = get_heatingcooling_rate(dens, ienergy, helium, redshift, 0, &uvbg, &ne);
+            const double tab = get_heatingcooling_rate_tabulated(dens, ienergy, helium, redshift, 0, &uvbg, &netab);
+            double scale = fabs(exact);
+            int k;
+            for(k = 0; k < 4; k++) {
+                double nek = ne;
+                double near = get_heatingcooling_rate(dens * pow(10, 0.05 * (k/2 ? 1 : -1)), ienergy * pow(10, 0.01 * (k%2 ? 1 : -1)), helium, redshift, 0, &uvbg, &nek);
+                if(fabs(near) > scale)
+                    scale = fabs(near);
+            }
+            assert_true(fabs(tab - exact) <= 0.03 * scale);
+            assert_true(fabs(netab - ne) <= 0.02 * ne + 1e-4);
+        }
+    }
+    /* A different UVB is not tabulated, so gets the exact answer*/
+    struct UVBG zero = {0};
+    double ne = 1, netab = 1;
+    assert_true(get_heatingcooling_rate(1e-3, 1e12, helium, redshift, 0, &zero, &ne) ==
+                get_heatingcooling_rate_tabulated(1e-3, 1e12, helium, redshift, 0, &zero, &netab));
+}
+
+/* Check the batched rate network against the rate network one particle at a time.
+ * The batch mixes densities, energies above the recombination tables and particles with no UVB.*/
+static void test_heatingcooling_rate_batch(void ** state)
+{
+    const char * TreeCool = GADGET_TESTDATA_ROOT "/examples/TREECOOL_ep_2018p";
+    const char * MetalCool = "";
+    Cosmology CP = {0};
+    CP.OmegaCDM = 0.3;
+    CP.OmegaBaryon = 0.17 * CP.OmegaCDM;
+    CP.HubbleParam = 0.7;
+
+    const double helium = 1 - HYDROGEN_MASSFRAC;
+    const double redshift = 2;
+    int c;
+    for(c = 0; c < 3; c++) {
+        struct cooling_params coolpar = get_test_coolpar();
+        /* The second set has different cooling rates and no self-shielding, the third a rate table*/
+        if(c == 1) {
+            coolpar.recomb = Cen92;
+            coolpar.cooling = Enzo2Nyx;
+            coolpar.SelfShieldingOn = 0;
+        }
+        coolpar.RateTableOn = (c == 2);
+        set_coolpar(coolpar);
+        init_cooling_rates(TreeCool, MetalCool, &CP);
+        struct UVBG uvbg = get_global_UVBG(redshift);
+        build_heatingcooling_table(redshift, &uvbg);
+        struct UVBG zero = {0};
+
+        double dens[COOLING_BATCH], ienergy[COOLING_BATCH], Z[COOLING_BATCH], ne[COOLING_BATCH], rate[COOLING_BATCH];
+        struct UVBG uv[COOLING_BATCH];
+        int i, k;
+        for(i = 0; i < 20; i++) {
+            for(k = 0; k < COOLING_BATCH; k++) {
+                dens[k] = pow(10, -7 + 0.35 * i + 0.011 * k);
+                /* Up to 10^10 K, above the recombination tables*/
+                ienergy[k] = pow(10, 10 + 0.3 * k + 0.007 * i);
+                Z[k] = 0;
+                uv[k] = (k % 5 == 3) ? zero : uvbg;
+                ne[k] = (k % 2) ? 1 : 0.5;
+            }
+            const int n = COOLING_BATCH - i % 7;
+            get_heatingcooling_rate_batch(n, dens, ienergy, helium, redshift, Z, uv, ne, rate);
+            for(k = 0; k < n; k++) {
+                double ne1 = (k % 2) ? 1 : 0.5;
+                const double exact = get_heatingcooling_rate_tabulated(dens[k], ienergy[k], helium, redshift, 0, &uv[k], &ne1);
+                assert_true(fabs(rate[k] - exact) <= 1e-12 * fabs(exact));
+                assert_true(fabs(ne[k] - ne1) <= 1e-12 * ne1);
+            }
+        }
+    }
+}
+
 /* This test checks that the heating and cooling rate is as expected.
  * In particular the physical density threshold is checked. */
 static void test_heatingcooling_rate(void ** state)
@@ -323,6 +425,8 @@ int main(void) {
         cmocka_unit_test(test_recomb_rates),
         cmocka_unit_test(test_rate_network),
         cmocka_unit_test(test_heatingcooling_rate),
+        cmocka_unit_test(test_heatingcooling_rate_table),
+        cmocka_unit_test(test_heatingcooling_rate_batch),
         cmocka_unit_test(test_uvbg_loader)
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
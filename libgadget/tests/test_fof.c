@@ -0,0 +1,454 @@
+/*Tests for the linking, the spherical overdensity masses and the merger trees of the FOF groups*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgadget/partmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/timestep.h>
+#include <libgadget/cosmology.h>
+#include <libgadget/fof.h>
+
+#include "stub.h"
+
+#define NUMPART (32*32*32)
+#define GRAVITY 43007.1
+
+static double BoxSize = 16;
+static Cosmology CP;
+static DomainDecomp ddecomp;
+static struct ClockTable CT;
+
+/*Make a simple trivial domain for all data on a single processor*/
+static void trivial_domain(DomainDecomp * dd)
+{
+    dd->domain_allocated_flag = 1;
+    dd->NTopNodes = 1;
+    dd->NTopLeaves = 1;
+    dd->TopNodes = mymalloc("topnode", sizeof(struct topnode_data));
+    dd->TopNodes[0].Daughter = -1;
+    dd->TopNodes[0].Leaf = 0;
+    dd->TopLeaves = mymalloc("topleaf",sizeof(struct topleaf_data));
+    dd->TopLeaves[0].Task = 0;
+    dd->TopLeaves[0].topnode = PartManager->MaxPart;
+    dd->TopNodes[0].StartKey = 0;
+    dd->TopNodes[0].Shift = BITS_PER_DIMENSION * 3;
+    dd->Tasks = mymalloc("task",sizeof(struct task_data));
+    dd->Tasks[0].StartLeaf = 0;
+    dd->Tasks[0].EndLeaf = 1;
+}
+
+/* Comoving critical density at a = 1, as used by fof_spherical_overdensity*/
+static double
+rhocrit(void)
+{
+    const double hubble = hubble_function(&CP, 1);
+    return 3 * hubble * hubble / (8 * M_PI * GRAVITY);
+}
+
+/* Bryan & Norman 1998 virial overdensity at a = 1*/
+static double
+deltavir(void)
+{
+    const double hubble = hubble_function(&CP, 1);
+    const double x = CP.Omega0 * pow(CP.Hubble / hubble, 2) - 1;
+    return 18 * M_PI * M_PI + 82 * x - 39 * x * x;
+}
+
+/* Put particle i at radius r from the box centre, in a random direction*/
+static void
+place_particle(int i, double r, double mass)
+{
+    const double mu = 2 * drand48() - 1;
+    const double phi = 2 * M_PI * drand48();
+    const double s = sqrt(1 - mu * mu);
+    P[i].Pos[0] = BoxSize / 2 + r * s * cos(phi);
+    P[i].Pos[1] = BoxSize / 2 + r * s * sin(phi);
+    P[i].Pos[2] = BoxSize / 2 + r * mu;
+    P[i].Mass = mass;
+    P[i].Type = 1;
+    P[i].TimeBin = 0;
+    P[i].Ti_drift = 0;
+    P[i].IsGarbage = 0;
+    P[i].Swallowed = 0;
+    P[i].Key = PEANO(P[i].Pos, BoxSize);
+}
+
+/* One group of all the particles, centred on particle 0. Returns the SO properties.*/
+static struct Group
+run_so(double totmass)
+{
+    PartManager->NumPart = NUMPART;
+    ForceTree tree = {0};
+    force_tree_rebuild(&tree, &ddecomp, BoxSize, 0, 1, NULL);
+
+    FOFGroups fof = {0};
+    fof.Group = mymalloc2("Group", sizeof(struct Group));
+    memset(fof.Group, 0, sizeof(struct Group));
+    fof.Ngroups = fof.NgroupsExt = 1;
+    fof.TotNgroups = 1;
+    fof.Group[0].base.Length = fof.Group[0].Length = NUMPART;
+    fof.Group[0].Mass = totmass;
+    fof.Group[0].MinPotIndex = 0;
+    fof.Group[0].MinPotTask = 0;
+
+    fof_spherical_overdensity(&fof, &tree, 1, MPI_COMM_WORLD);
+    struct Group g = fof.Group[0];
+    myfree(fof.Group);
+    force_tree_free(&tree);
+    return g;
+}
+
+/* Outside a uniform sphere the enclosed mean density is a power law,
+ * so all three radii are found exactly, enclosing the whole mass.*/
+static void
+test_so_uniform_sphere(void ** state)
+{
+    const double R200 = 2;
+    const double totmass = 200 * rhocrit() * 4 * M_PI / 3 * pow(R200, 3);
+    int i;
+    srand48(8675309);
+    place_particle(0, 0, totmass / NUMPART);
+    for(i = 1; i < NUMPART; i++)
+        place_particle(i, cbrt(drand48()), totmass / NUMPART);
+
+    struct Group g = run_so(totmass);
+
+    const double R500 = R200 * cbrt(200. / 500);
+    const double Rvir = R200 * cbrt(200. / deltavir());
+    message(0, "R200c %g (%g) R500c %g (%g) Rvir %g (%g)\n", g.R200c, R200, g.R500c, R500, g.Rvir, Rvir);
+    assert_true(fabs(g.R200c / R200 - 1) < 1e-3);
+    assert_true(fabs(g.R500c / R500 - 1) < 1e-3);
+    assert_true(fabs(g.Rvir / Rvir - 1) < 1e-3);
+    assert_true(fabs(g.M200c / totmass - 1) < 1e-3);
+    assert_true(fabs(g.M500c / totmass - 1) < 1e-3);
+    assert_true(fabs(g.Mvir / totmass - 1) < 1e-3);
+    assert_true(fabs(g.SOMassProfile[FOF_SO_NBINS - 1] / totmass - 1) < 1e-3);
+}
+
+/* Enclosed NFW mass in units of 4 pi rho_s r_s^3*/
+static double
+nfw_m(double x)
+{
+    return log(1 + x) - x / (1 + x);
+}
+
+/* Radius where the mean density of the NFW halo crosses delta times critical*/
+static double
+nfw_radius(double delta, double m200, double c, double r200)
+{
+    double lo = 1e-3 * r200, hi = 2 * r200;
+    int i;
+    for(i = 0; i < 100; i++) {
+        const double r = sqrt(lo * hi);
+        const double rho = m200 * nfw_m(c * r / r200) / nfw_m(c) / (4 * M_PI / 3 * r * r * r);
+        if(rho > delta * rhocrit())
+            lo = r;
+        else
+            hi = r;
+    }
+    return sqrt(lo * hi);
+}
+
+/* An NFW halo with concentration 5, truncated at twice r200. The radii have sampling and binning errors.*/
+static void
+test_so_nfw(void ** state)
+{
+    const double r200 = 1, c = 5;
+    const double m200 = 200 * rhocrit() * 4 * M_PI / 3 * pow(r200, 3);
+    const double xmax = 2 * c;
+    const double totmass = m200 * nfw_m(xmax) / nfw_m(c);
+    int i;
+    srand48(8675309);
+    place_particle(0, 0, totmass / NUMPART);
+    for(i = 1; i < NUMPART; i++) {
+        /* Invert the cumulative mass by bisection*/
+        const double target = drand48() * nfw_m(xmax);
+        double lo = 0, hi = xmax;
+        int j;
+        for(j = 0; j < 60; j++) {
+            const double x = 0.5 * (lo + hi);
+            if(nfw_m(x) < target)
+                lo = x;
+            else
+                hi = x;
+        }
+        place_particle(i, 0.5 * (lo + hi) * r200 / c, totmass / NUMPART);
+    }
+
+    struct Group g = run_so(totmass);
+
+    const double R500 = nfw_radius(500, m200, c, r200);
+    const double Rvir = nfw_radius(deltavir(), m200, c, r200);
+    message(0, "R200c %g (%g) R500c %g (%g) Rvir %g (%g)\n", g.R200c, r200, g.R500c, R500, g.Rvir, Rvir);
+    assert_true(fabs(g.R200c / r200 - 1) < 0.02);
+    assert_true(fabs(g.R500c / R500 - 1) < 0.02);
+    assert_true(fabs(g.Rvir / Rvir - 1) < 0.02);
+    assert_true(fabs(g.M200c / m200 - 1) < 0.06);
+}
+
+#define MT_GROUPSIZE 10
+#define MT_TRACERS 4
+
+/* Put the MT_GROUPSIZE particles of old group g, numbered from 1 on each task, into group grnr.
+ * The particle k of the group is the k-th most bound.*/
+static void
+set_group(int g, int64_t grnr)
+{
+    int ThisTask, k;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    for(k = 0; k < MT_GROUPSIZE; k++) {
+        const int i = (g - 1) * MT_GROUPSIZE + k;
+        P[i].ID = 1 + 3 * MT_GROUPSIZE * ThisTask + i;
+        P[i].GrNr = grnr;
+        P[i].Potential = k - MT_GROUPSIZE;
+        P[i].IsGarbage = 0;
+    }
+}
+
+/* Groups numbered from 1 + ngroups * ThisTask on each task, sorted by GrNr as after fof_save_particles*/
+static void
+make_groups(FOFGroups * fof, int ngroups)
+{
+    int ThisTask, i;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    fof->Group = mymalloc2("Group", ngroups * sizeof(struct Group));
+    memset(fof->Group, 0, ngroups * sizeof(struct Group));
+    fof->Ngroups = fof->NgroupsExt = ngroups;
+    for(i = 0; i < ngroups; i++)
+        fof->Group[i].base.GrNr = 1 + ngroups * ThisTask + i;
+}
+
+/* Set the FOF parameters to their defaults, except the linking method and the number of merger tree tracers*/
+static void
+set_test_fof_params(int UnionFind, int MergerTreeTracers)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 0, "");
+    param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, 0.2, "");
+    param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, 32, "");
+    param_declare_int(ps, "FOFUnionFind", OPTIONAL, UnionFind, "");
+    param_declare_int(ps, "FOFSphericalOverdensity", OPTIONAL, 0, "");
+    param_declare_int(ps, "FOFMergerTreeTracers", OPTIONAL, MergerTreeTracers, "");
+    param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 2, "");
+    param_declare_double(ps, "MinMStarForNewSeed", OPTIONAL, 5e-4, "");
+    char * error;
+    assert_int_equal(param_parse(ps, "", &error), 0);
+    set_fof_params(ps);
+    parameter_set_free(ps);
+}
+
+#define UF_NCLUMP 40
+#define UF_NLOCAL (NUMPART / 8)
+
+/* Clumps of particles from every task, some across the box edge, on a uniform background.
+ * After the domain decomposition most groups span several tasks. The union-find linking
+ * must put every particle in the same group as the iterated treewalks.*/
+static void
+test_fof_unionfind(void ** state)
+{
+    int ThisTask, NTask, i, d;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    double center[UF_NCLUMP][3], radius[UF_NCLUMP];
+    /* The same clumps on every task*/
+    srand48(2718);
+    for(i = 0; i < UF_NCLUMP; i++) {
+        for(d = 0; d < 3; d++)
+            center[i][d] = BoxSize * drand48();
+        radius[i] = 0.1 + 0.4 * drand48();
+    }
+    srand48(31415 + ThisTask);
+    PartManager->NumPart = UF_NLOCAL;
+    for(i = 0; i < UF_NLOCAL; i++) {
+        /* One particle in four is in the background*/
+        const int clump = (i % 4) ? lrand48() % UF_NCLUMP : -1;
+        for(d = 0; d < 3; d++) {
+            double x = BoxSize * drand48();
+            if(clump >= 0)
+                x = center[clump][d] + radius[clump] * (2 * drand48() - 1);
+            P[i].Pos[d] = x - BoxSize * floor(x / BoxSize);
+        }
+        P[i].ID = (MyIDType) ThisTask * UF_NLOCAL + i + 1;
+        P[i].Mass = 1;
+        P[i].Type = 1;
+        P[i].TimeBin = 0;
+        P[i].Ti_drift = 0;
+        P[i].IsGarbage = 0;
+        P[i].Swallowed = 0;
+        P[i].Key = PEANO(P[i].Pos, BoxSize);
+    }
+    DomainDecomp dd = {0};
+    domain_decompose_full(&dd);
+    ForceTree tree = {0};
+    force_tree_rebuild(&tree, &dd, BoxSize, 0, 1, NULL);
+    /* Linking length of a fifth of the mean separation*/
+    const double DMMeanSeparation = BoxSize / cbrt(UF_NLOCAL * NTask);
+
+    set_test_fof_params(0, 0);
+    fof_init(DMMeanSeparation, &CP, GRAVITY);
+    FOFGroups fof = fof_fof(&tree, MPI_COMM_WORLD);
+    const int64_t TotNgroups = fof.TotNgroups;
+    fof_finish(&fof);
+    int64_t * GrNr = mymalloc("GrNr", PartManager->NumPart * sizeof(int64_t));
+    int64_t ningroup = 0;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        GrNr[i] = P[i].GrNr;
+        ningroup += P[i].GrNr >= 0;
+    }
+
+    set_test_fof_params(1, 0);
+    fof_init(DMMeanSeparation, &CP, GRAVITY);
+    fof = fof_fof(&tree, MPI_COMM_WORLD);
+    int64_t nbad = 0;
+    for(i = 0; i < PartManager->NumPart; i++)
+        nbad += P[i].GrNr != GrNr[i];
+    MPI_Allreduce(MPI_IN_PLACE, &nbad, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &ningroup, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    message(0, "Found %ld groups with %ld particles, union-find %ld groups, %ld particles differ\n", TotNgroups, ningroup, fof.TotNgroups, nbad);
+    assert_true(TotNgroups >= UF_NCLUMP / 2);
+    assert_int_equal(fof.TotNgroups, TotNgroups);
+    assert_int_equal(nbad, 0);
+    fof_finish(&fof);
+    myfree(GrNr);
+    force_tree_free(&tree);
+    domain_free(&dd);
+}
+
+/* Three groups on each task are linked to two groups: the first goes whole into the first new group,
+ * the second is split between the new groups and the third is dispersed.*/
+static void
+test_merger_tree(void ** state)
+{
+    set_test_fof_params(0, MT_TRACERS);
+    assert_true(fof_merger_tree_enabled());
+
+    int ThisTask, NTask, i;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    PartManager->NumPart = 3 * MT_GROUPSIZE;
+    fof_merger_tree_set_tracers(NULL, 0);
+
+    /* The first output has no progenitors, and keeps the most bound particles*/
+    FOFGroups fof = {0};
+    make_groups(&fof, 3);
+    for(i = 1; i <= 3; i++)
+        set_group(i, 3 * ThisTask + i);
+    int64_t nlinks, ntracers, nbad = 0;
+    struct fof_mt_link * links = fof_merger_tree(&fof, &nlinks, MPI_COMM_WORLD);
+    assert_int_equal(nlinks, 0);
+    for(i = 0; i < fof.Ngroups; i++)
+        assert_int_equal(fof.Group[i].MainProgenitor, -1);
+    myfree(links);
+    myfree(fof.Group);
+
+    struct fof_mt_tracer * tracers = fof_merger_tree_tracers(&ntracers);
+    for(i = 0; i < ntracers; i++) {
+        const int64_t index = (tracers[i].ID - 1) % (3 * MT_GROUPSIZE);
+        const int64_t task = (tracers[i].ID - 1) / (3 * MT_GROUPSIZE);
+        nbad += index % MT_GROUPSIZE >= MT_TRACERS;
+        nbad += tracers[i].GrNr != 3 * task + index / MT_GROUPSIZE + 1;
+        nbad += tracers[i].NTracer != MT_TRACERS;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ntracers, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &nbad, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    assert_int_equal(ntracers, 3 * MT_TRACERS * NTask);
+    assert_int_equal(nbad, 0);
+
+    /* Old group 1 and the two most bound particles of old group 2 form new group 1,
+     * the rest of old group 2 forms new group 2 and old group 3 is not in a group.*/
+    make_groups(&fof, 2);
+    set_group(1, 2 * ThisTask + 1);
+    set_group(2, 2 * ThisTask + 2);
+    set_group(3, -1);
+    P[MT_GROUPSIZE].GrNr = P[MT_GROUPSIZE + 1].GrNr = 2 * ThisTask + 1;
+    links = fof_merger_tree(&fof, &nlinks, MPI_COMM_WORLD);
+
+    for(i = 0; i < nlinks; i++) {
+        const int64_t task = (links[i].Progenitor - 1) / 3;
+        const int64_t old = links[i].Progenitor - 3 * task;
+        const int64_t new = links[i].Descendant - 2 * task;
+        message(1, "Link %ld -> %ld shared %d of %d merit %g\n", links[i].Progenitor, links[i].Descendant, links[i].Shared, links[i].NProgTracer, links[i].Merit);
+        nbad += links[i].NProgTracer != MT_TRACERS;
+        if(old == 1)
+            nbad += new != 1 || links[i].Shared != MT_TRACERS || links[i].Merit != 1;
+        else if(old == 2)
+            nbad += (new != 1 && new != 2) || links[i].Shared != MT_TRACERS / 2 || links[i].Merit != 0.5;
+        else
+            nbad++;
+    }
+    for(i = 0; i < fof.Ngroups; i++) {
+        nbad += fof.Group[i].MainProgenitor != 3 * ThisTask + 1 + i;
+        nbad += fof.Group[i].ProgenitorMerit != (i == 0 ? 1 : 0.5);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &nlinks, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &nbad, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    assert_int_equal(nlinks, 3 * NTask);
+    assert_int_equal(nbad, 0);
+    myfree(links);
+    myfree(fof.Group);
+    fof_merger_tree_set_tracers(NULL, 0);
+}
+
+static int
+setup_fof(void ** state)
+{
+    /* Needed so the integer timeline works*/
+    setup_sync_points(0.01, 0.1, 0.0, 0);
+    slots_init(0, SlotsManager);
+    /* Allocate the empty slots now, so the domain exchange does not put them above the trivial domain*/
+    int64_t atleast[6] = {0};
+    slots_reserve(1, atleast, SlotsManager);
+    particle_alloc_memory(NUMPART);
+    walltime_init(&CT);
+    init_forcetree_params(2);
+    trivial_domain(&ddecomp);
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+
+    CP.CMBTemperature = 2.7255;
+    CP.Omega0 = 0.3;
+    CP.OmegaLambda = 1- CP.Omega0;
+    CP.OmegaBaryon = 0.045;
+    CP.HubbleParam = 0.7;
+    CP.RadiationOn = 0;
+    CP.w0_fld = -1;
+    CP.Hubble = 0.1;
+    init_cosmology(&CP, 0.01);
+    fof_init(1, &CP, GRAVITY);
+    return 0;
+}
+
+static int
+teardown_fof(void ** state)
+{
+    myfree(ddecomp.Tasks);
+    myfree(ddecomp.TopLeaves);
+    myfree(ddecomp.TopNodes);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_so_uniform_sphere),
+        cmocka_unit_test(test_so_nfw),
+        cmocka_unit_test(test_fof_unionfind),
+        cmocka_unit_test(test_merger_tree),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_fof, teardown_fof);
+}
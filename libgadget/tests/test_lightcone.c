@@ -0,0 +1,484 @@
+/*Tests for the replicas and crossings of the lightcone*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bigfile.h>
+#include <libgadget/allvars.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/cosmology.h>
+#include <libgadget/timebinmgr.h>
+#include <libgadget/petaio.h>
+#include <libgadget/physconst.h>
+#include <libgadget/lightcone.h>
+#include <libgadget/run.h>
+#include <libgadget/utils/mymalloc.h>
+
+#include "stub.h"
+
+#define NPART 256
+#define NSTEP 64
+/* Replicas per dimension considered by the lightcone*/
+#define BOXBOOST 20
+/* Comoving width of the map shells*/
+#define SHELLWIDTH 100000
+#define MAXSHELL 128
+
+static Cosmology CP;
+static double Pos[NPART][3];
+static const double TimeStart = 0.35, TimeEnd = 0.8;
+static inttime_t TiStart, dTi;
+
+/* Comoving distance to a, by Simpson's rule in log a*/
+static double
+comoving_distance(double a)
+{
+    const int n = 256;
+    const double h = -log(a) / n;
+    double sum = 0;
+    int i;
+    for(i = 0; i <= n; i++) {
+        const double x = exp(log(a) + i * h);
+        const double f = CP.Hubble / hubble_function(&CP, x) / x;
+        sum += f * ((i == 0 || i == n) ? 1 : (i % 2 ? 4 : 2));
+    }
+    return sum * h / 3 * LIGHTCGS / HUBBLE / All.UnitLength_in_cm;
+}
+
+/* The lightcone parameters, with shell maps of the given Nside if it is not zero*/
+static void
+set_test_lightcone_params(int MapNside)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "LightconeParticleTypes", OPTIONAL, 2, "");
+    param_declare_double(ps, "LightconeBufferMB", OPTIONAL, 64, "");
+    param_declare_int(ps, "LightconeMapNside", OPTIONAL, MapNside, "");
+    param_declare_double(ps, "LightconeMapShellWidth", OPTIONAL, SHELLWIDTH, "");
+    param_declare_int(ps, "LightconeMapParticleTypes", OPTIONAL, 63, "");
+    param_declare_int(ps, "LightconeMapVelocity", OPTIONAL, 0, "");
+    char * error;
+    assert_int_equal(param_parse(ps, "", &error), 0);
+    set_lightcone_params(ps);
+    parameter_set_free(ps);
+}
+
+static double
+time_of_step(int step)
+{
+    return exp(loga_from_ti(TiStart + step * dTi));
+}
+
+/* Static particles, none close to the horizon at the start, restart and end time. Each task has every NTask-th.
+ * Returns the number of crossings of all replicas.*/
+static int64_t
+make_particles(void)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const double Dstart = comoving_distance(TimeStart);
+    const double Dmid = comoving_distance(time_of_step(NSTEP / 2));
+    const double Dend = comoving_distance(time_of_step(NSTEP));
+    int64_t ncross = 0;
+    int i, n = 0;
+    srand48(9999);
+    for(i = 0; i < NPART; i++) {
+        int64_t nrep;
+        int ambiguous;
+        do {
+            int d, rx, ry, rz;
+            for(d = 0; d < 3; d++)
+                Pos[i][d] = All.BoxSize * drand48();
+            nrep = 0;
+            ambiguous = 0;
+            for(rx = 0; rx < BOXBOOST; rx++)
+            for(ry = 0; ry < BOXBOOST; ry++)
+            for(rz = 0; rz < BOXBOOST; rz++) {
+                const double x = Pos[i][0] + rx * All.BoxSize, y = Pos[i][1] + ry * All.BoxSize, z = Pos[i][2] + rz * All.BoxSize;
+                const double r = sqrt(x * x + y * y + z * z);
+                nrep += r > Dend && r < Dstart;
+                ambiguous |= fabs(r / Dstart - 1) < 1e-5 || fabs(r / Dmid - 1) < 1e-5 || fabs(r / Dend - 1) < 1e-5;
+            }
+        } while(ambiguous);
+        ncross += nrep;
+        if(i % NTask != ThisTask)
+            continue;
+        memset(&P[n], 0, sizeof(P[n]));
+        memcpy(P[n].Pos, Pos[i], sizeof(Pos[i]));
+        P[n].ID = i;
+        P[n].Type = 1;
+        P[n].Mass = 1;
+        n++;
+    }
+    PartManager->NumPart = n;
+    return ncross;
+}
+
+static void
+run_steps(int first, int last)
+{
+    int step;
+    for(step = first; step < last; step++)
+        lightcone_compute(time_of_step(step), &CP, TiStart + step * dTi, TiStart + (step + 1) * dTi);
+    lightcone_flush();
+}
+
+static void *
+read_block(BigFile * bf, const char * name, const char * dtype, int64_t * size)
+{
+    BigBlock bb;
+    BigArray array;
+    assert_int_equal(big_file_open_block(bf, &bb, name), 0);
+    assert_int_equal(big_block_read_simple(&bb, 0, bb.size, &array, dtype), 0);
+    *size = bb.size;
+    big_block_close(&bb);
+    return array.data;
+}
+
+static int
+cmp_int64(const void * a, const void * b)
+{
+    const int64_t * ia = a, * ib = b;
+    return (*ia > *ib) - (*ia < *ib);
+}
+
+/* The file has each crossing of a particle with a replica exactly once,
+ * at the position of the particle in the replica and the time the horizon passed it.*/
+static void
+check_crossings(const int64_t ncross)
+{
+    MPI_Barrier(MPI_COMM_WORLD);
+    BigFile bf;
+    int64_t n, n2, i;
+    assert_int_equal(big_file_open(&bf, "./lightcone"), 0);
+    double * pos = read_block(&bf, "Position", "f8", &n);
+    uint64_t * id = read_block(&bf, "ID", "u8", &n2);
+    assert_int_equal(n2, n);
+    float * redshift = read_block(&bf, "Redshift", "f4", &n2);
+    assert_int_equal(n2, n);
+    big_file_close(&bf);
+    message(0, "Found %ld crossings, expected %ld\n", n, ncross);
+    assert_int_equal(n, ncross);
+
+    const double dloga = log(TimeEnd / TimeStart) / NSTEP;
+    int64_t * keys = malloc(sizeof(int64_t) * sizemax(n, 1));
+    for(i = 0; i < n; i++) {
+        assert_true(id[i] < NPART);
+        int64_t rep = 0;
+        int d;
+        for(d = 0; d < 3; d++) {
+            const double r = (pos[3 * i + d] - Pos[id[i]][d]) / All.BoxSize;
+            assert_true(fabs(r - round(r)) < 1e-6);
+            assert_true(round(r) >= 0 && round(r) < BOXBOOST);
+            rep = rep * BOXBOOST + round(r);
+        }
+        keys[i] = id[i] * BOXBOOST * BOXBOOST * BOXBOOST + rep;
+        /* Static particles cross in the middle of the step*/
+        const double a = 1 / (1 + redshift[i]);
+        const double r = sqrt(pos[3 * i] * pos[3 * i] + pos[3 * i + 1] * pos[3 * i + 1] + pos[3 * i + 2] * pos[3 * i + 2]);
+        const double D = comoving_distance(a);
+        assert_true(fabs(D - r) <= comoving_distance(a * exp(-dloga)) - D);
+    }
+    qsort(keys, n, sizeof(int64_t), cmp_int64);
+    for(i = 1; i < n; i++)
+        assert_true(keys[i] != keys[i-1]);
+    free(keys);
+    free(redshift);
+    free(id);
+    free(pos);
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+/* A run finds every crossing of every replica once. Starting at TimeStart removes the crossings of earlier tests.*/
+static void
+test_lightcone_crossings(void ** state)
+{
+    const int64_t ncross = make_particles();
+    lightcone_init(&CP, TimeStart);
+    run_steps(0, NSTEP);
+    check_crossings(ncross);
+}
+
+/* A restart half way removes the crossings written after the restart, so they are not duplicated*/
+static void
+test_lightcone_restart(void ** state)
+{
+    const int64_t ncross = make_particles();
+    lightcone_init(&CP, TimeStart);
+    run_steps(0, NSTEP / 2);
+    run_steps(NSTEP / 2, NSTEP);
+    lightcone_init(&CP, time_of_step(NSTEP / 2));
+    run_steps(NSTEP / 2, NSTEP);
+    check_crossings(ncross);
+}
+
+/* ID and redshift of the crossings in the lightcone file*/
+static int64_t
+read_crossings(uint64_t ** id, float ** redshift)
+{
+    MPI_Barrier(MPI_COMM_WORLD);
+    BigFile bf;
+    int64_t n, n2;
+    assert_int_equal(big_file_open(&bf, "./lightcone"), 0);
+    *id = read_block(&bf, "ID", "u8", &n);
+    *redshift = read_block(&bf, "Redshift", "f4", &n2);
+    assert_int_equal(n2, n);
+    big_file_close(&bf);
+    MPI_Barrier(MPI_COMM_WORLD);
+    return n;
+}
+
+/* A restart as done by run: begrun leaves All.Time unset, and the lightcone starts at All.TimeInit once init has read the snapshot.
+ * Only the crossings after the restart time are removed from the file, and the others keep their order.*/
+static void
+test_lightcone_restart_run_order(void ** state)
+{
+    const int64_t ncross = make_particles();
+    All.LightconeOn = 1;
+    All.Time = 0;
+    All.TimeInit = TimeStart;
+    begin_output_streams(All.TimeInit);
+    run_steps(0, NSTEP);
+
+    uint64_t * id, * id2;
+    float * redshift, * redshift2;
+    const int64_t n = read_crossings(&id, &redshift);
+
+    All.Time = 0;
+    All.TimeInit = time_of_step(NSTEP / 2);
+    begin_output_streams(All.TimeInit);
+    const int64_t n2 = read_crossings(&id2, &redshift2);
+
+    /* As stored in the file*/
+    const float zrestart = 1 / All.TimeInit - 1;
+    int64_t i, j = 0;
+    for(i = 0; i < n; i++) {
+        if(redshift[i] < zrestart)
+            continue;
+        assert_true(j < n2);
+        assert_int_equal(id2[j], id[i]);
+        assert_true(redshift2[j] == redshift[i]);
+        j++;
+    }
+    message(0, "Restart kept %ld of %ld crossings\n", n2, n);
+    assert_int_equal(j, n2);
+    assert_true(n2 > 0 && n2 < n);
+    free(redshift2);
+    free(id2);
+    free(redshift);
+    free(id);
+
+    run_steps(NSTEP / 2, NSTEP);
+    check_crossings(ncross);
+    All.LightconeOn = 0;
+}
+
+/* Total mass of each shell map in the lightcone file, -1 if the shell was not written.
+ * Returns the index of the one shell marked as incomplete, or -1.*/
+static int
+read_shell_masses(double * mass)
+{
+    MPI_Barrier(MPI_COMM_WORLD);
+    BigFile bf;
+    int shell, incomplete = -1;
+    assert_int_equal(big_file_open(&bf, "./lightcone"), 0);
+    for(shell = 0; shell < MAXSHELL; shell++) {
+        char blockname[128];
+        snprintf(blockname, sizeof(blockname), "Shell%04d/Mass", shell);
+        BigBlock bb;
+        mass[shell] = -1;
+        if(0 != big_file_open_block(&bf, &bb, blockname))
+            continue;
+        int complete;
+        assert_int_equal(big_block_get_attr(&bb, "Complete", &complete, "i4", 1), 0);
+        if(!complete) {
+            assert_int_equal(incomplete, -1);
+            incomplete = shell;
+        }
+        big_block_close(&bb);
+        int64_t n, i;
+        float * map = read_block(&bf, blockname, "f4", &n);
+        assert_int_equal(n, 12 * 4 * 4);
+        mass[shell] = 0;
+        for(i = 0; i < n; i++)
+            mass[shell] += map[i];
+        free(map);
+    }
+    big_file_close(&bf);
+    MPI_Barrier(MPI_COMM_WORLD);
+    return incomplete;
+}
+
+/* The shell being filled when a run stopped loses its deposits from before the restart.
+ * It is marked as incomplete, and the other shells are the same as without the restart.*/
+static void
+test_lightcone_map_restart(void ** state)
+{
+    make_particles();
+    set_test_lightcone_params(4);
+    All.TimeIC = TimeStart;
+    lightcone_init(&CP, TimeStart);
+    run_steps(0, NSTEP);
+    double mass[MAXSHELL], mass2[MAXSHELL];
+    /* A run from the ICs has no missing deposits*/
+    assert_int_equal(read_shell_masses(mass), -1);
+
+    const double arestart = time_of_step(NSTEP / 2);
+    lightcone_init(&CP, arestart);
+    run_steps(NSTEP / 2, NSTEP);
+    const int incomplete = read_shell_masses(mass2);
+    message(0, "Shell %d is incomplete after the restart\n", incomplete);
+    assert_int_equal(incomplete, (int) (comoving_distance(arestart) / SHELLWIDTH));
+
+    int shell, nshell = 0;
+    for(shell = 0; shell < MAXSHELL; shell++) {
+        nshell += mass[shell] >= 0;
+        if(shell == incomplete) {
+            assert_true(mass2[shell] >= 0 && mass2[shell] < mass[shell]);
+            continue;
+        }
+        /* Unit masses add up exactly*/
+        assert_true(mass2[shell] == mass[shell]);
+    }
+    assert_true(nshell > 2);
+    set_test_lightcone_params(0);
+}
+
+/* z = cos(theta) and phi of the centre of a RING pixel. Follows pix2ang_ring of the HEALPix library.*/
+static void
+pix2ang_ring(const int64_t nside, const int64_t pix, double * z, double * phi)
+{
+    const int64_t ncap = 2 * nside * (nside - 1), npix = 12 * nside * nside;
+    if(pix < ncap) {
+        const int64_t iring = (1 + (int64_t) sqrt(1 + 2 * pix)) / 2;
+        const int64_t iphi = pix + 1 - 2 * iring * (iring - 1);
+        *z = 1 - iring * iring * 4. / npix;
+        *phi = (iphi - 0.5) * M_PI / (2 * iring);
+    }
+    else if(pix < npix - ncap) {
+        const int64_t ip = pix - ncap;
+        const int64_t iring = ip / (4 * nside) + nside;
+        const int64_t iphi = ip % (4 * nside) + 1;
+        const double fodd = ((iring + nside) & 1) ? 1 : 0.5;
+        *z = (2 * nside - iring) * 2. / (3 * nside);
+        *phi = (iphi - fodd) * M_PI / (2 * nside);
+    }
+    else {
+        const int64_t ip = npix - pix;
+        const int64_t iring = (1 + (int64_t) sqrt(2 * ip - 1)) / 2;
+        const int64_t iphi = 4 * iring + 1 - (ip - 2 * iring * (iring - 1));
+        *z = -1 + iring * iring * 4. / npix;
+        *phi = (iphi - 0.5) * M_PI / (2 * iring);
+    }
+}
+
+static int64_t
+ang2pix(const int64_t nside, const double z, const double phi)
+{
+    const double s = sqrt((1 - z) * (1 + z));
+    const double vec[3] = {s * cos(phi), s * sin(phi), z};
+    return lightcone_vec2pix_ring(nside, vec);
+}
+
+/* The pixels of directions from the ang2pix example of healpy, and the pixels of points around the centre of every pixel.*/
+static void
+test_lightcone_vec2pix_ring(void ** state)
+{
+    const double theta[5] = {M_PI / 2, M_PI / 4, M_PI / 2, 0, M_PI};
+    const double phi[5] = {0, M_PI / 4, M_PI / 2 + 1e-15, 0, 0};
+    const int64_t healpy[5] = {1440, 427, 1520, 0, 3068};
+    int i;
+    for(i = 0; i < 5; i++) {
+        const double vec[3] = {sin(theta[i]) * cos(phi[i]), sin(theta[i]) * sin(phi[i]), cos(theta[i])};
+        assert_int_equal(lightcone_vec2pix_ring(16, vec), healpy[i]);
+    }
+    /* Not normalised*/
+    const double vec[3] = {0, 0, -3};
+    assert_int_equal(lightcone_vec2pix_ring(16, vec), 3068);
+
+    int64_t nside;
+    for(nside = 1; nside <= 64; nside *= 2) {
+        const int64_t ncap = 2 * nside * (nside - 1), npix = 12 * nside * nside;
+        int64_t pix;
+        for(pix = 0; pix < npix; pix++) {
+            double z, phi;
+            pix2ang_ring(nside, pix, &z, &phi);
+            assert_int_equal(ang2pix(nside, z, phi), pix);
+            /* Equatorial pixels away from the caps are diamonds in z and phi*/
+            if(pix < ncap + 4 * nside || pix >= npix - ncap - 4 * nside)
+                continue;
+            const double dz = 0.9 * 2 / (3. * nside), dphi = 0.9 * M_PI / (4 * nside);
+            assert_int_equal(ang2pix(nside, z + dz, phi), pix);
+            assert_int_equal(ang2pix(nside, z - dz, phi), pix);
+            assert_int_equal(ang2pix(nside, z, phi + dphi), pix);
+            assert_int_equal(ang2pix(nside, z, phi - dphi), pix);
+        }
+    }
+}
+
+static int
+setup_lightcone(void ** state)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "BytesPerFile", OPTIONAL, 1024 * 1024 * 1024, "");
+    param_declare_int(ps, "NumWriters", OPTIONAL, 0, "");
+    param_declare_int(ps, "MinNumWriters", OPTIONAL, 1, "");
+    param_declare_int(ps, "WritersPerFile", OPTIONAL, 8, "");
+    param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 1024 * 1024 * 256, "");
+    param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotAsyncWrite", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotLosslessCompression", OPTIONAL, 0, "");
+    param_declare_double(ps, "SnapshotPositionTolerance", OPTIONAL, 0, "");
+    param_declare_double(ps, "SnapshotVelocityTolerance", OPTIONAL, 0, "");
+    param_declare_int(ps, "RestartUseSnapshotDomain", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotConcurrentBlocks", OPTIONAL, 1, "");
+    param_declare_int(ps, "SnapshotIndexChunkSize", OPTIONAL, 0, "");
+    param_declare_double(ps, "LiteSampleFraction", OPTIONAL, 1, "");
+    param_declare_int(ps, "LiteParticleTypes", OPTIONAL, 0, "");
+    param_declare_string(ps, "LiteBlocks", OPTIONAL, "Position,ID", "");
+    param_declare_int(ps, "LiteSinglePrecision", OPTIONAL, 1, "");
+    char * error;
+    assert_int_equal(param_parse(ps, "", &error), 0);
+    set_petaio_params(ps);
+    parameter_set_free(ps);
+    petaio_init();
+    set_test_lightcone_params(0);
+
+    All.BoxSize = 500000;
+    All.UnitLength_in_cm = 3.085678e21;
+    strcpy(All.OutputDir, ".");
+    CP.CMBTemperature = 2.7255;
+    CP.Omega0 = 0.3;
+    CP.OmegaLambda = 1- CP.Omega0;
+    CP.OmegaBaryon = 0.045;
+    CP.HubbleParam = 0.7;
+    CP.RadiationOn = 0;
+    CP.w0_fld = -1;
+    CP.Hubble = 0.1;
+    init_cosmology(&CP, 0.3);
+    All.CP = CP;
+    strcpy(All.SnapshotFileBase, "PART");
+    setup_sync_points(0.3, 0.9, 0.0, 0);
+    TiStart = ti_from_loga(log(TimeStart));
+    dTi = (ti_from_loga(log(TimeEnd)) - TiStart) / NSTEP;
+    particle_alloc_memory(NPART);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_lightcone_crossings),
+        cmocka_unit_test(test_lightcone_restart),
+        cmocka_unit_test(test_lightcone_restart_run_order),
+        cmocka_unit_test(test_lightcone_map_restart),
+        cmocka_unit_test(test_lightcone_vec2pix_ring),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_lightcone, NULL);
+}
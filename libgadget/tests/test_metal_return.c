@@ -16,6 +16,7 @@
 #include "libgadget/metal_return.h"
 #include "libgadget/slotsmanager.h"
 #include "libgadget/metal_tables.h"
+#include "libgadget/cosmology.h"
 
 void test_yields(void ** state)
 {
@@ -63,9 +64,99 @@ void test_yields(void ** state)
     assert_true(fabs(masslowsum - masslow2) < 0.01);
 }
 
+/* Metal yields of a star between two ages by integrating the IMF directly, as done before the yields were tabulated*/
+static double
+direct_metal_yield(double dtmyrstart, double dtmyrend, double stellarmetal, double hub, struct interps * interp, MyFloat * MetalYields, double imf_norm, gsl_integration_workspace * gsl_work, double masslow, double masshigh)
+{
+    int i;
+    const double Nsn1a = sn1a_number(dtmyrstart, dtmyrend, hub);
+    double MetalGenerated = compute_agb_yield(interp->agb_metallicity_interp, agb_total_metals, stellarmetal, masslow, masshigh, gsl_work);
+    MetalGenerated += compute_snii_yield(interp->snii_metallicity_interp, snii_total_metals, stellarmetal, masslow, masshigh, gsl_work);
+    for(i = 0; i < NMETALS; i++) {
+        MetalYields[i] = compute_agb_yield(interp->agb_metals_interp[i], agb_yield[i], stellarmetal, masslow, masshigh, gsl_work);
+        MetalYields[i] += compute_snii_yield(interp->snii_metals_interp[i], snii_yield[i], stellarmetal, masslow, masshigh, gsl_work);
+        MetalYields[i] = MetalYields[i] / imf_norm + Nsn1a * sn1a_yields[i];
+    }
+    return MetalGenerated / imf_norm + Nsn1a * sn1a_total_metals;
+}
+
+/* The tabulated yields match the direct integration over the IMF, on and between the table metallicities,
+ * for timesteps from a fraction of the table spacing to many Gyr. The dying masses are compared to
+ * find_mass_bin_limits, which has a root finding tolerance of 0.5%. The yields are compared to the integrals
+ * between the tabulated dying masses, so that tolerance does not dominate the yields of short timesteps.
+ * Timesteps of a fraction of the table spacing have errors of about 2%: longer ones are much better.*/
+void test_yield_tables(void ** state)
+{
+    gsl_integration_workspace * gsl_work = gsl_integration_workspace_alloc(GSL_WORKSPACE);
+    set_metal_params(1.3e-3);
+    Cosmology CP = {0};
+    CP.CMBTemperature = 2.7255;
+    CP.Omega0 = 0.3;
+    CP.OmegaLambda = 1- CP.Omega0;
+    CP.OmegaBaryon = 0.045;
+    CP.HubbleParam = 0.7;
+    CP.RadiationOn = 0;
+    CP.w0_fld = -1;
+    CP.Hubble = 0.1;
+    init_cosmology(&CP, 0.01);
+    init_metal_return(&CP, 1);
+
+    struct interps interp;
+    setup_metal_table_interp(&interp);
+    const double imf_norm = compute_imf_norm(gsl_work);
+
+    const double metals[] = {0, 0.0003, 0.004, 0.012, 0.02, 0.05};
+    const double steps[] = {1.02, 1.3, 3};
+    double maxmass = 0, maxmetal = 0, maxspecies = 0, maxdying = 0, maxswitch = 0;
+    int iz, is, ia, k;
+    for(iz = 0; iz < (int) (sizeof(metals) / sizeof(metals[0])); iz++)
+    for(is = 0; is < (int) (sizeof(steps) / sizeof(steps[0])); is++)
+    for(ia = 0; ia < 40; ia++) {
+        const double start = 2 * pow(5000, ia / 39.), end = start * steps[is];
+        double masslow, masshigh, mass, metal;
+        MyFloat species[NMETALS], dspecies[NMETALS], tablow, tabhigh;
+        tabulated_yields(start, end, metals[iz], CP.HubbleParam, &mass, &metal, species, &tablow, &tabhigh);
+        find_mass_bin_limits(&masslow, &masshigh, start, end, metals[iz], interp.lifetime_interp);
+        /* find_mass_bin_limits does not find dying masses below the lifetime table*/
+        if(masslow > lifetime_masses[0])
+            maxdying = fmax(maxdying, fabs(tablow - masslow) / masslow);
+        maxdying = fmax(maxdying, fabs(tabhigh - masshigh) / masshigh);
+
+        const double dmass = mass_yield(start, end, metals[iz], CP.HubbleParam, &interp, imf_norm, gsl_work, tablow, tabhigh);
+        const double dmetal = direct_metal_yield(start, end, metals[iz], CP.HubbleParam, &interp, dspecies, imf_norm, gsl_work, tablow, tabhigh);
+        /* Nothing is returned before the first stars die*/
+        if(dmass == 0) {
+            assert_true(fabs(mass) < 1e-10);
+            continue;
+        }
+        maxmass = fmax(maxmass, fabs(mass - dmass) / dmass);
+        /* The yields per star jump at the AGB to SNII switch, and the linear interpolation in age
+         * smears the jump over a table cell. Timesteps within a cell of the switch are only compared
+         * to the returned mass, with a tolerance set by the table spacing.*/
+        if(tablow < SNAGBSWITCH * 1.05 && tabhigh > SNAGBSWITCH / 1.05) {
+            maxswitch = fmax(maxswitch, fabs(metal - dmetal) / dmass);
+            for(k = 0; k < NMETALS; k++)
+                maxswitch = fmax(maxswitch, fabs(species[k] - dspecies[k]) / dmass);
+            continue;
+        }
+        maxmetal = fmax(maxmetal, fabs(metal - dmetal) / dmetal);
+        /* Species include hydrogen and helium and some net yields are tiny or negative, so compare to the returned mass*/
+        for(k = 0; k < NMETALS; k++)
+            maxspecies = fmax(maxspecies, fabs(species[k] - dspecies[k]) / dmass);
+    }
+    message(0, "Largest relative differences: mass %g metals %g species %g dying mass %g near the SNII switch %g\n", maxmass, maxmetal, maxspecies, maxdying, maxswitch);
+    assert_true(maxmass < 0.03);
+    assert_true(maxmetal < 0.03);
+    assert_true(maxspecies < 0.03);
+    assert_true(maxdying < 0.01);
+    assert_true(maxswitch < 0.25);
+    gsl_integration_workspace_free(gsl_work);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_yields),
+        cmocka_unit_test(test_yield_tables),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
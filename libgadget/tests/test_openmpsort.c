@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "stub.h"
 
@@ -99,10 +100,60 @@ static void test_openmpsort(void ** state) {
 
 }
 
+static uint64_t key_int(const void * a, void * arg) {
+    return *(const int *) a;
+}
+
+static uint64_t key_struct(const void * a, void * arg) {
+    return ((const struct __data *) a)->dd[0];
+}
+
+static void test_radix_sort_openmp(void ** state) {
+    int i;
+    int size = 87763;
+    int *a = (int *) malloc(size * sizeof(int));
+
+    srand48(8675309);
+    for(i = 0; i < size; i++)
+        a[i] = (int) (size * drand48());
+
+    double start, end;
+
+    start = omp_get_wtime();
+    radix_sort_openmp(a, size, sizeof(int), key_int, sizeof(int), NULL);
+    end = omp_get_wtime();
+
+    message(1,"parallel radix sort time = %g s %d threads\n",end-start, omp_get_max_threads());
+    for(i=1; i<size; i++) {
+        assert_true(a[i-1] <= a[i]);
+    }
+    free(a);
+
+    /* Large structs are sorted by index; check the sort is stable*/
+    size = 187763;
+    struct __data *b = (struct __data *) malloc(size * sizeof(struct __data));
+    for(i = 0; i < size; i++) {
+        b[i].dd[0] = (int) (1000 * drand48());
+        b[i].dd[1] = i;
+    }
+    start = omp_get_wtime();
+    radix_sort_openmp(b, size, sizeof(struct __data), key_struct, sizeof(int), NULL);
+    end = omp_get_wtime();
+
+    message(1,"parallel radix sort time (struct) = %g s\n",end-start);
+    for(i=1; i<size; i++) {
+        assert_true(b[i-1].dd[0] <= b[i].dd[0]);
+        if(b[i-1].dd[0] == b[i].dd[0])
+            assert_true(b[i-1].dd[1] < b[i].dd[1]);
+    }
+    free(b);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_openmpsort),
         cmocka_unit_test(test_openmpsort_struct),
+        cmocka_unit_test(test_radix_sort_openmp),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
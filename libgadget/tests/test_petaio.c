@@ -0,0 +1,293 @@
+/*Tests for the spatial index of the snapshots*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bigfile-mpi.h>
+#include <libgadget/allvars.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/petaio.h>
+#include <libgadget/utils/peano.h>
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/paramset.h>
+
+#include "stub.h"
+
+#define NUMPART 4000
+#define CHUNKSIZE 128
+
+static const char * SnapName = "test-petaio-index";
+
+static int
+peano_cmp(const void * a, const void * b)
+{
+    const struct particle_data * pa = a, * pb = b;
+    return (pa->Key > pb->Key) - (pa->Key < pb->Key);
+}
+
+/* Each task writes NUMPART particles of type 1, in Peano order, with their positions and an index.*/
+static void
+write_indexed_snapshot(void)
+{
+    int ThisTask, i, d;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    srand48(1234 + ThisTask);
+    PartManager->NumPart = NUMPART;
+    for(i = 0; i < NUMPART; i++) {
+        for(d = 0; d < 3; d++)
+            P[i].Pos[d] = All.BoxSize * (1 - drand48());
+        P[i].Type = 1;
+        P[i].Key = PEANO(P[i].Pos, All.BoxSize);
+    }
+    qsort(P, NUMPART, sizeof(struct particle_data), peano_cmp);
+
+    int * selection = mymalloc("selection", NUMPART * sizeof(int));
+    double * pos = mymalloc("pos", 3 * NUMPART * sizeof(double));
+    for(i = 0; i < NUMPART; i++) {
+        selection[i] = i;
+        for(d = 0; d < 3; d++)
+            pos[3 * i + d] = P[i].Pos[d];
+    }
+    const int ptype_offset[6] = {0};
+    const int ptype_count[6] = {0, NUMPART, 0, 0, 0, 0};
+
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, SnapName, MPI_COMM_WORLD))
+        endrun(0, "Failed to create snapshot: %s\n", big_file_get_error_message());
+    BigArray array = {0};
+    big_array_init(&array, pos, "f8", 2, (size_t []){NUMPART, 3}, NULL);
+    petaio_save_block(&bf, "1/Position", &array, 0);
+    petaio_save_index(&bf, selection, ptype_offset, ptype_count, CHUNKSIZE);
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    myfree(pos);
+    myfree(selection);
+}
+
+static int
+in_box(const double * pos, const double * BoxMin, const double * BoxMax)
+{
+    int d;
+    for(d = 0; d < 3; d++)
+        if(pos[d] < BoxMin[d] || pos[d] > BoxMax[d])
+            return 0;
+    return 1;
+}
+
+/* Read the positions in the ranges and count those in the box. Checks the rows are a subset of the block.*/
+static int64_t
+count_read_in_box(BigFile * bf, const int64_t * ranges, const int64_t nranges, const double * BoxMin, const double * BoxMax, int64_t * nread)
+{
+    BigArray array = {0};
+    *nread = petaio_read_ranges(bf, "1/Position", ranges, nranges, &array);
+    assert_true(*nread >= 0);
+    const double * pos = array.data;
+    int64_t i, n = 0;
+    for(i = 0; i < *nread; i++)
+        n += in_box(pos + 3 * i, BoxMin, BoxMax);
+    free(array.data);
+    return n;
+}
+
+/* The rows found for a box contain every particle in the box, and few others.*/
+static void
+test_index_find_box(void ** state)
+{
+    int NTask, i;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    write_indexed_snapshot();
+
+    const double BoxMin[3] = {20, 10, 60}, BoxMax[3] = {45, 40, 90};
+    int64_t nlocal = 0, ntotal;
+    for(i = 0; i < NUMPART; i++)
+        nlocal += in_box(P[i].Pos, BoxMin, BoxMax);
+    MPI_Allreduce(&nlocal, &ntotal, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+
+    BigFile bf;
+    assert_int_equal(big_file_open(&bf, SnapName), 0);
+    int64_t * ranges;
+    const int64_t nranges = petaio_index_find_box(&bf, 1, BoxMin, BoxMax, &ranges);
+    assert_true(nranges > 0);
+    for(i = 1; i < nranges; i++)
+        assert_true(ranges[2 * i] > ranges[2 * (i-1)] + ranges[2 * (i-1) + 1]);
+
+    int64_t nread;
+    const int64_t nfound = count_read_in_box(&bf, ranges, nranges, BoxMin, BoxMax, &nread);
+    message(0, "Box has %ld particles, read %ld of %ld in %ld ranges\n", ntotal, nread, (int64_t) NUMPART * NTask, nranges);
+    assert_int_equal(nfound, ntotal);
+    /* The box is 2% of the volume: the index should skip most of the block*/
+    assert_true(nread < (int64_t) NUMPART * NTask / 4);
+    free(ranges);
+
+    /* Type 0 was not saved and has no index*/
+    assert_int_equal(petaio_index_find_box(&bf, 0, BoxMin, BoxMax, &ranges), -1);
+    big_file_close(&bf);
+}
+
+/* The rows found for a key range contain every particle with a key in the range.*/
+static void
+test_index_find_keys(void ** state)
+{
+    int i;
+    write_indexed_snapshot();
+
+    const peano_t KeyMin = PEANOCELLS / 8 * 3, KeyMax = PEANOCELLS / 8 * 3 + PEANOCELLS / 64;
+    int64_t nlocal = 0, ntotal;
+    for(i = 0; i < NUMPART; i++)
+        nlocal += (P[i].Key >= KeyMin && P[i].Key <= KeyMax);
+    MPI_Allreduce(&nlocal, &ntotal, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+
+    BigFile bf;
+    assert_int_equal(big_file_open(&bf, SnapName), 0);
+    int64_t * ranges;
+    const int64_t nranges = petaio_index_find_keys(&bf, 1, KeyMin, KeyMax, &ranges);
+    assert_true(nranges > 0);
+
+    BigArray array = {0};
+    const int64_t nread = petaio_read_ranges(&bf, "1/Position", ranges, nranges, &array);
+    const double * pos = array.data;
+    int64_t nfound = 0;
+    for(i = 0; i < nread; i++) {
+        const peano_t key = PEANO((double *) pos + 3 * i, All.BoxSize);
+        nfound += (key >= KeyMin && key <= KeyMax);
+    }
+    message(0, "Key range has %ld particles, read %ld in %ld ranges\n", ntotal, nread, nranges);
+    assert_int_equal(nfound, ntotal);
+    free(array.data);
+    free(ranges);
+    big_file_close(&bf);
+}
+
+SIMPLE_GETTER(GTPosition, Pos[0], double, 3, struct particle_data)
+SIMPLE_GETTER(GTVelocity, Vel[0], float, 3, struct particle_data)
+SIMPLE_GETTER(GTMass, Mass, float, 1, struct particle_data)
+SIMPLE_GETTER(GTID, ID, uint64_t, 1, struct particle_data)
+
+#define NBATCH 4
+static const char * BatchBlocks[NBATCH] = {"1/Position", "1/Velocity", "1/Mass", "1/ID"};
+
+/* Small blocks written concurrently by writer groups are the same as those written one at a time by all ranks.*/
+static void
+test_save_batch(void ** state)
+{
+    int ThisTask, NTask, i, d;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    srand48(4321 + ThisTask);
+    /* A different number of rows on each rank, so the order of the rows in the file is checked*/
+    PartManager->NumPart = NUMPART - 300 * ThisTask;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        for(d = 0; d < 3; d++) {
+            P[i].Pos[d] = All.BoxSize * drand48();
+            P[i].Vel[d] = drand48() - 0.5;
+        }
+        P[i].Mass = 1 + drand48();
+        P[i].ID = (MyIDType) ThisTask * NUMPART + i + 1;
+        P[i].Type = 1;
+        P[i].IsGarbage = 0;
+    }
+
+    struct IOTable IOTable = {0};
+    IOTable.allocated = NBATCH;
+    IOTable.ent = mymalloc2("IOTable", IOTable.allocated * sizeof(IOTableEntry));
+    /* Position is written straight from the particles, the others are packed*/
+    IO_REG_WRONLY(Position, "f8", 3, 1, &IOTable);
+    IO_FIELD(Pos[0], &IOTable);
+    IO_REG_WRONLY(Velocity, "f4", 3, 1, &IOTable);
+    IO_REG_WRONLY(Mass, "f4", 1, 1, &IOTable);
+    IO_REG_WRONLY(ID, "u8", 1, 1, &IOTable);
+
+    int ptype_offset[6] = {0}, ptype_count[6] = {0};
+    int * selection = mymalloc("selection", PartManager->NumPart * sizeof(int));
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
+    const int blocks[NBATCH] = {0, 1, 2, 3};
+
+    /* All the blocks fit in one batch when there is more than one writer group*/
+    const int nbatch = petaio_plan_batch(&IOTable, blocks, NBATCH, ptype_count);
+    assert_int_equal(nbatch, NTask > 1 ? NBATCH : 1);
+
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, "test-petaio-batch", MPI_COMM_WORLD))
+        endrun(0, "Failed to create snapshot: %s\n", big_file_get_error_message());
+    petaio_save_batch(&bf, &IOTable, blocks, NBATCH, selection, ptype_offset, ptype_count, 1);
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+
+    if(0 != big_file_mpi_create(&bf, "test-petaio-batch-ref", MPI_COMM_WORLD))
+        endrun(0, "Failed to create snapshot: %s\n", big_file_get_error_message());
+    for(i = 0; i < NBATCH; i++) {
+        BigArray array = {0};
+        petaio_build_buffer(&array, &IOTable.ent[i], selection, ptype_count[1], P, SlotsManager);
+        petaio_save_block(&bf, (char *) BatchBlocks[i], &array, 0);
+        petaio_destroy_buffer(&array);
+    }
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    myfree(selection);
+    destroy_io_blocks(&IOTable);
+
+    int64_t NTotal = PartManager->NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &NTotal, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    const int64_t ranges[2] = {0, NTotal};
+    BigFile bfbatch, bfref;
+    assert_int_equal(big_file_open(&bfbatch, "test-petaio-batch"), 0);
+    assert_int_equal(big_file_open(&bfref, "test-petaio-batch-ref"), 0);
+    for(i = 0; i < NBATCH; i++) {
+        BigArray batch = {0}, ref = {0};
+        assert_int_equal(petaio_read_ranges(&bfbatch, BatchBlocks[i], ranges, 1, &batch), NTotal);
+        assert_int_equal(petaio_read_ranges(&bfref, BatchBlocks[i], ranges, 1, &ref), NTotal);
+        assert_string_equal(batch.dtype, ref.dtype);
+        assert_int_equal(batch.dims[1], ref.dims[1]);
+        assert_memory_equal(batch.data, ref.data, NTotal * batch.dims[1] * big_file_dtype_itemsize(batch.dtype));
+        free(ref.data);
+        free(batch.data);
+    }
+    big_file_close(&bfref);
+    big_file_close(&bfbatch);
+}
+
+static int
+setup_petaio(void ** state)
+{
+    All.BoxSize = 100;
+    particle_alloc_memory(NUMPART);
+
+    /* Up to 4 writer groups for small blocks*/
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "BytesPerFile", OPTIONAL, 1024 * 1024 * 1024, "");
+    param_declare_int(ps, "NumWriters", OPTIONAL, 0, "");
+    param_declare_int(ps, "MinNumWriters", OPTIONAL, 1, "");
+    param_declare_int(ps, "WritersPerFile", OPTIONAL, 8, "");
+    param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 1024 * 1024 * 256, "");
+    param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotAsyncWrite", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotLosslessCompression", OPTIONAL, 0, "");
+    param_declare_double(ps, "SnapshotPositionTolerance", OPTIONAL, 0, "");
+    param_declare_double(ps, "SnapshotVelocityTolerance", OPTIONAL, 0, "");
+    param_declare_int(ps, "RestartUseSnapshotDomain", OPTIONAL, 0, "");
+    param_declare_int(ps, "SnapshotConcurrentBlocks", OPTIONAL, 4, "");
+    param_declare_int(ps, "SnapshotIndexChunkSize", OPTIONAL, 0, "");
+    param_declare_double(ps, "LiteSampleFraction", OPTIONAL, 0, "");
+    param_declare_int(ps, "LiteParticleTypes", OPTIONAL, 0, "");
+    param_declare_string(ps, "LiteBlocks", OPTIONAL, "", "");
+    param_declare_int(ps, "LiteSinglePrecision", OPTIONAL, 0, "");
+    char * error;
+    assert_int_equal(param_parse(ps, "", &error), 0);
+    set_petaio_params(ps);
+    parameter_set_free(ps);
+    petaio_init();
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_index_find_box),
+        cmocka_unit_test(test_index_find_keys),
+        cmocka_unit_test(test_save_batch),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_petaio, NULL);
+}
@@ -0,0 +1,119 @@
+/*Tests for the unbinding of the subhalo finder*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libgadget/allvars.h>
+#include <libgadget/gravity.h>
+#include <libgadget/subfind.h>
+#include <libgadget/utils/mymalloc.h>
+
+#include "stub.h"
+
+/* A heavy clump A and a light clump B. There are more than SUBFIND_DIRECT particles, so the tree potential is used.*/
+#define NA 1600
+#define NB 400
+#define NPART (NA + NB)
+
+static double Pos[NPART][3], Vel[NPART][3], Mass[NPART];
+
+/* Put particle i uniformly inside a sphere of radius r around center, moving at bulk plus a random velocity of size disp*/
+static void
+place_particle(int i, const double * center, double r, const double * bulk, double disp, double mass)
+{
+    double x[3], v[3], r2, v2;
+    int d;
+    do {
+        r2 = 0;
+        for(d = 0; d < 3; d++) {
+            x[d] = 2 * drand48() - 1;
+            r2 += x[d] * x[d];
+        }
+    } while(r2 > 1);
+    do {
+        v2 = 0;
+        for(d = 0; d < 3; d++) {
+            v[d] = 2 * drand48() - 1;
+            v2 += v[d] * v[d];
+        }
+    } while(v2 > 1 || v2 == 0);
+    for(d = 0; d < 3; d++) {
+        Pos[i][d] = center[d] + r * x[d];
+        Vel[i][d] = bulk[d] + disp * v[d] / sqrt(v2);
+    }
+    Mass[i] = mass;
+}
+
+/* Clump A of mass 2 and radius 1 at rest, clump B of mass 0.1 and radius 0.3 a distance 5 away, moving at vB.*/
+static int
+make_clumps(double vB, int * bound)
+{
+    const double centerA[3] = {0, 0, 0}, centerB[3] = {5, 0, 0};
+    const double rest[3] = {0, 0, 0}, moving[3] = {0, vB, 0};
+    int i;
+    srand48(4242);
+    for(i = 0; i < NA; i++)
+        place_particle(i, centerA, 1, rest, 20, 2. / NA);
+    for(i = NA; i < NPART; i++)
+        place_particle(i, centerB, 0.3, moving, 10, 0.1 / NB);
+    return subfind_unbind_particles((const double (*)[3]) Pos, (const double (*)[3]) Vel, Mass, NPART, bound);
+}
+
+/* B flies past A much faster than the escape velocity: only A is bound*/
+static void
+test_unbind_flyby(void ** state)
+{
+    int bound[NPART];
+    int i, nA = 0, nB = 0;
+    int nbound = make_clumps(1000, bound);
+    for(i = 0; i < NA; i++)
+        nA += bound[i];
+    for(i = NA; i < NPART; i++)
+        nB += bound[i];
+    message(0, "Fly-by: bound %d, from A %d from B %d\n", nbound, nA, nB);
+    assert_int_equal(nbound, NA);
+    assert_int_equal(nA, NA);
+    assert_int_equal(nB, 0);
+}
+
+/* B at rest near A: both clumps are bound together*/
+static void
+test_unbind_satellite(void ** state)
+{
+    int bound[NPART];
+    int nbound = make_clumps(0, bound);
+    message(0, "Satellite: bound %d\n", nbound);
+    assert_int_equal(nbound, NPART);
+}
+
+static int
+setup_subfind(void ** state)
+{
+    struct subfind_params sp = {1, 20, 20, 0.5};
+    set_subfindpar(sp);
+    /* Static, physical coordinates*/
+    All.G = 43007.1;
+    All.cf.a = 1;
+    All.cf.hubble = 0;
+    struct gravshort_tree_params tree_params = {0};
+    tree_params.FractionalGravitySoftening = 1. / 30;
+    tree_params.AdaptiveSoftening = 0;
+    set_gravshort_treepar(tree_params);
+    /* Softening of 0.01, much smaller than the clumps*/
+    gravshort_set_softenings(0.3);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_unbind_flyby),
+        cmocka_unit_test(test_unbind_satellite),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_subfind, NULL);
+}
@@ -69,6 +69,25 @@ static void test_skip_first(void ** state) {
     assert_int_equal(find_current_sync_point(0)->write_snapshot, 1);
 }
 
+static void test_lite(void ** state) {
+    /* One lite output between snapshots, one on a snapshot and one past the end*/
+    double lite[3] = {0.5, 0.8, 2.0};
+    set_lite_sync_params(3, lite);
+    setup_sync_points(All.TimeIC, All.TimeMax, 0.0, 0);
+    SyncPoint * sync = find_current_sync_point(2 * TIMEBASE);
+    assert_true(fabs(sync->a - 0.5) < 1e-6);
+    assert_int_equal(sync->write_lite, 1);
+    assert_int_equal(sync->write_snapshot, 0);
+    sync = find_current_sync_point(3 * TIMEBASE);
+    assert_true(fabs(sync->a - 0.8) < 1e-6);
+    assert_int_equal(sync->write_lite, 1);
+    assert_int_equal(sync->write_snapshot, 1);
+    assert_int_equal(find_current_sync_point(TIMEBASE)->write_lite, 0);
+    assert_int_equal(find_current_sync_point(4 * TIMEBASE)->write_lite, 0);
+    assert_int_equal(find_next_sync_point(4 * TIMEBASE), NULL);
+    set_lite_sync_params(0, lite);
+}
+
 static void test_dloga(void ** state) {
 
     setup_sync_points(All.TimeIC, All.TimeMax, 0.0, 0);
@@ -121,6 +140,7 @@ int main(void) {
         cmocka_unit_test(test_conversions),
         cmocka_unit_test(test_dloga),
         cmocka_unit_test(test_skip_first),
+        cmocka_unit_test(test_lite),
     };
     return cmocka_run_group_tests_mpi(tests, setup, teardown);
 }
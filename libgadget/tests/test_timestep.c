@@ -0,0 +1,216 @@
+/*Tests for the active particle list and the timebin lists kept by timestep.c*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgadget/allvars.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/timebinmgr.h>
+#include <libgadget/timestep.h>
+#include <libgadget/walltime.h>
+#include <libgadget/utils/mymalloc.h>
+
+#include "stub.h"
+
+#define NPART 4000
+/* Particles live in bins MINBIN to MAXBIN, and the PM step is as long as the largest bin*/
+#define MINBIN 10
+#define MAXBIN 14
+
+static struct ClockTable CT;
+
+static int
+cmp_int(const void * a, const void * b)
+{
+    const int i = *(const int *) a;
+    const int j = *(const int *) b;
+    return (i > j) - (i < j);
+}
+
+/* A random bin which is active at Ti, so a particle may move into it now*/
+static int
+random_active_bin(inttime_t Ti)
+{
+    int bin;
+    do {
+        bin = MINBIN + (int) (drand48() * (MAXBIN - MINBIN + 1));
+    } while(!is_timebin_active(bin, Ti));
+    return bin;
+}
+
+/* Copy particle i to the end of the particle table, as if it had been exchanged in*/
+static int
+append_particle(int i)
+{
+    const int j = PartManager->NumPart++;
+    if(j >= PartManager->MaxPart)
+        endrun(5, "No space left for appended particles\n");
+    P[j] = P[i];
+    P[j].ID = P[i].ID + ((MyIDType) 1 << 40);
+    return j;
+}
+
+/* The active list must contain exactly the live particles in active bins*/
+static void
+check_activelist(const ActiveParticles * act, const DriftKickTimes * times)
+{
+    int64_t i, nexpect = 0;
+    int * expect = malloc(PartManager->NumPart * sizeof(int));
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(!P[i].IsGarbage && !P[i].Swallowed && is_timebin_active(P[i].TimeBin, times->Ti_Current))
+            expect[nexpect++] = i;
+
+    if(!act->ActiveParticle) {
+        /* On a PM step everything is active*/
+        assert_true(is_PM_timestep(times));
+        assert_int_equal(act->NumActiveParticle, PartManager->NumPart);
+        for(i = 0; i < PartManager->NumPart; i++)
+            assert_true(P[i].IsGarbage || is_timebin_active(P[i].TimeBin, times->Ti_Current));
+    }
+    else {
+        assert_int_equal(act->NumActiveParticle, nexpect);
+        int * sorted = malloc((nexpect + 1) * sizeof(int));
+        memcpy(sorted, act->ActiveParticle, nexpect * sizeof(int));
+        qsort(sorted, nexpect, sizeof(int), cmp_int);
+        assert_memory_equal(sorted, expect, nexpect * sizeof(int));
+        free(sorted);
+    }
+    free(expect);
+}
+
+/* The counts in every bin must match a scan of the live particles*/
+static void
+check_timebin_counts(void)
+{
+    int expect[6 * (TIMEBINS + 1)] = {0};
+    int64_t i;
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(!P[i].IsGarbage && !P[i].Swallowed)
+            expect[(TIMEBINS + 1) * P[i].Type + P[i].TimeBin]++;
+    assert_memory_equal(get_timebin_count_type(), expect, sizeof(expect));
+}
+
+/* Run two PM steps of sub-steps. On each sub-step the active particles change bin and fork children,
+ * particles are exchanged in and out and particles in inactive bins become garbage,
+ * and the active list and bin counts are checked against a scan of the particles.*/
+static void
+test_rebuild_activelist(void ** state)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    srand48(37 + ThisTask);
+
+    particle_alloc_memory(4 * NPART);
+    PartManager->NumPart = NPART;
+    memset(P, 0, PartManager->MaxPart * sizeof(struct particle_data));
+    int64_t i;
+    for(i = 0; i < NPART; i++) {
+        P[i].Type = (i % 3) ? 1 : 3;
+        P[i].ID = (MyIDType) ThisTask * NPART + i + 1;
+        P[i].Mass = 1;
+        P[i].PI = -1;
+        P[i].TimeBin = random_active_bin(0);
+    }
+
+    /* Everything starts synchronised on a PM step*/
+    DriftKickTimes times = init_driftkicktime(0);
+    times.PM_start = 0;
+    times.PM_length = 0;
+    const inttime_t dti_min = dti_from_timebin(MINBIN);
+    const inttime_t dti_pm = dti_from_timebin(MAXBIN);
+    int step, nforked = 0, nexchanged = 0, ngarbage = 0;
+    for(step = 0; step <= 2 * dti_pm / dti_min; step++)
+    {
+        times.Ti_Current = step * dti_min;
+        if(times.Ti_Current > times.PM_start + times.PM_length) {
+            times.PM_start += times.PM_length;
+            times.PM_length = dti_pm;
+        }
+        for(i = 0; i < PartManager->NumPart; i++)
+            P[i].Ti_drift = times.Ti_Current;
+
+        ActiveParticles act = {0};
+        rebuild_activelist(&act, &times, step);
+        check_activelist(&act, &times);
+        check_timebin_counts();
+        const int64_t NumPartStep = PartManager->NumPart;
+
+        /* New timesteps for the active particles*/
+        const int64_t nactive = act.NumActiveParticle;
+        int64_t n;
+        for(n = 0; n < nactive; n++) {
+            const int p = act.ActiveParticle ? act.ActiveParticle[n] : n;
+            if(!P[p].IsGarbage)
+                P[p].TimeBin = random_active_bin(times.Ti_Current);
+        }
+
+        /* Fork some active particles: the children are added to the active list*/
+        for(n = 0; n < nactive; n += 97) {
+            const int p = act.ActiveParticle ? act.ActiveParticle[n] : n;
+            if(P[p].IsGarbage || P[p].Generation >= 8)
+                continue;
+            slots_split_particle(p, P[p].Mass / 2, PartManager);
+            nforked++;
+        }
+        check_activelist(&act, &times);
+        free_activelist(&act);
+
+        /* Exchange some particles in any bin: they leave as garbage and arrive at the end*/
+        for(n = 0; n < 20; n++) {
+            const int p = drand48() * PartManager->NumPart;
+            if(P[p].IsGarbage)
+                continue;
+            append_particle(p);
+            slots_mark_garbage(p, PartManager, SlotsManager);
+            nexchanged++;
+        }
+
+        /* Every few steps some particles in inactive bins are removed and the particle table is compacted*/
+        if(step % 5 == 3) {
+            const inttime_t Ti_Next = times.Ti_Current + dti_min;
+            for(i = 0; i < PartManager->NumPart; i++) {
+                if(!P[i].IsGarbage && !is_timebin_active(P[i].TimeBin, Ti_Next) && drand48() < 0.05) {
+                    slots_mark_garbage(i, PartManager, SlotsManager);
+                    ngarbage++;
+                }
+            }
+            int compact[6] = {0};
+            slots_gc(compact, PartManager, SlotsManager);
+            for(i = 0; i < PartManager->NumPart; i++)
+                assert_false(P[i].IsGarbage);
+            /* Refill the particle table from other tasks, so that only the GC event marks the lists as stale*/
+            while(PartManager->NumPart <= NumPartStep)
+                append_particle(drand48() * PartManager->NumPart);
+        }
+    }
+    /* Make sure everything was exercised*/
+    assert_true(nforked > 0);
+    assert_true(nexchanged > 0);
+    assert_true(ngarbage > 0);
+    myfree(P);
+}
+
+static int
+setup_timestep(void ** state)
+{
+    walltime_init(&CT);
+    slots_init(0, SlotsManager);
+    All.Time = 0.1;
+    setup_sync_points(0.1, 1.0, 0.0, 0);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_rebuild_activelist),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_timestep, NULL);
+}
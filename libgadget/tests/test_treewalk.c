@@ -0,0 +1,224 @@
+/*Tests for the export and broadcast paths of the treewalk*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgadget/partmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/utils/mymalloc.h>
+#include <libgadget/utils/paramset.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/timestep.h>
+#include <libgadget/treewalk.h>
+
+#include "stub.h"
+
+#define NUMPART 4096
+/* One particle in this many is a query*/
+#define QUERYSTRIDE 64
+
+static double BoxSize = 8;
+static struct ClockTable CT;
+
+typedef struct {
+    TreeWalkQueryBase base;
+    double Hsml;
+} TreeWalkQueryCount;
+
+typedef struct {
+    TreeWalkResultBase base;
+    int64_t Count;
+    int64_t IDSum;
+    double MassR2;
+} TreeWalkResultCount;
+
+typedef struct {
+    TreeWalkNgbIterBase base;
+} TreeWalkNgbIterCount;
+
+struct CountPriv {
+    double Hsml;
+    int64_t * Count;
+    int64_t * IDSum;
+    double * MassR2;
+};
+#define COUNT_GET_PRIV(tw) ((struct CountPriv *) ((tw)->priv))
+
+static void
+count_copy(int place, TreeWalkQueryCount * I, TreeWalk * tw)
+{
+    I->Hsml = COUNT_GET_PRIV(tw)->Hsml;
+}
+
+static void
+count_reduce(int place, TreeWalkResultCount * remote, enum TreeWalkReduceMode mode, TreeWalk * tw)
+{
+    TREEWALK_REDUCE(COUNT_GET_PRIV(tw)->Count[place], remote->Count);
+    TREEWALK_REDUCE(COUNT_GET_PRIV(tw)->IDSum[place], remote->IDSum);
+    TREEWALK_REDUCE(COUNT_GET_PRIV(tw)->MassR2[place], remote->MassR2);
+}
+
+/* Count the neighbours of each query, and sum their IDs and mass weighted square distances*/
+static void
+count_ngbiter(TreeWalkQueryCount * I,
+        TreeWalkResultCount * O,
+        TreeWalkNgbIterCount * iter,
+        LocalTreeWalk * lv)
+{
+    if(iter->base.other == -1) {
+        iter->base.Hsml = I->Hsml;
+        iter->base.mask = 1 << 1;
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        return;
+    }
+    const int other = iter->base.other;
+    O->Count++;
+    O->IDSum += P[other].ID;
+    O->MassR2 += P[other].Mass * iter->base.r2;
+}
+
+/* Walk the queries with the given visit function, by export or by broadcast.*/
+static void
+run_count(TreeWalkVisitFunction visit, int broadcast, ForceTree * tree, int * queue, int64_t nqueue, struct CountPriv * priv)
+{
+    TreeWalk tw[1] = {{0}};
+    tw->ev_label = "COUNT";
+    tw->visit = visit;
+    tw->ngbiter = (TreeWalkNgbIterFunction) count_ngbiter;
+    tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterCount);
+    tw->fill = (TreeWalkFillQueryFunction) count_copy;
+    tw->reduce = (TreeWalkReduceResultFunction) count_reduce;
+    tw->query_type_elsize = sizeof(TreeWalkQueryCount);
+    tw->result_type_elsize = sizeof(TreeWalkResultCount);
+    tw->broadcast_small = broadcast;
+    tw->tree = tree;
+    tw->priv = priv;
+    memset(priv->Count, 0, PartManager->NumPart * sizeof(int64_t));
+    memset(priv->IDSum, 0, PartManager->NumPart * sizeof(int64_t));
+    memset(priv->MassR2, 0, PartManager->NumPart * sizeof(double));
+    treewalk_run(tw, queue, nqueue);
+    assert_int_equal(tw->UseBroadcast, broadcast);
+}
+
+/* Random particles over the box, decomposed over the tasks. Every query near a domain boundary
+ * has neighbours on other tasks, so the broadcast results must be reduced exactly as the exported ones.*/
+static void
+test_broadcast(void ** state)
+{
+    int ThisTask, NTask, i, d;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    srand48(1729 + ThisTask);
+    PartManager->NumPart = NUMPART;
+    for(i = 0; i < NUMPART; i++) {
+        for(d = 0; d < 3; d++)
+            P[i].Pos[d] = BoxSize * drand48();
+        P[i].ID = (MyIDType) ThisTask * NUMPART + i + 1;
+        P[i].Mass = 1 + drand48();
+        P[i].Type = 1;
+        P[i].TimeBin = 0;
+        P[i].Ti_drift = 0;
+        P[i].IsGarbage = 0;
+        P[i].Swallowed = 0;
+        P[i].Key = PEANO(P[i].Pos, BoxSize);
+    }
+    DomainDecomp dd = {0};
+    domain_decompose_full(&dd);
+    ForceTree tree = {0};
+    force_tree_rebuild(&tree, &dd, BoxSize, 0, 1, NULL);
+
+    int64_t nqueue = 0;
+    int * queue = mymalloc("queue", PartManager->NumPart * sizeof(int));
+    for(i = 0; i < PartManager->NumPart; i += QUERYSTRIDE)
+        queue[nqueue++] = i;
+
+    /* About 30 neighbours each*/
+    struct CountPriv priv[1];
+    priv->Hsml = BoxSize / cbrt(NUMPART * NTask) * 2;
+    priv->Count = mymalloc("Count", PartManager->NumPart * sizeof(int64_t));
+    priv->IDSum = mymalloc("IDSum", PartManager->NumPart * sizeof(int64_t));
+    priv->MassR2 = mymalloc("MassR2", PartManager->NumPart * sizeof(double));
+    int64_t * Count = mymalloc("Count0", PartManager->NumPart * sizeof(int64_t));
+    int64_t * IDSum = mymalloc("IDSum0", PartManager->NumPart * sizeof(int64_t));
+    double * MassR2 = mymalloc("MassR20", PartManager->NumPart * sizeof(double));
+
+    const TreeWalkVisitFunction visits[2] = {(TreeWalkVisitFunction) treewalk_visit_ngbiter, (TreeWalkVisitFunction) treewalk_visit_nolist_ngbiter};
+    int v;
+    for(v = 0; v < 2; v++) {
+        run_count(visits[v], 0, &tree, queue, nqueue, priv);
+        memcpy(Count, priv->Count, PartManager->NumPart * sizeof(int64_t));
+        memcpy(IDSum, priv->IDSum, PartManager->NumPart * sizeof(int64_t));
+        memcpy(MassR2, priv->MassR2, PartManager->NumPart * sizeof(double));
+
+        run_count(visits[v], 1, &tree, queue, nqueue, priv);
+        int64_t nbad = 0, nngb = 0, j;
+        for(j = 0; j < nqueue; j++) {
+            const int place = queue[j];
+            nngb += Count[place];
+            nbad += priv->Count[place] != Count[place];
+            nbad += priv->IDSum[place] != IDSum[place];
+            /* Sums from other tasks may be reduced in a different order*/
+            nbad += fabs(priv->MassR2[place] - MassR2[place]) > 1e-12 * MassR2[place];
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &nbad, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &nngb, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        message(0, "Visit %d: %ld neighbours, %ld differences between the export and broadcast results\n", v, nngb, nbad);
+        assert_true(nngb > 0);
+        assert_int_equal(nbad, 0);
+    }
+
+    myfree(MassR2);
+    myfree(IDSum);
+    myfree(Count);
+    myfree(priv->MassR2);
+    myfree(priv->IDSum);
+    myfree(priv->Count);
+    myfree(queue);
+    force_tree_free(&tree);
+    domain_free(&dd);
+}
+
+static int
+setup_treewalk(void ** state)
+{
+    /* Needed so the integer timeline works*/
+    setup_sync_points(0.01, 0.1, 0.0, 0);
+    slots_init(0, SlotsManager);
+    int64_t atleast[6] = {0};
+    slots_reserve(1, atleast, SlotsManager);
+    particle_alloc_memory(2 * NUMPART);
+    walltime_init(&CT);
+    init_forcetree_params(2);
+
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 2;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "ImportBufferBoost", OPTIONAL, 2, "");
+    param_declare_int(ps, "SmallTreeWalkMaxQueries", OPTIONAL, 1000, "");
+    char * error;
+    assert_int_equal(param_parse(ps, "", &error), 0);
+    set_treewalk_params(ps);
+    parameter_set_free(ps);
+    return 0;
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_broadcast),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_treewalk, NULL);
+}
@@ -12,6 +12,9 @@ static struct sync_params
 {
     int OutputListLength;
     double OutputListTimes[1024];
+    /* Times of the lite snapshot stream, which has its own output list*/
+    int LiteListLength;
+    double LiteListTimes[1024];
 } Sync;
 
 int cmp_double(const void * a, const void * b)
@@ -28,8 +31,8 @@ int cmp_double(const void * a, const void * b)
  *  We sort the input after reading it, so that the initial list need not be sorted.
  *  This function could be repurposed for reading generic arrays in future.
  */
-int
-OutputListAction(ParameterSet * ps, char * name, void * data)
+static int
+parse_output_list(ParameterSet * ps, char * name, double * OutputListTimes, int * OutputListLength)
 {
     char * outputlist = param_get_string(ps, name);
     char * strtmp = fastpm_strdup(outputlist);
@@ -44,16 +47,16 @@ OutputListAction(ParameterSet * ps, char * name, void * data)
 /*     message(1, "Found %d times in output list.\n", count); */
 
     /*Allocate enough memory*/
-    Sync.OutputListLength = count;
+    *OutputListLength = count;
     int maxcount = sizeof(Sync.OutputListTimes) / sizeof(Sync.OutputListTimes[0]);
     if(maxcount > (int) MAXSNAPSHOTS)
         maxcount = MAXSNAPSHOTS;
-    if(Sync.OutputListLength > maxcount) {
-        message(1, "Too many entries (%d) in the OutputList, can take no more than %d.\n", Sync.OutputListLength, maxcount);
+    if(*OutputListLength > maxcount) {
+        message(1, "Too many entries (%d) in the %s, can take no more than %d.\n", *OutputListLength, name, maxcount);
         return 1;
     }
     /*Now read in the values*/
-    for(count=0,token=strtok(outputlist,","); count < Sync.OutputListLength && token; count++, token=strtok(NULL,","))
+    for(count=0,token=strtok(outputlist,","); count < *OutputListLength && token; count++, token=strtok(NULL,","))
     {
         /* Skip a leading quote if one exists.
          * Extra characters are ignored by atof, so
@@ -66,13 +69,25 @@ OutputListAction(ParameterSet * ps, char * name, void * data)
         if(a < 0.0) {
             endrun(1, "Requesting a negative output scaling factor a = %g\n", a);
         }
-        Sync.OutputListTimes[count] = a;
-/*         message(1, "Output at: %g\n", Sync.OutputListTimes[count]); */
+        OutputListTimes[count] = a;
+/*         message(1, "Output at: %g\n", OutputListTimes[count]); */
     }
     myfree(strtmp);
     return 0;
 }
 
+int
+OutputListAction(ParameterSet * ps, char * name, void * data)
+{
+    return parse_output_list(ps, name, Sync.OutputListTimes, &Sync.OutputListLength);
+}
+
+int
+LiteOutputListAction(ParameterSet * ps, char * name, void * data)
+{
+    return parse_output_list(ps, name, Sync.LiteListTimes, &Sync.LiteListLength);
+}
+
 /* For the tests*/
 void set_sync_params(int OutputListLength, double * OutputListTimes)
 {
@@ -82,6 +97,45 @@ void set_sync_params(int OutputListLength, double * OutputListTimes)
         Sync.OutputListTimes[i] = OutputListTimes[i];
 }
 
+void set_lite_sync_params(int LiteListLength, double * LiteListTimes)
+{
+    int i;
+    Sync.LiteListLength = LiteListLength;
+    for(i = 0; i < LiteListLength; i++)
+        Sync.LiteListTimes[i] = LiteListTimes[i];
+}
+
+/* Find the sync point at a, inserting it if needed. Returns -1 if a is beyond the last sync point.*/
+static int
+insert_sync_point(double a)
+{
+    int j;
+    for(j = 0; j < NSyncPoints; j ++) {
+        if(a <= SyncPoints[j].a) {
+            break;
+        }
+    }
+    if(j == NSyncPoints) {
+        /* beyond TimeMax, skip */
+        return -1;
+    }
+    /* found, so loga >= SyncPoints[j].loga */
+    if(a == SyncPoints[j].a) {
+        /* requesting output on an existing entry, e.g. TimeInit or duplicated entry */
+        return j;
+    }
+    /* insert the item; */
+    memmove(&SyncPoints[j + 1], &SyncPoints[j],
+        sizeof(SyncPoints[0]) * (NSyncPoints - j));
+    SyncPoints[j].a = a;
+    SyncPoints[j].loga = log(a);
+    SyncPoints[j].write_snapshot = 0;
+    SyncPoints[j].write_fof = 0;
+    SyncPoints[j].write_lite = 0;
+    NSyncPoints ++;
+    return j;
+}
+
 /* This function compiles
  *
  * Sync.OutputListTimes, All.TimeIC, All.TimeMax
@@ -103,7 +157,7 @@ setup_sync_points(double TimeIC, double TimeMax, double no_snapshot_until_time,
 
     if(NSyncPoints > 0)
         myfree(SyncPoints);
-    SyncPoints = mymalloc("SyncPoints", sizeof(SyncPoint) * (Sync.OutputListLength+2));
+    SyncPoints = mymalloc("SyncPoints", sizeof(SyncPoint) * (Sync.OutputListLength + Sync.LiteListLength + 2));
 
     /* Set up first and last entry to SyncPoints; TODO we can insert many more! */
 
@@ -111,9 +165,11 @@ setup_sync_points(double TimeIC, double TimeMax, double no_snapshot_until_time,
     SyncPoints[0].loga = log(TimeIC);
     SyncPoints[0].write_snapshot = 0; /* by default no output here. */
     SyncPoints[0].write_fof = 0;
+    SyncPoints[0].write_lite = 0;
     SyncPoints[1].a = TimeMax;
     SyncPoints[1].loga = log(TimeMax);
     SyncPoints[1].write_snapshot = 1;
+    SyncPoints[1].write_lite = 0;
     if(SnapshotWithFOF)
         SyncPoints[1].write_fof = 1;
     else
@@ -122,30 +178,9 @@ setup_sync_points(double TimeIC, double TimeMax, double no_snapshot_until_time,
 
     /* we do an insertion sort here. A heap is faster but who cares the speed for this? */
     for(i = 0; i < Sync.OutputListLength; i ++) {
-        int j = 0;
-        double a = Sync.OutputListTimes[i];
-        double loga = log(a);
-
-        for(j = 0; j < NSyncPoints; j ++) {
-            if(a <= SyncPoints[j].a) {
-                break;
-            }
-        }
-        if(j == NSyncPoints) {
-            /* beyond TimeMax, skip */
+        int j = insert_sync_point(Sync.OutputListTimes[i]);
+        if(j < 0)
             continue;
-        }
-        /* found, so loga >= SyncPoints[j].loga */
-        if(a == SyncPoints[j].a) {
-            /* requesting output on an existing entry, e.g. TimeInit or duplicated entry */
-        } else {
-            /* insert the item; */
-            memmove(&SyncPoints[j + 1], &SyncPoints[j],
-                sizeof(SyncPoints[0]) * (NSyncPoints - j));
-            SyncPoints[j].a = a;
-            SyncPoints[j].loga = loga;
-            NSyncPoints ++;
-        }
         if(SyncPoints[j].a > no_snapshot_until_time) {
             SyncPoints[j].write_snapshot = 1;
             if(SnapshotWithFOF) {
@@ -159,6 +194,17 @@ setup_sync_points(double TimeIC, double TimeMax, double no_snapshot_until_time,
         }
     }
 
+    /* The lite snapshots only add sync points; they do not change the full snapshots.*/
+    for(i = 0; i < Sync.LiteListLength; i ++) {
+        int j = insert_sync_point(Sync.LiteListTimes[i]);
+        if(j < 0)
+            continue;
+        SyncPoints[j].write_lite = SyncPoints[j].a > no_snapshot_until_time;
+    }
+
+    if(NSyncPoints > (int) MAXSNAPSHOTS)
+        endrun(1, "Too many output times (%d), can take no more than %d.\n", NSyncPoints, MAXSNAPSHOTS);
+
     for(i = 0; i < NSyncPoints; i++) {
         SyncPoints[i].ti = (i * 1L) << (TIMEBINS);
     }
@@ -25,6 +25,7 @@ struct SyncPoint
     double loga;
     int write_snapshot;
     int write_fof;
+    int write_lite; /* Append to the lite snapshot stream*/
     inttime_t ti;
 };
 
@@ -59,7 +60,9 @@ inttime_t find_next_outputtime(inttime_t ti_curr);
 inttime_t out_from_ti(inttime_t ti);
 
 int OutputListAction(ParameterSet * ps, char * name, void * data);
+int LiteOutputListAction(ParameterSet * ps, char * name, void * data);
 void set_sync_params(int OutputListLength, double * OutputListTimes);
+void set_lite_sync_params(int LiteListLength, double * LiteListTimes);
 void setup_sync_points(double TimeIC, double TimeMax, double no_snapshot_until_time, int SnapshotWithFOF);
 
 SyncPoint *
@@ -742,81 +742,266 @@ inttime_t find_next_kick(inttime_t Ti_Current, int minTimeBin)
 
 static void print_timebin_statistics(const DriftKickTimes * const times, const int NumCurrentTiStep, int * TimeBinCountType);
 
-/* mark the bins that will be active before the next kick*/
-int rebuild_activelist(ActiveParticles * act, const DriftKickTimes * const times, int NumCurrentTiStep)
+/* Persistent lists of the particles in each timebin, so that the active list
+ * is the concatenation of the lists of the active bins and building it costs
+ * O(active particles) rather than a scan of every particle.
+ * The lists are rebuilt from scratch on PM steps and after a gc has reordered the particles.
+ * Otherwise only the bins which were active on the last step, whose particles may have
+ * changed bin in find_timesteps, and the particles appended since (by the exchange or by forking)
+ * are resorted. Particles exchanged away from an inactive bin stay in its list
+ * as garbage until the bin is next active.*/
+static struct TimeBinLists
 {
-    int i;
+    int * Bin[TIMEBINS+1];
+    int64_t Size[TIMEBINS+1];
+    int64_t MaxSize[TIMEBINS+1];
+    /* Live particles of each type in each bin on this task, laid out as [type][bin].
+     * The counts of a bin are refreshed whenever the bin is active, so inactive bins are
+     * reported as they were when last active. This keeps the global sums consistent,
+     * as a particle exchanged into an inactive bin is still counted by the task it came from.*/
+    int CountType[6 * (TIMEBINS+1)];
+    /* PartManager->NumPart at the last update: later particles are not yet in the lists*/
+    int64_t NumPart;
+    /* Highest bin active at the last update. Particles in bins up to this may have moved bin since.*/
+    int LastActiveBin;
+    /* Set if the indices in the lists refer to the current particle table*/
+    int valid;
+    int listening;
+} TimeBinLists;
 
-    int NumThreads = omp_get_max_threads();
-    /*Since we use a static schedule, only need NumPart/NumThreads elements per thread.*/
-    size_t narr = PartManager->NumPart / NumThreads + NumThreads;
+static int
+timestep_eh_slots_after_gc(EIBase * event, void * userdata)
+{
+    EISlotsAfterGC * ev = (EISlotsAfterGC *) event;
+    struct TimeBinLists * lists = (struct TimeBinLists *) userdata;
+    /* The particles have moved: rebuild the lists on the next step*/
+    if(ev->pman == PartManager)
+        lists->valid = 0;
+    return 0;
+}
 
-    /*We know all particles are active on a PM timestep*/
-    if(is_PM_timestep(times)) {
-        act->ActiveParticle = NULL;
-        act->NumActiveParticle = PartManager->NumPart;
-    }
-    else {
-        /*Need space for more particles than we have, because of star formation*/
-        act->ActiveParticle = (int *) mymalloc("ActiveParticle", narr * NumThreads * sizeof(int));
-        act->NumActiveParticle = 0;
-    }
+static void
+timebin_lists_reserve(struct TimeBinLists * lists, const int bin, const int64_t size)
+{
+    if(size <= lists->MaxSize[bin])
+        return;
+    lists->MaxSize[bin] = size + size / 4 + 64;
+    lists->Bin[bin] = realloc(lists->Bin[bin], lists->MaxSize[bin] * sizeof(int));
+    if(!lists->Bin[bin])
+        endrun(5, "Could not allocate %ld entries for the list of timebin %d\n", lists->MaxSize[bin], bin);
+}
 
-    int * TimeBinCountType = mymalloc("TimeBinCountType", 6*(TIMEBINS+1)*NumThreads * sizeof(int));
-    memset(TimeBinCountType, 0, 6 * (TIMEBINS+1) * NumThreads * sizeof(int));
+/* Append particles to the lists of their current timebins, preserving their order.
+ * The particles are cand[0..ncand), or the range [first, first + ncand) if cand is NULL.
+ * Garbage and swallowed particles are dropped. The type counts of bins up to maxcount are incremented.*/
+static void
+timebin_lists_insert(struct TimeBinLists * lists, const int * cand, const int64_t first, const int64_t ncand, const int maxcount, const inttime_t Ti_Current)
+{
+    int64_t n;
+    int bin, tid;
+    if(ncand <= 0)
+        return;
 
-    /*We want a lockless algorithm which preserves the ordering of the particle list.*/
-    size_t *NActiveThread = ta_malloc("NActiveThread", size_t, NumThreads);
-    int **ActivePartSets = ta_malloc("ActivePartSets", int *, NumThreads);
-    gadget_setup_thread_arrays(act->ActiveParticle, ActivePartSets, NActiveThread, narr, NumThreads);
+    const int NumThreads = omp_get_max_threads();
+    int64_t * ThreadCount = mymalloc2("ThreadCount", 6 * (TIMEBINS+1) * NumThreads * sizeof(int64_t));
+    memset(ThreadCount, 0, 6 * (TIMEBINS+1) * NumThreads * sizeof(int64_t));
+    int64_t * ThreadOffset = mymalloc2("ThreadOffset", (TIMEBINS+1) * NumThreads * sizeof(int64_t));
 
-    /* We enforce schedule static to imply monotonic, ensure that each thread executes on contiguous particles
-     * and ensure no thread gets more than narr particles.*/
-    size_t schedsz = PartManager->NumPart / NumThreads + 1;
+    /* We enforce schedule static so that each thread sees the same candidates in both loops.*/
+    size_t schedsz = ncand / NumThreads + 1;
     #pragma omp parallel for schedule(static, schedsz)
-    for(i = 0; i < PartManager->NumPart; i++)
+    for(n = 0; n < ncand; n++)
     {
-        const int bin = P[i].TimeBin;
-        const int tid = omp_get_thread_num();
+        const int i = cand ? cand[n] : first + n;
         if(P[i].IsGarbage || P[i].Swallowed)
             continue;
         /* when we are in PM, all particles must have been synced. */
-        if (P[i].Ti_drift != times->Ti_Current) {
-            endrun(5, "Particle %d type %d has drift time %x not ti_current %x!",i, P[i].Type, P[i].Ti_drift, times->Ti_Current);
+        if (P[i].Ti_drift != Ti_Current) {
+            endrun(5, "Particle %d type %d has drift time %x not ti_current %x!",i, P[i].Type, P[i].Ti_drift, Ti_Current);
+        }
+        const int tid = omp_get_thread_num();
+        ThreadCount[(TIMEBINS + 1) * (6* tid + P[i].Type) + P[i].TimeBin] ++;
+    }
+
+    /* Each thread writes its particles to a contiguous section of each list*/
+    for(bin = 0; bin <= TIMEBINS; bin++) {
+        int64_t size = lists->Size[bin];
+        for(tid = 0; tid < NumThreads; tid++) {
+            ThreadOffset[(TIMEBINS + 1) * tid + bin] = size;
+            int ptype;
+            for(ptype = 0; ptype < 6; ptype++) {
+                const int64_t count = ThreadCount[(TIMEBINS + 1) * (6* tid + ptype) + bin];
+                size += count;
+                if(bin <= maxcount)
+                    lists->CountType[(TIMEBINS + 1) * ptype + bin] += count;
+            }
         }
+        timebin_lists_reserve(lists, bin, size);
+        lists->Size[bin] = size;
+    }
 
-        if(act->ActiveParticle && is_timebin_active(bin, times->Ti_Current))
+    #pragma omp parallel for schedule(static, schedsz)
+    for(n = 0; n < ncand; n++)
+    {
+        const int i = cand ? cand[n] : first + n;
+        if(P[i].IsGarbage || P[i].Swallowed)
+            continue;
+        const int tid = omp_get_thread_num();
+        const int bin = P[i].TimeBin;
+        lists->Bin[bin][ThreadOffset[(TIMEBINS + 1) * tid + bin]++] = i;
+    }
+
+    myfree(ThreadOffset);
+    myfree(ThreadCount);
+}
+
+/* Rebuild the lists from a scan of all particles*/
+static void
+timebin_lists_build(struct TimeBinLists * lists, const inttime_t Ti_Current)
+{
+    memset(lists->Size, 0, sizeof(lists->Size));
+    memset(lists->CountType, 0, sizeof(lists->CountType));
+    timebin_lists_insert(lists, NULL, 0, PartManager->NumPart, TIMEBINS, Ti_Current);
+    lists->valid = 1;
+}
+
+/* Resort the bins active on the last step and add the particles appended since*/
+static void
+timebin_lists_update(struct TimeBinLists * lists, const inttime_t Ti_Current)
+{
+    int bin, ptype;
+    int64_t ngather = 0;
+    for(bin = 0; bin <= lists->LastActiveBin; bin++)
+        ngather += lists->Size[bin];
+
+    int * gather = mymalloc2("TimeBinGather", (ngather + 1) * sizeof(int));
+    ngather = 0;
+    for(bin = 0; bin <= lists->LastActiveBin; bin++) {
+        memcpy(gather + ngather, lists->Bin[bin], lists->Size[bin] * sizeof(int));
+        ngather += lists->Size[bin];
+        lists->Size[bin] = 0;
+        for(ptype = 0; ptype < 6; ptype++)
+            lists->CountType[(TIMEBINS + 1) * ptype + bin] = 0;
+    }
+    timebin_lists_insert(lists, gather, 0, ngather, lists->LastActiveBin, Ti_Current);
+    myfree(gather);
+
+    /* Particles exchanged in or forked since the last update*/
+    timebin_lists_insert(lists, NULL, lists->NumPart, PartManager->NumPart - lists->NumPart, lists->LastActiveBin, Ti_Current);
+}
+
+static int
+timestep_cmp_index(const void * a, const void * b)
+{
+    const int i = *(const int *) a;
+    const int j = *(const int *) b;
+    return (i > j) - (i < j);
+}
+
+/* mark the bins that will be active before the next kick*/
+int rebuild_activelist(ActiveParticles * act, const DriftKickTimes * const times, int NumCurrentTiStep)
+{
+    struct TimeBinLists * lists = &TimeBinLists;
+    int bin;
+
+    if(!lists->listening) {
+        event_listen(&EventSlotsAfterGC, timestep_eh_slots_after_gc, lists);
+        lists->listening = 1;
+    }
+
+    const int isPM = is_PM_timestep(times);
+    /* On a PM step all particles are active and about to change bin, so a scan costs nothing extra.*/
+    if(isPM || !lists->valid || lists->NumPart > PartManager->NumPart)
+        timebin_lists_build(lists, times->Ti_Current);
+    else
+        timebin_lists_update(lists, times->Ti_Current);
+    lists->NumPart = PartManager->NumPart;
+
+    /*We know all particles are active on a PM timestep*/
+    if(isPM) {
+        act->ActiveParticle = NULL;
+        act->NumActiveParticle = PartManager->NumPart;
+        lists->LastActiveBin = TIMEBINS;
+    }
+    else {
+        int64_t ncand = 0;
+        lists->LastActiveBin = 0;
+        for(bin = 0; bin <= TIMEBINS; bin++) {
+            if(!is_timebin_active(bin, times->Ti_Current))
+                continue;
+            ncand += lists->Size[bin];
+            lists->LastActiveBin = bin;
+        }
+        /*Need space for more particles than we have, because of star formation*/
+        act->ActiveParticle = (int *) mymalloc("ActiveParticle", (ncand + PartManager->MaxPart - PartManager->NumPart) * sizeof(int));
+        ncand = 0;
+        for(bin = 0; bin <= lists->LastActiveBin; bin++) {
+            if(!is_timebin_active(bin, times->Ti_Current))
+                continue;
+            memcpy(act->ActiveParticle + ncand, lists->Bin[bin], lists->Size[bin] * sizeof(int));
+            ncand += lists->Size[bin];
+            int ptype;
+            for(ptype = 0; ptype < 6; ptype++)
+                lists->CountType[(TIMEBINS + 1) * ptype + bin] = 0;
+        }
+
+        /* Drop the particles which became garbage while their bin was inactive and refresh the counts of the active bins.
+         * Each thread compacts its own section of the list in place.*/
+        int NumThreads = omp_get_max_threads();
+        size_t schedsz = ncand / NumThreads + 1;
+        int * TimeBinCountType = mymalloc("TimeBinCountType", 6*(TIMEBINS+1)*NumThreads * sizeof(int));
+        memset(TimeBinCountType, 0, 6 * (TIMEBINS+1) * NumThreads * sizeof(int));
+        size_t *NActiveThread = ta_malloc("NActiveThread", size_t, NumThreads);
+        int **ActivePartSets = ta_malloc("ActivePartSets", int *, NumThreads);
+        gadget_setup_thread_arrays(act->ActiveParticle, ActivePartSets, NActiveThread, schedsz, NumThreads);
+
+        int64_t n;
+        #pragma omp parallel for schedule(static, schedsz)
+        for(n = 0; n < ncand; n++)
         {
-            /* Store this particle in the ActiveSet for this thread*/
+            const int i = act->ActiveParticle[n];
+            const int tid = omp_get_thread_num();
+            if(P[i].IsGarbage || P[i].Swallowed)
+                continue;
             ActivePartSets[tid][NActiveThread[tid]] = i;
             NActiveThread[tid]++;
+            TimeBinCountType[(TIMEBINS + 1) * (6* tid + P[i].Type) + P[i].TimeBin] ++;
         }
-        TimeBinCountType[(TIMEBINS + 1) * (6* tid + P[i].Type) + bin] ++;
-    }
-    if(act->ActiveParticle) {
-        /*Now we want a merge step for the ActiveParticle list.*/
         act->NumActiveParticle = gadget_compact_thread_arrays(act->ActiveParticle, ActivePartSets, NActiveThread, NumThreads);
-    }
-    ta_free(ActivePartSets);
-    ta_free(NActiveThread);
+        ta_free(ActivePartSets);
+        ta_free(NActiveThread);
 
-    /*Print statistics for this time bin*/
-    print_timebin_statistics(times, NumCurrentTiStep, TimeBinCountType);
-    myfree(TimeBinCountType);
+        int tid, j;
+        for(tid = 0; tid < NumThreads; tid++)
+            for(j = 0; j < 6 * (TIMEBINS+1); j++)
+                lists->CountType[j] += TimeBinCountType[6 * (TIMEBINS+1) * tid + j];
+        myfree(TimeBinCountType);
 
-    /* Shrink the ActiveParticle array. We still need extra space for star formation,
-     * but we do not need space for the known-inactive particles*/
-    if(act->ActiveParticle) {
+        /* Keep the active list in particle order, as the tree walks expect*/
+        qsort_openmp(act->ActiveParticle, act->NumActiveParticle, sizeof(int), timestep_cmp_index);
+
+        /* Shrink the ActiveParticle array. We still need extra space for star formation,
+         * but we do not need space for the known-inactive particles*/
         act->ActiveParticle = myrealloc(act->ActiveParticle, sizeof(int)*(act->NumActiveParticle + PartManager->MaxPart - PartManager->NumPart));
         act->MaxActiveParticle = act->NumActiveParticle + PartManager->MaxPart - PartManager->NumPart;
-        /* listen to the slots events such that we can set timebin of new particles */
     }
+
+    /*Print statistics for this time bin*/
+    print_timebin_statistics(times, NumCurrentTiStep, lists->CountType);
+
+    /* listen to the slots events such that we can set timebin of new particles */
     event_listen(&EventSlotsFork, timestep_eh_slots_fork, act);
     walltime_measure("/Timeline/Active");
 
     return 0;
 }
 
+const int *
+get_timebin_count_type(void)
+{
+    return TimeBinLists.CountType;
+}
+
 void free_activelist(ActiveParticles * act)
 {
     if(act->ActiveParticle) {
@@ -828,6 +1013,7 @@ void free_activelist(ActiveParticles * act)
 /*! This routine writes one line for every timestep.
  * FdCPU the cumulative cpu-time consumption in various parts of the
  * code is stored.
+ * TimeBinCountType holds the local number of particles of each type in each bin, as [type][bin].
  */
 static void print_timebin_statistics(const DriftKickTimes * const times, const int NumCurrentTiStep, int * TimeBinCountType)
 {
@@ -839,14 +1025,6 @@ static void print_timebin_statistics(const DriftKickTimes * const times, const i
     int64_t tot_num_force = 0;
     int64_t TotNumPart = 0, TotNumType[6] = {0};
 
-    int NumThreads = omp_get_max_threads();
-    /*Sum the thread-local memory*/
-    for(i = 1; i < NumThreads; i ++) {
-        int j;
-        for(j=0; j < 6 * (TIMEBINS+1); j++)
-            TimeBinCountType[j] += TimeBinCountType[6 * (TIMEBINS+1) * i + j];
-    }
-
     for(i = 0; i < 6; i ++) {
         sumup_large_ints(TIMEBINS+1, &TimeBinCountType[(TIMEBINS+1) * i], tot_count_type[i]);
     }
@@ -33,6 +33,11 @@ typedef struct
 
 int rebuild_activelist(ActiveParticles * act, const DriftKickTimes * const times, int NumCurrentTiStep);
 void free_activelist(ActiveParticles * act);
+
+/* Number of particles of each type in each timebin on this task at the last rebuild_activelist, as [type][bin].
+ * Exposed for the tests.*/
+const int * get_timebin_count_type(void);
+
 void set_global_time(const inttime_t Ti_Current);
 
 /* This function assigns new short-range timesteps to particles.
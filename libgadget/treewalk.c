@@ -34,6 +34,13 @@ struct TreeWalkThreadLocals
 
 /*!< Memory factor to leave for (N imported particles) > (N exported particles). */
 static int ImportBufferBoost;
+/*!< Largest total number of queries for which a treewalk with broadcast_small set broadcasts the queries. */
+static int SmallTreeWalkMaxQueries;
+
+/* The tasks the tree walks have exchanged queries with. The pattern depends mostly on
+ * the domain, so it is kept across walks and rebuilt when the domain generation changes.*/
+static MPIU_Neighbourhood TreeWalkNeighbours;
+static int64_t TreeWalkNeighboursGeneration = -1;
 
 static struct data_nodelist
 {
@@ -56,9 +63,12 @@ void set_treewalk_params(ParameterSet * ps)
 {
     int ThisTask;
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
+    if(ThisTask == 0) {
         ImportBufferBoost = param_get_int(ps, "ImportBufferBoost");
+        SmallTreeWalkMaxQueries = param_get_int(ps, "SmallTreeWalkMaxQueries");
+    }
     MPI_Bcast(&ImportBufferBoost, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&SmallTreeWalkMaxQueries, 1, MPI_INT, 0, MPI_COMM_WORLD);
 }
 
 static void ev_init_thread(const struct TreeWalkThreadLocals export, TreeWalk * const tw, LocalTreeWalk * lv);
@@ -69,6 +79,7 @@ static struct SendRecvBuffer ev_get_remote(TreeWalk * tw);
 static void ev_secondary(TreeWalk * tw);
 static void ev_reduce_result(const struct SendRecvBuffer sndrcv, TreeWalk * tw);
 static int ev_ndone(TreeWalk * tw);
+static void ev_broadcast(TreeWalk * tw);
 
 static int
 ngb_treefind_threads(TreeWalkQueryBase * I,
@@ -173,10 +184,12 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
     int64_t nmin, nmax, total;
     MPI_Reduce(&tw->WorkSetSize, &nmin, 1, MPI_INT64, MPI_MIN, 0, MPI_COMM_WORLD);
     MPI_Reduce(&tw->WorkSetSize, &nmax, 1, MPI_INT64, MPI_MAX, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&tw->WorkSetSize, &total, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Allreduce(&tw->WorkSetSize, &total, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
     message(0, "Treewalk %s iter %d: total part %ld max/MPI: %ld min/MPI: %ld balance: %g.\n",
             tw->ev_label, tw->Niteration, total, nmax, nmin, (double)nmax/((total+0.001)/tw->NTask));
 
+    tw->UseBroadcast = tw->broadcast_small && tw->visit && total <= SmallTreeWalkMaxQueries;
+
     /* Start first iteration at the beginning*/
     tw->WorkSetStart = 0;
 
@@ -187,6 +200,14 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
 
     report_memory_usage(tw->ev_label);
 
+    /* The broadcast path needs no export buffers*/
+    if(tw->UseBroadcast) {
+        tw->BunchSize = 0;
+        DataIndexTable = NULL;
+        DataNodeList = NULL;
+        return;
+    }
+
     /* Assert that the query and result structures are aligned to  64-bit boundary,
      * so that our MPI Send/Recv's happen from aligned memory.*/
     if(tw->query_type_elsize % 8 != 0)
@@ -228,8 +249,10 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
 
 static void ev_finish(TreeWalk * tw)
 {
-    myfree(DataNodeList);
-    myfree(DataIndexTable);
+    if(!tw->UseBroadcast) {
+        myfree(DataNodeList);
+        myfree(DataIndexTable);
+    }
     if(tw->Ngblist)
         myfree(tw->Ngblist);
     if(!tw->work_set_stolen_from_active)
@@ -635,7 +658,10 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
         }
     }
 
-    if(tw->visit) {
+    if(tw->UseBroadcast) {
+        ev_broadcast(tw);
+    }
+    else if(tw->visit) {
         tw->Nexportfull = 0;
         tw->evaluated = NULL;
         do
@@ -688,6 +714,168 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
     tw->Niteration++;
 }
 
+/* Walk a small queue without the export buffers. Every task receives the queries of all tasks,
+ * and walks each of them over its local particles only (lv->mode == 2), skipping the remote branches
+ * of the tree. The results of the queries which met local particles are sent to the owning task
+ * and reduced there, exactly as for exported queries. This costs one Allgatherv and one Alltoallv,
+ * instead of at least two Alltoallv and the Allreduce of the export loop.*/
+static void
+ev_broadcast(TreeWalk * tw)
+{
+    const int NTask = tw->NTask;
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    double tstart, tend;
+    tstart = second();
+
+    int * QueryCount = ta_malloc("QueryCount", int, 5 * NTask);
+    int * QueryOffset = QueryCount + NTask;
+    int * Send_count = QueryCount + 2 * NTask;
+    int * Recv_count = QueryCount + 3 * NTask;
+    int * Recv_offset = QueryCount + 4 * NTask;
+    int nlocal = tw->WorkSetSize;
+    MPI_Allgather(&nlocal, 1, MPI_INT, QueryCount, 1, MPI_INT, MPI_COMM_WORLD);
+    int64_t ntot = 0;
+    int i;
+    for(i = 0; i < NTask; i++) {
+        QueryOffset[i] = ntot;
+        ntot += QueryCount[i];
+    }
+    const int64_t first = QueryOffset[ThisTask];
+
+    /* Each returned result is preceded by the index of the query in the workset of its owner*/
+    const size_t qsize = tw->query_type_elsize;
+    const size_t rsize = tw->result_type_elsize;
+    const size_t retsize = rsize + sizeof(int64_t);
+    char * queries = mymalloc("BcastQueries", ntot * qsize);
+    char * results = mymalloc("BcastResults", ntot * rsize);
+    char * touched = mymalloc("BcastTouched", ntot * sizeof(char));
+
+    int64_t j;
+    #pragma omp parallel for
+    for(j = 0; j < nlocal; j++) {
+        const int place = tw->WorkSet ? tw->WorkSet[j] : j;
+        treewalk_init_query(tw, (TreeWalkQueryBase *) (queries + (first + j) * qsize), place, NULL);
+    }
+
+    MPI_Datatype qtype;
+    MPI_Type_contiguous(qsize, MPI_BYTE, &qtype);
+    MPI_Type_commit(&qtype);
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, queries, QueryCount, QueryOffset, qtype, MPI_COMM_WORLD);
+    MPI_Type_free(&qtype);
+    tend = second();
+    tw->timecommsumm1 += timediff(tstart, tend);
+
+    tstart = second();
+    #pragma omp parallel
+    {
+        LocalTreeWalk lv[1] = {{0}};
+        lv->tw = tw;
+        lv->mode = 2;
+        if(tw->Ngblist)
+            lv->ngblist = tw->Ngblist + omp_get_thread_num() * PartManager->NumPart;
+        /* The result before the walk, to tell which queries met local particles*/
+        char * blank = alloca(rsize);
+        #pragma omp for schedule(dynamic)
+        for(j = 0; j < ntot; j++) {
+            TreeWalkQueryBase * input = (TreeWalkQueryBase *) (queries + j * qsize);
+            TreeWalkResultBase * output = (TreeWalkResultBase *) (results + j * rsize);
+            const int own = j >= first && j < first + nlocal;
+            treewalk_init_result(tw, output, input);
+            memcpy(blank, output, rsize);
+            lv->target = -1;
+            if(own)
+                lv->target = tw->WorkSet ? tw->WorkSet[j - first] : j - first;
+            tw->visit(input, output, lv);
+            /* Only the queries whose result changed have anything to return:
+             * the reductions start from the initial result, so the others add nothing.*/
+            touched[j] = memcmp(output, blank, rsize) != 0;
+        }
+    }
+    tend = second();
+    tw->timecomp2 += timediff(tstart, tend);
+
+    tstart = second();
+    /* Reduce the local part of our own queries first, as primaries*/
+    #pragma omp parallel for
+    for(j = 0; j < nlocal; j++) {
+        const int place = tw->WorkSet ? tw->WorkSet[j] : j;
+        treewalk_reduce_result(tw, (TreeWalkResultBase *) (results + (first + j) * rsize), place, TREEWALK_PRIMARY);
+    }
+
+    /* Pack the results for other tasks, in task order*/
+    memset(Send_count, 0, sizeof(int) * NTask);
+    int64_t nsend = 0;
+    for(i = 0; i < NTask; i++) {
+        if(i == ThisTask)
+            continue;
+        for(j = QueryOffset[i]; j < QueryOffset[i] + QueryCount[i]; j++)
+            if(touched[j])
+                Send_count[i]++;
+        nsend += Send_count[i];
+    }
+    char * sendbuf = mymalloc("BcastSend", nsend * retsize);
+    int64_t n = 0;
+    for(i = 0; i < NTask; i++) {
+        if(i == ThisTask)
+            continue;
+        for(j = QueryOffset[i]; j < QueryOffset[i] + QueryCount[i]; j++) {
+            if(!touched[j])
+                continue;
+            int64_t index = j - QueryOffset[i];
+            memcpy(sendbuf + n * retsize, &index, sizeof(int64_t));
+            memcpy(sendbuf + n * retsize + sizeof(int64_t), results + j * rsize, rsize);
+            n++;
+        }
+    }
+
+    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    int64_t nrecv = 0;
+    for(i = 0; i < NTask; i++) {
+        Recv_offset[i] = nrecv;
+        nrecv += Recv_count[i];
+    }
+    /* Reuse the query offsets as send offsets*/
+    int * Send_offset = QueryOffset;
+    Send_offset[0] = 0;
+    for(i = 1; i < NTask; i++)
+        Send_offset[i] = Send_offset[i-1] + Send_count[i-1];
+
+    char * recvbuf = mymalloc("BcastRecv", nrecv * retsize);
+    MPI_Datatype rtype;
+    MPI_Type_contiguous(retsize, MPI_BYTE, &rtype);
+    MPI_Type_commit(&rtype);
+    MPI_Alltoallv_sparse(sendbuf, Send_count, Send_offset, rtype,
+            recvbuf, Recv_count, Recv_offset, rtype, MPI_COMM_WORLD);
+    MPI_Type_free(&rtype);
+    tend = second();
+    tw->timecommsumm2 += timediff(tstart, tend);
+
+    tstart = second();
+    /* Not parallel: several tasks may return results for the same particle, and there are few of them.*/
+    if(tw->reduce != NULL) {
+        for(j = 0; j < nrecv; j++) {
+            int64_t index;
+            memcpy(&index, recvbuf + j * retsize, sizeof(int64_t));
+            const int place = tw->WorkSet ? tw->WorkSet[index] : index;
+            treewalk_reduce_result(tw, (TreeWalkResultBase *) (recvbuf + j * retsize + sizeof(int64_t)), place, TREEWALK_GHOSTS);
+        }
+    }
+    tend = second();
+    tw->timecomp1 += timediff(tstart, tend);
+
+    tw->Nexport_sum += nsend;
+    tw->Nimport = ntot - nlocal;
+
+    myfree(recvbuf);
+    myfree(sendbuf);
+    myfree(touched);
+    myfree(results);
+    myfree(queries);
+    ta_free(QueryCount);
+}
+
 static void
 ev_communicate(void * sendbuf, void * recvbuf, size_t elsize, const struct SendRecvBuffer sndrcv, int import) {
     /* if import is 1, import the results from neigbhours */
@@ -696,17 +884,24 @@ ev_communicate(void * sendbuf, void * recvbuf, size_t elsize, const struct SendR
     MPI_Type_commit(&type);
 
     if(import) {
-        MPI_Alltoallv_sparse(
+        MPI_Alltoallv_neighbour(&TreeWalkNeighbours,
                 sendbuf, sndrcv.Recv_count, sndrcv.Recv_offset, type,
                 recvbuf, sndrcv.Send_count, sndrcv.Send_offset, type, MPI_COMM_WORLD);
     } else {
-        MPI_Alltoallv_sparse(
+        MPI_Alltoallv_neighbour(&TreeWalkNeighbours,
                 sendbuf, sndrcv.Send_count, sndrcv.Send_offset, type,
                 recvbuf, sndrcv.Recv_count, sndrcv.Recv_offset, type, MPI_COMM_WORLD);
     }
     MPI_Type_free(&type);
 }
 
+void
+treewalk_free_neighbours(void)
+{
+    MPIU_neighbourhood_free(&TreeWalkNeighbours);
+    TreeWalkNeighboursGeneration = -1;
+}
+
 /* returns the remote particles */
 static struct SendRecvBuffer ev_get_remote(TreeWalk * tw)
 {
@@ -735,6 +930,14 @@ static struct SendRecvBuffer ev_get_remote(TreeWalk * tw)
     tend = second();
     tw->timewait1 += timediff(tstart, tend);
 
+    /* A new domain: rebuild the neighbours from the tasks this walk talks to.
+     * The generation is the same on every task, so they all rebuild together.*/
+    if(domain_get_generation() != TreeWalkNeighboursGeneration) {
+        MPIU_neighbourhood_free(&TreeWalkNeighbours);
+        TreeWalkNeighboursGeneration = domain_get_generation();
+    }
+    MPIU_neighbourhood_update(&TreeWalkNeighbours, sndrcv.Send_count, sndrcv.Recv_count, MPI_COMM_WORLD);
+
     for(i = 0, tw->Nimport = 0, sndrcv.Recv_offset[0] = 0, sndrcv.Send_offset[0] = 0; i < (size_t) NTask; i++)
     {
         tw->Nimport += sndrcv.Recv_count[i];
@@ -936,7 +1139,7 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
     int ninteractions = 0;
     int inode = 0;
 
-    for(inode = 0; (lv->mode == 0 && inode < 1)|| (lv->mode == 1 && inode < NODELISTLENGTH && I->NodeList[inode] >= 0); inode++)
+    for(inode = 0; (lv->mode != 1 && inode < 1)|| (lv->mode == 1 && inode < NODELISTLENGTH && I->NodeList[inode] >= 0); inode++)
     {
         int numcand = ngb_treefind_threads(I, O, iter, I->NodeList[inode], lv);
         /* Export buffer is full end prematurally */
@@ -1111,6 +1314,10 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
             /* pseudo particle */
             if(lv->mode == 1) {
                 endrun(12312, "Secondary for particle %d from node %d found pseudo at %d.\n", lv->target, startnode, current);
+            } else if(lv->mode == 2) {
+                /* Broadcast queries are walked by every task: skip the remote branch*/
+                no = current->sibling;
+                continue;
             } else {
                 /* Export the pseudo particle*/
                 if(-1 == treewalk_export_particle(lv, current->s.suns[0]))
@@ -1146,7 +1353,7 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
     lv->tw->ngbiter(I, O, iter, lv);
 
     int inode;
-    for(inode = 0; (lv->mode == 0 && inode < 1)|| (lv->mode == 1 && inode < NODELISTLENGTH && I->NodeList[inode] >= 0); inode++)
+    for(inode = 0; (lv->mode != 1 && inode < 1)|| (lv->mode == 1 && inode < NODELISTLENGTH && I->NodeList[inode] >= 0); inode++)
     {
         int no = I->NodeList[inode];
         const ForceTree * tree = lv->tw->tree;
@@ -1222,6 +1429,10 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
                 /* pseudo particle */
                 if(lv->mode == 1) {
                     endrun(12312, "Secondary for particle %d from node %d found pseudo at %d.\n", lv->target, I->NodeList[inode], current);
+                } else if(lv->mode == 2) {
+                    /* Broadcast queries are walked by every task: skip the remote branch*/
+                    no = current->sibling;
+                    continue;
                 } else {
                     /* Export the pseudo particle*/
                     if(-1 == treewalk_export_particle(lv, current->s.suns[0]))
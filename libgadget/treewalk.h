@@ -46,7 +46,7 @@ typedef struct {
 typedef struct {
     TreeWalk * tw;
 
-    int mode; /* 0 for Primary, 1 for Secondary */
+    int mode; /* 0 for Primary, 1 for Secondary, 2 for a broadcast query which only walks local particles */
     int target; /* defined only for primary (mode == 0) */
 
     /* Thread local export variables*/
@@ -117,6 +117,13 @@ struct TreeWalk {
     int repeatdisallowed;
     char * evaluated;
 
+    /* Small walks, such as the winds from a few new stars, are dominated by the fixed cost of
+     * the export buffers and communication rounds. If broadcast_small is true and the total
+     * number of queries is at most SmallTreeWalkMaxQueries, every task instead receives all the queries
+     * and walks them over its local particles, and the results are sent back to the owning task.
+     * The ngbiter must not depend on lv->mode or lv->target.*/
+    int broadcast_small;
+
     /* performance metrics */
     double timewait1;
     double timewait2;
@@ -142,6 +149,8 @@ struct TreeWalk {
     int64_t Niteration;
 
     /* internal flags*/
+    /* True if this run uses the broadcast path for small walks*/
+    int UseBroadcast;
     /* Number of particles marked for export to another processor*/
     size_t Nexport;
     /* Number of particles exported to this processor*/
@@ -175,6 +184,9 @@ struct TreeWalk {
 /*Initialise treewalk parameters on first run*/
 void set_treewalk_params(ParameterSet * ps);
 
+/* Free the communicator of the tasks the tree walks exchange with. Collective; call at the end of the run.*/
+void treewalk_free_neighbours(void);
+
 /* Do the distributed tree walking. Warning: as this is a threaded treewalk,
  * it may call tw->visit on particles more than once and in a noneterministic order.
  * Your module should behave correctly in this case! */
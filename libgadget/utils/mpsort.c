@@ -180,7 +180,8 @@ void _setup_radix_sort(
 
 /****
  * sort by radix;
- * internally this uses qsort_r of glibc.
+ * radixes that are native integers use the parallel radix sort,
+ * others fall back to qsort_openmp comparing the radixes.
  *
  **** */
 static struct crstruct _cacr_d;
@@ -194,6 +195,26 @@ static int _compute_and_compar_radix(const void * p1, const void * p2) {
     return c1;
 }
 
+/* The radix as an integer key; same ordering as _compar_radix_uint*_t */
+static uint64_t _compute_radix_key(const void * ptr, void * arg) {
+    struct crstruct * d = (struct crstruct *) arg;
+    union {
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        char c[8];
+    } r;
+    d->radix(ptr, r.c, d->arg);
+    switch(d->rsize) {
+        case 2:
+            return r.u16;
+        case 4:
+            return r.u32;
+        default:
+            return r.u64;
+    }
+}
+
 static void radix_sort(void * base, size_t nmemb, size_t size,
         void (*radix)(const void * ptr, void * radix, void * arg),
         size_t rsize,
@@ -202,7 +223,10 @@ static void radix_sort(void * base, size_t nmemb, size_t size,
     memset(&_cacr_d, 0, sizeof(struct crstruct));
     _setup_radix_sort(&_cacr_d, base, nmemb, size, radix, rsize, arg);
 
-    qsort_openmp(_cacr_d.base, _cacr_d.nmemb, _cacr_d.size, _compute_and_compar_radix);
+    if(rsize == 2 || rsize == 4 || rsize == 8)
+        radix_sort_openmp(_cacr_d.base, _cacr_d.nmemb, _cacr_d.size, _compute_radix_key, _cacr_d.rsize, &_cacr_d);
+    else
+        qsort_openmp(_cacr_d.base, _cacr_d.nmemb, _cacr_d.size, _compute_and_compar_radix);
 }
 
 
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "mymalloc.h"
+#include "endrun.h"
 /* Below is a merge-sort routine copied directly from glibc version 2.26
  * (although the code is the same since Dec. 2010, glibc 2.13).
  * The copy is so that we can control our memory allocation
@@ -375,3 +376,146 @@ void qsort_openmp(void *base, size_t nmemb, size_t size,
     }
     myfree(tmp);
 }
+
+/* Number of key bits sorted in each pass of the radix sort*/
+#define RADIX_BITS 8
+#define RADIX_NBUCKET (1 << RADIX_BITS)
+
+/* Parallel least significant digit radix sort. Each thread histograms the digits
+ * of its contiguous chunk; an exclusive prefix sum over (digit, thread) gives every
+ * thread a private output range for each digit, so the scatter is stable
+ * and needs no locks. Passes are skipped when all keys share the digit,
+ * which also drops the passes over the unused high bytes of the key.*/
+void radix_sort_openmp(void * base, size_t nmemb, size_t size,
+        uint64_t (*key)(const void * ptr, void * arg),
+        size_t keysize, void * arg)
+{
+    if(keysize < 1 || keysize > sizeof(uint64_t))
+        endrun(1, "Radix sort key of %td bytes is not supported\n", keysize);
+    if(nmemb <= 1)
+        return;
+
+    /* Large records are sorted as (key, index) pairs and moved once at the end*/
+    const int indirect = size > 2 * sizeof(uint64_t);
+    const size_t psize = indirect ? sizeof(size_t) : size;
+
+    uint64_t * Akey[2];
+    char * Apay[2];
+    Akey[0] = mymalloc("RadixKey", nmemb * sizeof(uint64_t));
+    Akey[1] = mymalloc("RadixKeyTmp", nmemb * sizeof(uint64_t));
+    char * paystore = mymalloc("RadixPayload", (indirect + 1) * nmemb * psize);
+    if(indirect) {
+        Apay[0] = paystore;
+        Apay[1] = paystore + nmemb * psize;
+    } else {
+        Apay[0] = base;
+        Apay[1] = paystore;
+    }
+
+    int Nt = omp_get_max_threads();
+    size_t * Offset = ta_malloc("RadixOffset", size_t, Nt * RADIX_NBUCKET);
+    uint64_t keybits = 0;
+    int skip = 0;
+    int sorted = 0;
+
+#pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        const int Nt = omp_get_num_threads();
+        const size_t start = tid * nmemb / Nt;
+        const size_t end = (tid + 1) * nmemb / Nt;
+        size_t * count = Offset + tid * RADIX_NBUCKET;
+        uint64_t mybits = 0;
+        size_t i;
+
+        /* Compute each key only once*/
+        for(i = start; i < end; i++) {
+            Akey[0][i] = key((char *) base + i * size, arg);
+            mybits |= Akey[0][i];
+            if(indirect)
+                ((size_t *) Apay[0])[i] = i;
+        }
+#pragma omp atomic
+        keybits |= mybits;
+#pragma omp barrier
+
+        /* Which of the two buffers holds the current ordering. Every thread takes the same branches.*/
+        int src = 0;
+        int shift;
+        for(shift = 0; shift < 8 * (int) keysize && (keybits >> shift); shift += RADIX_BITS) {
+            memset(count, 0, RADIX_NBUCKET * sizeof(size_t));
+            for(i = start; i < end; i++)
+                count[(Akey[src][i] >> shift) & (RADIX_NBUCKET - 1)]++;
+#pragma omp barrier
+#pragma omp single
+            {
+                size_t total = 0;
+                int d, t;
+                skip = 0;
+                for(d = 0; d < RADIX_NBUCKET; d++) {
+                    size_t ndigit = 0;
+                    for(t = 0; t < Nt; t++) {
+                        size_t c = Offset[t * RADIX_NBUCKET + d];
+                        Offset[t * RADIX_NBUCKET + d] = total;
+                        total += c;
+                        ndigit += c;
+                    }
+                    if(ndigit == nmemb)
+                        skip = 1;
+                }
+            }
+            /* Every key has the same digit: this pass would not move anything*/
+            if(skip)
+                continue;
+
+            const uint64_t * kin = Akey[src];
+            uint64_t * kout = Akey[1 - src];
+            const char * pin = Apay[src];
+            char * pout = Apay[1 - src];
+            for(i = start; i < end; i++) {
+                size_t j = count[(kin[i] >> shift) & (RADIX_NBUCKET - 1)]++;
+                kout[j] = kin[i];
+                memcpy(pout + j * psize, pin + i * psize, psize);
+            }
+            src = 1 - src;
+#pragma omp barrier
+        }
+        /* Direct sort finished in the temporary buffer: copy back*/
+        if(!indirect && src == 1)
+            memcpy((char *) base + start * size, Apay[1] + start * size, (end - start) * size);
+        if(tid == 0)
+            sorted = src;
+    }
+
+    ta_free(Offset);
+
+    /* Apply the sorted permutation by following its cycles,
+     * as in the indirect merge sort above.*/
+    if(indirect) {
+        size_t * idx = (size_t *) Apay[sorted];
+        char * tmp_storage = (char *) Akey[1];
+        size_t i;
+        /* The keys are no longer needed, so their buffer holds the displaced record*/
+        if(size > nmemb * sizeof(uint64_t))
+            tmp_storage = mymalloc("RadixRecord", size);
+        for(i = 0; i < nmemb; i++) {
+            if(idx[i] == i)
+                continue;
+            size_t j = i;
+            memcpy(tmp_storage, (char *) base + i * size, size);
+            while(idx[j] != i) {
+                size_t k = idx[j];
+                memcpy((char *) base + j * size, (char *) base + k * size, size);
+                idx[j] = j;
+                j = k;
+            }
+            memcpy((char *) base + j * size, tmp_storage, size);
+            idx[j] = j;
+        }
+        if(tmp_storage != (char *) Akey[1])
+            myfree(tmp_storage);
+    }
+    myfree(paystore);
+    myfree(Akey[1]);
+    myfree(Akey[0]);
+}
@@ -2,8 +2,19 @@
 #define OPENMPSORT_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 void qsort_openmp(void *base, size_t nmemb, size_t size,
                          int(*compar)(const void *, const void *));
 
+/* Stable parallel radix sort of nmemb elements of size bytes, in increasing order of
+ * the unsigned integer key(ptr, arg). keysize is the width of the key in bytes (1 - 8):
+ * keys must be smaller than 2^(8 keysize).
+ * Each key is computed once. Elements larger than 16 bytes are sorted as
+ * (key, index) pairs and moved into place at the end.
+ * Use qsort_openmp for orderings that do not reduce to an integer key.*/
+void radix_sort_openmp(void * base, size_t nmemb, size_t size,
+        uint64_t (*key)(const void * ptr, void * arg),
+        size_t keysize, void * arg);
+
 #endif
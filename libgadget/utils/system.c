@@ -429,6 +429,175 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
     return 0;
 }
 
+/* As MPI_Alltoallv_sparse, but each partner has its own datatype, which
+ * describes the whole message with absolute addresses (relative to MPI_BOTTOM).
+ * This lets several scattered arrays travel to a partner as a single message.
+ * Partners with a type of MPI_DATATYPE_NULL are skipped.
+ * There are no barriers: a task sends at most one message to each partner per call,
+ * and messages from one source are matched in order, so a task which returns early
+ * cannot confuse the next call.*/
+int MPI_Alltoallw_sparse(MPI_Datatype * sendtypes, MPI_Datatype * recvtypes, MPI_Comm comm) {
+
+    int NTask;
+    MPI_Comm_size(comm, &NTask);
+    int target;
+
+#ifndef NO_ISEND_IRECV_IN_DOMAIN
+    int nsend = 0, nrecv = 0;
+    for(target = 0; target < NTask; target++) {
+        nsend += sendtypes[target] != MPI_DATATYPE_NULL;
+        nrecv += recvtypes[target] != MPI_DATATYPE_NULL;
+    }
+
+    int n_requests = 0;
+    MPI_Request *requests = mymalloc("requests", (nsend + nrecv + 1) * sizeof(MPI_Request));
+
+    for(target = 0; target < NTask; target++) {
+        if(recvtypes[target] == MPI_DATATYPE_NULL) continue;
+        MPI_Irecv(MPI_BOTTOM, 1, recvtypes[target], target, 101935, comm, &requests[n_requests++]);
+    }
+
+    for(target = 0; target < NTask; target++) {
+        if(sendtypes[target] == MPI_DATATYPE_NULL) continue;
+        MPI_Isend(MPI_BOTTOM, 1, sendtypes[target], target, 101935, comm, &requests[n_requests++]);
+    }
+
+    MPI_Waitall(n_requests, requests, MPI_STATUSES_IGNORE);
+    myfree(requests);
+#else
+    /* Blocking pairwise exchanges need the partners in the same order on both sides*/
+    int ThisTask;
+    MPI_Comm_rank(comm, &ThisTask);
+    int PTask, ngrp;
+    for(PTask = 0; NTask > (1 << PTask); PTask++);
+
+    for(ngrp = 0; ngrp < (1 << PTask); ngrp++)
+    {
+        target = ThisTask ^ ngrp;
+
+        if(target >= NTask) continue;
+        const int nsend = sendtypes[target] != MPI_DATATYPE_NULL;
+        const int nrecv = recvtypes[target] != MPI_DATATYPE_NULL;
+        if(!nsend && !nrecv) continue;
+        MPI_Sendrecv(MPI_BOTTOM, nsend, nsend ? sendtypes[target] : MPI_BYTE,
+                target, 101935,
+                MPI_BOTTOM, nrecv, nrecv ? recvtypes[target] : MPI_BYTE,
+                target, 101935,
+                comm, MPI_STATUS_IGNORE);
+
+    }
+#endif
+    return 0;
+}
+
+void
+MPIU_neighbourhood_update(MPIU_Neighbourhood * nbr, const int * sendcnts, const int * recvcnts, MPI_Comm comm)
+{
+#if MPI_VERSION >= 3
+    int NTask;
+    MPI_Comm_size(comm, &NTask);
+    int i, n;
+
+    nbr->NOutside = 0;
+    if(!nbr->built) {
+        /* The counts come from an MPI_Alltoall, so a task which sends to us also receives from us:
+         * the graph is symmetric.*/
+        nbr->NNeighbour = 0;
+        for(i = 0; i < NTask; i++)
+            if(sendcnts[i] > 0 || recvcnts[i] > 0)
+                nbr->NNeighbour++;
+        nbr->Neighbours = realloc(nbr->Neighbours, (nbr->NNeighbour + 1) * sizeof(int));
+        nbr->Outside = realloc(nbr->Outside, NTask * sizeof(int));
+        if(!nbr->Neighbours || !nbr->Outside)
+            endrun(5, "Could not allocate %d neighbours\n", NTask);
+        n = 0;
+        for(i = 0; i < NTask; i++)
+            if(sendcnts[i] > 0 || recvcnts[i] > 0)
+                nbr->Neighbours[n++] = i;
+        MPI_Dist_graph_create_adjacent(comm, nbr->NNeighbour, nbr->Neighbours, MPI_UNWEIGHTED,
+                nbr->NNeighbour, nbr->Neighbours, MPI_UNWEIGHTED, MPI_INFO_NULL, 0, &nbr->Graph);
+        nbr->built = 1;
+        return;
+    }
+
+    /* Partners which are not neighbours. Both sides of a message see it, so no agreement is needed.*/
+    for(i = 0, n = 0; i < NTask; i++) {
+        while(n < nbr->NNeighbour && nbr->Neighbours[n] < i)
+            n++;
+        if(sendcnts[i] == 0 && recvcnts[i] == 0)
+            continue;
+        if(n < nbr->NNeighbour && nbr->Neighbours[n] == i)
+            continue;
+        nbr->Outside[nbr->NOutside++] = i;
+    }
+#endif
+}
+
+int MPI_Alltoallv_neighbour(MPIU_Neighbourhood * nbr, void *sendbuf, int *sendcnts, int *sdispls,
+        MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
+        int *rdispls, MPI_Datatype recvtype, MPI_Comm comm)
+{
+#if MPI_VERSION >= 3
+    int n;
+    if(!nbr->built)
+        endrun(5, "Exchange on a neighbourhood before MPIU_neighbourhood_update\n");
+
+    /* The partners outside the graph, point to point*/
+    MPI_Aint lb, sendext, recvext;
+    MPI_Type_get_extent(sendtype, &lb, &sendext);
+    MPI_Type_get_extent(recvtype, &lb, &recvext);
+    MPI_Request * requests = mymalloc("nbrrequests", (2 * nbr->NOutside + 1) * sizeof(MPI_Request));
+    int nrequests = 0;
+    for(n = 0; n < nbr->NOutside; n++) {
+        const int task = nbr->Outside[n];
+        if(recvcnts[task] > 0)
+            MPI_Irecv((char *) recvbuf + rdispls[task] * recvext, recvcnts[task], recvtype,
+                    task, 101936, comm, &requests[nrequests++]);
+    }
+    for(n = 0; n < nbr->NOutside; n++) {
+        const int task = nbr->Outside[n];
+        if(sendcnts[task] > 0)
+            MPI_Isend((char *) sendbuf + sdispls[task] * sendext, sendcnts[task], sendtype,
+                    task, 101936, comm, &requests[nrequests++]);
+    }
+
+    /* Compact the layout to the neighbours*/
+    int * layout = mymalloc("nbrlayout", 4 * (nbr->NNeighbour + 1) * sizeof(int));
+    int * nsendcnts = layout;
+    int * nsdispls = layout + nbr->NNeighbour + 1;
+    int * nrecvcnts = layout + 2 * (nbr->NNeighbour + 1);
+    int * nrdispls = layout + 3 * (nbr->NNeighbour + 1);
+    for(n = 0; n < nbr->NNeighbour; n++) {
+        const int task = nbr->Neighbours[n];
+        nsendcnts[n] = sendcnts[task];
+        nsdispls[n] = sdispls[task];
+        nrecvcnts[n] = recvcnts[task];
+        nrdispls[n] = rdispls[task];
+    }
+    int ret = MPI_Neighbor_alltoallv(sendbuf, nsendcnts, nsdispls, sendtype,
+                recvbuf, nrecvcnts, nrdispls, recvtype, nbr->Graph);
+    MPI_Waitall(nrequests, requests, MPI_STATUSES_IGNORE);
+    myfree(layout);
+    myfree(requests);
+    return ret;
+#else
+    return MPI_Alltoallv_sparse(sendbuf, sendcnts, sdispls, sendtype,
+                recvbuf, recvcnts, rdispls, recvtype, comm);
+#endif
+}
+
+void
+MPIU_neighbourhood_free(MPIU_Neighbourhood * nbr)
+{
+#if MPI_VERSION >= 3
+    if(nbr->built)
+        MPI_Comm_free(&nbr->Graph);
+#endif
+    free(nbr->Neighbours);
+    free(nbr->Outside);
+    memset(nbr, 0, sizeof(nbr[0]));
+}
+
 /* return the number of hosts */
 int
 cluster_get_num_hosts(void)
@@ -59,6 +59,45 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
 
+/* Sparse all-to-all where each partner has a datatype with absolute addresses,
+ * so that one message carries several arrays. MPI_DATATYPE_NULL skips a partner.*/
+int MPI_Alltoallw_sparse(MPI_Datatype * sendtypes, MPI_Datatype * recvtypes, MPI_Comm comm);
+
+/* A neighbourhood (distributed graph) communicator for sparse all-to-all exchanges
+ * which keep talking to the same tasks, eg, the tree walks between domain decompositions.
+ * Zero initialise before the first use.*/
+typedef struct MPIU_Neighbourhood {
+    /* Set once the graph communicator has been created*/
+    int built;
+    MPI_Comm Graph;
+    /* Ranks of the neighbours in the parent communicator, sorted. The graph is symmetric,
+     * so these are both the sources and the destinations.*/
+    int NNeighbour;
+    int * Neighbours;
+    /* Partners of the current layout which are not neighbours: these are exchanged point to point.*/
+    int NOutside;
+    int * Outside;
+} MPIU_Neighbourhood;
+
+/* Set the partners of the exchanges with the layout given by sendcnts and recvcnts,
+ * the counts of an MPI_Alltoall, so that both sides of a message agree.
+ * The first call after the neighbourhood is zeroed or freed builds the graph from these partners,
+ * and is collective: every task must call it together, eg, on the first exchange after a new domain.
+ * Later calls are local, and note the partners outside the graph.
+ * Call once per layout, before the exchanges with MPI_Alltoallv_neighbour.*/
+void MPIU_neighbourhood_update(MPIU_Neighbourhood * nbr, const int * sendcnts, const int * recvcnts, MPI_Comm comm);
+
+/* As MPI_Alltoallv_sparse, but using MPI_Neighbor_alltoallv on the graph in nbr, without global barriers.
+ * The counts and displacements are indexed by rank in comm, as usual, and must have the partners
+ * of the last MPIU_neighbourhood_update (send and receive may be swapped, eg, to return results).
+ * Requires MPI 3; on older MPI it is MPI_Alltoallv_sparse.*/
+int MPI_Alltoallv_neighbour(MPIU_Neighbourhood * nbr, void *sendbuf, int *sendcnts, int *sdispls,
+        MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
+        int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
+
+/* Free the graph communicator. Collective. The next MPIU_neighbourhood_update builds a new graph.*/
+void MPIU_neighbourhood_free(MPIU_Neighbourhood * nbr);
+
 double timediff(double t0, double t1);
 double second(void);
 size_t sizemax(size_t a, size_t b);
@@ -262,6 +262,8 @@ winds_and_feedback(int * NewStars, int NumNewStars, const double Time, const dou
     tw->haswork = NULL;
     tw->visit = (TreeWalkVisitFunction) treewalk_visit_nolist_ngbiter;
     tw->postprocess = (TreeWalkProcessFunction) sfr_wind_weight_postprocess;
+    /* Few stars form on each step, so the fixed cost of exporting dominates*/
+    tw->broadcast_small = 1;
     struct WindPriv priv[1];
     priv[0].Time = Time;
     priv[0].hubble = hubble;